@@ -0,0 +1,37 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/*
+ * Admin socket: a TCP port on the loopback interface (only) for looking inside the running server.
+ *
+ * Each connection carries one command and gets back one reply, after which the server closes it. The command
+ * is either a plain line:
+ *
+ *     <command> [<args>]\n
+ *
+ * or an HTTP GET of /<command>[?<args>], so that Prometheus can scrape /metrics directly. Commands:
+ *
+ *     metrics   all the metrics, in Prometheus text format (see metrics.h)
+ *     lockprof  [on|off|reset] switch lock profiling on or off, or start it over, then show the profile
+ *               (see lockprof.h)
+ *     trace     what every thread has been doing lately, in Chrome trace format (see trace.h)
+ *     threads   what every thread is doing right now, and the locks it holds, if the watchdog is on
+ *               (see watchdog.h)
+ *     help      the list of commands
+ *
+ * Connections are served one at a time by a thread of their own, so a slow admin client never holds up
+ * the clients of the exchange, and a client that doesn't send its command within ADMIN_TIMEOUT_MS is dropped.
+ */
+
+#define ADMIN_MAX_LINE 1024
+#define ADMIN_TIMEOUT_MS 1000
+
+/*
+ * Start serving the admin socket.
+ *
+ * @param port  The port to listen on, on 127.0.0.1.
+ * @return 0 if successful, -1 otherwise.
+ */
+int admin_init(char *port);
+
+#endif
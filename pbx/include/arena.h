@@ -0,0 +1,71 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump arenas: memory that is handed out a piece at a time from one block, and all given back at once.
+ *
+ * Each client connection has an arena, made when it connects, that everything needed only while one of its
+ * commands is carried out comes from: the command line itself (and so everything parsed out of it, like a
+ * chat message), and any scratch space the PBX needs along the way. The arena is reset before each command,
+ * so carrying out a command doesn't malloc or free anything, however many commands come in.
+ *
+ * Taking a piece is adding to an offset. An arena never grows: when it is full, arena_alloc returns NULL and
+ * the caller has to fall back on malloc (or do without).
+ */
+
+/* Pieces are aligned to this. */
+#define ARENA_ALIGN 16
+
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+/* The arena of the command the calling thread is carrying out, or NULL if it isn't carrying out a client's
+command (or the client has no arena). Scratch space that is only needed until the command is done can come
+from it. */
+extern __thread struct arena *command_arena;
+
+/*
+ * Make an arena.
+ *
+ * @param arena  The arena.
+ * @param size  How many bytes it holds.
+ * @return 0 if successful, -1 otherwise.
+ */
+int arena_init(struct arena *arena, size_t size);
+
+/*
+ * Take a piece of an arena.
+ *
+ * @return The piece, or NULL if there isn't room for it.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Give back every piece taken from an arena.
+ */
+void arena_reset(struct arena *arena);
+
+/*
+ * Free an arena's memory.
+ */
+void arena_destroy(struct arena *arena);
+
+/*
+ * Get scratch space that is needed until the calling thread is done with the command it is carrying out:
+ * from the command's arena if there is one and it has room, from malloc otherwise (exiting if that fails).
+ *
+ * @return The space, to be given to scratch_free when done with.
+ */
+void *scratch_alloc(size_t size);
+
+/*
+ * Give back space from scratch_alloc. Space from the command's arena is left for the reset.
+ */
+void scratch_free(void *ptr);
+
+#endif
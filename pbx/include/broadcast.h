@@ -0,0 +1,39 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include "outq.h"
+
+/*
+ * Broadcast delivery of one message to many connections.
+ *
+ * The caller snapshots the target set (taking a reference on each outbound queue) and hands it over
+ * here. The targets are split into chunks that a pool of worker threads (and the calling thread) take
+ * in turn, so delivery to thousands of connections runs in parallel. Each target gets the shared msgbuf
+ * queued on its outbound queue, which writes whatever is pending for that connection in one batch.
+ *
+ * Nothing holds the PBX mutex while this runs.
+ */
+
+/* # of worker threads, and # of targets a worker takes at a time. */
+#define BROADCAST_WORKERS 4
+#define BROADCAST_CHUNK 64
+
+struct broadcast_result {
+    int targets;
+    int delivered;
+    int failed;
+    long elapsed_us;
+};
+
+/*
+ * Deliver a message to every target and wait until it has been handed to all of them.
+ * The references on the targets are dropped once they have been delivered to.
+ *
+ * @param targets  The outbound queues to deliver to.
+ * @param num_targets  The # of targets.
+ * @param buf  The message.
+ * @param result  Filled in with the # delivered and failed, and how long it took.
+ */
+void broadcast_send(struct outq **targets, int num_targets, struct msgbuf *buf, struct broadcast_result *result);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef CDR_H
+#define CDR_H
+
+#include <stdint.h>
+
+/*
+ * Call detail records (CDRs).
+ *
+ * Every call that ends (answered or not) produces one fixed-size binary record. Recording one is a clock read
+ * and a store into a ring buffer owned by the calling thread, with no locks and no system calls. A background
+ * writer thread drains all the rings into append-only files in the CDR directory, and starts a new file when
+ * the current one gets big or old enough.
+ *
+ * Each file starts with a struct cdr_file_header, followed by struct cdr_records in the order the writer
+ * drained them (ordered per thread, but not across threads). If a ring fills up because the writer has fallen
+ * behind, records are dropped and counted rather than holding up the thread.
+ *
+ * Once a file is finished (rotated out, or at shutdown), the writer compacts it into a columnar segment with
+ * the same name but ".seg" instead of ".cdr" (see cdrseg.h), and removes it. Files left behind by a server
+ * that died are compacted at the next startup. The pbx-cdr tool queries the segments.
+ */
+
+/* Rings hold this many records (a power of 2). */
+#define CDR_RING_SIZE 256
+
+/* How often the writer drains the rings. */
+#define CDR_DRAIN_INTERVAL_MS 10
+
+/* A new file is started when the current one reaches this size, or is this old. */
+#define CDR_ROTATE_BYTES (16 << 20)
+#define CDR_ROTATE_SECS 3600
+
+#define CDR_MAGIC 0x50425852    /* "PBXR" */
+#define CDR_VERSION 1
+
+/* How a call ended. */
+typedef enum cdr_disposition {
+    CDR_ANSWERED, CDR_NO_ANSWER, CDR_BUSY, CDR_ERROR
+} CDR_DISPOSITION;
+
+/* On-disk record. Times are nanoseconds since the epoch; answer_ns is 0 if the call was never answered. */
+struct cdr_record {
+    uint64_t setup_ns;
+    uint64_t answer_ns;
+    uint64_t end_ns;
+    int32_t caller;
+    int32_t callee;
+    uint32_t disposition;
+    uint32_t reserved;
+};
+
+struct cdr_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+/* A call in progress, as kept by both of its TUs until it ends. */
+struct cdr_call {
+    uint64_t setup_ns;
+    uint64_t answer_ns;
+    int caller;
+    int callee;
+};
+
+/*
+ * Start writing CDRs into the given directory.
+ *
+ * @param dir  The directory.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cdr_init(char *dir);
+
+/*
+ * Stop the writer, after writing out every record recorded so far.
+ */
+void cdr_shutdown(void);
+
+/*
+ * Note that a call has been set up (dialed).
+ */
+void cdr_call_start(struct cdr_call *call, int caller, int callee);
+
+/*
+ * Note that a call has been answered.
+ */
+void cdr_call_answer(struct cdr_call *call);
+
+/*
+ * Record the CDR of a call that has ended. Does nothing if CDRs are off.
+ *
+ * @param call  The call.
+ * @param disposition  How it ended.
+ */
+void cdr_call_end(struct cdr_call *call, CDR_DISPOSITION disposition);
+
+#endif
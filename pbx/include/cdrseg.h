@@ -0,0 +1,117 @@
+#ifndef CDRSEG_H
+#define CDRSEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cdr.h"
+
+/*
+ * Columnar CDR segments.
+ *
+ * When the CDR writer finishes a row file (see cdr.h), it compacts it into a segment: the same records,
+ * sorted by setup time and stored column by column so that queries only touch the columns they need.
+ *
+ *     header        struct cdrseg_header
+ *     dictionary    int32_t[dict_size]: every distinct extension in the segment
+ *     caller        uint16_t[rows]: index of the caller in the dictionary
+ *     callee        uint16_t[rows]: index of the callee in the dictionary
+ *     disposition   uint8_t[rows]
+ *     setup         varints: zigzag delta from the previous row's setup time (from the block's base for
+ *                   the first row of a block)
+ *     answer        varints: 0 if not answered, else 1 + zigzag(answer - setup)
+ *     end           varints: zigzag(end - setup)
+ *     blocks        struct cdrseg_block[num_blocks]: per block of CDRSEG_BLOCK_ROWS rows, the min/max setup time
+ *                   and where its varints start, so blocks outside a time range are skipped without decoding
+ *     footer        struct cdrseg_footer: where everything above is
+ *
+ * The fixed-width columns can be scanned in place straight out of an mmap. The varint columns are decoded
+ * a block at a time. All integers are little-endian, which is what the server writes them as.
+ */
+
+#define CDRSEG_MAGIC 0x50425853    /* "PBXS" */
+#define CDRSEG_VERSION 1
+#define CDRSEG_BLOCK_ROWS 4096
+#define CDRSEG_MAX_DICT 65535
+
+struct cdrseg_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct cdrseg_block {
+    uint64_t base_setup_ns;
+    uint64_t min_setup_ns;
+    uint64_t max_setup_ns;
+    uint64_t setup_offset;
+    uint64_t answer_offset;
+    uint64_t end_offset;
+};
+
+struct cdrseg_footer {
+    uint64_t rows;
+    uint64_t min_setup_ns;
+    uint64_t max_setup_ns;
+    uint64_t dict_offset;
+    uint64_t caller_offset;
+    uint64_t callee_offset;
+    uint64_t disposition_offset;
+    uint64_t blocks_offset;
+    uint32_t dict_size;
+    uint32_t num_blocks;
+    uint32_t version;
+    uint32_t magic;
+};
+
+/* An open (mmapped) segment. The column pointers point into the map. */
+struct cdrseg {
+    void *map;
+    size_t size;
+    struct cdrseg_footer *footer;
+    int32_t *dict;
+    uint16_t *caller;
+    uint16_t *callee;
+    uint8_t *disposition;
+    struct cdrseg_block *blocks;
+};
+
+/*
+ * Write records into a new segment. The records are sorted by setup time in place.
+ * The segment is written to a temporary file and renamed into place once it is complete.
+ *
+ * @param path  The segment file.
+ * @param rows  The records.
+ * @param num_rows  The # of records.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cdrseg_write(char *path, struct cdr_record *rows, size_t num_rows);
+
+/*
+ * Compact a finished row file into a segment next to it (with the extension ".seg"), then remove the row file.
+ * A record cut short at the end of the row file is ignored.
+ *
+ * @param path  The row file.
+ * @return 0 if successful, -1 otherwise (the row file is left alone).
+ */
+int cdrseg_compact(char *path);
+
+/*
+ * Map a segment and check that it is sane.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int cdrseg_open(struct cdrseg *seg, char *path);
+
+void cdrseg_close(struct cdrseg *seg);
+
+/*
+ * Decode the times of one block.
+ *
+ * @param seg  The segment.
+ * @param block  The block.
+ * @param setup_ns, answer_ns, end_ns  Filled in with the times of each row in the block (up to CDRSEG_BLOCK_ROWS).
+ * @return the # of rows in the block, or -1 if the block is corrupt.
+ */
+int cdrseg_decode_block(struct cdrseg *seg, uint32_t block, uint64_t *setup_ns, uint64_t *answer_ns, uint64_t *end_ns);
+
+#endif
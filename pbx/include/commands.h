@@ -0,0 +1,19 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+/*
+ * Names of the commands that can be issued by a client, beyond the ones in
+ * tu_command_names (see server.h).
+ */
+
+/* "reclaim <ext>": take back an extension that was registered before a restart. */
+#define RECLAIM_CMD "reclaim"
+
+/* "page <msg>": send a message to every registered TU. */
+#define PAGE_CMD "page"
+
+/* "subscribe <ext>" / "unsubscribe <ext>": start or stop watching the state of an extension. */
+#define SUBSCRIBE_CMD "subscribe"
+#define UNSUBSCRIBE_CMD "unsubscribe"
+
+#endif
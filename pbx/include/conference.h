@@ -0,0 +1,47 @@
+#ifndef CONFERENCE_H
+#define CONFERENCE_H
+
+#include "outq.h"
+
+/*
+ * Conference bridges: rooms that any number of TUs can be connected to at once.
+ *
+ * Rooms are the extensions CONF_MIN_EXTENSION .. CONF_MIN_EXTENSION + CONF_MAX_ROOMS - 1, and exist
+ * as soon as somebody dials one. A TU with dial tone that dials a room goes to TU_CONNECTED, with the
+ * room as its connected extension, and stays in the room until it hangs up.
+ *
+ * A chat from a member is rendered once into a shared msgbuf and queued on the outbound queue of every
+ * other member (see outq.h), so the cost of a chat is linear in the size of the room with small constants.
+ */
+
+#define CONF_MIN_EXTENSION 9000
+#define CONF_MAX_ROOMS 1000
+
+/*
+ * Check whether an extension is a conference room.
+ */
+int conf_is_room(int ext);
+
+/*
+ * Add a member to a room.
+ *
+ * @param room  The room's extension.
+ * @param ext  The member's extension.
+ * @param out  The member's outbound queue. The room takes its own reference.
+ * @return 0 if successful, -1 otherwise.
+ */
+int conf_join(int room, int ext, struct outq *out);
+
+/*
+ * Remove a member from a room.
+ */
+void conf_leave(int room, int ext);
+
+/*
+ * Send a chat from a member to everybody else in the room.
+ *
+ * @return the # of members the chat was queued for, or -1 if the sender isn't in the room.
+ */
+int conf_chat(int room, int from_ext, char *msg);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+#include "log.h"
+
 #define NL "\n"
 
 #ifdef COLOR
@@ -35,52 +37,43 @@
 #define SUCCESS
 #endif
 
-#ifdef DEBUG
-#define debug(S, ...)                                                          \
+/* Hands a message to the logger (see log.h). The printf that is never called is there so the compiler still
+checks the arguments against the format. */
+#define LOG_AT(L, S, ...)                                                      \
   do {                                                                         \
-    fprintf(stderr, KMAG "DEBUG: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    static struct log_site log_site = {                                        \
+        L, __FILE__, __extension__ __FUNCTION__, __LINE__, S};                 \
+    if (0)                                                                     \
+      printf(S, ##__VA_ARGS__);                                                \
+    log_record(&log_site, ##__VA_ARGS__);                                      \
   } while (0)
+
+#ifdef DEBUG
+#define debug(S, ...) LOG_AT(LOG_DEBUG, S, ##__VA_ARGS__)
 #else
 #define debug(S, ...)
 #endif
 
 #ifdef INFO
-#define info(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KBLU "INFO: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define info(S, ...) LOG_AT(LOG_INFO, S, ##__VA_ARGS__)
 #else
 #define info(S, ...)
 #endif
 
 #ifdef WARN
-#define warn(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KYEL "WARN: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define warn(S, ...) LOG_AT(LOG_WARN, S, ##__VA_ARGS__)
 #else
 #define warn(S, ...)
 #endif
 
 #ifdef SUCCESS
-#define success(S, ...)                                                        \
-  do {                                                                         \
-    fprintf(stderr, KGRN "SUCCESS: %s:%s:%d " KNRM S NL, __FILE__,             \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define success(S, ...) LOG_AT(LOG_SUCCESS, S, ##__VA_ARGS__)
 #else
 #define success(S, ...)
 #endif
 
 #ifdef ERROR
-#define error(S, ...)                                                          \
-  do {                                                                         \
-    fprintf(stderr, KRED "ERROR: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define error(S, ...) LOG_AT(LOG_ERROR, S, ##__VA_ARGS__)
 #else
 #define error(S, ...)
 #endif
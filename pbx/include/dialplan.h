@@ -0,0 +1,87 @@
+#ifndef DIALPLAN_H
+#define DIALPLAN_H
+
+#include <stdint.h>
+
+/*
+ * Dial plan: maps the strings that clients dial to extension numbers.
+ *
+ * The plan is read from a config file with one rule per line:
+ *
+ *     <pattern> <target>
+ *
+ * Lines starting with ';' are comments. A pattern is made of:
+ *     0-9 * # a-z   themselves (letters are for aliases, and are matched case-insensitively)
+ *     X             any digit
+ *     N             any digit 2-9
+ *     Z             any digit 1-9
+ *     [...]         any of the listed digits/letters, with ranges like [1-5]
+ *     .             (last only) one or more of anything, making the rule a prefix rule
+ *
+ * A target is one of:
+ *     <ext>         that extension (short codes and aliases)
+ *     =             the dialed number itself
+ *     =+<n> / =-<n> the dialed number plus/minus n (to map number ranges onto extensions)
+ *
+ * When several rules match, a rule without '.' beats a prefix rule, a longer prefix beats a shorter
+ * one, and otherwise the rule that comes first in the file wins.
+ *
+ * The rules are compiled into a DFA whose states are small arrays indexed by symbol, so resolving a
+ * dialed string touches one state per character. Reloading (on SIGUSR1) compiles a new DFA and swaps
+ * it in atomically; lookups in flight keep using the old one until they are done with it. Lookups take
+ * no lock and share no reference count: the reloader waits them out before freeing the old DFA.
+ */
+
+#define DIALPLAN_MAX_RULES 1024
+#define DIALPLAN_MAX_PATTERN 32
+#define DIALPLAN_MAX_STATES 65535
+#define DIALPLAN_MAX_LINE 256
+
+/* # of counters of the lookups in progress. Threads are spread over them round robin. */
+#define DIALPLAN_READER_SHARDS 64
+
+/* Number of symbols that can be dialed: 0-9, '*', '#' and a-z. */
+#define DIALPLAN_SYMBOLS 38
+
+/* Kinds of rule targets. */
+typedef enum dialplan_target {
+    DIALPLAN_FIXED, DIALPLAN_DIALED
+} DIALPLAN_TARGET;
+
+/* One DFA state. next[] is 0 (the dead state) where there is no transition. */
+struct dialplan_state {
+    uint16_t next[DIALPLAN_SYMBOLS];
+    int16_t rule;
+};
+
+/*
+ * Load the dial plan from the given file and start the thread that reloads it on SIGUSR1.
+ *
+ * @param path  The config file.
+ * @return 0 if the plan was loaded, -1 otherwise.
+ */
+int dialplan_init(char *path);
+
+/*
+ * Compile the dial plan in the given file and swap it in for the current one.
+ * If the file can't be read or has errors, the current plan stays.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int dialplan_load(char *path);
+
+/*
+ * Ask the reloader thread to reload the plan. Safe to call from a signal handler.
+ */
+void dialplan_request_reload(void);
+
+/*
+ * Resolve a dialed string to an extension number.
+ * If there is no plan or no rule matches, the string is taken as a plain extension number.
+ *
+ * @param dialed  The dialed string.
+ * @return the extension number, or -1 if the string doesn't resolve to one.
+ */
+int dialplan_resolve(char *dialed);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histograms (in the style of HDR histograms).
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS each have a bucket of their own. Above that, every power of 2 is split
+ * into 2^HISTOGRAM_SUB_BITS equal buckets, so any recorded value is known to within about 3% (for 5 sub
+ * bits), from nanoseconds to centuries, in a fixed 15 KB. Recording is a count leading zeros, a shift and
+ * an increment.
+ *
+ * A histogram normally has a single writer, and histograms of different threads are combined with
+ * histogram_merge. One that is shared by many writers is recorded into with histogram_record_shared instead.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Empty a histogram.
+ */
+void histogram_init(struct histogram *h);
+
+/*
+ * Record a value.
+ */
+void histogram_record(struct histogram *h, uint64_t value);
+
+/*
+ * Record a value in a histogram that other threads are recording in at the same time. Readers may see the
+ * count, sum and buckets of a value that is being recorded out of step with each other.
+ */
+void histogram_record_shared(struct histogram *h, uint64_t value);
+
+/*
+ * Add everything recorded in src to dst.
+ */
+void histogram_merge(struct histogram *dst, struct histogram *src);
+
+/*
+ * Get the value at a percentile (0 to 100) of what was recorded, or 0 if nothing was.
+ * The value is the middle of the bucket it fell in, but never more than the largest value recorded.
+ */
+uint64_t histogram_percentile(struct histogram *h, double percentile);
+
+/*
+ * Get the bucket a value goes in, and the smallest and largest values that go in a bucket.
+ */
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_low(int bucket);
+uint64_t histogram_bucket_high(int bucket);
+
+#endif
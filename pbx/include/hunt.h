@@ -0,0 +1,65 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * Hunt groups: group extensions that ring the first available member.
+ *
+ * Groups are read from a config file with one group per line:
+ *
+ *     <group_ext> <linear|circular|lru> <member_ext> <member_ext> ...
+ *
+ * Lines starting with ';' are comments. Group extensions must be at least HUNT_MIN_EXTENSION, so they
+ * never collide with the extensions of registered TUs (they can be given friendlier names in the dial plan),
+ * and must not be conference rooms.
+ *
+ * Strategies:
+ *     linear    the first idle member, in the order listed
+ *     circular  the next idle member after the one picked last time
+ *     lru       the member that has been idle the longest
+ *
+ * Each group keeps a bitmap with one bit per member that is set while the member is registered and
+ * ON HOOK. The PBX module updates the bitmaps on every state change, so finding an idle member is a
+ * find-first-set over a few words instead of a scan of the PBX. For lru, the idle members are also
+ * kept in a queue ordered by when they went idle.
+ */
+
+#define HUNT_MIN_EXTENSION (PBX_MAX_EXTENSIONS + 4)
+#define HUNT_MAX_GROUPS 256
+#define HUNT_MAX_LINE 8192
+
+typedef enum hunt_strategy {
+    HUNT_LINEAR, HUNT_CIRCULAR, HUNT_LRU
+} HUNT_STRATEGY;
+
+/*
+ * Load the hunt groups from the given config file.
+ *
+ * @param path  The config file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int hunt_init(char *path);
+
+/*
+ * Check whether an extension is a hunt group.
+ */
+int hunt_is_group(int ext);
+
+/*
+ * Pick an idle member of a hunt group, according to the group's strategy.
+ *
+ * @param group_ext  The group extension.
+ * @return the member's extension, or -1 if no member is idle.
+ */
+int hunt_select(int group_ext);
+
+/*
+ * Tell the hunt groups whether an extension is idle (registered and ON HOOK) or not.
+ * This must be called on every state change. It costs nothing for extensions that aren't in any group.
+ */
+void hunt_member_idle(int ext, int idle);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Command journal: a record of every command received from every client, so that a run can be replayed.
+ *
+ * Each client service thread appends records to a buffer of its own, which only it and the flusher thread
+ * ever lock, so recording a command is a clock read and a memcpy. The flusher writes out every thread's
+ * buffer every JOURNAL_FLUSH_INTERVAL_MS (and a thread whose buffer fills up writes it out itself), each
+ * with a single append to the journal file.
+ *
+ * File format: a struct journal_header, then records. Each record is a struct journal_record followed by
+ * len bytes of payload, padded with zeros to a multiple of 8 bytes:
+ *
+ *     JOURNAL_CONNECT     a client connected; the payload is its extension (int32_t)
+ *     JOURNAL_COMMAND     a command line from the client, without the "\r\n"
+ *     JOURNAL_DISCONNECT  the client went away; no payload
+ *
+ * Clients are identified by a connection id that is never reused within a journal. Records of one
+ * connection are in order, but records of different connections are only in order within one write,
+ * so readers order them by timestamp (see journal_read).
+ */
+
+#define JOURNAL_MAGIC 0x5042584a    /* "PBXJ" */
+#define JOURNAL_VERSION 1
+
+/* Size of each thread's buffer. A record that doesn't fit in an empty buffer is written on its own. */
+#define JOURNAL_BUFFER_SIZE 16384
+
+#define JOURNAL_FLUSH_INTERVAL_MS 100
+
+/* Longest command that is recorded in full. Anything longer is cut short. */
+#define JOURNAL_MAX_COMMAND 65535
+
+typedef enum journal_record_type {
+    JOURNAL_CONNECT = 1, JOURNAL_COMMAND, JOURNAL_DISCONNECT
+} JOURNAL_RECORD_TYPE;
+
+/* start_ns is the wall clock time the journal was started at. Record timestamps are relative to it. */
+struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;
+};
+
+struct journal_record {
+    uint64_t time_ns;
+    uint32_t conn;
+    uint16_t len;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+/* A journal read back into memory, with its records in timestamp order. */
+struct journal {
+    struct journal_header header;
+    char *data;
+    size_t num_records;
+    struct journal_record **records;
+};
+
+/*
+ * Start journaling into the given file (replacing it if it exists).
+ *
+ * @param path  The journal file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_init(char *path);
+
+/*
+ * Stop journaling, after writing out everything recorded so far.
+ */
+void journal_shutdown(void);
+
+/*
+ * Record a client connecting.
+ *
+ * @param ext  The extension it was given.
+ * @return the connection id to record its commands under (0 if journaling is off).
+ */
+uint32_t journal_connect(int ext);
+
+/*
+ * Record a command.
+ */
+void journal_command(uint32_t conn, char *cmd, size_t len);
+
+/*
+ * Record a client going away.
+ */
+void journal_disconnect(uint32_t conn);
+
+/*
+ * Read a whole journal, and sort its records by timestamp (records with the same timestamp stay in file order).
+ * A record cut short at the end of the file is ignored.
+ *
+ * @param path  The journal file.
+ * @param journal  Filled in with the journal.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_read(char *path, struct journal *journal);
+
+void journal_free(struct journal *journal);
+
+/*
+ * Get the payload of a record.
+ */
+char *journal_payload(struct journal_record *rec);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mutex.h"
+#include "trace.h"
+#include "watchdog.h"
+
+/*
+ * Lock profiling: where threads wait for locks, and for how long they hold them.
+ *
+ * Mutexes (see mutex.h) taken with PROF_P and let go of with PROF_V are profiled by call site. While
+ * profiling is on, each site counts its acquisitions and how many of them had to wait, and keeps a histogram
+ * of the wait times and one of the hold times (from the acquisition to the PROF_V of the same lock, wherever
+ * that is). A site is named by the lock expression, e.g. "&(tu -> tu_mutex)", and the function and line it
+ * is in, so pbx -> mutex and the TU mutexes in each PBX function show up separately.
+ *
+ * Profiling is switched on and off at runtime (see the "lockprof" admin command). When it is off, PROF_P and
+ * PROF_V cost a test of a global flag or a thread-local count before the mutex_lock or mutex_unlock. A thread
+ * that is holding profiled locks when profiling is switched off still has their hold times recorded when it
+ * lets go of them.
+ *
+ * Either way, PROF_P records how long it waited in the trace (see trace.h), and if the watchdog is running,
+ * PROF_P and PROF_V tell it what locks the thread holds (see watchdog.h).
+ */
+
+/* Most profiled locks a thread can hold at once. The hold times of any more aren't recorded. */
+#define LOCKPROF_MAX_HELD 8
+
+struct lockprof_stats;
+
+struct lockprof_site {
+    char *lock;
+    const char *func;
+    int line;
+    struct lockprof_stats *stats;   /* Made the first time the site is profiled. */
+};
+
+extern int lockprof_enabled;
+extern __thread int lockprof_held;
+
+#define PROF_P(mutex) \
+    do \
+    { \
+        static struct lockprof_site prof_site = { #mutex, __func__, __LINE__, NULL }; \
+        uint64_t prof_start = trace_now(); \
+        int prof_watched = __atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED); \
+        if (__builtin_expect(prof_watched, 0)) \
+        { \
+            watchdog_waiting((mutex), &prof_site); \
+        } \
+        if (__builtin_expect(__atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED), 0)) \
+        { \
+            lockprof_P((mutex), &prof_site); \
+        } \
+        else \
+        { \
+            mutex_lock(mutex); \
+        } \
+        if (__builtin_expect(prof_watched, 0)) \
+        { \
+            watchdog_acquired((mutex), &prof_site); \
+        } \
+        trace_event(TRACE_LOCK, -1, (uintptr_t) &prof_site, prof_start); \
+    } while (0)
+
+#define PROF_V(mutex) \
+    do \
+    { \
+        if (__builtin_expect(__atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED), 0)) \
+        { \
+            watchdog_released(mutex); \
+        } \
+        if (__builtin_expect(lockprof_held, 0)) \
+        { \
+            lockprof_V(mutex); \
+        } \
+        else \
+        { \
+            mutex_unlock(mutex); \
+        } \
+    } while (0)
+
+/*
+ * mutex_lock and mutex_unlock with profiling. Use PROF_P and PROF_V rather than calling these.
+ */
+void lockprof_P(MUTEX *mutex, struct lockprof_site *site);
+void lockprof_V(MUTEX *mutex);
+
+/*
+ * Switch profiling on (nonzero) or off.
+ */
+void lockprof_enable(int enable);
+
+/*
+ * Throw away everything recorded so far. Anything recorded while this is going on may be only partly thrown away.
+ */
+void lockprof_reset(void);
+
+/*
+ * Write out a table of the sites profiled so far, the ones with the most waiting first. Times are in ns.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int lockprof_write(FILE *out);
+
+#endif
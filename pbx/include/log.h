@@ -0,0 +1,69 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/*
+ * Asynchronous logging, behind the macros in debug.h.
+ *
+ * Which levels are logged at all is decided at compile time (see debug.h), and the ones that aren't compile
+ * to nothing. A message that is logged isn't formatted by the thread logging it: the thread copies the raw
+ * arguments (and the contents of any strings) into a ring buffer of its own, together with a pointer to the
+ * static description of the call site, which includes the format. That is a store of a few words, with no
+ * locks and no system calls. A formatter thread drains the rings every LOG_FLUSH_INTERVAL_MS, formats the
+ * messages in the order they were logged, and writes them all to stderr at once.
+ *
+ * The arguments are picked up according to the format, so the format has to be a string literal (it is
+ * checked by the compiler like a printf format). Formats that can't be taken apart (e.g. with a '*' width,
+ * or with more than LOG_MAX_ARGS arguments) are formatted by the thread logging them instead. If a thread
+ * logs faster than the formatter keeps up with, messages are dropped and counted rather than holding it up.
+ *
+ * Until log_init is called (and in the tools, which never call it), messages are written out on the spot.
+ */
+
+/* Messages kept per thread (a power of 2). */
+#define LOG_RING_SIZE 256
+
+/* Max # of rings, i.e. of threads logging at the same time. Threads beyond that write their messages out on
+the spot. */
+#define LOG_MAX_RINGS 2048
+
+#define LOG_FLUSH_INTERVAL_MS 10
+
+/* Max # of arguments of a deferred message, and room for the contents of its string arguments. Longer strings
+are cut short. */
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_SIZE 160
+
+typedef enum log_level {
+    LOG_DEBUG, LOG_INFO, LOG_SUCCESS, LOG_WARN, LOG_ERROR
+} LOG_LEVEL;
+
+/* A call site of one of the debug.h macros. The rest is filled in the first time the site logs. */
+struct log_site {
+    LOG_LEVEL level;
+    const char *file;
+    const char *func;
+    int line;
+    const char *format;
+    int parsed;
+    int num_args;
+    unsigned char kinds[LOG_MAX_ARGS];
+};
+
+/*
+ * Log a message from a call site. The arguments are the ones for the site's format.
+ */
+void log_record(struct log_site *site, ...);
+
+/*
+ * Start the formatter thread.
+ */
+void log_init(void);
+
+/*
+ * Write out every message logged so far.
+ */
+void log_flush(void);
+
+#endif
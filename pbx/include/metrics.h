@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * Metrics: counters of what the exchange is doing, and latency histograms of the commands it carries out.
+ *
+ * Everything is sharded by CPU. A thread counts into the shard of the CPU it is running on (sched_getcpu is
+ * a vDSO call), so counting is an uncontended atomic add on a cache line that no other CPU is writing, and
+ * the hot path never waits on anybody. The shards are only added up when the metrics are read, which is
+ * rare (a scrape every few seconds).
+ *
+ * Command latencies go in log-linear histograms (see histogram.h), one per command type per shard, and are
+ * exposed as Prometheus histograms with power-of-2 bucket bounds from 256 ns to 17 s.
+ *
+ * Calls are followed from stage to stage. A call gets a 64-bit ID when it is dialed, which both of its TUs keep
+ * (in a struct metrics_call) until it ends, and which its events in the trace are tagged with (see trace.h).
+ * The time it takes to get from one stage to the next goes in a histogram per stage:
+ *
+ *     ring    from the dial command coming in until the callee has been told it is RINGING, which is all
+ *             down to the server
+ *     answer  from then until the callee picks up, which is down to the callee
+ *     talk    from then until either end hangs up (or goes away)
+ *
+ * These go up to 2^40 ns (18 min) rather than 17 s.
+ *
+ * The metrics are read in Prometheus text format, thru the admin socket (see admin.h).
+ */
+
+/* Max # of shards. CPUs beyond that share shards (CPU # mod METRICS_MAX_SHARDS). */
+#define METRICS_MAX_SHARDS 64
+
+typedef enum metric_counter {
+    METRIC_TUS_REGISTERED,
+    METRIC_TUS_UNREGISTERED,
+    METRIC_STATE_CHANGES,   /* One counter per TU state from here on, indexed by TU_STATE. */
+    METRIC_NUM_COUNTERS = METRIC_STATE_CHANGES + TU_ERROR + 1
+} METRIC_COUNTER;
+
+/* Command types with a latency histogram. The first four are in the order of TU_COMMAND (see server.h). */
+typedef enum metric_command {
+    METRIC_CMD_PICKUP, METRIC_CMD_HANGUP, METRIC_CMD_DIAL, METRIC_CMD_CHAT,
+    METRIC_CMD_PAGE, METRIC_CMD_SUBSCRIBE, METRIC_CMD_RECLAIM,
+    METRIC_NUM_COMMANDS
+} METRIC_COMMAND;
+
+/* Stages of a call, each named after how it got there. */
+typedef enum metric_stage {
+    METRIC_STAGE_RING, METRIC_STAGE_ANSWER, METRIC_STAGE_TALK,
+    METRIC_NUM_STAGES
+} METRIC_STAGE;
+
+/* A call in progress, as kept by both of its TUs. id is 0 for a call that isn't followed (e.g. one put back
+together after a restart, whose earlier stages died with the old process). */
+struct metrics_call {
+    uint64_t id;
+    uint64_t stage_ns;  /* When the call got to the stage it is at, as from metrics_start. */
+};
+
+/*
+ * Add one to a counter.
+ */
+void metrics_count(METRIC_COUNTER counter);
+
+/*
+ * Get a timestamp to hand to metrics_command when the command is done.
+ */
+uint64_t metrics_start(void);
+
+/*
+ * Record a command that was started at a time got from metrics_start.
+ */
+void metrics_command(METRIC_COMMAND command, uint64_t start);
+
+/*
+ * Give a call that has just been dialed a new ID.
+ *
+ * @param call  The call.
+ * @param start  When the dial command came in, from metrics_start.
+ * @return The ID.
+ */
+uint64_t metrics_call_start(struct metrics_call *call, uint64_t start);
+
+/*
+ * Record a call getting to the next stage. Does nothing for a call that isn't followed.
+ */
+void metrics_call_stage(struct metrics_call *call, METRIC_STAGE stage);
+
+/*
+ * Write out all the metrics in Prometheus text format.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int metrics_write(FILE *out);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include <stdint.h>
+
+/*
+ * Mutexes built on futexes, for the PBX and TU locks.
+ *
+ * A mutex is one 32-bit word: 0 when it is free, 1 when it is held, and 2 when it is held and somebody may be
+ * asleep waiting for it. Taking a free mutex is one compare-and-swap and letting go of one nobody waits for is
+ * one exchange, both inline, with no system calls. A thread that finds the mutex held first spins for a while
+ * (backing off more each time it looks), since the PBX locks are only held for a few microseconds, and only
+ * goes to sleep in the kernel (FUTEX_WAIT) if it still can't have it. The spinning adapts to the lock and the
+ * machine: there is none on a machine with one CPU (where the holder can't let go while we spin), and a
+ * thread stops spinning as soon as it sees that others have gone to sleep waiting, as the lock is then too
+ * contended for spinning to pay. A thread letting go of a mutex only calls into the kernel (FUTEX_WAKE) if
+ * somebody may be asleep.
+ *
+ * Mutexes are private to the process, and not recursive. Unlike a semaphore, a mutex must be let go of by the
+ * thread that took it.
+ */
+
+/* Most times a thread looks at a held mutex before going to sleep. */
+#define MUTEX_SPIN_LIMIT 100
+
+typedef struct mutex {
+    uint32_t state;
+} MUTEX;
+
+#define MUTEX_INITIALIZER { 0 }
+
+/* The slow paths, which the inline functions fall back on. */
+void mutex_lock_contended(MUTEX *mutex);
+void mutex_wake(MUTEX *mutex);
+
+/*
+ * Initialize a mutex, free.
+ */
+static inline void mutex_init(MUTEX *mutex)
+{
+    mutex -> state = 0;
+}
+
+/*
+ * Take a mutex, waiting for it if it is held.
+ */
+static inline void mutex_lock(MUTEX *mutex)
+{
+    uint32_t expected = 0;
+
+    if (!__atomic_compare_exchange_n(&(mutex -> state), &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        mutex_lock_contended(mutex);
+    }
+}
+
+/*
+ * Take a mutex if it is free.
+ *
+ * @return 0 if the mutex was taken, -1 if it is held.
+ */
+static inline int mutex_trylock(MUTEX *mutex)
+{
+    uint32_t expected = 0;
+
+    return __atomic_compare_exchange_n(&(mutex -> state), &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ?
+        0 : -1;
+}
+
+/*
+ * Let go of a mutex.
+ */
+static inline void mutex_unlock(MUTEX *mutex)
+{
+    if (__atomic_exchange_n(&(mutex -> state), 0, __ATOMIC_RELEASE) == 2)
+    {
+        mutex_wake(mutex);
+    }
+}
+
+#endif
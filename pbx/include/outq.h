@@ -0,0 +1,104 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Shared message buffers and per-connection outbound queues.
+ *
+ * A message that goes to many clients (e.g. a chat in a conference) is rendered once into a msgbuf.
+ * A msgbuf is immutable once it has been sent anywhere, and is reference counted: every outbound queue
+ * that holds it has a reference, and it is freed when the last one is dropped. So fanning a message out
+ * costs a pointer and a reference per recipient, not a copy and a format.
+ *
+ * An outbound queue holds the messages waiting to be written to one client connection. There is no
+ * writer thread: whoever queues a message onto an idle queue drains it on the spot, writing everything
+ * that has piled up with a single writev(). Anybody else queueing while a drain is in progress just
+ * leaves the message for the drainer.
+ *
+ * So the drainer is the thread of whoever sent the message (e.g. the client that chatted in a conference), and
+ * its writes block while the client being written to isn't reading: a client that stops reading holds up the
+ * sender, and everybody the sender was to send to after it. That is bounded by a send timeout on the socket
+ * (OUTQ_SEND_TIMEOUT_MS), and a message that takes longer than that to get out (the client reads, but a few
+ * bytes at a time) counts as a timeout too. On a timeout the connection is taken to have failed: what is queued
+ * for it is dropped, and so is everything sent to it from then on, without blocking anybody again, and the
+ * socket is shut down so that the client's service thread sees the end of the connection and unregisters it.
+ *
+ * Everything written to a connection goes thru its queue, so what a client is sent is one stream, in the order
+ * it was sent in, and lines from different senders are never spliced together. Lines sent while holding locks
+ * (the PBX's state notifications, with outq_write) are only queued: the thread drains the queues it was handed
+ * with outq_flush once it has let go of its locks, so a slow client never holds up anybody waiting on them.
+ */
+
+/* # of messages a queue holds. When a client falls this far behind, new messages to it are dropped. */
+#define OUTQ_MAX_MESSAGES 256
+
+/* Longest a write to a client may block (on a socket buffer that is full) before the connection is taken to
+have failed. */
+#define OUTQ_SEND_TIMEOUT_MS 1000
+
+/* # of messages written by one writev(). */
+#define OUTQ_BATCH 64
+
+struct msgbuf {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct outq;
+
+/*
+ * Make a new message buffer of the given length, with one reference owned by the caller.
+ * The caller fills in the data before sending it.
+ */
+struct msgbuf *msgbuf_new(size_t len);
+
+/*
+ * Make a new message buffer from a printf-style format, with one reference owned by the caller.
+ */
+struct msgbuf *msgbuf_printf(char *fmt, ...);
+
+void msgbuf_ref(struct msgbuf *buf);
+void msgbuf_unref(struct msgbuf *buf);
+
+/*
+ * Make a new outbound queue for a connection, with one reference owned by the caller.
+ * Sets the send timeout (OUTQ_SEND_TIMEOUT_MS) on the connection's socket.
+ */
+struct outq *outq_new(int fd);
+
+void outq_ref(struct outq *q);
+void outq_unref(struct outq *q);
+
+/*
+ * Queue a message (taking a reference to it), then drain the queue unless somebody else already is.
+ *
+ * @return 0 if the message was queued, -1 if it was dropped because the queue is full or the
+ * connection has failed.
+ */
+int outq_send(struct outq *q, struct msgbuf *buf);
+
+/*
+ * Send a message that only goes to this connection, without writing anything: the message is copied and
+ * queued. If nobody is draining the queue, the calling thread has to, by calling outq_flush once it holds no
+ * locks.
+ *
+ * @return 0 if the message was queued, -1 if it was dropped because the queue is full or the connection has
+ * failed.
+ */
+int outq_write(struct outq *q, struct iovec *iov, int iovcnt);
+
+/*
+ * Drain the queues the calling thread was handed by outq_write. The caller must not hold any locks.
+ */
+void outq_flush(void);
+
+/*
+ * Mark a connection as gone, before its fd is closed: nothing is written to the fd (or shuts it down) any more.
+ * Waits for a write in progress to finish, so the caller must not hold any locks.
+ */
+void outq_close(struct outq *q);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "mutex.h"
+
+/*
+ * Functions of the PBX module beyond the ones given in pbx.h.
+ */
+
+/*
+ * Reclaim an extension that was registered before the server restarted.
+ *
+ * The TU must be on hook, and the extension must still be reserved from recovery (see wal.h).
+ * If so, the TU takes over the extension, together with the state it was in. A call that was
+ * in progress is restored once both of its parties have reclaimed their extensions.
+ * In all cases, a notification of the current state is sent to the network client underlying the TU.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU doing the reclaiming.
+ * @param ext  The extension to reclaim.
+ * @return 0 if successful (even if nothing was reclaimed), -1 if any error occurs.
+ */
+int pbx_reclaim(PBX *pbx, TU *tu, int ext);
+
+/*
+ * Page every registered TU (other than the one paging) with a message.
+ *
+ * The set of TUs is taken as it is when the page starts; TUs registering after that don't get it,
+ * and TUs that go away partway thru just count as failures. Delivery runs in parallel (see broadcast.h)
+ * without holding up the rest of the PBX. Each paged client is sent "PAGE <ext> <msg>", where <ext> is
+ * the extension that paged. When it is done, the TU that paged is sent
+ * "PAGED <# delivered> <# failed> <microseconds taken>".
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU doing the paging.
+ * @param msg  The message.
+ * @return 0 if successful, -1 if any error occurs.
+ */
+int pbx_page(PBX *pbx, TU *tu, char *msg);
+
+/*
+ * Start or stop watching the state of an extension (see presence.h).
+ *
+ * When a TU starts watching an extension, it is sent the extension's current state, and then every
+ * change of it (coalesced if the TU falls behind). Subscribing to an extension that is already
+ * watched just sends the current state again. Subscriptions are dropped when the TU unregisters.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU doing the watching.
+ * @param ext  The extension to watch.
+ * @param subscribe  Nonzero to start watching, 0 to stop.
+ * @return 0 if successful, -1 if any error occurs.
+ */
+int pbx_subscribe(PBX *pbx, TU *tu, int ext, int subscribe);
+
+/*
+ * Say whose a lock is, for the watchdog (see watchdog.h): "PBX" for the PBX mutex, "TU <ext>" for the mutex
+ * of a registered TU, or "?". Takes no locks, so it can be used while the PBX is stuck.
+ *
+ * @param lock  The lock.
+ * @param buf  Where to put the description.
+ * @param size  The size of buf.
+ */
+void pbx_describe_lock(MUTEX *lock, char *buf, size_t size);
+
+#endif
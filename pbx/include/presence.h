@@ -0,0 +1,73 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "pbx.h"
+#include "outq.h"
+
+/*
+ * Presence (busy lamp field) subscriptions: a TU can watch the state of other extensions.
+ *
+ * Every state change of a watched extension is sent to its subscribers as
+ *
+ *     PRESENCE <ext> <state>            e.g. "PRESENCE 5 ON HOOK"
+ *     PRESENCE <ext> <state> <peer>     for RINGING, RING BACK and CONNECTED, e.g. "PRESENCE 5 CONNECTED 7"
+ *     PRESENCE <ext> UNREGISTERED       when nobody is at the extension any more
+ *
+ * Publishing a change doesn't write anything. It only records the new state in each subscriber's table
+ * of pending states (one slot per watched extension) and puts the subscriber on a ready queue. Presence
+ * worker threads take subscribers off the queue and write out whatever is pending, as one batch. So a
+ * subscriber that falls behind during a burst of calls only gets the latest state of each extension it
+ * watches, never a backlog of every transition, and the memory it can tie up is fixed. The latest state is
+ * never dropped: if a subscriber's outbound queue is too full to take a batch, what was in it stays pending and
+ * is written out the next time the subscriber is flushed (i.e. the next time anything it watches changes).
+ */
+
+/* Only TU extensions can be watched. */
+#define PRESENCE_MAX_EXTENSIONS (PBX_MAX_EXTENSIONS + 4)
+
+/* # of presence worker threads, and max # of bytes they write to one subscriber at a time. */
+#define PRESENCE_WORKERS 2
+#define PRESENCE_BATCH_BYTES 4096
+
+/* State published for an extension that nobody is registered at. */
+#define PRESENCE_UNREGISTERED -1
+
+struct presence_sub;
+
+/*
+ * Make the subscriber side of a TU. It takes its own reference on the TU's outbound queue.
+ */
+struct presence_sub *presence_sub_new(struct outq *out);
+
+/*
+ * Drop every subscription of a subscriber, and let go of it.
+ */
+void presence_sub_release(struct presence_sub *sub);
+
+/*
+ * Start watching an extension. Its current state is sent as the first notification.
+ *
+ * @param sub  The subscriber.
+ * @param ext  The extension to watch.
+ * @param state  Its current state, or PRESENCE_UNREGISTERED.
+ * @param peer  Its current peer extension.
+ * @return 0 if successful, -1 if the extension can't be watched.
+ */
+int presence_subscribe(struct presence_sub *sub, int ext, int state, int peer);
+
+/*
+ * Stop watching an extension. Does nothing if the extension wasn't being watched.
+ */
+void presence_unsubscribe(struct presence_sub *sub, int ext);
+
+/*
+ * Publish the new state of an extension to its subscribers.
+ * This must be called on every state change. It is a single load for extensions nobody watches.
+ *
+ * @param ext  The extension.
+ * @param state  Its new state, or PRESENCE_UNREGISTERED.
+ * @param peer  Its peer extension (only looked at for RINGING, RING BACK and CONNECTED).
+ */
+void presence_publish(int ext, int state, int peer);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "pbx.h"
+
+/*
+ * Functions of the server module beyond the ones given in server.h.
+ */
+
+/* Longest command line (without the "\r\n") a client may send. Longer lines are thrown away. */
+#define CLIENT_MAX_LINE 4096
+
+/* Size of each client's arena (see arena.h): room for a command line, and the scratch space of a page to
+every extension. */
+#define CLIENT_ARENA_SIZE 16384
+
+/*
+ * Carry out one command line received from a client, by calling the PBX module function it names.
+ * Lines that aren't a valid command are ignored, as they are by the server.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The client's TU.
+ * @param msg  The command line, without the "\r\n". It may be modified.
+ * @return 0 if successful, -1 if the PBX module reported an error.
+ */
+int pbx_dispatch(PBX *pbx, TU *tu, char *msg);
+
+#endif
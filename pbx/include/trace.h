@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Tracing: what every thread has been doing lately, for looking at the timeline of a call across threads.
+ *
+ * Tracing is always on. Each thread records compact binary events into a ring of its own, timestamped with
+ * the CPU's time stamp counter, so recording an event is a couple of rdtscs and a 32 byte store, with no
+ * locks and no system calls. The rings only keep the last TRACE_RING_SIZE events of each thread.
+ *
+ * The rings are dumped in Chrome trace format (JSON), which chrome://tracing and ui.perfetto.dev open, either
+ * by the "trace" admin command (see admin.h) or, in the server, by sending it SIGUSR2, which writes them to
+ * pbx-trace.<pid>.<n>.json in the working directory. Events:
+ *
+ *     command  a command line carried out by pbx_dispatch, from when it came in until it was done (the
+ *              thread of a client is named after its TU, so it shows whose command it was)
+ *     lock     a PROF_P (see lockprof.h), from when it started waiting until it got the lock
+ *     state    a TU going into a new state
+ *     write    a notification written to a client
+ *     call     a call being dialed, ringing, answered, chatted over or hung up, with the call's ID (see
+ *              metrics.h); the events of each call are joined up by flow arrows
+ */
+
+/* Events kept per thread (a power of 2). */
+#define TRACE_RING_SIZE 1024
+
+/* Max # of rings, i.e. of threads tracing at the same time. Threads beyond that aren't traced. */
+#define TRACE_MAX_RINGS 4096
+
+typedef enum trace_type {
+    TRACE_COMMAND = 1, TRACE_LOCK, TRACE_STATE, TRACE_WRITE,
+    TRACE_DIAL, TRACE_RING, TRACE_ANSWER, TRACE_CHAT, TRACE_HANGUP
+} TRACE_TYPE;
+
+/*
+ * Get the current time, for the start of a span.
+ */
+uint64_t trace_now(void);
+
+/*
+ * Record an event.
+ *
+ * @param type  What happened.
+ * @param ext  The extension it happened to, or -1.
+ * @param arg  The first 8 bytes of the command line for TRACE_COMMAND, the struct lockprof_site for TRACE_LOCK,
+ * the new TU_STATE for TRACE_STATE, the # of bytes for TRACE_WRITE and the call ID for the call events.
+ * @param start  When it started (from trace_now), or 0 if it has no length.
+ */
+void trace_event(TRACE_TYPE type, int ext, uint64_t arg, uint64_t start);
+
+/*
+ * Give the calling thread a name to show in the trace.
+ */
+void trace_name_thread(char *name);
+
+/*
+ * Write out everything in the rings, in Chrome trace format.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int trace_write(FILE *out);
+
+/*
+ * Start the thread that dumps the rings to a file when asked to by trace_request_dump.
+ */
+void trace_init(void);
+
+/*
+ * Ask for the rings to be dumped to a file. Can be called from a signal handler.
+ */
+void trace_request_dump(void);
+
+#endif
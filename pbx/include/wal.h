@@ -0,0 +1,128 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+
+#include "pbx.h"
+
+/*
+ * Write-ahead log (WAL) of TU state transitions.
+ *
+ * Every register, unregister and state change made by the PBX module is appended as a small fixed-size
+ * record to a memory-mapped log file. Appending is only a memcpy under a short lock, so the command path
+ * never waits on the disk. A background flusher thread group-commits everything appended since its last
+ * pass with a single msync(), and periodically writes a compacted checkpoint of the whole directory so the
+ * logs can be recycled.
+ *
+ * There are two log files that are used in turn. When a checkpoint is taken, appenders are switched over to
+ * the other log, the old log is flushed and folded into the checkpoint, and only then is it free to be reused.
+ *
+ * On startup the checkpoint and both logs are replayed to rebuild the directory as it was when the process
+ * died. Extensions that were registered at that time are reserved for a grace period, so that reconnecting
+ * clients can reclaim them (and the call they were in) with the "reclaim" command.
+ */
+
+#define WAL_LOG_NAMES { "pbx.wal.0", "pbx.wal.1" }
+#define WAL_CHECKPOINT_NAME "pbx.ckpt"
+
+/* Size of each log file, including the header page. */
+#define WAL_LOG_SIZE (4 << 20)
+#define WAL_HEADER_SIZE 4096
+
+/* A checkpoint is taken when the active log is this full, or when the checkpoint interval expires. */
+#define WAL_CHECKPOINT_FILL (WAL_LOG_SIZE / 2)
+#define WAL_CHECKPOINT_INTERVAL_MS 10000
+
+/* How often the flusher group-commits appended records. */
+#define WAL_COMMIT_INTERVAL_MS 5
+
+/* How long recovered extensions stay reserved for their old clients. */
+#define WAL_RECLAIM_GRACE_SECS 120
+
+#define WAL_MAGIC 0x50425857    /* "PBXW" */
+#define WAL_CKPT_MAGIC 0x50425843    /* "PBXC" */
+#define WAL_VERSION 1
+
+/* Types of log records. */
+typedef enum wal_record_type {
+    WAL_REGISTER = 1, WAL_UNREGISTER, WAL_STATE
+} WAL_RECORD_TYPE;
+
+/* On-disk log record. The checksum covers every field before it. */
+struct wal_record {
+    uint64_t seq;
+    uint16_t type;
+    uint16_t state;
+    int32_t ext;
+    int32_t peer;
+    uint32_t checksum;
+};
+
+/* Header at the start of each log file. base_seq is the sequence number of the first record in the log. */
+struct wal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_seq;
+};
+
+/* On-disk checkpoint: a header followed by one entry per registered extension. */
+struct wal_checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;
+    uint32_t count;
+    uint32_t checksum;
+};
+
+struct wal_checkpoint_entry {
+    int32_t ext;
+    int32_t state;
+    int32_t peer;
+};
+
+/*
+ * Open (or create) the WAL in the given directory, recover the directory it describes, and start the
+ * flusher thread. Recovered extensions become reserved for reclaiming.
+ *
+ * @param dir  Directory that holds the log and checkpoint files.
+ * @return 0 if successful, -1 otherwise.
+ */
+int wal_init(char *dir);
+
+/* Commit everything, write a final checkpoint, and stop the flusher thread. */
+void wal_shutdown(void);
+
+/* Append records for a transition. These do nothing if the WAL was not initialized. */
+void wal_log_register(int ext);
+void wal_log_unregister(int ext);
+void wal_log_state(int ext, TU_STATE state, int peer);
+
+/*
+ * Check whether an extension is reserved for a client that was registered before a restart.
+ * Reserved extensions are not handed out to new registrations. A reservation that has expired (so it can no
+ * longer be claimed) holds until the unregistration of its extension has been logged.
+ */
+int wal_is_reserved(int ext);
+
+/*
+ * Claim a reserved extension. On success, the reservation is removed and the recovered state and peer
+ * of the extension are returned.
+ *
+ * @return 0 if the extension was reserved, -1 otherwise.
+ */
+int wal_claim(int ext, TU_STATE *state, int *peer);
+
+/*
+ * Record that a reclaimed extension was in a call whose peer has not reclaimed yet. The pending call is
+ * dropped as soon as any further transition is logged for the extension.
+ */
+void wal_await_peer(int ext, TU_STATE state, int peer);
+
+/*
+ * Take the pending call of an extension that is waiting for its peer.
+ *
+ * @return 0 if the extension had a pending call, -1 otherwise.
+ */
+int wal_take_pending(int ext, TU_STATE *state, int *peer);
+
+#endif
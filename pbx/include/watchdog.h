@@ -0,0 +1,76 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mutex.h"
+
+/*
+ * Watchdog: reports threads that are stuck, e.g. in a write to a client that isn't reading while holding the
+ * PBX mutex, which would otherwise just freeze the whole exchange with nothing to show for it.
+ *
+ * While the watchdog is running, every thread that takes a lock with PROF_P (see lockprof.h) keeps a record
+ * of the locks it is holding and since when, and of the lock it is waiting for, if any. A client's thread
+ * also beats a heartbeat when it starts carrying out a command, and says when it is done. The records are
+ * only ever written by their own threads, with no locks and no system calls (the time comes from the coarse
+ * monotonic clock, which is a vDSO call), and the watchdog reads them without stopping anybody, so what it
+ * reports can be a little out of date.
+ *
+ * The watchdog thread looks at the records four times per threshold. A thread that has held a lock, or
+ * been carrying out a command, for longer than the threshold is reported once (per hold or command) on
+ * stderr: which locks it holds, whose they are (the PBX's or which TU's), where it took them, what lock it is
+ * waiting for, and a backtrace of where it is now. The backtrace is taken by the stuck thread itself, in a
+ * handler of WATCHDOG_SIGNAL, which interrupts whatever it is blocked in (and restarts it afterwards).
+ * Every thread waiting for a lock held by the stuck thread is listed too.
+ *
+ * Until the watchdog is started, PROF_P and PROF_V only test a flag, and the heartbeats do nothing.
+ */
+
+/* Most locks a thread can be seen holding at once. Any more aren't tracked. */
+#define WATCHDOG_MAX_HELD 8
+
+/* Max # of threads tracked at the same time. Threads beyond that aren't watched. */
+#define WATCHDOG_MAX_THREADS 4096
+
+/* Frames in a backtrace. */
+#define WATCHDOG_MAX_FRAMES 32
+
+/* Signal that asks a stuck thread for its backtrace. */
+#define WATCHDOG_SIGNAL (SIGRTMIN + 1)
+
+struct lockprof_site;
+
+extern int watchdog_enabled;
+
+/*
+ * Note that the calling thread is about to wait for a lock, has got it, or has let go of it. Use PROF_P and
+ * PROF_V rather than calling these.
+ */
+void watchdog_waiting(MUTEX *mutex, struct lockprof_site *site);
+void watchdog_acquired(MUTEX *mutex, struct lockprof_site *site);
+void watchdog_released(MUTEX *mutex);
+
+/*
+ * Note that the calling thread has started carrying out a command for the TU with an extension, or is done
+ * with it.
+ */
+void watchdog_busy(int ext);
+void watchdog_idle(void);
+
+/*
+ * Write out what every watched thread is doing right now: how long it has been busy, and the locks it holds
+ * or is waiting for. Threads that are doing nothing are left out.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int watchdog_write(FILE *out);
+
+/*
+ * Start the watchdog.
+ *
+ * @param threshold_ms  How long a lock can be held, or a command take, before the thread is reported.
+ */
+void watchdog_init(int threshold_ms);
+
+#endif
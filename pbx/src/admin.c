@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "admin.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* A command writes its reply to out, and returns 0 if successful or -1 otherwise. args is what followed the
+command name (never NULL). */
+struct admin_command {
+    char *name;
+    char *help;
+    int (*run)(FILE *out, char *args);
+};
+
+static int admin_metrics(FILE *out, char *args);
+static int admin_lockprof(FILE *out, char *args);
+static int admin_trace(FILE *out, char *args);
+static int admin_threads(FILE *out, char *args);
+static int admin_help(FILE *out, char *args);
+
+static struct admin_command admin_commands[] = {
+    {"metrics", "all the metrics, in Prometheus text format", admin_metrics},
+    {"lockprof", "[on|off|reset] switch lock profiling on or off, or start it over; then the profile so far",
+        admin_lockprof},
+    {"trace", "what every thread has been doing lately, in Chrome trace format", admin_trace},
+    {"threads", "what every thread is doing right now, and the locks it holds (with the watchdog on)", admin_threads},
+    {"help", "this list", admin_help},
+};
+
+#define ADMIN_NUM_COMMANDS ((int) (sizeof(admin_commands) / sizeof(admin_commands[0])))
+
+static int admin_listenfd = -1;
+static pthread_t admin_thread_id;
+
+static int admin_metrics(FILE *out, char *args)
+{
+    return metrics_write(out);
+}
+
+static int admin_lockprof(FILE *out, char *args)
+{
+    if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0)
+    {
+        lockprof_enable(strcmp(args, "on") == 0);
+    }
+    else if (strcmp(args, "reset") == 0)
+    {
+        lockprof_reset();
+    }
+    else if (*args != '\0')
+    {
+        fprintf(out, "usage: lockprof [on|off|reset]\n");
+        return -1;
+    }
+
+    return lockprof_write(out);
+}
+
+static int admin_trace(FILE *out, char *args)
+{
+    return trace_write(out);
+}
+
+static int admin_threads(FILE *out, char *args)
+{
+    return watchdog_write(out);
+}
+
+static int admin_help(FILE *out, char *args)
+{
+    for (int i = 0; i < ADMIN_NUM_COMMANDS; i++)
+    {
+        fprintf(out, "%-10s %s\n", admin_commands[i].name, admin_commands[i].help);
+    }
+
+    return 0;
+}
+
+/* Reads the first line of the request (without the line ending) into line. Returns -1 if there isn't one. */
+static int admin_read_line(int fd, char *line)
+{
+    size_t len = 0;
+
+    while (len < ADMIN_MAX_LINE - 1)
+    {
+        ssize_t n = recv(fd, line + len, ADMIN_MAX_LINE - 1 - len, 0);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+
+        len += n;
+        line[len] = '\0';
+
+        char *end = strpbrk(line, "\r\n");
+        if (end != NULL)
+        {
+            *end = '\0';
+            return 0;
+        }
+    }
+
+    line[len] = '\0';
+    return (len > 0) ? 0 : -1;
+}
+
+static void admin_write(int fd, char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return;
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+/* Carries out one request. An HTTP GET of /<command>?<args> is taken as "<command> <args>", with '+' and
+'&' in the args turned into spaces. */
+static void admin_serve(int fd)
+{
+    char line[ADMIN_MAX_LINE];
+
+    if (admin_read_line(fd, line) < 0)
+    {
+        return;
+    }
+
+    int http = (strncmp(line, "GET /", 5) == 0);
+    char *name = line;
+
+    if (http)
+    {
+        name = line + 5;
+        name[strcspn(name, " ")] = '\0';
+
+        char *query = strchr(name, '?');
+        if (query != NULL)
+        {
+            *query = ' ';
+            for (char *c = query; *c != '\0'; c++)
+            {
+                *c = (*c == '+' || *c == '&') ? ' ' : *c;
+            }
+        }
+    }
+
+    while (*name == ' ')
+    {
+        name++;
+    }
+
+    char *args = name + strcspn(name, " ");
+    if (*args != '\0')
+    {
+        *args++ = '\0';
+    }
+
+    /* The reply is put together in memory first, so HTTP clients can be told how long it is. */
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *out = open_memstream(&reply, &reply_len);
+
+    if (out == NULL)
+    {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < ADMIN_NUM_COMMANDS && strcmp(admin_commands[i].name, name) != 0; i++)
+    {
+        ;
+    }
+
+    int result = -1;
+    if (i == ADMIN_NUM_COMMANDS)
+    {
+        fprintf(out, "unknown command: %s (try help)\n", name);
+    }
+    else if ((result = admin_commands[i].run(out, args)) < 0)
+    {
+        fprintf(out, "%s failed\n", name);
+    }
+
+    fclose(out);
+
+    if (http)
+    {
+        char header[256];
+        int header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            (i == ADMIN_NUM_COMMANDS) ? "404 Not Found" : (result < 0) ? "500 Internal Server Error" : "200 OK",
+            reply_len);
+        admin_write(fd, header, header_len);
+    }
+
+    admin_write(fd, reply, reply_len);
+    free(reply);
+}
+
+static void *admin_thread(void *arg)
+{
+    struct timeval timeout = { ADMIN_TIMEOUT_MS / 1000, (ADMIN_TIMEOUT_MS % 1000) * 1000 };
+
+    while (1)
+    {
+        int fd = accept(admin_listenfd, NULL, NULL);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            error("Admin socket failed, no longer serving it");
+            return NULL;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        admin_serve(fd);
+
+        /* Read whatever else the client sent (e.g. the rest of an HTTP request) until it closes its end, so that
+        closing ours doesn't reset the connection before the client has read the reply. */
+        char discard[256];
+        shutdown(fd, SHUT_WR);
+        while (recv(fd, discard, sizeof(discard), 0) > 0)
+        {
+            ;
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int admin_init(char *port)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(port));
+
+    if ((admin_listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(admin_listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    if (bind(admin_listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(admin_listenfd, 16) < 0)
+    {
+        close(admin_listenfd);
+        admin_listenfd = -1;
+        return -1;
+    }
+
+    Pthread_create(&admin_thread_id, NULL, admin_thread, NULL);
+    Pthread_detach(admin_thread_id);
+
+    info("Admin socket on 127.0.0.1:%s", port);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+__thread struct arena *command_arena;
+
+int arena_init(struct arena *arena, size_t size)
+{
+    arena -> base = malloc(size);
+    arena -> size = (arena -> base != NULL) ? size : 0;
+    arena -> used = 0;
+
+    return (arena -> base != NULL) ? 0 : -1;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t start = (arena -> used + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    if (start > arena -> size || size > arena -> size - start)
+    {
+        return NULL;
+    }
+
+    arena -> used = start + size;
+    return arena -> base + start;
+}
+
+void arena_reset(struct arena *arena)
+{
+    arena -> used = 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    free(arena -> base);
+    arena -> base = NULL;
+    arena -> size = 0;
+    arena -> used = 0;
+}
+
+void *scratch_alloc(size_t size)
+{
+    void *ptr = (command_arena != NULL) ? arena_alloc(command_arena, size) : NULL;
+
+    if (ptr == NULL && (ptr = malloc(size)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    return ptr;
+}
+
+void scratch_free(void *ptr)
+{
+    struct arena *arena = command_arena;
+
+    if (arena != NULL && (char *) ptr >= arena -> base && (char *) ptr < arena -> base + arena -> size)
+    {
+        return;
+    }
+
+    free(ptr);
+}
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "broadcast.h"
+#include "outq.h"
+#include "debug.h"
+#include "csapp.h"
+
+struct broadcast_job;
+
+/* A request for one worker to help with a job. Each job has one per worker, so queueing never allocates. */
+struct broadcast_token {
+    struct broadcast_job *job;
+    struct broadcast_token *next;
+};
+
+/* One broadcast. next is the index of the next chunk to hand out. helpers_done counts the tokens that
+workers have finished with; the job can't go away until all of them are. */
+struct broadcast_job {
+    struct outq **targets;
+    int num_targets;
+    struct msgbuf *buf;
+    int next;
+    int delivered;
+    int failed;
+    int helpers_done;
+    sem_t done;
+    struct broadcast_token tokens[BROADCAST_WORKERS];
+};
+
+/* The pool is started the first time anything is broadcast. */
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static sem_t queue_mutex;
+static sem_t queue_items;
+static struct broadcast_token *queue_head;
+static struct broadcast_token *queue_tail;
+
+/* Delivers chunks of a job until there are none left. */
+static void broadcast_work(struct broadcast_job *job)
+{
+    int start;
+
+    while ((start = __atomic_fetch_add(&(job -> next), BROADCAST_CHUNK, __ATOMIC_RELAXED)) < job -> num_targets)
+    {
+        int end = start + BROADCAST_CHUNK;
+        if (end > job -> num_targets)
+        {
+            end = job -> num_targets;
+        }
+
+        int delivered = 0;
+        for (int i = start; i < end; i++)
+        {
+            if (outq_send(job -> targets[i], job -> buf) == 0)
+            {
+                delivered++;
+            }
+            outq_unref(job -> targets[i]);
+        }
+
+        __atomic_add_fetch(&(job -> delivered), delivered, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(job -> failed), (end - start) - delivered, __ATOMIC_RELAXED);
+    }
+}
+
+/* Thread function of a worker. */
+static void *broadcast_worker(void *arg)
+{
+    while (1)
+    {
+        P(&queue_items);
+
+        P(&queue_mutex);
+        struct broadcast_token *token = queue_head;
+        queue_head = token -> next;
+        if (queue_head == NULL)
+        {
+            queue_tail = NULL;
+        }
+        V(&queue_mutex);
+
+        struct broadcast_job *job = token -> job;
+        broadcast_work(job);
+
+        /* The last helper out tells the caller the job can go. */
+        if (__atomic_add_fetch(&(job -> helpers_done), 1, __ATOMIC_ACQ_REL) == BROADCAST_WORKERS)
+        {
+            V(&(job -> done));
+        }
+    }
+
+    return NULL;
+}
+
+static void broadcast_start_pool(void)
+{
+    Sem_init(&queue_mutex, 0, 1);
+    Sem_init(&queue_items, 0, 0);
+
+    for (int i = 0; i < BROADCAST_WORKERS; i++)
+    {
+        pthread_t thread_id;
+        Pthread_create(&thread_id, NULL, broadcast_worker, NULL);
+        Pthread_detach(thread_id);
+    }
+}
+
+void broadcast_send(struct outq **targets, int num_targets, struct msgbuf *buf, struct broadcast_result *result)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Pthread_once(&pool_once, broadcast_start_pool);
+
+    struct broadcast_job job;
+    job.targets = targets;
+    job.num_targets = num_targets;
+    job.buf = buf;
+    job.next = 0;
+    job.delivered = 0;
+    job.failed = 0;
+    job.helpers_done = 0;
+    Sem_init(&(job.done), 0, 0);
+
+    /* Ask every worker to help, then pitch in ourselves. */
+    P(&queue_mutex);
+    for (int i = 0; i < BROADCAST_WORKERS; i++)
+    {
+        job.tokens[i].job = &job;
+        job.tokens[i].next = NULL;
+
+        if (queue_tail != NULL)
+        {
+            queue_tail -> next = &(job.tokens[i]);
+        }
+        else
+        {
+            queue_head = &(job.tokens[i]);
+        }
+        queue_tail = &(job.tokens[i]);
+    }
+    V(&queue_mutex);
+
+    for (int i = 0; i < BROADCAST_WORKERS; i++)
+    {
+        V(&queue_items);
+    }
+
+    broadcast_work(&job);
+
+    /* The job lives on our stack, so wait for every helper to be done with it. */
+    P(&(job.done));
+    sem_destroy(&(job.done));
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result -> targets = num_targets;
+    result -> delivered = job.delivered;
+    result -> failed = job.failed;
+    result -> elapsed_us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+}
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "cdr.h"
+#include "cdrseg.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* Max # of rings, i.e. of threads recording at the same time. Threads beyond that have their records dropped. */
+#define CDR_MAX_RINGS 2048
+
+/* # of records the writer gathers up before writing them out. */
+#define CDR_WRITE_BATCH 1024
+
+/* Ring buffer of one thread. The owning thread is the only one that moves tail, and the writer is the only one
+that moves head, so neither needs a lock. They are kept on separate cache lines so the two don't fight over one.
+When a thread exits, its ring goes on the free list for the next thread (the writer keeps draining it either way). */
+struct cdr_ring {
+    uint32_t head;
+    char head_pad[60];
+    uint32_t tail;
+    char tail_pad[60];
+    struct cdr_record records[CDR_RING_SIZE];
+    struct cdr_ring *next_free;
+};
+
+static struct {
+    int enabled;
+    int stopping;
+    char *dir;
+    int fd;
+    char path[4096];
+    size_t file_bytes;
+    time_t file_started;
+    unsigned int file_seq;
+    struct cdr_ring *rings[CDR_MAX_RINGS];
+    int num_rings;
+    struct cdr_ring *free_rings;
+    sem_t rings_mutex;
+    pthread_key_t ring_key;
+    pthread_t writer;
+    sem_t wakeup;
+    uint64_t dropped;
+    uint64_t dropped_reported;
+    struct cdr_record batch[CDR_WRITE_BATCH];
+    int batch_count;
+} cdr;
+
+static __thread struct cdr_ring *cdr_thread_ring;
+
+static uint64_t cdr_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Runs when a thread that recorded CDRs exits. The writer still drains whatever it left behind. */
+static void cdr_release_ring(void *arg)
+{
+    struct cdr_ring *ring = arg;
+
+    P(&(cdr.rings_mutex));
+    ring -> next_free = cdr.free_rings;
+    cdr.free_rings = ring;
+    V(&(cdr.rings_mutex));
+}
+
+/* Gets the calling thread's ring, taking one the first time. Returns NULL if there are no rings left. */
+static struct cdr_ring *cdr_get_ring(void)
+{
+    if (cdr_thread_ring != NULL)
+    {
+        return cdr_thread_ring;
+    }
+
+    struct cdr_ring *ring = NULL;
+
+    P(&(cdr.rings_mutex));
+
+    if (cdr.free_rings != NULL)
+    {
+        ring = cdr.free_rings;
+        cdr.free_rings = ring -> next_free;
+    }
+    else if (cdr.num_rings < CDR_MAX_RINGS)
+    {
+        ring = calloc(1, sizeof(struct cdr_ring));
+
+        if (ring == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        cdr.rings[cdr.num_rings] = ring;
+        __atomic_store_n(&(cdr.num_rings), cdr.num_rings + 1, __ATOMIC_RELEASE);
+    }
+
+    V(&(cdr.rings_mutex));
+
+    if (ring != NULL)
+    {
+        pthread_setspecific(cdr.ring_key, ring);
+        cdr_thread_ring = ring;
+    }
+
+    return ring;
+}
+
+void cdr_call_start(struct cdr_call *call, int caller, int callee)
+{
+    call -> setup_ns = cdr.enabled ? cdr_now() : 0;
+    call -> answer_ns = 0;
+    call -> caller = caller;
+    call -> callee = callee;
+}
+
+void cdr_call_answer(struct cdr_call *call)
+{
+    call -> answer_ns = cdr.enabled ? cdr_now() : 0;
+}
+
+void cdr_call_end(struct cdr_call *call, CDR_DISPOSITION disposition)
+{
+    if (!cdr.enabled)
+    {
+        return;
+    }
+
+    struct cdr_ring *ring = cdr_get_ring();
+
+    if (ring == NULL)
+    {
+        __atomic_add_fetch(&(cdr.dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t tail = ring -> tail;
+
+    if (tail - __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE) == CDR_RING_SIZE)
+    {
+        __atomic_add_fetch(&(cdr.dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct cdr_record *rec = &(ring -> records[tail & (CDR_RING_SIZE - 1)]);
+    rec -> setup_ns = call -> setup_ns;
+    rec -> answer_ns = call -> answer_ns;
+    rec -> end_ns = cdr_now();
+    rec -> caller = call -> caller;
+    rec -> callee = call -> callee;
+    rec -> disposition = disposition;
+    rec -> reserved = 0;
+
+    __atomic_store_n(&(ring -> tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes all of a buffer, unless there is an error. */
+static int cdr_write_all(int fd, void *data, size_t len)
+{
+    char *p = data;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Closes the current CDR file, and compacts it into a columnar segment (see cdrseg.h). */
+static void cdr_finish_file(void)
+{
+    if (cdr.fd < 0)
+    {
+        return;
+    }
+
+    close(cdr.fd);
+    cdr.fd = -1;
+    cdrseg_compact(cdr.path);
+}
+
+/* Starts a new CDR file if there is none yet, or the current one is big or old enough. */
+static void cdr_rotate(void)
+{
+    time_t now = time(NULL);
+
+    if (cdr.fd >= 0 && cdr.file_bytes < CDR_ROTATE_BYTES && now - cdr.file_started < CDR_ROTATE_SECS)
+    {
+        return;
+    }
+
+    cdr_finish_file();
+
+    char stamp[32];
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    char *path = cdr.path;
+    snprintf(path, sizeof(cdr.path), "%s/cdr-%s-%u.cdr", cdr.dir, stamp, cdr.file_seq++);
+
+    if ((cdr.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    {
+        error("Can't open CDR file %s: %s", path, strerror(errno));
+        return;
+    }
+
+    struct cdr_file_header header;
+    header.magic = CDR_MAGIC;
+    header.version = CDR_VERSION;
+    header.record_size = sizeof(struct cdr_record);
+    header.reserved = 0;
+
+    if (cdr_write_all(cdr.fd, &header, sizeof(header)) < 0)
+    {
+        error("Can't write CDR file %s: %s", path, strerror(errno));
+        close(cdr.fd);
+        cdr.fd = -1;
+        return;
+    }
+
+    cdr.file_bytes = sizeof(header);
+    cdr.file_started = now;
+}
+
+/* Writes out the records gathered up so far. If there is no file to write them to, they are lost. */
+static void cdr_flush_batch(void)
+{
+    if (cdr.batch_count == 0)
+    {
+        return;
+    }
+
+    cdr_rotate();
+
+    size_t len = sizeof(struct cdr_record) * cdr.batch_count;
+
+    if (cdr.fd < 0 || cdr_write_all(cdr.fd, cdr.batch, len) < 0)
+    {
+        cdr.dropped += cdr.batch_count;
+    }
+    else
+    {
+        cdr.file_bytes += len;
+    }
+
+    cdr.batch_count = 0;
+}
+
+/* Moves everything out of every ring and writes it out. */
+static void cdr_drain(void)
+{
+    int num_rings = __atomic_load_n(&(cdr.num_rings), __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_rings; i++)
+    {
+        struct cdr_ring *ring = cdr.rings[i];
+        uint32_t head = ring -> head;
+        uint32_t tail = __atomic_load_n(&(ring -> tail), __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            cdr.batch[cdr.batch_count++] = ring -> records[head & (CDR_RING_SIZE - 1)];
+            head++;
+
+            if (cdr.batch_count == CDR_WRITE_BATCH)
+            {
+                cdr_flush_batch();
+            }
+        }
+
+        __atomic_store_n(&(ring -> head), head, __ATOMIC_RELEASE);
+    }
+
+    cdr_flush_batch();
+
+    uint64_t dropped = __atomic_load_n(&(cdr.dropped), __ATOMIC_RELAXED);
+    if (dropped != cdr.dropped_reported)
+    {
+        error("%lu CDRs dropped so far", (unsigned long) dropped);
+        cdr.dropped_reported = dropped;
+    }
+}
+
+/* Thread function of the writer. */
+static void *cdr_writer(void *arg)
+{
+    while (!cdr.stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CDR_DRAIN_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (sem_timedwait(&(cdr.wakeup), &deadline) < 0 && errno == EINTR)
+        {
+            ;
+        }
+
+        cdr_drain();
+    }
+
+    return NULL;
+}
+
+/* Compacts the row files left behind by a server that died before it could. */
+static void cdr_compact_leftovers(void)
+{
+    DIR *d = opendir(cdr.dir);
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        size_t len = strlen(entry -> d_name);
+
+        if (len > 4 && strncmp(entry -> d_name, "cdr-", 4) == 0 && strcmp(entry -> d_name + len - 4, ".cdr") == 0)
+        {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", cdr.dir, entry -> d_name);
+            cdrseg_compact(path);
+        }
+    }
+
+    closedir(d);
+}
+
+int cdr_init(char *dir)
+{
+    if ((cdr.dir = strdup(dir)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    cdr.fd = -1;
+    cdr.num_rings = 0;
+    cdr.free_rings = NULL;
+    Sem_init(&(cdr.rings_mutex), 0, 1);
+    Sem_init(&(cdr.wakeup), 0, 0);
+
+    if (pthread_key_create(&(cdr.ring_key), cdr_release_ring) != 0)
+    {
+        return -1;
+    }
+
+    cdr_compact_leftovers();
+
+    /* Open the first file now, so a bad directory is caught at startup. */
+    cdr_rotate();
+
+    if (cdr.fd < 0)
+    {
+        return -1;
+    }
+
+    cdr.stopping = 0;
+    cdr.enabled = 1;
+    Pthread_create(&(cdr.writer), NULL, cdr_writer, NULL);
+
+    info("Writing CDRs to %s", dir);
+    return 0;
+}
+
+void cdr_shutdown(void)
+{
+    if (!cdr.enabled)
+    {
+        return;
+    }
+
+    cdr.stopping = 1;
+    V(&(cdr.wakeup));
+    Pthread_join(cdr.writer, NULL);
+
+    /* Anything recorded after the writer's last pass. */
+    cdr_drain();
+    cdr.enabled = 0;
+
+    cdr_finish_file();
+    free(cdr.dir);
+}
@@ -0,0 +1,490 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cdr.h"
+#include "cdrseg.h"
+#include "debug.h"
+
+/* Growable output buffer for building a segment in memory. */
+struct cdrseg_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+static void cdrseg_reserve(struct cdrseg_buf *buf, size_t more)
+{
+    if (buf -> len + more <= buf -> cap)
+    {
+        return;
+    }
+
+    while (buf -> len + more > buf -> cap)
+    {
+        buf -> cap = (buf -> cap == 0) ? 4096 : buf -> cap * 2;
+    }
+
+    if ((buf -> data = realloc(buf -> data, buf -> cap)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void cdrseg_append(struct cdrseg_buf *buf, void *data, size_t len)
+{
+    cdrseg_reserve(buf, len);
+    memcpy(buf -> data + buf -> len, data, len);
+    buf -> len += len;
+}
+
+/* Pads with zeros up to a multiple of 8, so whatever comes next can be read in place. */
+static void cdrseg_align(struct cdrseg_buf *buf)
+{
+    uint64_t zero = 0;
+    cdrseg_append(buf, &zero, (8 - buf -> len % 8) % 8);
+}
+
+static void cdrseg_put_varint(struct cdrseg_buf *buf, uint64_t value)
+{
+    cdrseg_reserve(buf, 10);
+
+    while (value >= 0x80)
+    {
+        buf -> data[buf -> len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    buf -> data[buf -> len++] = (uint8_t) value;
+}
+
+static uint64_t cdrseg_zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t cdrseg_unzigzag(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/* Reads a varint, without going past end. Returns NULL if it doesn't end before end. */
+static uint8_t *cdrseg_get_varint(uint8_t *p, uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64)
+    {
+        uint8_t byte = *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return p;
+        }
+
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+static int cdrseg_compare_rows(const void *a, const void *b)
+{
+    const struct cdr_record *x = a;
+    const struct cdr_record *y = b;
+
+    return (x -> setup_ns > y -> setup_ns) - (x -> setup_ns < y -> setup_ns);
+}
+
+static int cdrseg_compare_exts(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *) a;
+    int32_t y = *(const int32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Index of an extension in the (sorted) dictionary. */
+static uint16_t cdrseg_code(int32_t *dict, uint32_t dict_size, int32_t ext)
+{
+    int32_t *found = bsearch(&ext, dict, dict_size, sizeof(int32_t), cdrseg_compare_exts);
+    return (uint16_t) (found - dict);
+}
+
+/* Writes a whole buffer to a new file, and makes sure it is on disk before renaming it into place. */
+static int cdrseg_write_file(char *path, struct cdrseg_buf *buf)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < buf -> len)
+    {
+        ssize_t n = write(fd, buf -> data + done, buf -> len - done);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+
+        done += n;
+    }
+
+    if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp_path, path) < 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int cdrseg_write(char *path, struct cdr_record *rows, size_t num_rows)
+{
+    qsort(rows, num_rows, sizeof(struct cdr_record), cdrseg_compare_rows);
+
+    /* Dictionary: every distinct caller and callee, sorted. */
+    int32_t *dict = malloc(sizeof(int32_t) * (2 * num_rows + 1));
+
+    if (dict == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t dict_size = 0;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        dict[dict_size++] = rows[i].caller;
+        dict[dict_size++] = rows[i].callee;
+    }
+
+    qsort(dict, dict_size, sizeof(int32_t), cdrseg_compare_exts);
+
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < dict_size; i++)
+    {
+        if (unique == 0 || dict[unique - 1] != dict[i])
+        {
+            dict[unique++] = dict[i];
+        }
+    }
+    dict_size = unique;
+
+    if (dict_size > CDRSEG_MAX_DICT)
+    {
+        free(dict);
+        return -1;
+    }
+
+    struct cdrseg_buf buf = { NULL, 0, 0 };
+    struct cdrseg_footer footer;
+    memset(&footer, 0, sizeof(footer));
+
+    struct cdrseg_header header = { CDRSEG_MAGIC, CDRSEG_VERSION };
+    cdrseg_append(&buf, &header, sizeof(header));
+
+    footer.dict_offset = buf.len;
+    cdrseg_append(&buf, dict, sizeof(int32_t) * dict_size);
+
+    footer.caller_offset = buf.len;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        uint16_t code = cdrseg_code(dict, dict_size, rows[i].caller);
+        cdrseg_append(&buf, &code, sizeof(code));
+    }
+
+    footer.callee_offset = buf.len;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        uint16_t code = cdrseg_code(dict, dict_size, rows[i].callee);
+        cdrseg_append(&buf, &code, sizeof(code));
+    }
+
+    footer.disposition_offset = buf.len;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        uint8_t disposition = rows[i].disposition;
+        cdrseg_append(&buf, &disposition, sizeof(disposition));
+    }
+
+    free(dict);
+
+    /* The varint columns go one after the other, so the blocks' offsets into them are found in three passes. */
+    uint32_t num_blocks = (num_rows + CDRSEG_BLOCK_ROWS - 1) / CDRSEG_BLOCK_ROWS;
+    struct cdrseg_block *blocks = calloc(num_blocks + 1, sizeof(struct cdrseg_block));
+
+    if (blocks == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t b = 0; b < num_blocks; b++)
+    {
+        size_t first = (size_t) b * CDRSEG_BLOCK_ROWS;
+        blocks[b].base_setup_ns = rows[first].setup_ns;
+        blocks[b].min_setup_ns = rows[first].setup_ns;
+        blocks[b].max_setup_ns = rows[(first + CDRSEG_BLOCK_ROWS < num_rows) ? first + CDRSEG_BLOCK_ROWS - 1 : num_rows - 1].setup_ns;
+    }
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        if (i % CDRSEG_BLOCK_ROWS == 0)
+        {
+            blocks[i / CDRSEG_BLOCK_ROWS].setup_offset = buf.len;
+        }
+
+        uint64_t prev = (i % CDRSEG_BLOCK_ROWS == 0) ? blocks[i / CDRSEG_BLOCK_ROWS].base_setup_ns : rows[i - 1].setup_ns;
+        cdrseg_put_varint(&buf, cdrseg_zigzag((int64_t) (rows[i].setup_ns - prev)));
+    }
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        if (i % CDRSEG_BLOCK_ROWS == 0)
+        {
+            blocks[i / CDRSEG_BLOCK_ROWS].answer_offset = buf.len;
+        }
+
+        if (rows[i].answer_ns == 0)
+        {
+            cdrseg_put_varint(&buf, 0);
+        }
+        else
+        {
+            cdrseg_put_varint(&buf, 1 + cdrseg_zigzag((int64_t) (rows[i].answer_ns - rows[i].setup_ns)));
+        }
+    }
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        if (i % CDRSEG_BLOCK_ROWS == 0)
+        {
+            blocks[i / CDRSEG_BLOCK_ROWS].end_offset = buf.len;
+        }
+
+        cdrseg_put_varint(&buf, cdrseg_zigzag((int64_t) (rows[i].end_ns - rows[i].setup_ns)));
+    }
+
+    cdrseg_align(&buf);
+    footer.blocks_offset = buf.len;
+    cdrseg_append(&buf, blocks, sizeof(struct cdrseg_block) * num_blocks);
+    free(blocks);
+
+    footer.rows = num_rows;
+    footer.min_setup_ns = (num_rows > 0) ? rows[0].setup_ns : 0;
+    footer.max_setup_ns = (num_rows > 0) ? rows[num_rows - 1].setup_ns : 0;
+    footer.dict_size = dict_size;
+    footer.num_blocks = num_blocks;
+    footer.version = CDRSEG_VERSION;
+    footer.magic = CDRSEG_MAGIC;
+    cdrseg_append(&buf, &footer, sizeof(footer));
+
+    int result = cdrseg_write_file(path, &buf);
+    free(buf.data);
+
+    return result;
+}
+
+int cdrseg_compact(char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct cdr_file_header header;
+    size_t num_rows = 0;
+    struct cdr_record *rows = NULL;
+
+    if (st.st_size >= sizeof(header))
+    {
+        num_rows = (st.st_size - sizeof(header)) / sizeof(struct cdr_record);
+    }
+
+    if ((rows = malloc(sizeof(struct cdr_record) * num_rows + 1)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t want = sizeof(struct cdr_record) * num_rows;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CDR_MAGIC ||
+        header.record_size != sizeof(struct cdr_record) || pread(fd, rows, want, sizeof(header)) != want)
+    {
+        /* An empty file (nothing recorded before it was rotated, or the header never made it) is just removed. */
+        if (st.st_size <= sizeof(header))
+        {
+            free(rows);
+            close(fd);
+            return unlink(path);
+        }
+
+        error("CDR file %s is unreadable, leaving it alone", path);
+        free(rows);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    if (num_rows == 0)
+    {
+        free(rows);
+        return unlink(path);
+    }
+
+    /* Same name, with .seg instead of .cdr. */
+    char seg_path[4096];
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".cdr") == 0)
+    {
+        len -= 4;
+    }
+    snprintf(seg_path, sizeof(seg_path), "%.*s.seg", (int) len, path);
+
+    int result = cdrseg_write(seg_path, rows, num_rows);
+    free(rows);
+
+    if (result < 0)
+    {
+        error("Can't compact CDR file %s", path);
+        return -1;
+    }
+
+    return unlink(path);
+}
+
+int cdrseg_open(struct cdrseg *seg, char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct cdrseg_header) + sizeof(struct cdrseg_footer))
+    {
+        close(fd);
+        return -1;
+    }
+
+    seg -> size = st.st_size;
+    seg -> map = mmap(NULL, seg -> size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (seg -> map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    uint8_t *base = seg -> map;
+    struct cdrseg_header *header = seg -> map;
+    struct cdrseg_footer *footer = (struct cdrseg_footer *) (base + seg -> size - sizeof(struct cdrseg_footer));
+    size_t limit = seg -> size - sizeof(struct cdrseg_footer);
+
+    /* Everything has to be where the footer says, and fit before it. */
+    if (header -> magic != CDRSEG_MAGIC || footer -> magic != CDRSEG_MAGIC || footer -> version != CDRSEG_VERSION ||
+        (seg -> size - sizeof(struct cdrseg_footer)) % 8 != 0 ||
+        footer -> num_blocks != (footer -> rows + CDRSEG_BLOCK_ROWS - 1) / CDRSEG_BLOCK_ROWS ||
+        footer -> dict_offset + 4ULL * footer -> dict_size > limit ||
+        footer -> caller_offset + 2 * footer -> rows > limit ||
+        footer -> callee_offset + 2 * footer -> rows > limit ||
+        footer -> disposition_offset + footer -> rows > limit ||
+        footer -> blocks_offset % 8 != 0 ||
+        footer -> blocks_offset + sizeof(struct cdrseg_block) * footer -> num_blocks > limit)
+    {
+        munmap(seg -> map, seg -> size);
+        return -1;
+    }
+
+    seg -> footer = footer;
+    seg -> dict = (int32_t *) (base + footer -> dict_offset);
+    seg -> caller = (uint16_t *) (base + footer -> caller_offset);
+    seg -> callee = (uint16_t *) (base + footer -> callee_offset);
+    seg -> disposition = base + footer -> disposition_offset;
+    seg -> blocks = (struct cdrseg_block *) (base + footer -> blocks_offset);
+
+    return 0;
+}
+
+void cdrseg_close(struct cdrseg *seg)
+{
+    munmap(seg -> map, seg -> size);
+}
+
+int cdrseg_decode_block(struct cdrseg *seg, uint32_t block, uint64_t *setup_ns, uint64_t *answer_ns, uint64_t *end_ns)
+{
+    if (block >= seg -> footer -> num_blocks)
+    {
+        return -1;
+    }
+
+    struct cdrseg_block *b = &(seg -> blocks[block]);
+    uint8_t *base = seg -> map;
+    uint8_t *end = base + seg -> footer -> blocks_offset;
+
+    if (b -> setup_offset > seg -> footer -> blocks_offset || b -> answer_offset > seg -> footer -> blocks_offset ||
+        b -> end_offset > seg -> footer -> blocks_offset)
+    {
+        return -1;
+    }
+
+    int rows = CDRSEG_BLOCK_ROWS;
+    if ((uint64_t) block * CDRSEG_BLOCK_ROWS + rows > seg -> footer -> rows)
+    {
+        rows = seg -> footer -> rows - (uint64_t) block * CDRSEG_BLOCK_ROWS;
+    }
+
+    uint8_t *setup_p = base + b -> setup_offset;
+    uint8_t *answer_p = base + b -> answer_offset;
+    uint8_t *end_p = base + b -> end_offset;
+    uint64_t prev = b -> base_setup_ns;
+
+    for (int i = 0; i < rows; i++)
+    {
+        uint64_t delta, answer, duration;
+
+        if ((setup_p = cdrseg_get_varint(setup_p, end, &delta)) == NULL ||
+            (answer_p = cdrseg_get_varint(answer_p, end, &answer)) == NULL ||
+            (end_p = cdrseg_get_varint(end_p, end, &duration)) == NULL)
+        {
+            return -1;
+        }
+
+        prev += cdrseg_unzigzag(delta);
+        setup_ns[i] = prev;
+        answer_ns[i] = (answer == 0) ? 0 : prev + cdrseg_unzigzag(answer - 1);
+        end_ns[i] = prev + cdrseg_unzigzag(duration);
+    }
+
+    return rows;
+}
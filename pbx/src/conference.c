@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "pbx.h"
+#include "conference.h"
+#include "outq.h"
+#include "arena.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define CONF_MAX_MEMBER_EXTENSIONS (PBX_MAX_EXTENSIONS + 4)
+
+struct conf_member {
+    int ext;
+    struct outq *out;
+};
+
+/* A room. position[ext] is 1 + the index of the member with that extension, or 0 if it isn't a member,
+so that leaving is O(1) too (the last member is moved into the hole). */
+struct conf_room {
+    sem_t mutex;
+    int count;
+    int cap;
+    struct conf_member *members;
+    int position[CONF_MAX_MEMBER_EXTENSIONS];
+};
+
+/* Rooms are made the first time somebody joins them. The rooms mutex is only for making them. */
+static struct conf_room *rooms[CONF_MAX_ROOMS];
+static sem_t rooms_mutex;
+static pthread_once_t rooms_once = PTHREAD_ONCE_INIT;
+
+static void conf_init_rooms(void)
+{
+    Sem_init(&rooms_mutex, 0, 1);
+}
+
+int conf_is_room(int ext)
+{
+    return ext >= CONF_MIN_EXTENSION && ext < CONF_MIN_EXTENSION + CONF_MAX_ROOMS;
+}
+
+/* Gets a room, making it if it doesn't exist yet (and create is set). */
+static struct conf_room *conf_get_room(int room_ext, int create)
+{
+    int index = room_ext - CONF_MIN_EXTENSION;
+    struct conf_room *room = __atomic_load_n(&(rooms[index]), __ATOMIC_ACQUIRE);
+
+    if (room != NULL || !create)
+    {
+        return room;
+    }
+
+    Pthread_once(&rooms_once, conf_init_rooms);
+    P(&rooms_mutex);
+
+    if ((room = rooms[index]) == NULL)
+    {
+        room = calloc(1, sizeof(struct conf_room));
+
+        if (room == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        Sem_init(&(room -> mutex), 0, 1);
+        __atomic_store_n(&(rooms[index]), room, __ATOMIC_RELEASE);
+    }
+
+    V(&rooms_mutex);
+    return room;
+}
+
+int conf_join(int room_ext, int ext, struct outq *out)
+{
+    if (!conf_is_room(room_ext) || ext < 0 || ext >= CONF_MAX_MEMBER_EXTENSIONS)
+    {
+        return -1;
+    }
+
+    struct conf_room *room = conf_get_room(room_ext, 1);
+
+    P(&(room -> mutex));
+
+    if (room -> position[ext] != 0)
+    {
+        V(&(room -> mutex));
+        return -1;
+    }
+
+    if (room -> count == room -> cap)
+    {
+        room -> cap = (room -> cap == 0) ? 16 : room -> cap * 2;
+        room -> members = realloc(room -> members, sizeof(struct conf_member) * room -> cap);
+
+        if (room -> members == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    outq_ref(out);
+    room -> members[room -> count].ext = ext;
+    room -> members[room -> count].out = out;
+    room -> position[ext] = ++(room -> count);
+
+    V(&(room -> mutex));
+
+    return 0;
+}
+
+void conf_leave(int room_ext, int ext)
+{
+    if (!conf_is_room(room_ext) || ext < 0 || ext >= CONF_MAX_MEMBER_EXTENSIONS)
+    {
+        return;
+    }
+
+    struct conf_room *room = conf_get_room(room_ext, 0);
+
+    if (room == NULL)
+    {
+        return;
+    }
+
+    P(&(room -> mutex));
+
+    int index = room -> position[ext] - 1;
+    struct outq *out = NULL;
+
+    if (index >= 0)
+    {
+        out = room -> members[index].out;
+
+        /* Move the last member into the hole. */
+        room -> count--;
+        if (index != room -> count)
+        {
+            room -> members[index] = room -> members[room -> count];
+            room -> position[room -> members[index].ext] = index + 1;
+        }
+        room -> position[ext] = 0;
+    }
+
+    V(&(room -> mutex));
+
+    if (out != NULL)
+    {
+        outq_unref(out);
+    }
+}
+
+int conf_chat(int room_ext, int from_ext, char *msg)
+{
+    if (!conf_is_room(room_ext) || from_ext < 0 || from_ext >= CONF_MAX_MEMBER_EXTENSIONS)
+    {
+        return -1;
+    }
+
+    struct conf_room *room = conf_get_room(room_ext, 0);
+
+    if (room == NULL)
+    {
+        return -1;
+    }
+
+    /* Snapshot the other members' queues, so nobody waits on the room while the chat is written out. */
+    P(&(room -> mutex));
+
+    if (room -> position[from_ext] == 0)
+    {
+        V(&(room -> mutex));
+        return -1;
+    }
+
+    int num_targets = 0;
+    struct outq **targets = scratch_alloc(sizeof(struct outq *) * room -> count);
+
+    for (int i = 0; i < room -> count; i++)
+    {
+        if (room -> members[i].ext != from_ext)
+        {
+            outq_ref(room -> members[i].out);
+            targets[num_targets++] = room -> members[i].out;
+        }
+    }
+
+    V(&(room -> mutex));
+
+    /* Render the chat once and hand the same buffer to everybody. This writes to each member's connection on the
+    chatter's own thread, one after another, so a member that isn't reading holds up the chat to the members after
+    it, but only once, and for no longer than the send timeout (see outq.h). */
+    struct msgbuf *buf = msgbuf_printf("CHAT %s\n", msg);
+    int sent = 0;
+
+    for (int i = 0; i < num_targets; i++)
+    {
+        if (outq_send(targets[i], buf) == 0)
+        {
+            sent++;
+        }
+        outq_unref(targets[i]);
+    }
+
+    msgbuf_unref(buf);
+    scratch_free(targets);
+
+    return sent;
+}
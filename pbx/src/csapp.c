@@ -728,8 +728,12 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value)
 
 void P(sem_t *sem)
 {
-    if (sem_wait(sem) < 0)
-    unix_error("P error");
+    /* A signal handler (e.g. the watchdog's, see watchdog.h) interrupts sem_wait even with SA_RESTART. */
+    while (sem_wait(sem) < 0)
+    {
+        if (errno != EINTR)
+            unix_error("P error");
+    }
 }
 
 void V(sem_t *sem)
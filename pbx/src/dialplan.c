@@ -0,0 +1,627 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "dialplan.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* Set of symbols that a pattern element matches, one bit per symbol. */
+#define DIALPLAN_ANY ((1ULL << DIALPLAN_SYMBOLS) - 1)
+
+/* NFA states are (rule, position) pairs packed into one int. */
+#define DIALPLAN_NFA_STRIDE (DIALPLAN_MAX_PATTERN + 2)
+
+#define DIALPLAN_HASH_SIZE (1 << 17)
+
+/* A rule as it is parsed from the config file. */
+struct dialplan_rule {
+    uint64_t elems[DIALPLAN_MAX_PATTERN];
+    int len;
+    int prefix;
+    DIALPLAN_TARGET target;
+    int value;
+};
+
+/* What a compiled plan keeps of a rule. */
+struct dialplan_target_entry {
+    DIALPLAN_TARGET target;
+    int value;
+};
+
+/* A compiled plan. State 0 is the dead state and state 1 is the start state. */
+struct dialplan {
+    int num_states;
+    struct dialplan_state *states;
+    struct dialplan_target_entry *targets;
+};
+
+/* Lookups in progress, counted in shards that the threads are spread over, so that a lookup only touches a cache
+line that few other threads do. Each lookup counts itself under the parity of the reader epoch it started in; a load waits out the
+lookups of one parity, then the other, before it frees the plan it replaced. */
+struct dialplan_readers {
+    long count[2];
+} __attribute__((aligned(64)));
+
+static int dialplan_initialized;
+static struct dialplan *current_plan;
+static struct dialplan_readers readers[DIALPLAN_READER_SHARDS];
+static unsigned int reader_epoch;
+static unsigned int next_reader_shard;
+static __thread int reader_shard = -1;
+
+/* Only one load swaps plans at a time. Lookups never take it. */
+static sem_t dialplan_mutex;
+
+static char *dialplan_path;
+static sem_t dialplan_reload;
+static pthread_t dialplan_reloader;
+
+/* Maps a character to its symbol number, or -1 if it can't be dialed. The letters are spelled out as ranges
+rather than left to isalpha, which is undefined for the negative chars a client can send. */
+static int dialplan_symbol(int c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c == '*')
+    {
+        return 10;
+    }
+    if (c == '#')
+    {
+        return 11;
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return 12 + (c - 'a');
+    }
+    if (c >= 'A' && c <= 'Z')
+    {
+        return 12 + (c - 'A');
+    }
+    return -1;
+}
+
+/* Set of the digits lo..hi. */
+static uint64_t dialplan_digits(int lo, int hi)
+{
+    uint64_t set = 0;
+
+    for (int i = lo; i <= hi; i++)
+    {
+        set |= 1ULL << i;
+    }
+
+    return set;
+}
+
+/* Parses a pattern into a rule's elements. Returns 0 if it's valid, -1 otherwise. */
+static int dialplan_parse_pattern(char *pattern, struct dialplan_rule *rule)
+{
+    rule -> len = 0;
+    rule -> prefix = 0;
+
+    for (char *p = pattern; *p != '\0'; p++)
+    {
+        /* '.' must be the last thing in the pattern. */
+        if (rule -> len >= DIALPLAN_MAX_PATTERN || rule -> prefix)
+        {
+            return -1;
+        }
+
+        uint64_t set = 0;
+
+        if (*p == 'X')
+        {
+            set = dialplan_digits(0, 9);
+        }
+        else if (*p == 'N')
+        {
+            set = dialplan_digits(2, 9);
+        }
+        else if (*p == 'Z')
+        {
+            set = dialplan_digits(1, 9);
+        }
+        else if (*p == '.')
+        {
+            set = DIALPLAN_ANY;
+            rule -> prefix = 1;
+        }
+        else if (*p == '[')
+        {
+            /* Character class, with ranges like 1-5. */
+            for (p++; *p != ']'; p++)
+            {
+                int lo = dialplan_symbol(*p);
+                int hi = lo;
+
+                if (lo < 0)
+                {
+                    return -1;
+                }
+
+                if (p[1] == '-' && p[2] != ']' && p[2] != '\0')
+                {
+                    hi = dialplan_symbol(p[2]);
+                    p += 2;
+                }
+
+                if (hi < lo)
+                {
+                    return -1;
+                }
+
+                for (int i = lo; i <= hi; i++)
+                {
+                    set |= 1ULL << i;
+                }
+            }
+        }
+        else
+        {
+            int symbol = dialplan_symbol(*p);
+
+            if (symbol < 0)
+            {
+                return -1;
+            }
+
+            set = 1ULL << symbol;
+        }
+
+        if (set == 0)
+        {
+            return -1;
+        }
+
+        rule -> elems[rule -> len++] = set;
+    }
+
+    return (rule -> len > 0) ? 0 : -1;
+}
+
+/* Parses a target. Returns 0 if it's valid, -1 otherwise. */
+static int dialplan_parse_target(char *target, struct dialplan_rule *rule)
+{
+    char *end;
+
+    if (target[0] == '=')
+    {
+        rule -> target = DIALPLAN_DIALED;
+        rule -> value = (target[1] == '\0') ? 0 : strtol(target + 1, &end, 10);
+        return (target[1] == '\0' || *end == '\0') ? 0 : -1;
+    }
+
+    rule -> target = DIALPLAN_FIXED;
+    rule -> value = strtol(target, &end, 10);
+    return (*end == '\0' && rule -> value > 0) ? 0 : -1;
+}
+
+/* Reads all the rules in a config file. Returns the # of rules, or -1 if there's an error. */
+static int dialplan_read_rules(char *path, struct dialplan_rule *rules)
+{
+    FILE *fp;
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        error("Can't open dial plan %s", path);
+        return -1;
+    }
+
+    char line[DIALPLAN_MAX_LINE];
+    int line_num = 0;
+    int num_rules = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_num++;
+
+        char *save_ptr;
+        char *pattern = strtok_r(line, " \t\r\n", &save_ptr);
+
+        /* Skip blank lines and comments. */
+        if (pattern == NULL || pattern[0] == ';')
+        {
+            continue;
+        }
+
+        char *target = strtok_r(NULL, " \t\r\n", &save_ptr);
+        char *extra = strtok_r(NULL, " \t\r\n", &save_ptr);
+
+        if (num_rules >= DIALPLAN_MAX_RULES || target == NULL || (extra != NULL && extra[0] != ';') ||
+            dialplan_parse_pattern(pattern, &(rules[num_rules])) < 0 ||
+            dialplan_parse_target(target, &(rules[num_rules])) < 0)
+        {
+            error("Bad dial plan rule at %s:%d", path, line_num);
+            fclose(fp);
+            return -1;
+        }
+
+        num_rules++;
+    }
+
+    fclose(fp);
+    return num_rules;
+}
+
+/* Checks whether rule a takes precedence over rule b when both match. */
+static int dialplan_rule_beats(struct dialplan_rule *rules, int a, int b)
+{
+    if (rules[a].prefix != rules[b].prefix)
+    {
+        return !rules[a].prefix;
+    }
+    if (rules[a].prefix && rules[a].len != rules[b].len)
+    {
+        return rules[a].len > rules[b].len;
+    }
+    return a < b;
+}
+
+static uint32_t dialplan_hash_set(int *set, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint32_t)set[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* Compiles the rules into a DFA by subset construction. Each DFA state stands for the set of (rule, position)
+pairs that could still match. Because every rule's NFA is a straight line (plus a loop at the end of a prefix
+rule), each rule is at no more than one position in a set, so the sets stay sorted by rule. */
+static struct dialplan *dialplan_compile(struct dialplan_rule *rules, int num_rules)
+{
+    struct dialplan *plan = malloc(sizeof(struct dialplan));
+    int states_cap = 64;
+    int pool_cap = 1024;
+    int *pool = malloc(sizeof(int) * pool_cap);
+    int *set_start = malloc(sizeof(int) * states_cap);
+    int *set_len = malloc(sizeof(int) * states_cap);
+    int *hash_table = calloc(DIALPLAN_HASH_SIZE, sizeof(int));
+    int *next_set = malloc(sizeof(int) * (num_rules + 1));
+
+    if (plan == NULL || pool == NULL || set_start == NULL || set_len == NULL || hash_table == NULL ||
+        next_set == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    plan -> states = malloc(sizeof(struct dialplan_state) * states_cap);
+    plan -> targets = malloc(sizeof(struct dialplan_target_entry) * (num_rules + 1));
+
+    if (plan -> states == NULL || plan -> targets == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int r = 0; r < num_rules; r++)
+    {
+        plan -> targets[r].target = rules[r].target;
+        plan -> targets[r].value = rules[r].value;
+    }
+
+    /* State 0 is dead. State 1 starts with every rule at position 0. */
+    set_start[0] = 0;
+    set_len[0] = 0;
+    set_start[1] = 0;
+    set_len[1] = num_rules;
+    for (int r = 0; r < num_rules; r++)
+    {
+        pool[r] = r * DIALPLAN_NFA_STRIDE;
+    }
+    int pool_used = num_rules;
+    int num_states = 2;
+
+    memset(&(plan -> states[0]), 0, sizeof(struct dialplan_state));
+    plan -> states[0].rule = -1;
+
+    for (int s = 1; s < num_states; s++)
+    {
+        struct dialplan_state state;
+        memset(&state, 0, sizeof(state));
+        state.rule = -1;
+
+        /* The best rule that has reached its end is the one this state accepts. */
+        for (int i = 0; i < set_len[s]; i++)
+        {
+            int nfa = pool[set_start[s] + i];
+            int r = nfa / DIALPLAN_NFA_STRIDE;
+
+            if (nfa % DIALPLAN_NFA_STRIDE == rules[r].len && (state.rule < 0 || dialplan_rule_beats(rules, r, state.rule)))
+            {
+                state.rule = r;
+            }
+        }
+
+        for (int symbol = 0; symbol < DIALPLAN_SYMBOLS; symbol++)
+        {
+            int next_len = 0;
+
+            for (int i = 0; i < set_len[s]; i++)
+            {
+                int nfa = pool[set_start[s] + i];
+                int r = nfa / DIALPLAN_NFA_STRIDE;
+                int pos = nfa % DIALPLAN_NFA_STRIDE;
+
+                if (pos < rules[r].len && (rules[r].elems[pos] >> symbol & 1))
+                {
+                    next_set[next_len++] = nfa + 1;
+                }
+                else if (pos == rules[r].len && rules[r].prefix)
+                {
+                    next_set[next_len++] = nfa;
+                }
+            }
+
+            if (next_len == 0)
+            {
+                continue;
+            }
+
+            /* Look the set up among the states we have so far. */
+            uint32_t slot = dialplan_hash_set(next_set, next_len) & (DIALPLAN_HASH_SIZE - 1);
+            int found = 0;
+
+            while (hash_table[slot] != 0)
+            {
+                int t = hash_table[slot];
+
+                if (set_len[t] == next_len && memcmp(&(pool[set_start[t]]), next_set, sizeof(int) * next_len) == 0)
+                {
+                    found = t;
+                    break;
+                }
+
+                slot = (slot + 1) & (DIALPLAN_HASH_SIZE - 1);
+            }
+
+            if (!found)
+            {
+                /* New state. */
+                if (num_states >= DIALPLAN_MAX_STATES)
+                {
+                    error("Dial plan is too big");
+                    free(plan -> states);
+                    free(plan -> targets);
+                    free(plan);
+                    plan = NULL;
+                    goto compile_ended;
+                }
+
+                if (num_states == states_cap)
+                {
+                    states_cap *= 2;
+                    set_start = realloc(set_start, sizeof(int) * states_cap);
+                    set_len = realloc(set_len, sizeof(int) * states_cap);
+                    plan -> states = realloc(plan -> states, sizeof(struct dialplan_state) * states_cap);
+
+                    if (set_start == NULL || set_len == NULL || plan -> states == NULL)
+                    {
+                        exit(EXIT_FAILURE);
+                    }
+                }
+
+                while (pool_used + next_len > pool_cap)
+                {
+                    pool_cap *= 2;
+                    if ((pool = realloc(pool, sizeof(int) * pool_cap)) == NULL)
+                    {
+                        exit(EXIT_FAILURE);
+                    }
+                }
+
+                memcpy(&(pool[pool_used]), next_set, sizeof(int) * next_len);
+                set_start[num_states] = pool_used;
+                set_len[num_states] = next_len;
+                pool_used += next_len;
+
+                found = num_states++;
+                hash_table[slot] = found;
+            }
+
+            state.next[symbol] = found;
+        }
+
+        plan -> states[s] = state;
+    }
+
+    plan -> num_states = num_states;
+    debug("Dial plan compiled: %d rules, %d states", num_rules, num_states);
+
+    compile_ended:
+        free(next_set);
+        free(hash_table);
+        free(set_len);
+        free(set_start);
+        free(pool);
+        return plan;
+}
+
+/* Counts the calling thread as looking up in whatever plan is current from now on. Returns the counter to give to
+dialplan_read_end. */
+static long *dialplan_read_begin(void)
+{
+    if (reader_shard < 0)
+    {
+        reader_shard = __atomic_fetch_add(&next_reader_shard, 1, __ATOMIC_RELAXED) % DIALPLAN_READER_SHARDS;
+    }
+
+    int parity = __atomic_load_n(&reader_epoch, __ATOMIC_RELAXED) & 1;
+    long *count = &(readers[reader_shard].count[parity]);
+
+    /* Sequentially consistent, so the plan can't be loaded before the lookup has been counted. */
+    __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+    return count;
+}
+
+static void dialplan_read_end(long *count)
+{
+    __atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+}
+
+/* Waits until the lookups counted under one parity of the epoch are done. */
+static void dialplan_wait_readers(int parity)
+{
+    while (1)
+    {
+        long count = 0;
+        for (int i = 0; i < DIALPLAN_READER_SHARDS; i++)
+        {
+            count += __atomic_load_n(&(readers[i].count[parity]), __ATOMIC_SEQ_CST);
+        }
+
+        if (count == 0)
+        {
+            return;
+        }
+
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Waits until no lookup can still be using a plan that has been swapped out. A lookup that read the epoch just
+before it was flipped counts itself under the old parity after the first wait may have seen none there, so both
+parities are waited out, each after flipping the epoch away from it. Loads only. */
+static void dialplan_synchronize(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned int epoch = __atomic_add_fetch(&reader_epoch, 1, __ATOMIC_SEQ_CST);
+        dialplan_wait_readers((epoch - 1) & 1);
+    }
+}
+
+static void dialplan_free(struct dialplan *plan)
+{
+    free(plan -> states);
+    free(plan -> targets);
+    free(plan);
+}
+
+int dialplan_load(char *path)
+{
+    struct dialplan_rule *rules = malloc(sizeof(struct dialplan_rule) * DIALPLAN_MAX_RULES);
+
+    if (rules == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    int num_rules = dialplan_read_rules(path, rules);
+    struct dialplan *plan = (num_rules < 0) ? NULL : dialplan_compile(rules, num_rules);
+    free(rules);
+
+    if (plan == NULL)
+    {
+        return -1;
+    }
+
+    /* Swap the new plan in. The old one goes away once the lookups still using it are done. */
+    P(&dialplan_mutex);
+    struct dialplan *old_plan = __atomic_exchange_n(&current_plan, plan, __ATOMIC_SEQ_CST);
+
+    if (old_plan != NULL)
+    {
+        dialplan_synchronize();
+        dialplan_free(old_plan);
+    }
+
+    V(&dialplan_mutex);
+
+    info("Dial plan loaded from %s (%d rules)", path, num_rules);
+    return 0;
+}
+
+/* Thread function of the reloader, which reloads the plan each time it is asked to. */
+static void *dialplan_reloader_thread(void *arg)
+{
+    while (1)
+    {
+        P(&dialplan_reload);
+        dialplan_load(dialplan_path);
+    }
+
+    return NULL;
+}
+
+int dialplan_init(char *path)
+{
+    Sem_init(&dialplan_mutex, 0, 1);
+    Sem_init(&dialplan_reload, 0, 0);
+    dialplan_path = path;
+    dialplan_initialized = 1;
+
+    if (dialplan_load(path) < 0)
+    {
+        return -1;
+    }
+
+    Pthread_create(&dialplan_reloader, NULL, dialplan_reloader_thread, NULL);
+    Pthread_detach(dialplan_reloader);
+    return 0;
+}
+
+void dialplan_request_reload(void)
+{
+    /* sem_post is async-signal-safe, so this can be called from the SIGUSR1 handler. */
+    if (dialplan_initialized)
+    {
+        sem_post(&dialplan_reload);
+    }
+}
+
+int dialplan_resolve(char *dialed)
+{
+    int ext = -1;
+    int matched = 0;
+
+    long *reading = dialplan_initialized ? dialplan_read_begin() : NULL;
+    struct dialplan *plan = dialplan_initialized ? __atomic_load_n(&current_plan, __ATOMIC_SEQ_CST) : NULL;
+
+    if (plan != NULL)
+    {
+        /* Walk the DFA, one state per dialed character. */
+        int state = 1;
+        for (char *c = dialed; *c != '\0' && state != 0; c++)
+        {
+            int symbol = dialplan_symbol(*c);
+            state = (symbol < 0) ? 0 : plan -> states[state].next[symbol];
+        }
+
+        int rule = plan -> states[state].rule;
+        if (rule >= 0)
+        {
+            matched = 1;
+            ext = plan -> targets[rule].value;
+
+            if (plan -> targets[rule].target == DIALPLAN_DIALED)
+            {
+                ext += atoi(dialed);
+            }
+        }
+
+    }
+
+    if (reading != NULL)
+    {
+        dialplan_read_end(reading);
+    }
+
+    /* No plan or no match: it's a plain extension number (or nothing). */
+    if (!matched)
+    {
+        ext = atoi(dialed);
+    }
+
+    return (ext > 0) ? ext : -1;
+}
@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_init(struct histogram *h)
+{
+    memset(h, 0, sizeof(struct histogram));
+    h -> min = UINT64_MAX;
+}
+
+int histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    /* Which power of 2, then which of its sub-buckets. */
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t histogram_bucket_low(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+uint64_t histogram_bucket_high(int bucket)
+{
+    if (bucket == HISTOGRAM_BUCKETS - 1)
+    {
+        return UINT64_MAX;
+    }
+
+    return histogram_bucket_low(bucket + 1) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    h -> buckets[histogram_bucket(value)]++;
+    h -> count++;
+    h -> sum += value;
+
+    if (value < h -> min)
+    {
+        h -> min = value;
+    }
+    if (value > h -> max)
+    {
+        h -> max = value;
+    }
+}
+
+void histogram_record_shared(struct histogram *h, uint64_t value)
+{
+    __atomic_add_fetch(&(h -> buckets[histogram_bucket(value)]), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(h -> count), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(h -> sum), value, __ATOMIC_RELAXED);
+
+    /* The min and max hardly ever change once there are a few values, so these are nearly always just loads. */
+    uint64_t min = __atomic_load_n(&(h -> min), __ATOMIC_RELAXED);
+    while (value < min &&
+        !__atomic_compare_exchange_n(&(h -> min), &min, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        ;
+    }
+
+    uint64_t max = __atomic_load_n(&(h -> max), __ATOMIC_RELAXED);
+    while (value > max &&
+        !__atomic_compare_exchange_n(&(h -> max), &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        ;
+    }
+}
+
+void histogram_merge(struct histogram *dst, struct histogram *src)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        dst -> buckets[i] += src -> buckets[i];
+    }
+
+    dst -> count += src -> count;
+    dst -> sum += src -> sum;
+
+    if (src -> min < dst -> min)
+    {
+        dst -> min = src -> min;
+    }
+    if (src -> max > dst -> max)
+    {
+        dst -> max = src -> max;
+    }
+}
+
+uint64_t histogram_percentile(struct histogram *h, double percentile)
+{
+    if (h -> count == 0)
+    {
+        return 0;
+    }
+
+    /* The rank of the value wanted, counting from 1. */
+    uint64_t rank = (uint64_t) (percentile / 100.0 * h -> count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > h -> count)
+    {
+        rank = h -> count;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h -> buckets[i];
+
+        if (seen >= rank)
+        {
+            uint64_t low = histogram_bucket_low(i);
+            uint64_t middle = low + (histogram_bucket_high(i) - low) / 2;
+
+            return (middle > h -> max) ? h -> max : (middle < h -> min) ? h -> min : middle;
+        }
+    }
+
+    return h -> max;
+}
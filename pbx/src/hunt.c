@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "pbx.h"
+#include "hunt.h"
+#include "conference.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define HUNT_MAX_MEMBER_EXTENSIONS (PBX_MAX_EXTENSIONS + 4)
+#define HUNT_HASH_SIZE (HUNT_MAX_GROUPS * 2)
+
+/* A hunt group. The mutex protects the bitmap, the cursor and the LRU queue. It is only ever held for
+a few instructions, and no other lock is taken while holding it. */
+struct hunt_group {
+    int ext;
+    HUNT_STRATEGY strategy;
+    int num_members;
+    int *members;
+    int num_words;
+    uint64_t *idle;
+    int cursor;
+    int *lru_prev;
+    int *lru_next;
+    int lru_head;
+    int lru_tail;
+    sem_t mutex;
+};
+
+/* Which bit of which group an extension is. An extension can be in several groups. */
+struct hunt_membership {
+    struct hunt_group *group;
+    int index;
+    struct hunt_membership *next;
+};
+
+static int hunt_loaded;
+static int num_groups;
+static struct hunt_group groups[HUNT_MAX_GROUPS];
+static struct hunt_group *group_table[HUNT_HASH_SIZE];
+static struct hunt_membership *memberships[HUNT_MAX_MEMBER_EXTENSIONS];
+
+static struct hunt_group *hunt_find(int ext)
+{
+    if (!hunt_loaded || ext < HUNT_MIN_EXTENSION)
+    {
+        return NULL;
+    }
+
+    for (int slot = ext % HUNT_HASH_SIZE; group_table[slot] != NULL; slot = (slot + 1) % HUNT_HASH_SIZE)
+    {
+        if (group_table[slot] -> ext == ext)
+        {
+            return group_table[slot];
+        }
+    }
+
+    return NULL;
+}
+
+/* Appends a member to the tail of the LRU queue. Group mutex must be held. */
+static void hunt_lru_append(struct hunt_group *group, int index)
+{
+    group -> lru_prev[index] = group -> lru_tail;
+    group -> lru_next[index] = -1;
+
+    if (group -> lru_tail >= 0)
+    {
+        group -> lru_next[group -> lru_tail] = index;
+    }
+    else
+    {
+        group -> lru_head = index;
+    }
+
+    group -> lru_tail = index;
+}
+
+/* Takes a member out of the LRU queue. Group mutex must be held. */
+static void hunt_lru_unlink(struct hunt_group *group, int index)
+{
+    int prev = group -> lru_prev[index];
+    int next = group -> lru_next[index];
+
+    if (prev >= 0)
+    {
+        group -> lru_next[prev] = next;
+    }
+    else
+    {
+        group -> lru_head = next;
+    }
+
+    if (next >= 0)
+    {
+        group -> lru_prev[next] = prev;
+    }
+    else
+    {
+        group -> lru_tail = prev;
+    }
+}
+
+/* Parses one line of the config file into a new group. Returns 0 if it's valid, -1 otherwise. */
+static int hunt_parse_group(char *line)
+{
+    char *save_ptr;
+    char *ext_str = strtok_r(line, " \t\r\n", &save_ptr);
+    char *strategy_str = strtok_r(NULL, " \t\r\n", &save_ptr);
+
+    if (ext_str == NULL || strategy_str == NULL || num_groups >= HUNT_MAX_GROUPS)
+    {
+        return -1;
+    }
+
+    struct hunt_group *group = &(groups[num_groups]);
+    group -> ext = atoi(ext_str);
+
+    if (group -> ext < HUNT_MIN_EXTENSION || conf_is_room(group -> ext) || hunt_find(group -> ext) != NULL)
+    {
+        return -1;
+    }
+
+    if (strcmp(strategy_str, "linear") == 0)
+    {
+        group -> strategy = HUNT_LINEAR;
+    }
+    else if (strcmp(strategy_str, "circular") == 0)
+    {
+        group -> strategy = HUNT_CIRCULAR;
+    }
+    else if (strcmp(strategy_str, "lru") == 0)
+    {
+        group -> strategy = HUNT_LRU;
+    }
+    else
+    {
+        return -1;
+    }
+
+    /* The line can't have more members than it has characters. */
+    group -> members = malloc(sizeof(int) * (strlen(save_ptr) + 1));
+    if (group -> members == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    group -> num_members = 0;
+    char *member_str;
+    while ((member_str = strtok_r(NULL, " \t\r\n", &save_ptr)) != NULL && member_str[0] != ';')
+    {
+        int member = atoi(member_str);
+
+        if (member <= 0 || member >= HUNT_MAX_MEMBER_EXTENSIONS)
+        {
+            return -1;
+        }
+
+        group -> members[group -> num_members++] = member;
+    }
+
+    if (group -> num_members == 0)
+    {
+        return -1;
+    }
+
+    /* Nobody is registered yet, so every bit starts out clear and the LRU queue starts out empty. */
+    group -> num_words = (group -> num_members + 63) / 64;
+    group -> idle = calloc(group -> num_words, sizeof(uint64_t));
+    group -> lru_prev = malloc(sizeof(int) * group -> num_members);
+    group -> lru_next = malloc(sizeof(int) * group -> num_members);
+
+    if (group -> idle == NULL || group -> lru_prev == NULL || group -> lru_next == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    group -> cursor = 0;
+    group -> lru_head = -1;
+    group -> lru_tail = -1;
+    Sem_init(&(group -> mutex), 0, 1);
+
+    for (int i = 0; i < group -> num_members; i++)
+    {
+        struct hunt_membership *membership = malloc(sizeof(struct hunt_membership));
+
+        if (membership == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        membership -> group = group;
+        membership -> index = i;
+        membership -> next = memberships[group -> members[i]];
+        memberships[group -> members[i]] = membership;
+    }
+
+    int slot = group -> ext % HUNT_HASH_SIZE;
+    while (group_table[slot] != NULL)
+    {
+        slot = (slot + 1) % HUNT_HASH_SIZE;
+    }
+    group_table[slot] = group;
+
+    num_groups++;
+    return 0;
+}
+
+int hunt_init(char *path)
+{
+    FILE *fp;
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        error("Can't open hunt groups %s", path);
+        return -1;
+    }
+
+    char *line = malloc(HUNT_MAX_LINE);
+    if (line == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    int line_num = 0;
+    int ret = 0;
+
+    /* Groups become visible to hunt_find() as they are parsed, so duplicates are caught. */
+    hunt_loaded = 1;
+
+    while (fgets(line, HUNT_MAX_LINE, fp) != NULL)
+    {
+        line_num++;
+
+        char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == ';')
+        {
+            continue;
+        }
+
+        if (hunt_parse_group(start) < 0)
+        {
+            error("Bad hunt group at %s:%d", path, line_num);
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    info("Loaded %d hunt groups from %s", num_groups, path);
+    return ret;
+}
+
+int hunt_is_group(int ext)
+{
+    return hunt_find(ext) != NULL;
+}
+
+/* Finds the first set bit at or after start, wrapping around. Returns -1 if no bit is set. */
+static int hunt_find_next(struct hunt_group *group, int start)
+{
+    int word = start / 64;
+    uint64_t bits = group -> idle[word] & (~0ULL << (start % 64));
+
+    for (int i = 0; i <= group -> num_words; i++)
+    {
+        if (bits != 0)
+        {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+
+        word = (word + 1) % group -> num_words;
+        bits = group -> idle[word];
+    }
+
+    return -1;
+}
+
+int hunt_select(int group_ext)
+{
+    struct hunt_group *group = hunt_find(group_ext);
+
+    if (group == NULL)
+    {
+        return -1;
+    }
+
+    int index = -1;
+
+    P(&(group -> mutex));
+
+    switch (group -> strategy)
+    {
+        case HUNT_LINEAR:
+            index = hunt_find_next(group, 0);
+            break;
+        case HUNT_CIRCULAR:
+            index = hunt_find_next(group, group -> cursor);
+            if (index >= 0)
+            {
+                group -> cursor = (index + 1) % group -> num_members;
+            }
+            break;
+        case HUNT_LRU:
+            index = group -> lru_head;
+            break;
+    }
+
+    V(&(group -> mutex));
+
+    return (index >= 0) ? group -> members[index] : -1;
+}
+
+void hunt_member_idle(int ext, int idle)
+{
+    if (!hunt_loaded || ext < 0 || ext >= HUNT_MAX_MEMBER_EXTENSIONS)
+    {
+        return;
+    }
+
+    for (struct hunt_membership *membership = memberships[ext]; membership != NULL; membership = membership -> next)
+    {
+        struct hunt_group *group = membership -> group;
+        int index = membership -> index;
+        uint64_t bit = 1ULL << (index % 64);
+
+        P(&(group -> mutex));
+
+        int was_idle = (group -> idle[index / 64] & bit) != 0;
+
+        if (idle && !was_idle)
+        {
+            group -> idle[index / 64] |= bit;
+            hunt_lru_append(group, index);
+        }
+        else if (!idle && was_idle)
+        {
+            group -> idle[index / 64] &= ~bit;
+            hunt_lru_unlink(group, index);
+        }
+
+        V(&(group -> mutex));
+    }
+}
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "journal.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* Max # of thread buffers. Threads beyond that write their records straight to the file. */
+#define JOURNAL_MAX_BUFFERS 2048
+
+#define JOURNAL_PAD(len) (((len) + 7) & ~((size_t) 7))
+
+/* Buffer of one thread. The mutex is only ever contended by the flusher. When the thread exits, the buffer
+goes on the free list for the next thread. */
+struct journal_buffer {
+    sem_t mutex;
+    size_t len;
+    struct journal_buffer *next_free;
+    char data[JOURNAL_BUFFER_SIZE];
+};
+
+static struct {
+    int enabled;
+    int stopping;
+    int fd;
+    struct timespec start;
+    uint32_t next_conn;
+    struct journal_buffer *buffers[JOURNAL_MAX_BUFFERS];
+    int num_buffers;
+    struct journal_buffer *free_buffers;
+    sem_t buffers_mutex;
+    pthread_key_t buffer_key;
+    pthread_t flusher;
+    sem_t wakeup;
+} journal;
+
+static __thread struct journal_buffer *journal_thread_buffer;
+
+static void journal_release_buffer(void *arg)
+{
+    struct journal_buffer *buf = arg;
+
+    P(&(journal.buffers_mutex));
+    buf -> next_free = journal.free_buffers;
+    journal.free_buffers = buf;
+    V(&(journal.buffers_mutex));
+}
+
+static struct journal_buffer *journal_get_buffer(void)
+{
+    if (journal_thread_buffer != NULL)
+    {
+        return journal_thread_buffer;
+    }
+
+    struct journal_buffer *buf = NULL;
+
+    P(&(journal.buffers_mutex));
+
+    if (journal.free_buffers != NULL)
+    {
+        buf = journal.free_buffers;
+        journal.free_buffers = buf -> next_free;
+    }
+    else if (journal.num_buffers < JOURNAL_MAX_BUFFERS)
+    {
+        if ((buf = malloc(sizeof(struct journal_buffer))) == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        Sem_init(&(buf -> mutex), 0, 1);
+        buf -> len = 0;
+        journal.buffers[journal.num_buffers] = buf;
+        __atomic_store_n(&(journal.num_buffers), journal.num_buffers + 1, __ATOMIC_RELEASE);
+    }
+
+    V(&(journal.buffers_mutex));
+
+    if (buf != NULL)
+    {
+        pthread_setspecific(journal.buffer_key, buf);
+        journal_thread_buffer = buf;
+    }
+
+    return buf;
+}
+
+/* Appends to the journal file. O_APPEND makes each write land in one piece. */
+static void journal_write(struct iovec *iov, int iovcnt)
+{
+    while (writev(journal.fd, iov, iovcnt) < 0 && errno == EINTR)
+    {
+        ;
+    }
+}
+
+/* Writes out a buffer. Its mutex must be held. */
+static void journal_flush_buffer(struct journal_buffer *buf)
+{
+    if (buf -> len == 0)
+    {
+        return;
+    }
+
+    struct iovec iov = { buf -> data, buf -> len };
+    journal_write(&iov, 1);
+    buf -> len = 0;
+}
+
+static void journal_append(uint32_t conn, JOURNAL_RECORD_TYPE type, void *payload, size_t len)
+{
+    static const char zeros[8];
+
+    if (len > JOURNAL_MAX_COMMAND)
+    {
+        len = JOURNAL_MAX_COMMAND;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct journal_record rec;
+    rec.time_ns = (now.tv_sec - journal.start.tv_sec) * 1000000000ULL + (now.tv_nsec - journal.start.tv_nsec);
+    rec.conn = conn;
+    rec.len = len;
+    rec.type = type;
+    rec.reserved = 0;
+
+    size_t size = sizeof(rec) + JOURNAL_PAD(len);
+    struct journal_buffer *buf = journal_get_buffer();
+
+    /* No buffer to be had, or a record too big for one: write it on its own. */
+    if (buf == NULL || size > JOURNAL_BUFFER_SIZE)
+    {
+        if (buf != NULL)
+        {
+            P(&(buf -> mutex));
+            journal_flush_buffer(buf);
+            V(&(buf -> mutex));
+        }
+
+        struct iovec iov[3] = { { &rec, sizeof(rec) }, { payload, len }, { (void *) zeros, JOURNAL_PAD(len) - len } };
+        journal_write(iov, 3);
+        return;
+    }
+
+    P(&(buf -> mutex));
+
+    if (buf -> len + size > JOURNAL_BUFFER_SIZE)
+    {
+        journal_flush_buffer(buf);
+    }
+
+    memcpy(buf -> data + buf -> len, &rec, sizeof(rec));
+    memcpy(buf -> data + buf -> len + sizeof(rec), payload, len);
+    memset(buf -> data + buf -> len + sizeof(rec) + len, 0, JOURNAL_PAD(len) - len);
+    buf -> len += size;
+
+    V(&(buf -> mutex));
+}
+
+uint32_t journal_connect(int ext)
+{
+    if (!journal.enabled)
+    {
+        return 0;
+    }
+
+    uint32_t conn = __atomic_add_fetch(&(journal.next_conn), 1, __ATOMIC_RELAXED);
+    int32_t payload = ext;
+    journal_append(conn, JOURNAL_CONNECT, &payload, sizeof(payload));
+
+    return conn;
+}
+
+void journal_command(uint32_t conn, char *cmd, size_t len)
+{
+    if (!journal.enabled || conn == 0)
+    {
+        return;
+    }
+
+    journal_append(conn, JOURNAL_COMMAND, cmd, len);
+}
+
+void journal_disconnect(uint32_t conn)
+{
+    if (!journal.enabled || conn == 0)
+    {
+        return;
+    }
+
+    journal_append(conn, JOURNAL_DISCONNECT, NULL, 0);
+}
+
+/* Writes out every buffer. */
+static void journal_flush_all(void)
+{
+    int num_buffers = __atomic_load_n(&(journal.num_buffers), __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_buffers; i++)
+    {
+        P(&(journal.buffers[i] -> mutex));
+        journal_flush_buffer(journal.buffers[i]);
+        V(&(journal.buffers[i] -> mutex));
+    }
+}
+
+/* Thread function of the flusher. */
+static void *journal_flusher(void *arg)
+{
+    while (!journal.stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (sem_timedwait(&(journal.wakeup), &deadline) < 0 && errno == EINTR)
+        {
+            ;
+        }
+
+        journal_flush_all();
+    }
+
+    return NULL;
+}
+
+int journal_init(char *path)
+{
+    if ((journal.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0)
+    {
+        error("Can't open journal %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &(journal.start));
+
+    struct journal_header header;
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.start_ns = wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+
+    if (write(journal.fd, &header, sizeof(header)) != sizeof(header))
+    {
+        close(journal.fd);
+        return -1;
+    }
+
+    Sem_init(&(journal.buffers_mutex), 0, 1);
+    Sem_init(&(journal.wakeup), 0, 0);
+
+    if (pthread_key_create(&(journal.buffer_key), journal_release_buffer) != 0)
+    {
+        close(journal.fd);
+        return -1;
+    }
+
+    journal.next_conn = 0;
+    journal.stopping = 0;
+    journal.enabled = 1;
+    Pthread_create(&(journal.flusher), NULL, journal_flusher, NULL);
+
+    info("Journaling commands to %s", path);
+    return 0;
+}
+
+void journal_shutdown(void)
+{
+    if (!journal.enabled)
+    {
+        return;
+    }
+
+    journal.stopping = 1;
+    V(&(journal.wakeup));
+    Pthread_join(journal.flusher, NULL);
+
+    journal_flush_all();
+    journal.enabled = 0;
+    close(journal.fd);
+}
+
+char *journal_payload(struct journal_record *rec)
+{
+    return (char *) (rec + 1);
+}
+
+/* Orders records by timestamp, then by where they are in the file. */
+static int journal_compare_records(const void *a, const void *b)
+{
+    struct journal_record *x = *(struct journal_record **) a;
+    struct journal_record *y = *(struct journal_record **) b;
+
+    if (x -> time_ns != y -> time_ns)
+    {
+        return (x -> time_ns > y -> time_ns) ? 1 : -1;
+    }
+
+    return (x > y) - (x < y);
+}
+
+int journal_read(char *path, struct journal *j)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct journal_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if ((j -> data = malloc(st.st_size)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = 0;
+    while (size < st.st_size)
+    {
+        ssize_t n = read(fd, j -> data + size, st.st_size - size);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        size += n;
+    }
+    close(fd);
+
+    memcpy(&(j -> header), j -> data, sizeof(j -> header));
+
+    if (size < sizeof(j -> header) || j -> header.magic != JOURNAL_MAGIC || j -> header.version != JOURNAL_VERSION)
+    {
+        free(j -> data);
+        return -1;
+    }
+
+    /* Count the records, then index them. */
+    size_t offset, count = 0;
+    for (offset = sizeof(j -> header); offset + sizeof(struct journal_record) <= size; count++)
+    {
+        struct journal_record *rec = (struct journal_record *) (j -> data + offset);
+        size_t next = offset + sizeof(struct journal_record) + JOURNAL_PAD(rec -> len);
+
+        if (next > size)
+        {
+            break;
+        }
+        offset = next;
+    }
+
+    if ((j -> records = malloc(sizeof(struct journal_record *) * (count + 1))) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    offset = sizeof(j -> header);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct journal_record *rec = (struct journal_record *) (j -> data + offset);
+        j -> records[i] = rec;
+        offset += sizeof(struct journal_record) + JOURNAL_PAD(rec -> len);
+    }
+
+    j -> num_records = count;
+    qsort(j -> records, count, sizeof(struct journal_record *), journal_compare_records);
+
+    return 0;
+}
+
+void journal_free(struct journal *j)
+{
+    free(j -> records);
+    free(j -> data);
+}
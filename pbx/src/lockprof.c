@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lockprof.h"
+#include "histogram.h"
+
+/* What a site has recorded. Every thread that goes thru the site records into the same stats. */
+struct lockprof_stats {
+    struct lockprof_site *site;
+    uint64_t acquisitions;
+    uint64_t contended;
+    struct histogram wait;
+    struct histogram hold;
+    struct lockprof_stats *next;
+};
+
+/* A lock the thread is holding, and since when. */
+struct lockprof_hold {
+    MUTEX *mutex;
+    struct lockprof_stats *stats;
+    uint64_t acquired_ns;
+};
+
+int lockprof_enabled;
+
+/* lockprof_held is the # of entries in lockprof_holds, so PROF_V only looks further when it is nonzero. */
+__thread int lockprof_held;
+static __thread struct lockprof_hold lockprof_holds[LOCKPROF_MAX_HELD];
+
+/* Every site's stats, newest first. Entries are only ever pushed on the front. */
+static struct lockprof_stats *lockprof_all;
+
+static uint64_t lockprof_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Gets a site's stats, making them if this is the first time the site is profiled. Two threads can get here
+at once for the same site, in which case the loser throws its copy away. */
+static struct lockprof_stats *lockprof_stats(struct lockprof_site *site)
+{
+    struct lockprof_stats *stats = __atomic_load_n(&(site -> stats), __ATOMIC_ACQUIRE);
+
+    if (stats != NULL)
+    {
+        return stats;
+    }
+
+    struct lockprof_stats *made = calloc(1, sizeof(struct lockprof_stats));
+
+    if (made == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    made -> site = site;
+    histogram_init(&(made -> wait));
+    histogram_init(&(made -> hold));
+
+    if (!__atomic_compare_exchange_n(&(site -> stats), &stats, made, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(made);
+        return stats;
+    }
+
+    made -> next = __atomic_load_n(&lockprof_all, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&lockprof_all, &(made -> next), made, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        ;
+    }
+
+    return made;
+}
+
+void lockprof_P(MUTEX *mutex, struct lockprof_site *site)
+{
+    struct lockprof_stats *stats = lockprof_stats(site);
+    uint64_t start = lockprof_now();
+
+    if (mutex_trylock(mutex) < 0)
+    {
+        __atomic_add_fetch(&(stats -> contended), 1, __ATOMIC_RELAXED);
+        mutex_lock(mutex);
+    }
+
+    uint64_t acquired = lockprof_now();
+
+    __atomic_add_fetch(&(stats -> acquisitions), 1, __ATOMIC_RELAXED);
+    histogram_record_shared(&(stats -> wait), acquired - start);
+
+    if (lockprof_held < LOCKPROF_MAX_HELD)
+    {
+        lockprof_holds[lockprof_held].mutex = mutex;
+        lockprof_holds[lockprof_held].stats = stats;
+        lockprof_holds[lockprof_held].acquired_ns = acquired;
+        lockprof_held++;
+    }
+}
+
+void lockprof_V(MUTEX *mutex)
+{
+    /* Locks are nearly always let go of in the reverse order, so look from the most recent one. */
+    for (int i = lockprof_held - 1; i >= 0; i--)
+    {
+        if (lockprof_holds[i].mutex == mutex)
+        {
+            histogram_record_shared(&(lockprof_holds[i].stats -> hold), lockprof_now() - lockprof_holds[i].acquired_ns);
+
+            lockprof_held--;
+            memmove(&lockprof_holds[i], &lockprof_holds[i + 1], sizeof(struct lockprof_hold) * (lockprof_held - i));
+            break;
+        }
+    }
+
+    mutex_unlock(mutex);
+}
+
+void lockprof_enable(int enable)
+{
+    __atomic_store_n(&lockprof_enabled, enable != 0, __ATOMIC_RELAXED);
+}
+
+void lockprof_reset(void)
+{
+    for (struct lockprof_stats *stats = __atomic_load_n(&lockprof_all, __ATOMIC_ACQUIRE); stats != NULL;
+        stats = stats -> next)
+    {
+        __atomic_store_n(&(stats -> acquisitions), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(stats -> contended), 0, __ATOMIC_RELAXED);
+        histogram_init(&(stats -> wait));
+        histogram_init(&(stats -> hold));
+    }
+}
+
+static int lockprof_compare(const void *a, const void *b)
+{
+    uint64_t wait_a = (*(struct lockprof_stats **) a) -> wait.sum;
+    uint64_t wait_b = (*(struct lockprof_stats **) b) -> wait.sum;
+
+    return (wait_a < wait_b) - (wait_a > wait_b);
+}
+
+int lockprof_write(FILE *out)
+{
+    int count = 0;
+    struct lockprof_stats *all = __atomic_load_n(&lockprof_all, __ATOMIC_ACQUIRE);
+
+    for (struct lockprof_stats *stats = all; stats != NULL; stats = stats -> next)
+    {
+        count++;
+    }
+
+    struct lockprof_stats **sorted = malloc(sizeof(struct lockprof_stats *) * (count + 1));
+
+    if (sorted == NULL)
+    {
+        return -1;
+    }
+
+    count = 0;
+    for (struct lockprof_stats *stats = all; stats != NULL; stats = stats -> next)
+    {
+        sorted[count++] = stats;
+    }
+
+    qsort(sorted, count, sizeof(struct lockprof_stats *), lockprof_compare);
+
+    fprintf(out, "lock profiling is %s\n", __atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED) ? "on" : "off");
+    fprintf(out, "%-28s %-24s %10s %10s %12s %9s %9s %9s %9s %9s %9s\n", "lock", "site", "acquired", "contended",
+        "wait_total", "wait_p50", "wait_p99", "wait_max", "hold_p50", "hold_p99", "hold_max");
+
+    for (int i = 0; i < count; i++)
+    {
+        struct lockprof_stats *stats = sorted[i];
+        char site[64];
+
+        snprintf(site, sizeof(site), "%s:%d", stats -> site -> func, stats -> site -> line);
+        fprintf(out, "%-28s %-24s %10lu %10lu %12lu %9lu %9lu %9lu %9lu %9lu %9lu\n",
+            stats -> site -> lock, site, stats -> acquisitions, stats -> contended, stats -> wait.sum,
+            histogram_percentile(&(stats -> wait), 50.0), histogram_percentile(&(stats -> wait), 99.0),
+            stats -> wait.max, histogram_percentile(&(stats -> hold), 50.0),
+            histogram_percentile(&(stats -> hold), 99.0), stats -> hold.max);
+    }
+
+    free(sorted);
+
+    return ferror(out) ? -1 : 0;
+}
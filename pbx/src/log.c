@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "log.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* How a site's arguments are picked up. */
+typedef enum log_arg_kind {
+    LOG_ARG_NONE, LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG, LOG_ARG_DOUBLE, LOG_ARG_POINTER, LOG_ARG_STRING
+} LOG_ARG_KIND;
+
+/* Values of parsed in a struct log_site. */
+#define LOG_UNPARSED 0
+#define LOG_DEFERRED 1
+#define LOG_FORMAT_NOW 2
+
+/* Longest conversion spec (e.g. "%-08.3lx") that can be deferred. */
+#define LOG_MAX_SPEC 16
+
+/* A message waiting to be formatted. A string argument is kept as the offset of its contents in text. If the
+site couldn't be deferred, text is the message itself. */
+struct log_entry {
+    struct log_site *site;
+    uint64_t time_ns;
+    uint64_t args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_SIZE];
+};
+
+/* Ring of one thread, the same as the CDR rings: the owner moves tail and the formatter moves head. */
+struct log_ring {
+    uint32_t head;
+    char head_pad[60];
+    uint32_t tail;
+    uint32_t dropped;
+    char tail_pad[56];
+    struct log_entry entries[LOG_RING_SIZE];
+    struct log_ring *next_free;
+};
+
+/* A message picked up by the formatter. ring and seq keep messages logged in the same ns in order. */
+struct log_batch_entry {
+    struct log_entry entry;
+    int ring;
+    uint32_t seq;
+};
+
+static struct {
+    int started;
+    struct log_ring *rings[LOG_MAX_RINGS];
+    int num_rings;
+    struct log_ring *free_rings;
+    sem_t rings_mutex;
+    pthread_key_t ring_key;
+    pthread_t formatter;
+    sem_t drain_mutex;
+    struct log_batch_entry *batch;
+    size_t batch_cap;
+    uint64_t dropped_reported;
+} logger;
+
+static __thread struct log_ring *log_thread_ring;
+
+static char *log_prefixes[] = {
+    [LOG_DEBUG] KMAG "DEBUG: ",
+    [LOG_INFO] KBLU "INFO: ",
+    [LOG_SUCCESS] KGRN "SUCCESS: ",
+    [LOG_WARN] KYEL "WARN: ",
+    [LOG_ERROR] KRED "ERROR: "
+};
+
+static uint64_t log_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Finds the end of the conversion spec that starts at spec (on its '%'), and what kind of argument it takes
+(LOG_ARG_NONE for "%%"). Returns NULL if it is a spec that can't be deferred. */
+static const char *log_spec(const char *spec, LOG_ARG_KIND *kind)
+{
+    const char *c = spec + 1;
+    int longs = 0;
+
+    if (*c == '%')
+    {
+        *kind = LOG_ARG_NONE;
+        return c + 1;
+    }
+
+    c += strspn(c, "-+ #0'");
+    c += strspn(c, "0123456789");
+    if (*c == '.')
+    {
+        c++;
+        c += strspn(c, "0123456789");
+    }
+
+    /* Length modifiers. size_t, ptrdiff_t and intmax_t are all 64 bits, the same as long. */
+    while (*c != '\0' && strchr("hlzjt", *c) != NULL)
+    {
+        longs += (*c == 'h') ? 0 : (*c == 'l') ? 1 : 2;
+        c++;
+    }
+
+    switch (*c)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            *kind = (longs == 0) ? LOG_ARG_INT : (longs == 1) ? LOG_ARG_LONG : LOG_ARG_LLONG;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            *kind = LOG_ARG_DOUBLE;
+            break;
+        case 'p':
+            *kind = LOG_ARG_POINTER;
+            break;
+        case 's':
+            *kind = LOG_ARG_STRING;
+            break;
+        default:
+            return NULL;
+    }
+
+    return (c + 1 - spec < LOG_MAX_SPEC) ? c + 1 : NULL;
+}
+
+/* Works out the kinds of a site's arguments from its format. Threads may do this at the same time for the
+same site, but they all work out the same thing. */
+static void log_parse(struct log_site *site)
+{
+    int num_args = 0;
+    int parsed = LOG_DEFERRED;
+
+    for (const char *c = site -> format; *c != '\0' && parsed == LOG_DEFERRED; )
+    {
+        LOG_ARG_KIND kind;
+
+        if (*c != '%')
+        {
+            c++;
+        }
+        else if ((c = log_spec(c, &kind)) == NULL || (kind != LOG_ARG_NONE && num_args == LOG_MAX_ARGS))
+        {
+            parsed = LOG_FORMAT_NOW;
+        }
+        else if (kind != LOG_ARG_NONE)
+        {
+            site -> kinds[num_args++] = kind;
+        }
+    }
+
+    site -> num_args = num_args;
+    __atomic_store_n(&(site -> parsed), parsed, __ATOMIC_RELEASE);
+}
+
+/* Writes out a message as it would be formatted, with its prefix and newline. */
+static void log_write_prefix(FILE *out, struct log_site *site)
+{
+    fprintf(out, "%s%s:%s:%d " KNRM, log_prefixes[site -> level], site -> file, site -> func, site -> line);
+}
+
+/* Formats a deferred message. */
+static void log_write_entry(FILE *out, struct log_entry *entry)
+{
+    struct log_site *site = entry -> site;
+
+    log_write_prefix(out, site);
+
+    if (site -> parsed != LOG_DEFERRED)
+    {
+        fprintf(out, "%s" NL, entry -> text);
+        return;
+    }
+
+    int arg = 0;
+    const char *c = site -> format;
+
+    while (*c != '\0')
+    {
+        size_t literal = strcspn(c, "%");
+        fwrite(c, 1, literal, out);
+        c += literal;
+
+        if (*c == '\0')
+        {
+            break;
+        }
+
+        /* Each spec is handed to fprintf on its own, with its argument converted back to the right type. */
+        LOG_ARG_KIND kind;
+        const char *end = log_spec(c, &kind);
+        char spec[LOG_MAX_SPEC];
+
+        memcpy(spec, c, end - c);
+        spec[end - c] = '\0';
+        c = end;
+
+        uint64_t value = (kind == LOG_ARG_NONE) ? 0 : entry -> args[arg++];
+        double real;
+
+        switch (kind)
+        {
+            case LOG_ARG_NONE:
+                fputc('%', out);
+                break;
+            case LOG_ARG_INT:
+                fprintf(out, spec, (int) value);
+                break;
+            case LOG_ARG_LONG:
+                fprintf(out, spec, (long) value);
+                break;
+            case LOG_ARG_LLONG:
+                fprintf(out, spec, (long long) value);
+                break;
+            case LOG_ARG_DOUBLE:
+                memcpy(&real, &value, sizeof(real));
+                fprintf(out, spec, real);
+                break;
+            case LOG_ARG_POINTER:
+                fprintf(out, spec, (void *) (uintptr_t) value);
+                break;
+            case LOG_ARG_STRING:
+                fprintf(out, spec, entry -> text + value);
+                break;
+        }
+    }
+
+    fputs(NL, out);
+}
+
+static void log_release_ring(void *arg)
+{
+    struct log_ring *ring = arg;
+
+    P(&(logger.rings_mutex));
+    ring -> next_free = logger.free_rings;
+    logger.free_rings = ring;
+    V(&(logger.rings_mutex));
+}
+
+/* Gets the calling thread's ring, taking one the first time. Returns NULL if there are no rings left. */
+static struct log_ring *log_get_ring(void)
+{
+    if (log_thread_ring != NULL)
+    {
+        return log_thread_ring;
+    }
+
+    struct log_ring *ring = NULL;
+
+    P(&(logger.rings_mutex));
+
+    if (logger.free_rings != NULL)
+    {
+        ring = logger.free_rings;
+        logger.free_rings = ring -> next_free;
+    }
+    else if (logger.num_rings < LOG_MAX_RINGS)
+    {
+        ring = calloc(1, sizeof(struct log_ring));
+
+        if (ring == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        logger.rings[logger.num_rings] = ring;
+        __atomic_store_n(&(logger.num_rings), logger.num_rings + 1, __ATOMIC_RELEASE);
+    }
+
+    V(&(logger.rings_mutex));
+
+    if (ring != NULL)
+    {
+        pthread_setspecific(logger.ring_key, ring);
+        log_thread_ring = ring;
+    }
+
+    return ring;
+}
+
+void log_record(struct log_site *site, ...)
+{
+    va_list args;
+
+    if (__atomic_load_n(&(site -> parsed), __ATOMIC_ACQUIRE) == LOG_UNPARSED)
+    {
+        log_parse(site);
+    }
+
+    struct log_ring *ring = __atomic_load_n(&(logger.started), __ATOMIC_ACQUIRE) ? log_get_ring() : NULL;
+
+    if (ring == NULL)
+    {
+        /* No formatter: write it out on the spot, in one piece. */
+        va_start(args, site);
+        flockfile(stderr);
+        log_write_prefix(stderr, site);
+        vfprintf(stderr, site -> format, args);
+        fputs(NL, stderr);
+        funlockfile(stderr);
+        va_end(args);
+        return;
+    }
+
+    uint32_t tail = ring -> tail;
+
+    if (tail - __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_add_fetch(&(ring -> dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_entry *entry = &(ring -> entries[tail & (LOG_RING_SIZE - 1)]);
+    entry -> site = site;
+    entry -> time_ns = log_now();
+
+    va_start(args, site);
+
+    if (site -> parsed != LOG_DEFERRED)
+    {
+        vsnprintf(entry -> text, LOG_TEXT_SIZE, site -> format, args);
+    }
+    else
+    {
+        size_t text_len = 0;
+
+        for (int i = 0; i < site -> num_args; i++)
+        {
+            double real;
+            char *string;
+
+            switch (site -> kinds[i])
+            {
+                case LOG_ARG_INT:
+                    entry -> args[i] = (uint64_t) va_arg(args, int);
+                    break;
+                case LOG_ARG_LONG:
+                    entry -> args[i] = (uint64_t) va_arg(args, long);
+                    break;
+                case LOG_ARG_LLONG:
+                    entry -> args[i] = (uint64_t) va_arg(args, long long);
+                    break;
+                case LOG_ARG_DOUBLE:
+                    real = va_arg(args, double);
+                    memcpy(&(entry -> args[i]), &real, sizeof(real));
+                    break;
+                case LOG_ARG_POINTER:
+                    entry -> args[i] = (uintptr_t) va_arg(args, void *);
+                    break;
+                case LOG_ARG_STRING:
+                    /* The string may be gone by the time the message is formatted, so its contents are copied. */
+                    string = va_arg(args, char *);
+                    string = (string == NULL) ? "(null)" : string;
+
+                    if (text_len == LOG_TEXT_SIZE)
+                    {
+                        text_len--;
+                    }
+
+                    size_t len = strnlen(string, LOG_TEXT_SIZE - 1 - text_len);
+                    memcpy(entry -> text + text_len, string, len);
+                    entry -> text[text_len + len] = '\0';
+                    entry -> args[i] = text_len;
+                    text_len += len + 1;
+                    break;
+            }
+        }
+    }
+
+    va_end(args);
+
+    __atomic_store_n(&(ring -> tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+static int log_compare(const void *a, const void *b)
+{
+    const struct log_batch_entry *entry_a = a;
+    const struct log_batch_entry *entry_b = b;
+
+    if (entry_a -> entry.time_ns != entry_b -> entry.time_ns)
+    {
+        return (entry_a -> entry.time_ns < entry_b -> entry.time_ns) ? -1 : 1;
+    }
+    if (entry_a -> ring != entry_b -> ring)
+    {
+        return entry_a -> ring - entry_b -> ring;
+    }
+
+    return (int32_t) (entry_a -> seq - entry_b -> seq);
+}
+
+/* Takes everything out of the rings, and writes it out in order with a single write. */
+static void log_drain(void)
+{
+    P(&(logger.drain_mutex));
+
+    size_t count = 0;
+    uint64_t dropped = 0;
+    int num_rings = __atomic_load_n(&(logger.num_rings), __ATOMIC_ACQUIRE);
+
+    for (int r = 0; r < num_rings; r++)
+    {
+        struct log_ring *ring = logger.rings[r];
+        uint32_t head = ring -> head;
+        uint32_t tail = __atomic_load_n(&(ring -> tail), __ATOMIC_ACQUIRE);
+
+        dropped += __atomic_load_n(&(ring -> dropped), __ATOMIC_RELAXED);
+
+        if (count + (tail - head) > logger.batch_cap)
+        {
+            logger.batch_cap = (count + (tail - head)) * 2;
+            logger.batch = realloc(logger.batch, sizeof(struct log_batch_entry) * logger.batch_cap);
+
+            if (logger.batch == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (; head != tail; head++)
+        {
+            logger.batch[count].entry = ring -> entries[head & (LOG_RING_SIZE - 1)];
+            logger.batch[count].ring = r;
+            logger.batch[count].seq = head;
+            count++;
+        }
+
+        __atomic_store_n(&(ring -> head), head, __ATOMIC_RELEASE);
+    }
+
+    if (count > 0 || dropped > logger.dropped_reported)
+    {
+        char *text = NULL;
+        size_t text_len = 0;
+        FILE *out = open_memstream(&text, &text_len);
+
+        if (out != NULL)
+        {
+            qsort(logger.batch, count, sizeof(struct log_batch_entry), log_compare);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                log_write_entry(out, &(logger.batch[i].entry));
+            }
+
+            if (dropped > logger.dropped_reported)
+            {
+                fprintf(out, "%s" KNRM "%lu log messages dropped so far" NL, log_prefixes[LOG_WARN], dropped);
+                logger.dropped_reported = dropped;
+            }
+
+            fclose(out);
+            fwrite(text, 1, text_len, stderr);
+            fflush(stderr);
+            free(text);
+        }
+    }
+
+    V(&(logger.drain_mutex));
+}
+
+/* Thread function of the formatter. */
+static void *log_formatter(void *arg)
+{
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+        log_drain();
+    }
+
+    return NULL;
+}
+
+void log_init(void)
+{
+    Sem_init(&(logger.rings_mutex), 0, 1);
+    Sem_init(&(logger.drain_mutex), 0, 1);
+
+    if (pthread_key_create(&(logger.ring_key), log_release_ring) != 0)
+    {
+        return;
+    }
+
+    /* Whatever is still in the rings when the server exits (by any path) is written out on the way. */
+    atexit(log_flush);
+
+    __atomic_store_n(&(logger.started), 1, __ATOMIC_RELEASE);
+    Pthread_create(&(logger.formatter), NULL, log_formatter, NULL);
+    Pthread_detach(logger.formatter);
+}
+
+void log_flush(void)
+{
+    if (__atomic_load_n(&(logger.started), __ATOMIC_ACQUIRE))
+    {
+        log_drain();
+    }
+}
@@ -15,6 +15,15 @@
 
 /* My own imports. */
 #include "csapp.h"
+#include "wal.h"
+#include "dialplan.h"
+#include "hunt.h"
+#include "cdr.h"
+#include "journal.h"
+#include "admin.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "log.h"
 
 static void terminate(int status);
 
@@ -24,10 +33,23 @@ void sighup_server_handler(int sig)
     terminate(EXIT_SUCCESS);
 }
 
+/* SIGUSR1 handler for server. Reloads the dial plan (in the reloader thread). */
+void sigusr1_server_handler(int sig)
+{
+    dialplan_request_reload();
+}
+
+/* SIGUSR2 handler for server. Dumps the trace rings to a file (in the dumper thread). */
+void sigusr2_server_handler(int sig)
+{
+    trace_request_dump();
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-w <wal_dir>] [-d <dial_plan>] [-g <hunt_groups>] [-c <cdr_dir>] [-j <journal>]
+ *            [-a <admin_port>] [-t <watchdog_ms>]
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
@@ -35,29 +57,85 @@ int main(int argc, char* argv[]){
     // on which the server should listen.
 
     char *port_num = NULL;
-    /* First check if there are just 3 arguments (file name, -p, port #). */
-    if (argc == 3)
+    char *wal_dir = NULL;
+    char *dial_plan = NULL;
+    char *hunt_groups = NULL;
+    char *cdr_dir = NULL;
+    char *journal_path = NULL;
+    char *admin_port = NULL;
+    int watchdog_ms = 0;
+    int option;
+
+    /* Options: -p <port> is required. -w <dir> turns on the write-ahead log of call state in that directory.
+    -d <file> loads a dial plan. -g <file> loads hunt groups. -c <dir> writes call detail records into that
+    directory. -j <file> journals every command received into that file. -a <port> serves the admin socket
+    (metrics etc., see admin.h) on that port of 127.0.0.1. -t <ms> starts the watchdog, which reports threads that
+    hold a lock (or take on a command) for longer than that (see watchdog.h). Any other option (or missing argument)
+    is an exit failure. */
+    while ((option = getopt(argc, argv, "p:w:d:g:c:j:a:t:")) != -1)
     {
-        /* Now check if first argument is -p flag. */
-        if (strcmp(argv[1], "-p") == 0)
+        switch (option)
         {
-            /* Now check if the port num is 1024 or greater (valid port num). If not, exit failure. */
-            if (atoi(argv[2]) < 1024)
-            {
-                exit(EXIT_FAILURE);
-            }
-            else
-            {
+            case 'p':
+                /* Now check if the port num is 1024 or greater (valid port num). If not, exit failure. */
+                if (atoi(optarg) < 1024)
+                {
+                    exit(EXIT_FAILURE);
+                }
+
                 /* Otherwise set port num as a string for future use. */
-                port_num = argv[2];
-            }
-        }
-        else
-        {
-            exit(EXIT_FAILURE);
+                port_num = optarg;
+                break;
+            case 'w':
+                wal_dir = optarg;
+                break;
+            case 'd':
+                dial_plan = optarg;
+                break;
+            case 'g':
+                hunt_groups = optarg;
+                break;
+            case 'c':
+                cdr_dir = optarg;
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'a':
+                if (atoi(optarg) < 1024)
+                {
+                    exit(EXIT_FAILURE);
+                }
+
+                admin_port = optarg;
+                break;
+            case 't':
+                if ((watchdog_ms = atoi(optarg)) < 1)
+                {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                exit(EXIT_FAILURE);
         }
     }
-    else
+
+    if (port_num == NULL || optind != argc)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* From here on, log messages are formatted and written out by the logger's own thread. */
+    log_init();
+
+    /* Start the watchdog before any lock it should watch is taken. */
+    if (watchdog_ms > 0)
+    {
+        watchdog_init(watchdog_ms);
+    }
+
+    /* Hunt groups have to be loaded before any TU registers, so their idle bitmaps start out right. */
+    if (hunt_groups != NULL && hunt_init(hunt_groups) < 0)
     {
         exit(EXIT_FAILURE);
     }
@@ -66,6 +144,39 @@ int main(int argc, char* argv[]){
     debug("Initializing PBX...");
     pbx = pbx_init();
 
+    /* Recover call state from the WAL (if any) before accepting clients, so reconnecting clients can reclaim it. */
+    if (wal_dir != NULL && wal_init(wal_dir) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Load the dial plan. A bad plan at startup is an exit failure; a bad plan on reload just keeps the old one. */
+    if (dial_plan != NULL && dialplan_init(dial_plan) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start the CDR writer. */
+    if (cdr_dir != NULL && cdr_init(cdr_dir) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start the command journal. */
+    if (journal_path != NULL && journal_init(journal_path) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start the thread that dumps the trace when asked to by SIGUSR2. */
+    trace_init();
+
+    /* Start serving the admin socket. */
+    if (admin_port != NULL && admin_init(admin_port) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
     // run function pbx_client_service().  In addition, you should install
@@ -85,6 +196,27 @@ int main(int argc, char* argv[]){
     sighup_signal.sa_handler = sighup_server_handler;
     sigaction(SIGHUP, &sighup_signal, NULL);
 
+    /* SIGUSR1 reloads the dial plan. SA_RESTART so accept() just carries on. */
+    struct sigaction sigusr1_signal;
+    memset(&sigusr1_signal, 0, sizeof(sigusr1_signal));
+    sigusr1_signal.sa_handler = sigusr1_server_handler;
+    sigusr1_signal.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sigusr1_signal, NULL);
+
+    /* SIGUSR2 dumps the trace. */
+    struct sigaction sigusr2_signal;
+    memset(&sigusr2_signal, 0, sizeof(sigusr2_signal));
+    sigusr2_signal.sa_handler = sigusr2_server_handler;
+    sigusr2_signal.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sigusr2_signal, NULL);
+
+    /* A client that goes away while a notification is being written to it must not take the server down with
+    SIGPIPE. The write just fails with EPIPE, and the client's thread cleans up when its read sees the EOF. */
+    struct sigaction sigpipe_signal;
+    memset(&sigpipe_signal, 0, sizeof(sigpipe_signal));
+    sigpipe_signal.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigpipe_signal, NULL);
+
     int *connfdp;
     pthread_t thread_id;
 
@@ -122,6 +254,9 @@ int main(int argc, char* argv[]){
 void terminate(int status) {
     debug("Shutting down PBX...");
     pbx_shutdown(pbx);
+    wal_shutdown();
+    cdr_shutdown();
+    journal_shutdown();
     debug("PBX server terminating");
     exit(status);
 }
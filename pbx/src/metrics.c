@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pbx.h"
+#include "metrics.h"
+#include "histogram.h"
+
+/* Prometheus histogram bucket bounds are 2^METRICS_LOW_BOUND .. 2^METRICS_HIGH_BOUND ns. Powers of 2 are
+bucket edges of the log-linear histograms, so each bound is exact. */
+#define METRICS_LOW_BOUND 8
+#define METRICS_HIGH_BOUND 34
+#define METRICS_STAGE_HIGH_BOUND 40
+
+/* Latency of one command type (or call stage). No min or max is kept, so that recording is only adds. */
+struct metrics_latency {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* One CPU's metrics, on cache lines of their own. */
+struct metrics_shard {
+    uint64_t counters[METRIC_NUM_COUNTERS];
+    struct metrics_latency latency[METRIC_NUM_COMMANDS];
+    struct metrics_latency stages[METRIC_NUM_STAGES];
+} __attribute__((aligned(64)));
+
+/* The shards are never touched until a thread on that CPU counts something, so unused ones cost no memory. */
+static struct metrics_shard shards[METRICS_MAX_SHARDS];
+
+/* Call IDs are handed out in order, starting at 1. */
+static uint64_t last_call_id;
+
+static char *command_names[METRIC_NUM_COMMANDS] = {
+    [METRIC_CMD_PICKUP] "pickup",
+    [METRIC_CMD_HANGUP] "hangup",
+    [METRIC_CMD_DIAL] "dial",
+    [METRIC_CMD_CHAT] "chat",
+    [METRIC_CMD_PAGE] "page",
+    [METRIC_CMD_SUBSCRIBE] "subscribe",
+    [METRIC_CMD_RECLAIM] "reclaim"
+};
+
+static char *stage_names[METRIC_NUM_STAGES] = {
+    [METRIC_STAGE_RING] "ring",
+    [METRIC_STAGE_ANSWER] "answer",
+    [METRIC_STAGE_TALK] "talk"
+};
+
+static struct metrics_shard *metrics_shard(void)
+{
+    int cpu = sched_getcpu();
+
+    return &shards[(cpu < 0) ? 0 : cpu % METRICS_MAX_SHARDS];
+}
+
+void metrics_count(METRIC_COUNTER counter)
+{
+    __atomic_add_fetch(&(metrics_shard() -> counters[counter]), 1, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_start(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Records a time in a latency histogram. */
+static void metrics_record(struct metrics_latency *latency, uint64_t elapsed)
+{
+    __atomic_add_fetch(&(latency -> buckets[histogram_bucket(elapsed)]), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(latency -> sum), elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(latency -> count), 1, __ATOMIC_RELAXED);
+}
+
+void metrics_command(METRIC_COMMAND command, uint64_t start)
+{
+    uint64_t elapsed = metrics_start() - start;
+
+    /* The thread may have moved to another CPU during the command. It doesn't matter which shard it uses. */
+    metrics_record(&(metrics_shard() -> latency[command]), elapsed);
+}
+
+uint64_t metrics_call_start(struct metrics_call *call, uint64_t start)
+{
+    call -> id = __atomic_add_fetch(&last_call_id, 1, __ATOMIC_RELAXED);
+    call -> stage_ns = start;
+    return call -> id;
+}
+
+void metrics_call_stage(struct metrics_call *call, METRIC_STAGE stage)
+{
+    if (call -> id == 0)
+    {
+        return;
+    }
+
+    uint64_t now = metrics_start();
+
+    metrics_record(&(metrics_shard() -> stages[stage]), now - call -> stage_ns);
+    call -> stage_ns = now;
+}
+
+/* Adds up a counter over all the shards. */
+static uint64_t metrics_counter_total(METRIC_COUNTER counter)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < METRICS_MAX_SHARDS; i++)
+    {
+        total += __atomic_load_n(&(shards[i].counters[counter]), __ATOMIC_RELAXED);
+    }
+
+    return total;
+}
+
+/* Prometheus label value of a state: its name in lower case, with '_' for ' '. */
+static void metrics_state_label(TU_STATE state, char *label, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size && tu_state_names[state][i] != '\0'; i++)
+    {
+        char c = tu_state_names[state][i];
+        label[i] = (c == ' ') ? '_' : (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    label[i] = '\0';
+}
+
+/* Adds up a histogram over all the shards. offset is where it is in a shard. */
+static void metrics_latency_total(size_t offset, struct metrics_latency *total)
+{
+    memset(total, 0, sizeof(*total));
+
+    for (int i = 0; i < METRICS_MAX_SHARDS; i++)
+    {
+        struct metrics_latency *latency = (struct metrics_latency *) ((char *) &shards[i] + offset);
+
+        /* Reading the count first means a concurrent record can make the buckets add up to more than the count,
+        but never less, and Prometheus takes the +Inf bucket from the count. */
+        total -> count += __atomic_load_n(&(latency -> count), __ATOMIC_RELAXED);
+        total -> sum += __atomic_load_n(&(latency -> sum), __ATOMIC_RELAXED);
+
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        {
+            total -> buckets[b] += __atomic_load_n(&(latency -> buckets[b]), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Writes out one histogram of a family (e.g. pbx_command_duration_seconds{command="dial"}), with bucket bounds
+up to 2^high_bound ns. */
+static void metrics_write_latency(FILE *out, char *family, char *label, char *value, size_t offset, int high_bound)
+{
+    struct metrics_latency total;
+
+    metrics_latency_total(offset, &total);
+
+    int bucket = 0;
+    uint64_t cumulative = 0;
+
+    for (int bound = METRICS_LOW_BOUND; bound <= high_bound; bound++)
+    {
+        /* Everything below 2^bound ns is at or below the bound. */
+        int end = histogram_bucket(1ULL << bound);
+        while (bucket < end)
+        {
+            cumulative += total.buckets[bucket++];
+        }
+
+        if (cumulative > total.count)
+        {
+            cumulative = total.count;
+        }
+
+        fprintf(out, "%s_bucket{%s=\"%s\",le=\"%.9g\"} %lu\n", family, label, value, (1ULL << bound) / 1e9,
+            cumulative);
+    }
+
+    fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", family, label, value, total.count);
+    fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n", family, label, value, total.sum / 1e9);
+    fprintf(out, "%s_count{%s=\"%s\"} %lu\n", family, label, value, total.count);
+}
+
+int metrics_write(FILE *out)
+{
+    uint64_t registered = metrics_counter_total(METRIC_TUS_REGISTERED);
+    uint64_t unregistered = metrics_counter_total(METRIC_TUS_UNREGISTERED);
+
+    fprintf(out, "# HELP pbx_tus_active TUs registered right now.\n");
+    fprintf(out, "# TYPE pbx_tus_active gauge\n");
+    fprintf(out, "pbx_tus_active %ld\n", (long) (registered - unregistered));
+
+    fprintf(out, "# HELP pbx_tu_registrations_total TUs registered since the server started.\n");
+    fprintf(out, "# TYPE pbx_tu_registrations_total counter\n");
+    fprintf(out, "pbx_tu_registrations_total %lu\n", registered);
+
+    fprintf(out, "# HELP pbx_tu_state_changes_total Times a TU went into each state. RING BACK is a call placed, "
+        "BUSY SIGNAL a busy callee, ERROR a bad dial and CONNECTED (twice per call) an answer.\n");
+    fprintf(out, "# TYPE pbx_tu_state_changes_total counter\n");
+
+    for (TU_STATE state = TU_ON_HOOK; state <= TU_ERROR; state++)
+    {
+        char label[32];
+        metrics_state_label(state, label, sizeof(label));
+        fprintf(out, "pbx_tu_state_changes_total{state=\"%s\"} %lu\n", label,
+            metrics_counter_total(METRIC_STATE_CHANGES + state));
+    }
+
+    fprintf(out, "# HELP pbx_command_duration_seconds Time taken to carry out client commands.\n");
+    fprintf(out, "# TYPE pbx_command_duration_seconds histogram\n");
+
+    for (METRIC_COMMAND command = 0; command < METRIC_NUM_COMMANDS; command++)
+    {
+        metrics_write_latency(out, "pbx_command_duration_seconds", "command", command_names[command],
+            offsetof(struct metrics_shard, latency[command]), METRICS_HIGH_BOUND);
+    }
+
+    fprintf(out, "# HELP pbx_call_stage_seconds Time taken by calls to get to each stage from the one before: "
+        "ring from the dial to the callee ringing, answer from then to the pickup, talk from then to the hangup.\n");
+    fprintf(out, "# TYPE pbx_call_stage_seconds histogram\n");
+
+    for (METRIC_STAGE stage = 0; stage < METRIC_NUM_STAGES; stage++)
+    {
+        metrics_write_latency(out, "pbx_call_stage_seconds", "stage", stage_names[stage],
+            offsetof(struct metrics_shard, stages[stage]), METRICS_STAGE_HIGH_BOUND);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mutex.h"
+
+static pthread_once_t mutex_once = PTHREAD_ONCE_INIT;
+static int mutex_spin_limit;
+
+/* Spinning only makes sense if the holder can be running on another CPU at the same time. */
+static void mutex_setup(void)
+{
+    mutex_spin_limit = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? MUTEX_SPIN_LIMIT : 0;
+}
+
+static void mutex_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+void mutex_lock_contended(MUTEX *mutex)
+{
+    pthread_once(&mutex_once, mutex_setup);
+
+    /* Spin while the mutex is held by someone who is (presumably) running, pausing twice as long each time.
+    Once somebody is asleep waiting for it, spinning won't get it any sooner. */
+    int delay = 1;
+
+    for (int spins = 0; spins < mutex_spin_limit; spins++)
+    {
+        uint32_t state = __atomic_load_n(&(mutex -> state), __ATOMIC_RELAXED);
+
+        if (state == 2)
+        {
+            break;
+        }
+
+        uint32_t expected = 0;
+
+        if (state == 0 &&
+            __atomic_compare_exchange_n(&(mutex -> state), &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return;
+        }
+
+        for (int i = 0; i < delay; i++)
+        {
+            mutex_pause();
+        }
+
+        if (delay < 64)
+        {
+            delay *= 2;
+        }
+    }
+
+    /* Go to sleep until the mutex is let go of. The mutex is marked as having a sleeper (2) on the way in, and
+    taken the same way, since there is no telling whether others are still asleep. */
+    while (__atomic_exchange_n(&(mutex -> state), 2, __ATOMIC_ACQUIRE) != 0)
+    {
+        /* EAGAIN means it was let go of in the meantime, and EINTR that a signal came in. Either way, look again. */
+        syscall(SYS_futex, &(mutex -> state), FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+void mutex_wake(MUTEX *mutex)
+{
+    syscall(SYS_futex, &(mutex -> state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
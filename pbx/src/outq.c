@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "outq.h"
+#include "mutex.h"
+#include "debug.h"
+
+/* Outbound queue of one connection. The mutex protects everything but fd and not_socket, which only whoever is
+draining the queue uses, and next_deferred, which only the thread it was deferred to uses. head_offset is how much
+of the message at the head has already been written. writing is set while the drainer is using fd without the
+mutex, and closed once the connection has gone away (so fd may be somebody else's by now). */
+struct outq {
+    int refs;
+    int fd;
+    MUTEX mutex;
+    struct msgbuf *messages[OUTQ_MAX_MESSAGES];
+    int head;
+    int count;
+    size_t head_offset;
+    int draining;
+    int writing;
+    int failed;
+    int closed;
+    int not_socket;
+    struct outq *next_deferred;
+};
+
+/* Queues the calling thread has to drain once it holds no locks (see outq_write). */
+static __thread struct outq *deferred;
+
+struct msgbuf *msgbuf_new(size_t len)
+{
+    struct msgbuf *buf = malloc(sizeof(struct msgbuf) + len);
+
+    if (buf == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    buf -> refs = 1;
+    buf -> len = len;
+    return buf;
+}
+
+struct msgbuf *msgbuf_printf(char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    /* One extra byte for the null terminator vsnprintf writes, which isn't part of the message. */
+    struct msgbuf *buf = msgbuf_new(len + 1);
+    buf -> len = len;
+
+    va_start(args, fmt);
+    vsnprintf(buf -> data, len + 1, fmt, args);
+    va_end(args);
+
+    return buf;
+}
+
+void msgbuf_ref(struct msgbuf *buf)
+{
+    __atomic_add_fetch(&(buf -> refs), 1, __ATOMIC_RELAXED);
+}
+
+void msgbuf_unref(struct msgbuf *buf)
+{
+    if (__atomic_sub_fetch(&(buf -> refs), 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(buf);
+    }
+}
+
+struct outq *outq_new(int fd)
+{
+    struct outq *q = malloc(sizeof(struct outq));
+
+    if (q == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    q -> refs = 1;
+    q -> fd = fd;
+    q -> head = 0;
+    q -> count = 0;
+    q -> head_offset = 0;
+    q -> draining = 0;
+    q -> writing = 0;
+    q -> failed = 0;
+    q -> closed = 0;
+    q -> not_socket = 0;
+    q -> next_deferred = NULL;
+    mutex_init(&(q -> mutex));
+
+    /* Bound how long a client that isn't reading can hold up whoever is writing to it. */
+    struct timeval timeout = { OUTQ_SEND_TIMEOUT_MS / 1000, (OUTQ_SEND_TIMEOUT_MS % 1000) * 1000 };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0 && errno == ENOTSOCK)
+    {
+        q -> not_socket = 1;
+    }
+
+    return q;
+}
+
+void outq_ref(struct outq *q)
+{
+    __atomic_add_fetch(&(q -> refs), 1, __ATOMIC_RELAXED);
+}
+
+/* Drops every queued message. Queue mutex must be held. */
+static void outq_clear(struct outq *q)
+{
+    while (q -> count > 0)
+    {
+        msgbuf_unref(q -> messages[q -> head]);
+        q -> head = (q -> head + 1) % OUTQ_MAX_MESSAGES;
+        q -> count--;
+    }
+
+    q -> head_offset = 0;
+}
+
+void outq_unref(struct outq *q)
+{
+    if (__atomic_sub_fetch(&(q -> refs), 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        outq_clear(q);
+        free(q);
+    }
+}
+
+/* Writes a batch of iovecs. MSG_NOSIGNAL keeps a closed socket from killing the server with SIGPIPE;
+anything that isn't a socket (e.g. a pipe in a test harness) falls back to a plain writev, from then on. */
+static ssize_t outq_writev(struct outq *q, struct iovec *iov, int iovcnt)
+{
+    if (q -> not_socket)
+    {
+        return writev(q -> fd, iov, iovcnt);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t n = sendmsg(q -> fd, &msg, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == ENOTSOCK)
+    {
+        q -> not_socket = 1;
+        n = writev(q -> fd, iov, iovcnt);
+    }
+
+    return n;
+}
+
+/* Milliseconds since a time from CLOCK_MONOTONIC. */
+static long outq_ms_since(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since -> tv_sec) * 1000 + (now.tv_nsec - since -> tv_nsec) / 1000000;
+}
+
+/* Gives up on a connection: what is queued for it is dropped, and so is everything sent to it from now on. Unless
+it has already gone away, the socket is shut down too, so that the client's service thread sees the end of it
+and unregisters its TU, instead of it staying registered and never hearing anything again. Mutex must be held. */
+static void outq_fail(struct outq *q)
+{
+    if (!q -> failed && !q -> closed)
+    {
+        shutdown(q -> fd, SHUT_RDWR);
+    }
+
+    q -> failed = 1;
+}
+
+/* Writes out the queue until it is empty. The caller must have set draining, and must not hold the mutex.
+The mutex is only held to look at the queue, never during a write. A message that takes longer than the send
+timeout to get out (the client is reading, but too slowly to keep up) fails the connection, like a write that
+times out does. */
+static void outq_drain(struct outq *q)
+{
+    struct iovec iov[OUTQ_BATCH];
+    struct timespec head_start;
+
+    clock_gettime(CLOCK_MONOTONIC, &head_start);
+    mutex_lock(&(q -> mutex));
+
+    while (q -> count > 0 && !q -> failed && !q -> closed)
+    {
+        /* Gather up to a batch of messages, starting partway into the head one if the last write was short. */
+        int iovcnt = 0;
+        for (int i = 0; i < q -> count && iovcnt < OUTQ_BATCH; i++)
+        {
+            struct msgbuf *buf = q -> messages[(q -> head + i) % OUTQ_MAX_MESSAGES];
+            size_t offset = (i == 0) ? q -> head_offset : 0;
+
+            iov[iovcnt].iov_base = buf -> data + offset;
+            iov[iovcnt].iov_len = buf -> len - offset;
+            iovcnt++;
+        }
+
+        q -> writing = 1;
+        mutex_unlock(&(q -> mutex));
+
+        ssize_t written;
+        while ((written = outq_writev(q, iov, iovcnt)) < 0 && errno == EINTR)
+        {
+            ;
+        }
+
+        mutex_lock(&(q -> mutex));
+        q -> writing = 0;
+
+        if (written < 0)
+        {
+            outq_fail(q);
+            break;
+        }
+
+        /* Pop whatever got written completely. */
+        size_t remaining = written;
+        int popped = 0;
+        while (q -> count > 0)
+        {
+            struct msgbuf *buf = q -> messages[q -> head];
+            size_t left = buf -> len - q -> head_offset;
+
+            if (remaining < left)
+            {
+                q -> head_offset += remaining;
+                break;
+            }
+
+            remaining -= left;
+            q -> head_offset = 0;
+            q -> head = (q -> head + 1) % OUTQ_MAX_MESSAGES;
+            q -> count--;
+            msgbuf_unref(buf);
+            popped = 1;
+        }
+
+        if (popped)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &head_start);
+        }
+        else if (outq_ms_since(&head_start) >= OUTQ_SEND_TIMEOUT_MS)
+        {
+            outq_fail(q);
+        }
+    }
+
+    if (q -> failed || q -> closed)
+    {
+        outq_clear(q);
+    }
+
+    q -> draining = 0;
+    mutex_unlock(&(q -> mutex));
+}
+
+/* Puts a message (taking a reference to it) at the tail of the queue. The mutex must be held.
+Returns -1 if it was dropped, 1 if the caller now has to drain the queue, 0 if somebody else already is. */
+static int outq_push(struct outq *q, struct msgbuf *buf)
+{
+    if (q -> failed || q -> closed || q -> count == OUTQ_MAX_MESSAGES)
+    {
+        return -1;
+    }
+
+    msgbuf_ref(buf);
+    q -> messages[(q -> head + q -> count) % OUTQ_MAX_MESSAGES] = buf;
+    q -> count++;
+
+    /* If nobody is draining the queue, we are it. */
+    int drain = !q -> draining;
+    q -> draining = 1;
+
+    return drain;
+}
+
+int outq_send(struct outq *q, struct msgbuf *buf)
+{
+    mutex_lock(&(q -> mutex));
+    int pushed = outq_push(q, buf);
+    mutex_unlock(&(q -> mutex));
+
+    if (pushed < 0)
+    {
+        return -1;
+    }
+
+    if (pushed)
+    {
+        outq_drain(q);
+    }
+
+    return 0;
+}
+
+int outq_write(struct outq *q, struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+
+    struct msgbuf *buf = msgbuf_new(len);
+    char *p = buf -> data;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    mutex_lock(&(q -> mutex));
+    int pushed = outq_push(q, buf);
+    mutex_unlock(&(q -> mutex));
+    msgbuf_unref(buf);
+
+    if (pushed < 0)
+    {
+        return -1;
+    }
+
+    /* The queue is ours to drain, but not until outq_flush. It keeps a reference until then. */
+    if (pushed)
+    {
+        outq_ref(q);
+        q -> next_deferred = deferred;
+        deferred = q;
+    }
+
+    return 0;
+}
+
+void outq_flush(void)
+{
+    while (deferred != NULL)
+    {
+        struct outq *q = deferred;
+        deferred = q -> next_deferred;
+        q -> next_deferred = NULL;
+
+        outq_drain(q);
+        outq_unref(q);
+    }
+}
+
+void outq_close(struct outq *q)
+{
+    mutex_lock(&(q -> mutex));
+    q -> closed = 1;
+
+    /* Wait for a write in progress to be done with fd. It is bounded by the send timeout. */
+    while (q -> writing)
+    {
+        mutex_unlock(&(q -> mutex));
+
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+
+        mutex_lock(&(q -> mutex));
+    }
+
+    /* Unless somebody is going to drain it (and find it closed), nobody needs what is queued any more. */
+    if (!q -> draining)
+    {
+        outq_clear(q);
+    }
+
+    mutex_unlock(&(q -> mutex));
+}
@@ -5,31 +5,231 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/socket.h>
-#include <semaphore.h>
+#include <sys/uio.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "debug.h"
 #include "csapp.h"
-
-/* Each TU needs an extension number, which will be the same as its file descriptor.
+#include "wal.h"
+#include "hunt.h"
+#include "conference.h"
+#include "outq.h"
+#include "broadcast.h"
+#include "arena.h"
+#include "presence.h"
+#include "cdr.h"
+#include "metrics.h"
+#include "mutex.h"
+#include "lockprof.h"
+#include "trace.h"
+
+/* Longest notification line of a state: the longest state name, a space, an int and the newline. */
+#define NOTIFY_LINE_SIZE 32
+
+/* Each TU needs an extension number, which will be the same as its file descriptor unless that extension was
+reserved by the WAL (or the TU reclaimed an old extension after a restart). So the fd is kept separately.
 Also, a TU needs to maintain its state name.
-Also, a TU needs to maintain the extension number of the TU it is connecting with. */
+Also, a TU needs to maintain the extension number of the TU it is connecting with (or of the conference room it is in).
+Messages that fan out to many TUs go thru the TU's outbound queue instead of straight to the fd.
+A TU that watches other extensions also has a presence subscriber, which is made the first time it subscribes.
+It also keeps its "ON HOOK <ext>\n" ready made, as that is what it gets sent most.
+Both TUs of a call keep the same copy of the call's CDR details, and whichever one ends the call records them.
+They also keep the same copy of its ID and of when it got to the stage it is at (see metrics.h). */
 struct tu {
     int extension_num;
+    int fd;
     char *state_name;
     int connected_tu_extension_num;
-    sem_t tu_mutex;
+    struct outq *out;
+    struct presence_sub *presence;
+    struct cdr_call call;
+    struct metrics_call progress;
+    char on_hook_line[NOTIFY_LINE_SIZE];
+    size_t on_hook_len;
+    MUTEX tu_mutex;
 };
 
 /* A PBX struct will contain a count of num of TU's registered.
 It will also contain a list of all the TU's registered, WHERE THE INDEX REPRESENTS THE FD OF THE TU (MAPPING).
-It also has a semaphore to perform asynchronous function while updating information. */
+It also has a mutex to perform asynchronous function while updating information. */
 struct pbx {
     int TU_count;
     TU *client_TUs[PBX_MAX_EXTENSIONS + 4];
-    sem_t mutex;
+    MUTEX mutex;
 };
 
+/* Every state change of a TU goes through here, so that it also gets appended to the WAL, the hunt groups
+know whether the TU is idle, the TU's presence subscribers hear about it and it is counted in the metrics and
+traced. The TU's connected_tu_extension_num should already be set when this is called. */
+static void set_tu_state(TU *tu, TU_STATE state)
+{
+    tu -> state_name = tu_state_names[state];
+    metrics_count(METRIC_STATE_CHANGES + state);
+    trace_event(TRACE_STATE, tu -> extension_num, state, 0);
+    wal_log_state(tu -> extension_num, state, tu -> connected_tu_extension_num);
+    hunt_member_idle(tu -> extension_num, state == TU_ON_HOOK);
+    presence_publish(tu -> extension_num, state, tu -> connected_tu_extension_num);
+}
+
+/* Same for a TU showing up at (or going away from) an extension. A new TU is always ON HOOK. */
+static void note_registered(TU *tu)
+{
+    wal_log_register(tu -> extension_num);
+    hunt_member_idle(tu -> extension_num, 1);
+    presence_publish(tu -> extension_num, TU_ON_HOOK, -1);
+}
+
+static void note_unregistered(TU *tu)
+{
+    wal_log_unregister(tu -> extension_num);
+    hunt_member_idle(tu -> extension_num, 0);
+    presence_publish(tu -> extension_num, PRESENCE_UNREGISTERED, -1);
+}
+
+/* Traces an event of the call a TU is in, unless the call isn't followed. */
+static void trace_call(TU *tu, TRACE_TYPE type)
+{
+    if (tu -> progress.id != 0)
+    {
+        trace_event(type, tu -> extension_num, tu -> progress.id, 0);
+    }
+}
+
+/* Records the CDR of a dial that failed straight away. */
+static void failed_call(TU *tu, int ext, CDR_DISPOSITION disposition)
+{
+    cdr_call_start(&(tu -> call), tu -> extension_num, ext);
+    cdr_call_end(&(tu -> call), disposition);
+}
+
+/* Gets the state a TU is in from its state name (which always points into tu_state_names). */
+static TU_STATE get_tu_state(TU *tu)
+{
+    TU_STATE state = TU_ON_HOOK;
+
+    while (state < TU_ERROR && tu -> state_name != tu_state_names[state])
+    {
+        state++;
+    }
+
+    return state;
+}
+
+/* Notifications aren't formatted with printf when they are sent. The line of each state is made once (by
+pbx_init), and one with an extension after it is put together backwards in a buffer on the stack, from its end. */
+static struct {
+    char text[NOTIFY_LINE_SIZE];
+    size_t len;
+} state_lines[TU_ERROR + 1];
+
+static void make_state_lines(void)
+{
+    for (TU_STATE state = TU_ON_HOOK; state <= TU_ERROR; state++)
+    {
+        state_lines[state].len = snprintf(state_lines[state].text, NOTIFY_LINE_SIZE, "%s\n", tu_state_names[state]);
+    }
+}
+
+/* Puts "<state> <ext>\n" in the buffer, so that it ends at end. Returns where it starts. */
+static char *render_state_ext(char *end, TU_STATE state, int ext)
+{
+    char *p = end;
+    unsigned int n = (ext < 0) ? -(unsigned int) ext : (unsigned int) ext;
+
+    *--p = '\n';
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    if (ext < 0)
+    {
+        *--p = '-';
+    }
+    *--p = ' ';
+
+    size_t name_len = state_lines[state].len - 1;
+    p -= name_len;
+    memcpy(p, state_lines[state].text, name_len);
+
+    return p;
+}
+
+/* Makes the TU's "ON HOOK <ext>\n", which it is sent more than anything else. Called whenever its extension
+is set. */
+static void make_on_hook_line(TU *tu)
+{
+    char buf[NOTIFY_LINE_SIZE];
+    char *line = render_state_ext(buf + NOTIFY_LINE_SIZE, TU_ON_HOOK, tu -> extension_num);
+
+    tu -> on_hook_len = buf + NOTIFY_LINE_SIZE - line;
+    memcpy(tu -> on_hook_line, line, tu -> on_hook_len);
+}
+
+/* Lets go of the PBX mutex, then writes out the notifications queued while it was held (see notify_write). Every
+TU mutex must have been let go of already. */
+#define PBX_UNLOCK(pbx) \
+    do \
+    { \
+        PROF_V(&((pbx) -> mutex)); \
+        outq_flush(); \
+    } while (0)
+
+/* Every notification to a TU's client goes thru here, and is traced. It goes thru the TU's outbound queue, like
+conference chats, pages and presence updates do, so that it can't overtake any of them or be cut into by them.
+Notifications are sent with the PBX mutex held, so they are only queued here: nothing is written to a client
+until PBX_UNLOCK, so a client that is slow to read can't hold up the PBX. */
+static void notify_write(TU *tu, struct iovec *iov, int iovcnt)
+{
+    uint64_t start = trace_now();
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    outq_write(tu -> out, iov, iovcnt);
+
+    trace_event(TRACE_WRITE, tu -> extension_num, total, start);
+}
+
+/* Sends a TU "<state>\n", for the state it is in. */
+static void notify_state(TU *tu)
+{
+    TU_STATE state = get_tu_state(tu);
+    struct iovec iov = { state_lines[state].text, state_lines[state].len };
+
+    notify_write(tu, &iov, 1);
+}
+
+/* Sends a TU "<state> <ext>\n", for the state it is in. */
+static void notify_state_ext(TU *tu, int ext)
+{
+    char buf[NOTIFY_LINE_SIZE];
+    char *line = render_state_ext(buf + NOTIFY_LINE_SIZE, get_tu_state(tu), ext);
+    struct iovec iov = { line, buf + NOTIFY_LINE_SIZE - line };
+
+    notify_write(tu, &iov, 1);
+}
+
+/* Sends a TU that is ON HOOK "ON HOOK <its ext>\n". */
+static void notify_on_hook(TU *tu)
+{
+    struct iovec iov = { tu -> on_hook_line, tu -> on_hook_len };
+
+    notify_write(tu, &iov, 1);
+}
+
+/* Sends a TU "CHAT <msg>\n". */
+static void notify_chat(TU *tu, char *msg)
+{
+    struct iovec iov[3] = { { "CHAT ", 5 }, { msg, strlen(msg) }, { "\n", 1 } };
+
+    notify_write(tu, iov, 3);
+}
+
 /* Makes a new PBX and initializes all its fields. */
 PBX *pbx_init()
 {
@@ -50,8 +250,10 @@ PBX *pbx_init()
         initial_pbx -> client_TUs[i] = NULL;
     }
 
-    /* Initialize semaphore w/ value 1. */
-    sem_init(&(initial_pbx -> mutex), 0, 1);
+    /* Initialize mutex, free. */
+    mutex_init(&(initial_pbx -> mutex));
+
+    make_state_lines();
 
     return initial_pbx;
 }
@@ -66,17 +268,17 @@ void pbx_shutdown(PBX *pbx)
         {
             /* Shutdown leads to pbx_unregister at server.c */
             // pbx_unregister(pbx, pbx -> client_TUs[i]);
-            shutdown((pbx -> client_TUs[i]) -> extension_num, SHUT_RDWR);
+            shutdown((pbx -> client_TUs[i]) -> fd, SHUT_RDWR);
         }
     }
 
-    P(&(pbx -> mutex));
+    PROF_P(&(pbx -> mutex));
     /* Now wait for TU count to go down to 0. */
     while(pbx -> TU_count > 0)
     {
         ;
     }
-    V(&(pbx -> mutex));
+    PBX_UNLOCK(pbx);
 
     /* After everything is shutdown, then free PBX. */
     free(pbx);
@@ -87,32 +289,56 @@ TU assigned an extension number and initialized to TU_ON_HOOK state.
 Then the client is notified of the assigned extension number. */
 TU *pbx_register(PBX *pbx, int fd)
 {
-    P(&(pbx -> mutex));
+    PROF_P(&(pbx -> mutex));
 
     /* Allocate memory for new TU. WILL BE FREED IN PBX_UNREGISTER! */
     TU *new_TU = malloc(sizeof(TU));
 
-    /* If can't malloc for new TU OR max # of TU's for PBX then return NULL. */
-    if (new_TU == NULL || (pbx -> TU_count) >= PBX_MAX_EXTENSIONS)
+    /* If can't malloc for new TU OR max # of TU's for PBX OR the fd is past the last extension, then return NULL. */
+    if (new_TU == NULL || (pbx -> TU_count) >= PBX_MAX_EXTENSIONS || fd < 0 || fd >= PBX_MAX_EXTENSIONS + 4)
+    {
+        free(new_TU);
+        PBX_UNLOCK(pbx);
+        return NULL;
+    }
+
+    /* Extension # is the same as the fd, unless that extension is still reserved for a client from before a restart.
+    In that case, take the next free extension above it that isn't reserved. */
+    int ext = fd;
+    while (ext < PBX_MAX_EXTENSIONS + 4 && (wal_is_reserved(ext) || pbx -> client_TUs[ext] != NULL))
+    {
+        ext++;
+    }
+
+    if (ext >= PBX_MAX_EXTENSIONS + 4)
     {
+        free(new_TU);
+        PBX_UNLOCK(pbx);
         return NULL;
     }
 
-    /* Assign extension number (same as fd) and state name to TU_ON_HOOK state. connected_tu state now -1 for now. */
-    /* Initialize TU semaphore w/ value 1. */
-    new_TU -> extension_num = fd;
+    /* Assign extension number and state name to TU_ON_HOOK state. connected_tu state now -1 for now. */
+    /* Initialize TU mutex, free. */
+    new_TU -> extension_num = ext;
+    new_TU -> fd = fd;
     new_TU -> state_name = tu_state_names[TU_ON_HOOK];
     new_TU -> connected_tu_extension_num = -1;
-    sem_init(&(new_TU -> tu_mutex), 0, 1);
+    new_TU -> out = outq_new(fd);
+    new_TU -> presence = NULL;
+    new_TU -> progress.id = 0;
+    make_on_hook_line(new_TU);
+    mutex_init(&(new_TU -> tu_mutex));
 
-    /* Now set new TU in PBX WHERE THE INDEX IS THE FD/EXTENSION # OF THE TU (MAPPING) and increment TU count. */
+    /* Now set new TU in PBX WHERE THE INDEX IS THE EXTENSION # OF THE TU (MAPPING) and increment TU count. */
     pbx -> client_TUs[new_TU -> extension_num] = new_TU;
     pbx -> TU_count++;
+    note_registered(new_TU);
+    metrics_count(METRIC_TUS_REGISTERED);
 
     /* Now print message! */
-    dprintf(fd, "%s %d\n", new_TU -> state_name, new_TU -> extension_num);
+    notify_on_hook(new_TU);
 
-    V(&(pbx -> mutex));
+    PBX_UNLOCK(pbx);
 
     return new_TU;
 }
@@ -127,48 +353,90 @@ int pbx_unregister(PBX *pbx, TU *tu)
         return -1;
     }
 
-    P(&(pbx -> mutex));
-    P(&(tu -> tu_mutex));
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
+
+    /* Going away in the middle of a call ends it. */
+    if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
+    {
+        cdr_call_end(&(tu -> call), CDR_ANSWERED);
+        metrics_call_stage(&(tu -> progress), METRIC_STAGE_TALK);
+        trace_call(tu, TRACE_HANGUP);
+    }
+    else if (strcmp(tu -> state_name, tu_state_names[TU_RINGING]) == 0 ||
+        strcmp(tu -> state_name, tu_state_names[TU_RING_BACK]) == 0)
+    {
+        cdr_call_end(&(tu -> call), CDR_NO_ANSWER);
+        trace_call(tu, TRACE_HANGUP);
+    }
+
+    /* Before freeing the TU, change state of other TU. The connected extension is -1 if this TU never dialed. */
+    TU *peer_TU = NULL;
+    int peer_TU_extension_num = tu -> connected_tu_extension_num;
 
-    /* Before freeing the TU, change state of other TU. */
-    TU *peer_TU = pbx -> client_TUs[tu -> connected_tu_extension_num];
+    if (peer_TU_extension_num >= 0 && peer_TU_extension_num < PBX_MAX_EXTENSIONS + 4)
+    {
+        peer_TU = pbx -> client_TUs[peer_TU_extension_num];
+    }
 
-    /* Only change and print new state if peer TU is not NULL. */
-    if (peer_TU != NULL)
+    /* Only change and print new state if peer TU is not NULL (and not in a call with someone else by now). */
+    if (peer_TU != NULL && peer_TU != tu)
     {
-        P(&(peer_TU -> tu_mutex));
+        PROF_P(&(peer_TU -> tu_mutex));
 
-        /* If peer TU was in RINGING state, it was the called TU. Go to ON HOOK state. */
-        if (strcmp(peer_TU -> state_name, tu_state_names[TU_RINGING]) == 0)
+        if (peer_TU -> connected_tu_extension_num == tu -> extension_num)
         {
-            peer_TU -> state_name = tu_state_names[TU_ON_HOOK];
-            dprintf(peer_TU -> extension_num, "%s %d\n", peer_TU -> state_name, peer_TU -> extension_num);
-        }
+            /* If peer TU was in RINGING state, it was the called TU. Go to ON HOOK state. */
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_RINGING]) == 0)
+            {
+                set_tu_state(peer_TU, TU_ON_HOOK);
+                notify_on_hook(peer_TU);
+            }
 
-        /* If peer TU was in RING BACK state, it was the calling TU. Go to DIAL TONE state. */
-        /* If peer TU was in CONNECTED state, there was a peer connection. Set peer to DIAL TONE state. */
-        if (strcmp(peer_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0 ||
-            strcmp(peer_TU -> state_name, tu_state_names[TU_CONNECTED]) == 0)
-        {
-            peer_TU -> state_name = tu_state_names[TU_DIAL_TONE];
-            dprintf(peer_TU -> extension_num, "%s\n", peer_TU -> state_name);
+            /* If peer TU was in RING BACK state, it was the calling TU. Go to DIAL TONE state. */
+            /* If peer TU was in CONNECTED state, there was a peer connection. Set peer to DIAL TONE state. */
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0 ||
+                strcmp(peer_TU -> state_name, tu_state_names[TU_CONNECTED]) == 0)
+            {
+                set_tu_state(peer_TU, TU_DIAL_TONE);
+                notify_state(peer_TU);
+            }
         }
 
-        V(&(peer_TU -> tu_mutex));
+        PROF_V(&(peer_TU -> tu_mutex));
     }
 
-    free(tu);
-
-    /* Now set the TU at its index/fd/extension # to NULL. After, decrement the count. */
+    /* Now set the TU at its index/extension # to NULL. After, decrement the count. */
     pbx -> client_TUs[tu -> extension_num] = NULL;
     pbx -> TU_count--;
+    note_unregistered(tu);
+    metrics_count(METRIC_TUS_UNREGISTERED);
+
+    /* If the TU was in a conference room, leave it. */
+    if (conf_is_room(peer_TU_extension_num) && strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
+    {
+        conf_leave(peer_TU_extension_num, tu -> extension_num);
+    }
+
+    /* Only free the TU once nothing else is going to touch it. The outbound queue might still be held by a chat
+    in progress, and goes away when that is done with it. */
+    PROF_V(&(tu -> tu_mutex));
+    if (tu -> presence != NULL)
+    {
+        presence_sub_release(tu -> presence);
+    }
+    struct outq *out = tu -> out;
+    free(tu);
 
-    V(&(tu -> tu_mutex));
-    V(&(pbx -> mutex));
+    PBX_UNLOCK(pbx);
+
+    /* The client's fd is closed once this returns, so from now on nothing may write to it (or shut it down). */
+    outq_close(out);
+    outq_unref(out);
     return 0;
 }
 
-/* Gets the TU's fd which is the same as the extension # which is the same as the index @ the TU array. */
+/* Gets the TU's fd which is usually (but not always) the same as the extension #. */
 int tu_fileno(TU *tu)
 {
     /* If invalid tu, return -1. */
@@ -177,15 +445,15 @@ int tu_fileno(TU *tu)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    PROF_P(&(tu -> tu_mutex));
 
-    int tu_fd = tu -> extension_num;
-    V(&(tu -> tu_mutex));
+    int tu_fd = tu -> fd;
+    PROF_V(&(tu -> tu_mutex));
 
     return tu_fd;
 }
 
-/* Gets the TU's extension # which is the same as the TU's fd which is the same as the index @ the TU array. */
+/* Gets the TU's extension # which is the same as the index @ the TU array. */
 int tu_extension(TU *tu)
 {
     /* If invalid tu, return -1. */
@@ -194,10 +462,10 @@ int tu_extension(TU *tu)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    PROF_P(&(tu -> tu_mutex));
 
     int tu_extension_num = tu -> extension_num;
-    V(&(tu -> tu_mutex));
+    PROF_V(&(tu -> tu_mutex));
 
     return tu_extension_num;
 }
@@ -216,64 +484,64 @@ int tu_pickup(TU *tu)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    /* PBX mutex first, then the TU's, then the peer's, held until both ends have changed state. Changing this
+    TU's state and only then going back for the peer lets a hangup of the caller slip in between, leaving one
+    end CONNECTED to a TU that has gone ON HOOK. */
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
 
     /* Check if on TU_ON_HOOK state. Change to TU_DIAL_TONE state. */
     if (strcmp(tu -> state_name, tu_state_names[TU_ON_HOOK]) == 0)
     {
-        tu -> state_name = tu_state_names[TU_DIAL_TONE];
-        dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+        set_tu_state(tu, TU_DIAL_TONE);
+        notify_state(tu);
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_RINGING]) == 0)
     {
-        tu -> state_name = tu_state_names[TU_CONNECTED];
+        cdr_call_answer(&(tu -> call));
+        metrics_call_stage(&(tu -> progress), METRIC_STAGE_ANSWER);
+        trace_call(tu, TRACE_ANSWER);
+        set_tu_state(tu, TU_CONNECTED);
         /* Now print message that you are connected to the CALLING TU! NOT URSELF! */
         int calling_TU_extension_num = tu -> connected_tu_extension_num;
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, calling_TU_extension_num);
-
-        V(&(tu -> tu_mutex));
-
-        /* Now grab other TU from global PBX variable. REMEMBER TO MUTEX FOR EXCLUSIVE ACCESS! */
-        P(&(pbx -> mutex));
+        notify_state_ext(tu, calling_TU_extension_num);
 
+        /* Now grab other TU from global PBX variable. A RINGING TU's caller is always registered and in
+        RING BACK to it: hanging up or going away would have put this TU ON HOOK first. */
         TU *calling_TU = pbx -> client_TUs[calling_TU_extension_num];
 
-        /* If calling TU is NULL. */
-        if (calling_TU == NULL)
+        if (calling_TU != NULL)
         {
-            return -1;
-        }
+            /* Mutex the Calling TU now. */
+            PROF_P(&(calling_TU -> tu_mutex));
 
-        /* Mutex the Calling TU now. */
-        P(&(calling_TU -> tu_mutex));
+            /* If calling TU is in TU_RING_BACK state, set to TU_CONNECTED state and print CONNECTED message. */
+            if (strcmp(calling_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0)
+            {
+                calling_TU -> call.answer_ns = tu -> call.answer_ns;
+                calling_TU -> progress = tu -> progress;
+                set_tu_state(calling_TU, TU_CONNECTED);
 
-        /* If calling TU is in TU_RING_BACK state, set to TU_CONNECTED state and print CONNECTED message. */
-        if (strcmp(calling_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0)
-        {
-            calling_TU -> state_name = tu_state_names[TU_CONNECTED];
+                /* Now print message that you are connected to the called TU! NOT URSELF! */
+                notify_state_ext(calling_TU, calling_TU -> connected_tu_extension_num);
+            }
 
-            /* Now print message that you are connected to the called TU! NOT URSELF! */
-            dprintf(calling_TU -> extension_num, "%s %d\n", calling_TU -> state_name,
-                calling_TU -> connected_tu_extension_num);
+            PROF_V(&(calling_TU -> tu_mutex));
         }
-
-        V(&(calling_TU -> tu_mutex));
-        V(&(pbx -> mutex));
-
-        return 0;
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
     {
         /* If in TU_CONNECTED, print connected_tu extension # as well. */
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> connected_tu_extension_num);
+        notify_state_ext(tu, tu -> connected_tu_extension_num);
     }
     else
     {
         /* Any other state, print message of same state. */
-        dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+        notify_state(tu);
     }
 
-    V(&(tu -> tu_mutex));
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
 
     return 0;
 }
@@ -294,136 +562,123 @@ int tu_hangup(TU *tu)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    /* Same locking as pickup: both ends of a call change state under the PBX mutex and both TU mutexes. */
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
 
+    /* If TU in a conference room, just leave the room and go to on hook state. Nobody else changes state. */
+    if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0 && conf_is_room(tu -> connected_tu_extension_num))
+    {
+        conf_leave(tu -> connected_tu_extension_num, tu -> extension_num);
+        cdr_call_end(&(tu -> call), CDR_ANSWERED);
+        set_tu_state(tu, TU_ON_HOOK);
+        notify_on_hook(tu);
+    }
     /* If TU in connected state, go to on hook state and make peer TU go to dial tone state! Print message too. */
-    if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
+    else if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
     {
-        tu -> state_name = tu_state_names[TU_ON_HOOK];
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
-
-        int peer_TU_extension_num = tu -> connected_tu_extension_num;
-
-        V(&(tu -> tu_mutex));
+        cdr_call_end(&(tu -> call), CDR_ANSWERED);
+        metrics_call_stage(&(tu -> progress), METRIC_STAGE_TALK);
+        trace_call(tu, TRACE_HANGUP);
+        set_tu_state(tu, TU_ON_HOOK);
+        notify_on_hook(tu);
 
-        /* Now make other TU transition to dial tone state. */
-        P(&(pbx -> mutex));
+        /* Now make other TU transition to dial tone state, if it is still in the call with this one. */
+        TU *peer_TU = pbx -> client_TUs[tu -> connected_tu_extension_num];
 
-        TU *peer_TU = pbx -> client_TUs[peer_TU_extension_num];
-
-        /* If peer TU is NULL, return -1. */
-        if (peer_TU == NULL)
+        if (peer_TU != NULL)
         {
-            return -1;
-        }
-
-        /* Mutex the peer TU now. */
-        P(&(peer_TU -> tu_mutex));
-
-        /* peer TU set to TU_DIAL_TONE state and print DIAL TONE message. */
-        peer_TU -> state_name = tu_state_names[TU_DIAL_TONE];
+            PROF_P(&(peer_TU -> tu_mutex));
 
-        /* Now print message that you are dial tone state. */
-        dprintf(peer_TU -> extension_num, "%s\n", peer_TU -> state_name);
-
-        V(&(peer_TU -> tu_mutex));
-        V(&(pbx -> mutex));
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_CONNECTED]) == 0 &&
+                peer_TU -> connected_tu_extension_num == tu -> extension_num)
+            {
+                set_tu_state(peer_TU, TU_DIAL_TONE);
+                notify_state(peer_TU);
+            }
 
-        return 0;
+            PROF_V(&(peer_TU -> tu_mutex));
+        }
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_RING_BACK]) == 0)
     {
         /* If TU in ring back state, go to on hook state and make peer TU whose on ringing state go to on hook state!
         Print message too. */
-        tu -> state_name = tu_state_names[TU_ON_HOOK];
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
-
-        int peer_TU_extension_num = tu -> connected_tu_extension_num;
+        cdr_call_end(&(tu -> call), CDR_NO_ANSWER);
+        trace_call(tu, TRACE_HANGUP);
+        set_tu_state(tu, TU_ON_HOOK);
+        notify_on_hook(tu);
 
-        V(&(tu -> tu_mutex));
+        TU *peer_TU = pbx -> client_TUs[tu -> connected_tu_extension_num];
 
-        /* Now make peer TU transition to on hook state. */
-        P(&(pbx -> mutex));
-
-        TU *peer_TU = pbx -> client_TUs[peer_TU_extension_num];
-
-        /* If peer TU is NULL, return -1. */
-        if (peer_TU == NULL)
+        if (peer_TU != NULL)
         {
-            return -1;
-        }
+            PROF_P(&(peer_TU -> tu_mutex));
 
-        /* Mutex the peer TU now. */
-        P(&(peer_TU -> tu_mutex));
-
-        /* If peer TU is in TU_RINGING state, set to TU_ON_HOOK state and print TU_ON_HOOK message. */
-        if (strcmp(peer_TU -> state_name, tu_state_names[TU_RINGING]) == 0)
-        {
-            /* peer TU set to TU_ON_HOOK state and print TU_ON_HOOK message. */
-            peer_TU -> state_name = tu_state_names[TU_ON_HOOK];
+            /* If peer TU is in TU_RINGING state (from us), set to TU_ON_HOOK state and print TU_ON_HOOK message. */
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_RINGING]) == 0 &&
+                peer_TU -> connected_tu_extension_num == tu -> extension_num)
+            {
+                set_tu_state(peer_TU, TU_ON_HOOK);
+                notify_on_hook(peer_TU);
+            }
 
-            /* Now print message that you are TU_ON_HOOK state. */
-            dprintf(peer_TU -> extension_num, "%s %d\n", peer_TU -> state_name, peer_TU -> extension_num);
+            PROF_V(&(peer_TU -> tu_mutex));
         }
-
-        V(&(peer_TU -> tu_mutex));
-        V(&(pbx -> mutex));
-
-        return 0;
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_RINGING]) == 0)
     {
         /* If TU in ringing state, go to on hook state and make peer TU whose on ring back state go to dial tone state!
         Print message too. */
-        tu -> state_name = tu_state_names[TU_ON_HOOK];
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
-
-        int peer_TU_extension_num = tu -> connected_tu_extension_num;
-
-        V(&(tu -> tu_mutex));
+        cdr_call_end(&(tu -> call), CDR_NO_ANSWER);
+        trace_call(tu, TRACE_HANGUP);
+        set_tu_state(tu, TU_ON_HOOK);
+        notify_on_hook(tu);
 
-        /* Now make peer TU transition to dial tone state. */
-        P(&(pbx -> mutex));
+        TU *peer_TU = pbx -> client_TUs[tu -> connected_tu_extension_num];
 
-        TU *peer_TU = pbx -> client_TUs[peer_TU_extension_num];
-
-        /* If peer TU is NULL, return -1. */
-        if (peer_TU == NULL)
+        if (peer_TU != NULL)
         {
-            return -1;
-        }
-
-        /* Mutex the peer TU now. */
-        P(&(peer_TU -> tu_mutex));
+            PROF_P(&(peer_TU -> tu_mutex));
 
-        /* If peer TU is in TU_RING_BACK state, set to TU_DIAL_TONE state and print TU_DIAL_TONE message. */
-        if (strcmp(peer_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0)
-        {
-            /* peer TU set to TU_DIAL_TONE state and print TU_DIAL_TONE message. */
-            peer_TU -> state_name = tu_state_names[TU_DIAL_TONE];
+            /* If peer TU is in TU_RING_BACK state (to us), set to TU_DIAL_TONE state and print TU_DIAL_TONE message. */
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_RING_BACK]) == 0 &&
+                peer_TU -> connected_tu_extension_num == tu -> extension_num)
+            {
+                set_tu_state(peer_TU, TU_DIAL_TONE);
+                notify_state(peer_TU);
+            }
 
-            /* Now print message that you are TU_DIAL_TONE state. */
-            dprintf(peer_TU -> extension_num, "%s\n", peer_TU -> state_name);
+            PROF_V(&(peer_TU -> tu_mutex));
         }
-
-        V(&(peer_TU -> tu_mutex));
-        V(&(pbx -> mutex));
-
-        return 0;
     }
     else
     {
         /* Any other state (TU_DIAL_TONE, TU_BUSY_SIGNAL, TU_ERROR, or TU_ON_HOOK) goes to TU_ON_HOOK state.
         Then, print the message of the on hook state. */
-        tu -> state_name = tu_state_names[TU_ON_HOOK];
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
+        set_tu_state(tu, TU_ON_HOOK);
+        notify_on_hook(tu);
     }
 
-    V(&(tu -> tu_mutex));
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
 
     return 0;
 }
 
+/* Marks a hunt group dial that found nobody idle. */
+#define HUNT_ALL_BUSY (-2)
+
+/* Picks the member of a hunt group to ring. PBX mutex must be held.
+The bitmaps are updated on every state change, and every state change (and registration) is made under the PBX
+mutex, so the member selected is registered and ON HOOK for as long as the caller holds it. */
+static int select_hunt_member(int group_ext)
+{
+    int member_ext = hunt_select(group_ext);
+
+    return (member_ext < 0) ? HUNT_ALL_BUSY : member_ext;
+}
+
 /* dials TU whose extension number is given ext. */
 int tu_dial(TU *tu, int ext)
 {
@@ -433,85 +688,144 @@ int tu_dial(TU *tu, int ext)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    /* A call's ring stage is timed from here, so that it includes waiting for the locks. */
+    uint64_t start = metrics_start();
+
+    /* The PBX mutex has to be taken before the TU's, like everywhere else. Taking it after (only once the TU
+    turned out to have dial tone) deadlocks against a hangup or unregister that holds it and wants this TU. */
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
 
     /* First check if TU in dial tone state. If not, simply reprint the same state. */
     if (strcmp(tu -> state_name, tu_state_names[TU_DIAL_TONE]) == 0)
     {
-        P(&(pbx -> mutex));
 
         /* Check if any TU has given ext #. */
         TU *peer_TU;
+        int dialed_ext = ext;
+
+        /* If the ext # is a hunt group, dial its first available member instead. No member available is a busy line. */
+        if (hunt_is_group(ext))
+        {
+            ext = select_hunt_member(ext);
+        }
 
+        /* If the ext # is a conference room, join it and go straight to connected state. */
+        if (conf_is_room(ext))
+        {
+            if (conf_join(ext, tu -> extension_num, tu -> out) == 0)
+            {
+                cdr_call_start(&(tu -> call), tu -> extension_num, ext);
+                cdr_call_answer(&(tu -> call));
+                tu -> progress.id = 0;
+                tu -> connected_tu_extension_num = ext;
+                set_tu_state(tu, TU_CONNECTED);
+                notify_state_ext(tu, ext);
+            }
+            else
+            {
+                failed_call(tu, ext, CDR_ERROR);
+                set_tu_state(tu, TU_ERROR);
+                notify_state(tu);
+            }
+        }
         /* Check if within array bounds. If not, go to error state and print error state. */
-        if (ext >= 0 && ext < PBX_MAX_EXTENSIONS + 4)
+        else if (ext == HUNT_ALL_BUSY)
+        {
+            failed_call(tu, dialed_ext, CDR_BUSY);
+            set_tu_state(tu, TU_BUSY_SIGNAL);
+            notify_state(tu);
+        }
+        else if (ext >= 0 && ext < PBX_MAX_EXTENSIONS + 4)
         {
             peer_TU = pbx -> client_TUs[ext];
 
             /* If NULL TU dialing to, go to error state and print error state. */
             if (peer_TU == NULL)
             {
-                tu -> state_name = tu_state_names[TU_ERROR];
-                dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+                failed_call(tu, ext, CDR_ERROR);
+                set_tu_state(tu, TU_ERROR);
+                notify_state(tu);
+            }
+            else if (peer_TU == tu)
+            {
+                /* Dialing yourself (easy to do thru a dial plan alias) is a busy line. Don't lock the same TU twice! */
+                failed_call(tu, ext, CDR_BUSY);
+                set_tu_state(tu, TU_BUSY_SIGNAL);
+                notify_state(tu);
             }
             else
             {
                 /* Otherwise proceed to dial the other TU. */
-                P(&(peer_TU -> tu_mutex));
-
-                /* First set each other's connection TU extension #'s. */
-                tu -> connected_tu_extension_num = ext;
-                peer_TU -> connected_tu_extension_num = tu -> extension_num;
+                PROF_P(&(peer_TU -> tu_mutex));
 
                 /* Check if the peer TU was in TU_ON_HOOK state. If so,
                 calling TU goes from TU_DIAL_TONE state -> TU_RING_BACK state AND
                 peer TU goes from TU_ON_HOOK state -> TU_RINGING state. */
                 if (strcmp(peer_TU -> state_name, tu_state_names[TU_ON_HOOK]) == 0)
                 {
-                    tu -> state_name = tu_state_names[TU_RING_BACK];
-                    dprintf(tu -> extension_num, "%s\n", tu -> state_name);
-
-                    peer_TU -> state_name = tu_state_names[TU_RINGING];
-                    dprintf(peer_TU -> extension_num, "%s\n", peer_TU -> state_name);
+                    /* First set each other's connection TU extension #'s. Only now: a busy peer is in a call
+                    of its own, and pointing it at us would have its hangup or pickup go to the wrong TU. */
+                    tu -> connected_tu_extension_num = ext;
+                    peer_TU -> connected_tu_extension_num = tu -> extension_num;
+
+                    cdr_call_start(&(tu -> call), tu -> extension_num, ext);
+                    peer_TU -> call = tu -> call;
+                    metrics_call_start(&(tu -> progress), start);
+                    trace_call(tu, TRACE_DIAL);
+
+                    set_tu_state(tu, TU_RING_BACK);
+                    notify_state(tu);
+
+                    set_tu_state(peer_TU, TU_RINGING);
+                    notify_state(peer_TU);
+
+                    /* The callee has been told it is ringing. */
+                    metrics_call_stage(&(tu -> progress), METRIC_STAGE_RING);
+                    peer_TU -> progress = tu -> progress;
+                    trace_call(peer_TU, TRACE_RING);
                 }
                 else
                 {
                     /* Otherwise, calling TU goes to TU_BUSY_SIGNAL state and peer TU same state. */
-                    tu -> state_name = tu_state_names[TU_BUSY_SIGNAL];
-                    dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+                    failed_call(tu, ext, CDR_BUSY);
+                    set_tu_state(tu, TU_BUSY_SIGNAL);
+                    notify_state(tu);
                 }
 
-                V(&(peer_TU -> tu_mutex));
+                PROF_V(&(peer_TU -> tu_mutex));
             }
         }
         else
         {
-            tu -> state_name = tu_state_names[TU_ERROR];
-            dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+            failed_call(tu, dialed_ext, CDR_ERROR);
+            set_tu_state(tu, TU_ERROR);
+            notify_state(tu);
         }
 
-        V(&(tu -> tu_mutex));
-        V(&(pbx -> mutex));
+        PROF_V(&(tu -> tu_mutex));
+        PBX_UNLOCK(pbx);
 
         return 0;
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_ON_HOOK]) == 0)
     {
         /* ON HOOK state. */
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
+        notify_on_hook(tu);
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
     {
         /* CONNECTED state. */
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> connected_tu_extension_num);
+        notify_state_ext(tu, tu -> connected_tu_extension_num);
     }
     else
     {
         /* Any other state. */
-        dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+        notify_state(tu);
     }
 
-    V(&(tu -> tu_mutex));
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
 
     return 0;
 }
@@ -526,51 +840,315 @@ int tu_chat(TU *tu, char *msg)
         return -1;
     }
 
-    P(&(tu -> tu_mutex));
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
 
     /* Check if TU_CONNECTED state. If not, return -1. */
     if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
     {
         /* Now print message that you are connected to the CALLING TU! NOT URSELF! */
         int peer_TU_extension_num = tu -> connected_tu_extension_num;
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, peer_TU_extension_num);
+        notify_state_ext(tu, peer_TU_extension_num);
 
-        V(&(tu -> tu_mutex));
+        /* In a conference room, the chat fans out to all the other members. No need for the PBX mutex. */
+        if (conf_is_room(peer_TU_extension_num))
+        {
+            int tu_extension_num = tu -> extension_num;
+            PROF_V(&(tu -> tu_mutex));
+            PBX_UNLOCK(pbx);
 
-        /* Now grab peer TU from global PBX variable. REMEMBER TO MUTEX FOR EXCLUSIVE ACCESS! */
-        P(&(pbx -> mutex));
+            return (conf_chat(peer_TU_extension_num, tu_extension_num, msg) < 0) ? -1 : 0;
+        }
 
+        /* Now grab peer TU from global PBX variable. A CONNECTED TU's peer is always registered and CONNECTED
+        to it, because its hangup or unregister would have given this TU dial tone first. */
         TU *peer_TU = pbx -> client_TUs[peer_TU_extension_num];
 
-        /* If peer TU is NULL. */
-        if (peer_TU == NULL)
+        if (peer_TU != NULL)
         {
-            return -1;
-        }
+            PROF_P(&(peer_TU -> tu_mutex));
 
-        /* Mutex the peer TU now. */
-        P(&(peer_TU -> tu_mutex));
+            if (strcmp(peer_TU -> state_name, tu_state_names[TU_CONNECTED]) == 0 &&
+                peer_TU -> connected_tu_extension_num == tu -> extension_num)
+            {
+                notify_chat(peer_TU, msg);
+                trace_call(tu, TRACE_CHAT);
+            }
 
-        /* If peer TU is in TU_CONNECTED state, print chat message. */
-        if (strcmp(peer_TU -> state_name, tu_state_names[TU_CONNECTED]) == 0)
-        {
-            dprintf(peer_TU -> extension_num, "CHAT %s\n", msg);
+            PROF_V(&(peer_TU -> tu_mutex));
         }
 
-        V(&(peer_TU -> tu_mutex));
-        V(&(pbx -> mutex));
+        PROF_V(&(tu -> tu_mutex));
+        PBX_UNLOCK(pbx);
 
-        return 0;
+        return (peer_TU == NULL) ? -1 : 0;
     }
     else if (strcmp(tu -> state_name, tu_state_names[TU_ON_HOOK]) == 0)
     {
-        dprintf(tu -> extension_num, "%s %d\n", tu -> state_name, tu -> extension_num);
+        notify_on_hook(tu);
     }
     else
     {
-        dprintf(tu -> extension_num, "%s\n", tu -> state_name);
+        notify_state(tu);
     }
 
-    V(&(tu -> tu_mutex));
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
     return -1;
-}
\ No newline at end of file
+}
+
+/* Checks whether the recovered states of two TUs make up one call between them. */
+static int is_call_pair(TU_STATE state, TU_STATE peer_state)
+{
+    return (state == TU_CONNECTED && peer_state == TU_CONNECTED) ||
+        (state == TU_RINGING && peer_state == TU_RING_BACK) ||
+        (state == TU_RING_BACK && peer_state == TU_RINGING);
+}
+
+/* Prints the current state of a TU, the same way every other function does. */
+static void print_tu_state(TU *tu)
+{
+    if (strcmp(tu -> state_name, tu_state_names[TU_ON_HOOK]) == 0)
+    {
+        notify_on_hook(tu);
+    }
+    else if (strcmp(tu -> state_name, tu_state_names[TU_CONNECTED]) == 0)
+    {
+        notify_state_ext(tu, tu -> connected_tu_extension_num);
+    }
+    else
+    {
+        notify_state(tu);
+    }
+}
+
+/* Lets a client that was registered before a restart take back its old extension. Situations:
+If the extension is not reserved (or the TU is not ON HOOK) -> nothing changes.
+If the old state was DIAL TONE, BUSY SIGNAL or ERROR -> TU goes back to that state.
+If the old state was part of a call and the peer already reclaimed -> both TUs go back into the call.
+If the old state was part of a call and the peer hasn't reclaimed yet -> TU stays ON HOOK and waits for the peer.
+Then, w/e happened, print message of the current state (of both TUs if the call was restored). */
+int pbx_reclaim(PBX *pbx, TU *tu, int ext)
+{
+    /* If tu was NULL, return -1. */
+    if (tu == NULL)
+    {
+        return -1;
+    }
+
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
+
+    TU_STATE state;
+    int peer_TU_extension_num;
+
+    /* Only a TU sitting ON HOOK can take over a reserved extension that nobody is using. */
+    if (strcmp(tu -> state_name, tu_state_names[TU_ON_HOOK]) != 0 || ext < 0 || ext >= PBX_MAX_EXTENSIONS + 4 ||
+        pbx -> client_TUs[ext] != NULL || wal_claim(ext, &state, &peer_TU_extension_num) < 0)
+    {
+        print_tu_state(tu);
+
+        PROF_V(&(tu -> tu_mutex));
+        PBX_UNLOCK(pbx);
+        return 0;
+    }
+
+    /* Move the TU over to its old extension. */
+    pbx -> client_TUs[tu -> extension_num] = NULL;
+    note_unregistered(tu);
+
+    tu -> extension_num = ext;
+    tu -> connected_tu_extension_num = -1;
+    make_on_hook_line(tu);
+    pbx -> client_TUs[ext] = tu;
+    note_registered(tu);
+
+    if (state == TU_DIAL_TONE || state == TU_BUSY_SIGNAL || state == TU_ERROR)
+    {
+        set_tu_state(tu, state);
+    }
+    else if (state == TU_CONNECTED && conf_is_room(peer_TU_extension_num))
+    {
+        /* Was in a conference room. Just join it again. */
+        if (conf_join(peer_TU_extension_num, ext, tu -> out) == 0)
+        {
+            cdr_call_start(&(tu -> call), ext, peer_TU_extension_num);
+            cdr_call_answer(&(tu -> call));
+            tu -> progress.id = 0;
+            tu -> connected_tu_extension_num = peer_TU_extension_num;
+            set_tu_state(tu, TU_CONNECTED);
+        }
+    }
+    else if (state == TU_RINGING || state == TU_RING_BACK || state == TU_CONNECTED)
+    {
+        TU *peer_TU = NULL;
+        TU_STATE peer_state;
+        int peer_peer_extension_num;
+
+        if (peer_TU_extension_num >= 0 && peer_TU_extension_num < PBX_MAX_EXTENSIONS + 4)
+        {
+            peer_TU = pbx -> client_TUs[peer_TU_extension_num];
+        }
+
+        if (peer_TU == NULL)
+        {
+            /* Peer hasn't come back yet. Wait for it ON HOOK. */
+            wal_await_peer(ext, state, peer_TU_extension_num);
+        }
+        else if (wal_take_pending(peer_TU_extension_num, &peer_state, &peer_peer_extension_num) == 0 &&
+            peer_peer_extension_num == ext && is_call_pair(state, peer_state))
+        {
+            /* Peer is waiting for us. Put the call back together. */
+            PROF_P(&(peer_TU -> tu_mutex));
+
+            tu -> connected_tu_extension_num = peer_TU_extension_num;
+            peer_TU -> connected_tu_extension_num = ext;
+
+            /* The call's CDR starts over from here; its original setup time died with the old process. It isn't
+            followed thru its stages any more, for the same reason. */
+            if (state == TU_RINGING)
+            {
+                cdr_call_start(&(tu -> call), peer_TU_extension_num, ext);
+            }
+            else
+            {
+                cdr_call_start(&(tu -> call), ext, peer_TU_extension_num);
+            }
+            if (state == TU_CONNECTED)
+            {
+                cdr_call_answer(&(tu -> call));
+            }
+            peer_TU -> call = tu -> call;
+            tu -> progress.id = 0;
+            peer_TU -> progress = tu -> progress;
+
+            set_tu_state(tu, state);
+            set_tu_state(peer_TU, peer_state);
+            print_tu_state(peer_TU);
+
+            PROF_V(&(peer_TU -> tu_mutex));
+        }
+    }
+
+    print_tu_state(tu);
+
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
+    return 0;
+}
+
+/* Pages every other registered TU. The PBX mutex is only held long enough to take a reference on each TU's
+outbound queue; the message is rendered once and delivered by the broadcast workers after it is released. */
+int pbx_page(PBX *pbx, TU *tu, char *msg)
+{
+    /* If tu was NULL, return -1. */
+    if (tu == NULL)
+    {
+        return -1;
+    }
+
+    struct outq **targets = scratch_alloc(sizeof(struct outq *) * (PBX_MAX_EXTENSIONS + 4));
+
+    PROF_P(&(pbx -> mutex));
+
+    int from_ext = tu -> extension_num;
+    int num_targets = 0;
+
+    for (int i = 0; i < PBX_MAX_EXTENSIONS + 4; i++)
+    {
+        TU *target_TU = pbx -> client_TUs[i];
+
+        if (target_TU != NULL && target_TU != tu)
+        {
+            outq_ref(target_TU -> out);
+            targets[num_targets++] = target_TU -> out;
+        }
+    }
+
+    PBX_UNLOCK(pbx);
+
+    struct msgbuf *buf = msgbuf_printf("PAGE %d %s\n", from_ext, msg);
+    struct broadcast_result result;
+
+    broadcast_send(targets, num_targets, buf, &result);
+
+    msgbuf_unref(buf);
+    scratch_free(targets);
+
+    info("Page from %d: %d delivered, %d failed, %ld us", from_ext, result.delivered, result.failed, result.elapsed_us);
+
+    /* Report back to the TU that paged. Goes thru its queue too, so it can't cut into anything queued for it. */
+    struct msgbuf *report = msgbuf_printf("PAGED %d %d %ld\n", result.delivered, result.failed, result.elapsed_us);
+    outq_send(tu -> out, report);
+    msgbuf_unref(report);
+
+    return 0;
+}
+
+/* Starts (or stops) a TU watching another extension. The state of the watched extension is read under the PBX
+mutex, which every state change holds, so the first notification can't miss a change that happens meanwhile. */
+int pbx_subscribe(PBX *pbx, TU *tu, int ext, int subscribe)
+{
+    /* If tu was NULL, return -1. */
+    if (tu == NULL)
+    {
+        return -1;
+    }
+
+    PROF_P(&(pbx -> mutex));
+    PROF_P(&(tu -> tu_mutex));
+
+    if (!subscribe)
+    {
+        if (tu -> presence != NULL)
+        {
+            presence_unsubscribe(tu -> presence, ext);
+        }
+    }
+    else if (ext >= 0 && ext < PBX_MAX_EXTENSIONS + 4)
+    {
+        if (tu -> presence == NULL)
+        {
+            tu -> presence = presence_sub_new(tu -> out);
+        }
+
+        TU *watched_TU = pbx -> client_TUs[ext];
+
+        if (watched_TU == NULL)
+        {
+            presence_subscribe(tu -> presence, ext, PRESENCE_UNREGISTERED, -1);
+        }
+        else
+        {
+            presence_subscribe(tu -> presence, ext, get_tu_state(watched_TU), watched_TU -> connected_tu_extension_num);
+        }
+    }
+
+    PROF_V(&(tu -> tu_mutex));
+    PBX_UNLOCK(pbx);
+    return 0;
+}
+
+/* Says whose a lock is. The TU pointers are read without the PBX mutex (which may be what is stuck), but only
+their addresses are compared, so a TU going away meanwhile does no harm. */
+void pbx_describe_lock(MUTEX *lock, char *buf, size_t size)
+{
+    if (pbx != NULL && lock == &(pbx -> mutex))
+    {
+        snprintf(buf, size, "PBX");
+        return;
+    }
+
+    for (int ext = 0; pbx != NULL && ext < PBX_MAX_EXTENSIONS + 4; ext++)
+    {
+        TU *tu = __atomic_load_n(&(pbx -> client_TUs[ext]), __ATOMIC_RELAXED);
+
+        if (tu != NULL && lock == &(tu -> tu_mutex))
+        {
+            snprintf(buf, size, "TU %d", ext);
+            return;
+        }
+    }
+
+    snprintf(buf, size, "?");
+}
@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "pbx.h"
+#include "presence.h"
+#include "outq.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* Latest state of one watched extension that hasn't been written to the subscriber yet. */
+struct presence_slot {
+    int state;
+    int peer;
+    char watching;
+    char dirty;
+};
+
+/* Subscriber side of a TU. The mutex protects the slots and the dirty list. queued is set while the
+subscriber is on the ready queue or being written out by a worker, which each hold a reference. */
+struct presence_sub {
+    int refs;
+    struct outq *out;
+    sem_t mutex;
+    int queued;
+    int num_dirty;
+    int dirty[PRESENCE_MAX_EXTENSIONS];
+    struct presence_slot slots[PRESENCE_MAX_EXTENSIONS];
+    struct presence_sub *next_ready;
+};
+
+/* Subscribers of one extension. count is also read without the mutex, so that publishing a change of an
+extension nobody watches costs nothing. */
+struct presence_watchers {
+    int count;
+    int cap;
+    struct presence_sub **subs;
+};
+
+/* Lock order: watchers_mutex, then a subscriber's mutex, then ready_mutex. */
+static struct presence_watchers watchers[PRESENCE_MAX_EXTENSIONS];
+static sem_t watchers_mutex;
+
+static struct presence_sub *ready_head;
+static struct presence_sub *ready_tail;
+static sem_t ready_mutex;
+static sem_t ready_items;
+
+static pthread_once_t presence_once = PTHREAD_ONCE_INIT;
+
+static void *presence_worker(void *arg);
+
+static void presence_start(void)
+{
+    Sem_init(&watchers_mutex, 0, 1);
+    Sem_init(&ready_mutex, 0, 1);
+    Sem_init(&ready_items, 0, 0);
+
+    for (int i = 0; i < PRESENCE_WORKERS; i++)
+    {
+        pthread_t thread_id;
+        Pthread_create(&thread_id, NULL, presence_worker, NULL);
+        Pthread_detach(thread_id);
+    }
+}
+
+static void presence_sub_unref(struct presence_sub *sub)
+{
+    if (__atomic_sub_fetch(&(sub -> refs), 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        outq_unref(sub -> out);
+        sem_destroy(&(sub -> mutex));
+        free(sub);
+    }
+}
+
+struct presence_sub *presence_sub_new(struct outq *out)
+{
+    Pthread_once(&presence_once, presence_start);
+
+    struct presence_sub *sub = calloc(1, sizeof(struct presence_sub));
+
+    if (sub == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    sub -> refs = 1;
+    sub -> out = out;
+    outq_ref(out);
+    Sem_init(&(sub -> mutex), 0, 1);
+
+    return sub;
+}
+
+/* Records a new state in a subscriber's slot, and makes sure a worker is going to write it out.
+Subscriber mutex must be held. Returns 1 if the subscriber was put on the ready queue. */
+static int presence_mark(struct presence_sub *sub, int ext, int state, int peer)
+{
+    struct presence_slot *slot = &(sub -> slots[ext]);
+
+    slot -> state = state;
+    slot -> peer = peer;
+
+    if (!slot -> dirty)
+    {
+        slot -> dirty = 1;
+        sub -> dirty[sub -> num_dirty++] = ext;
+    }
+
+    if (sub -> queued)
+    {
+        return 0;
+    }
+
+    /* The ready queue gets its own reference. */
+    sub -> queued = 1;
+    __atomic_add_fetch(&(sub -> refs), 1, __ATOMIC_RELAXED);
+
+    P(&ready_mutex);
+    sub -> next_ready = NULL;
+    if (ready_tail != NULL)
+    {
+        ready_tail -> next_ready = sub;
+    }
+    else
+    {
+        ready_head = sub;
+    }
+    ready_tail = sub;
+    V(&ready_mutex);
+
+    return 1;
+}
+
+/* Takes a subscriber out of the list of watchers of an extension. Watchers mutex must be held. */
+static void presence_remove_watcher(struct presence_sub *sub, int ext)
+{
+    struct presence_watchers *w = &(watchers[ext]);
+
+    for (int i = 0; i < w -> count; i++)
+    {
+        if (w -> subs[i] == sub)
+        {
+            w -> subs[i] = w -> subs[w -> count - 1];
+            __atomic_store_n(&(w -> count), w -> count - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+}
+
+int presence_subscribe(struct presence_sub *sub, int ext, int state, int peer)
+{
+    if (ext < 0 || ext >= PRESENCE_MAX_EXTENSIONS)
+    {
+        return -1;
+    }
+
+    P(&watchers_mutex);
+    P(&(sub -> mutex));
+
+    if (!sub -> slots[ext].watching)
+    {
+        struct presence_watchers *w = &(watchers[ext]);
+
+        if (w -> count == w -> cap)
+        {
+            w -> cap = (w -> cap == 0) ? 4 : w -> cap * 2;
+            w -> subs = realloc(w -> subs, sizeof(struct presence_sub *) * w -> cap);
+
+            if (w -> subs == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        w -> subs[w -> count] = sub;
+        __atomic_store_n(&(w -> count), w -> count + 1, __ATOMIC_RELAXED);
+        sub -> slots[ext].watching = 1;
+    }
+
+    /* Either way, the subscriber gets the current state. */
+    int queued = presence_mark(sub, ext, state, peer);
+
+    V(&(sub -> mutex));
+    V(&watchers_mutex);
+
+    if (queued)
+    {
+        V(&ready_items);
+    }
+
+    return 0;
+}
+
+void presence_unsubscribe(struct presence_sub *sub, int ext)
+{
+    if (ext < 0 || ext >= PRESENCE_MAX_EXTENSIONS)
+    {
+        return;
+    }
+
+    P(&watchers_mutex);
+    P(&(sub -> mutex));
+
+    if (sub -> slots[ext].watching)
+    {
+        presence_remove_watcher(sub, ext);
+        sub -> slots[ext].watching = 0;
+    }
+
+    V(&(sub -> mutex));
+    V(&watchers_mutex);
+}
+
+void presence_sub_release(struct presence_sub *sub)
+{
+    P(&watchers_mutex);
+    P(&(sub -> mutex));
+
+    for (int ext = 0; ext < PRESENCE_MAX_EXTENSIONS; ext++)
+    {
+        if (sub -> slots[ext].watching)
+        {
+            presence_remove_watcher(sub, ext);
+            sub -> slots[ext].watching = 0;
+        }
+    }
+
+    V(&(sub -> mutex));
+    V(&watchers_mutex);
+
+    presence_sub_unref(sub);
+}
+
+void presence_publish(int ext, int state, int peer)
+{
+    if (ext < 0 || ext >= PRESENCE_MAX_EXTENSIONS || __atomic_load_n(&(watchers[ext].count), __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+
+    int queued = 0;
+
+    P(&watchers_mutex);
+
+    struct presence_watchers *w = &(watchers[ext]);
+    for (int i = 0; i < w -> count; i++)
+    {
+        P(&(w -> subs[i] -> mutex));
+        queued += presence_mark(w -> subs[i], ext, state, peer);
+        V(&(w -> subs[i] -> mutex));
+    }
+
+    V(&watchers_mutex);
+
+    while (queued-- > 0)
+    {
+        V(&ready_items);
+    }
+}
+
+/* Renders one pending state. Returns the # of bytes, which is more than size if it didn't fit. */
+static int presence_render(char *buf, size_t size, int ext, struct presence_slot *slot)
+{
+    if (slot -> state == PRESENCE_UNREGISTERED)
+    {
+        return snprintf(buf, size, "PRESENCE %d UNREGISTERED\n", ext);
+    }
+
+    if (slot -> state == TU_RINGING || slot -> state == TU_RING_BACK || slot -> state == TU_CONNECTED)
+    {
+        return snprintf(buf, size, "PRESENCE %d %s %d\n", ext, tu_state_names[slot -> state], slot -> peer);
+    }
+
+    return snprintf(buf, size, "PRESENCE %d %s\n", ext, tu_state_names[slot -> state]);
+}
+
+/* Writes out everything pending for a subscriber, a batch at a time. The subscriber mutex is dropped during
+each write, so changes published meanwhile just overwrite the pending slots. If a batch can't be queued (the
+subscriber's outbound queue is full), its extensions are marked pending again, unless a newer state of theirs
+already is, and the flush stops there: they go out with the next one. */
+static void presence_flush(struct presence_sub *sub)
+{
+    char batch[PRESENCE_BATCH_BYTES];
+    int batch_exts[PRESENCE_MAX_EXTENSIONS];
+
+    P(&(sub -> mutex));
+
+    while (sub -> num_dirty > 0)
+    {
+        size_t len = 0;
+        int taken = 0;
+        int num_batch_exts = 0;
+
+        while (taken < sub -> num_dirty)
+        {
+            int ext = sub -> dirty[taken];
+            struct presence_slot *slot = &(sub -> slots[ext]);
+
+            /* Unsubscribed since it was marked. */
+            if (!slot -> watching)
+            {
+                slot -> dirty = 0;
+                taken++;
+                continue;
+            }
+
+            int n = presence_render(batch + len, sizeof(batch) - len, ext, slot);
+
+            if (n < 0 || (size_t) n >= sizeof(batch) - len)
+            {
+                break;
+            }
+
+            len += n;
+            slot -> dirty = 0;
+            batch_exts[num_batch_exts++] = ext;
+            taken++;
+        }
+
+        sub -> num_dirty -= taken;
+        memmove(sub -> dirty, sub -> dirty + taken, sizeof(int) * sub -> num_dirty);
+
+        V(&(sub -> mutex));
+
+        int sent = 0;
+
+        if (len > 0)
+        {
+            struct msgbuf *buf = msgbuf_new(len);
+            memcpy(buf -> data, batch, len);
+            sent = outq_send(sub -> out, buf);
+            msgbuf_unref(buf);
+        }
+
+        P(&(sub -> mutex));
+
+        if (sent < 0)
+        {
+            for (int i = 0; i < num_batch_exts; i++)
+            {
+                struct presence_slot *slot = &(sub -> slots[batch_exts[i]]);
+
+                if (slot -> watching && !slot -> dirty)
+                {
+                    slot -> dirty = 1;
+                    sub -> dirty[sub -> num_dirty++] = batch_exts[i];
+                }
+            }
+            break;
+        }
+    }
+
+    sub -> queued = 0;
+    V(&(sub -> mutex));
+}
+
+/* Thread function of a presence worker. */
+static void *presence_worker(void *arg)
+{
+    while (1)
+    {
+        P(&ready_items);
+
+        P(&ready_mutex);
+        struct presence_sub *sub = ready_head;
+        ready_head = sub -> next_ready;
+        if (ready_head == NULL)
+        {
+            ready_tail = NULL;
+        }
+        V(&ready_mutex);
+
+        presence_flush(sub);
+        presence_sub_unref(sub);
+    }
+
+    return NULL;
+}
@@ -7,9 +7,207 @@
 #include <sys/socket.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "server.h"
+#include "server_ext.h"
+#include "commands.h"
+#include "dialplan.h"
+#include "journal.h"
+#include "metrics.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "arena.h"
 #include "debug.h"
 
+/* Carries out one command line from a client (without the "\r\n") on its TU. The line may be modified.
+Returns -1 if the PBX module reported an error (which takes the server down), 0 otherwise.
+The time taken by each PBX module function goes in the latency histogram of its command (see metrics.h), and
+the whole command goes in the trace (see trace.h). */
+int pbx_dispatch(PBX *pbx, TU *client_TU, char *client_msg)
+{
+    /* The start of the line is saved for the trace before anything below cuts it up. */
+    uint64_t trace_start = trace_now();
+    uint64_t trace_arg;
+
+    memset(&trace_arg, 0, sizeof(trace_arg));
+    memcpy(&trace_arg, client_msg, strnlen(client_msg, sizeof(trace_arg)));
+
+    /* NOTES FOR EACH TU FUNCTION in demo:
+    1. pickup doesn't work if spaces after 'pickup'.
+    2. hangup doesn't work if spaces after 'hangup'.
+    3. dial ONLY works if at least 1 space after the 'dial' keyword. dial + 3 spaces + extension # WORKS.
+    dial + extension # immediately afterwards doesn't work. Ex:dial   4 works but dial4 doesn't work.
+    4. chat requires NO space afterwards for the message. if no msg after chat, chat will send empty msg.
+    chat always sends a message. Therefore send string w/e it is after splitting it. */
+
+    /* First check if msg is STRICTLY "pickup". If it is, call tu_pickup command. */
+    if (strcmp(client_msg, tu_command_names[TU_PICKUP_CMD]) == 0)
+    {
+        uint64_t start = metrics_start();
+        int pickup_int = tu_pickup(client_TU);
+        metrics_command(METRIC_CMD_PICKUP, start);
+
+        if (pickup_int < 0)
+        {
+            /* If -1, then error occurred. The caller exits failure! */
+            return -1;
+        }
+    }
+
+    /* Now check if msg is STRICTLY "hangup". If it is, call tu_hangup command. */
+    if (strcmp(client_msg, tu_command_names[TU_HANGUP_CMD]) == 0)
+    {
+        uint64_t start = metrics_start();
+        int hangup_int = tu_hangup(client_TU);
+        metrics_command(METRIC_CMD_HANGUP, start);
+
+        if (hangup_int < 0)
+        {
+            /* If -1, then error occurred. The caller exits failure! */
+            return -1;
+        }
+    }
+
+    /* Now check if msg is dial case. Remember this requires at least 1 space. So check strcmp first for "dial" then
+    number. If not a number exit failure. */
+    if (strncmp(client_msg, tu_command_names[TU_DIAL_CMD], strlen(tu_command_names[TU_DIAL_CMD])) == 0)
+    {
+        /* Now split by message by space to see if there is any space. Lets use the strtok_r function for reentrant. */
+        char *second_half = client_msg;
+        char *first_half = strtok_r(second_half, " ", &second_half);
+
+        /* For cases where dial has no second half. Example command: "dial"
+        FOR CASES WHERE DIAL # IS NOT A NUM DEALT W/ LATER (Ex: "dial q"). */
+
+        /* After splitting, check if first half was dial. If it was not, go on to exit failure.
+        Example command: "dial4" */
+        if (strcmp(first_half, tu_command_names[TU_DIAL_CMD]) == 0)
+        {
+            /* Now cut off any excess space before the dialed string and run it through the dial plan. Without a
+            plan (or a matching rule) this is just the extension # as an integer. */
+            while (*second_half == ' ')
+            {
+                second_half++;
+            }
+
+            int second_half_int = dialplan_resolve(second_half);
+
+            /* Check if second half could be resolved to an extension. If it can't (-1) exit failure
+            (catches dial with bunch of spaces command: "dial    " */
+            if (second_half_int > 0)
+            {
+                /* If it is a valid #, proceed to call tu_dial command. */
+                uint64_t start = metrics_start();
+                int dial_int = tu_dial(client_TU, second_half_int);
+                metrics_command(METRIC_CMD_DIAL, start);
+
+                if (dial_int < 0)
+                {
+                    /* If -1, then error occurred. The caller exits failure! */
+                    return -1;
+                }
+            }
+        }
+    }
+
+    /* Lastly check if the msg is chat case. First check if "chat" is in the msg. If it is, then any valid chat is
+    acceptable. chat does not require any spaces. */
+    if (strncmp(client_msg, tu_command_names[TU_CHAT_CMD], strlen(tu_command_names[TU_CHAT_CMD])) == 0)
+    {
+        char *chat_msg = client_msg + strlen(tu_command_names[TU_CHAT_CMD]);
+
+        /* Now cut off any excess space before the msg. any spaces afterwards is NOT cut off. For example,
+        the message "     hey" -> "hey" BUT "    hey  there    " -> "hey  there    ". */
+        while (*chat_msg == ' ')
+        {
+            chat_msg++;
+        }
+
+        /* Now send the chat message using the tu_chat command. -1 just means there was no call to chat over
+        (the TU was already sent its current state), so it must not take the whole server down. */
+        uint64_t start = metrics_start();
+        tu_chat(client_TU, chat_msg);
+        metrics_command(METRIC_CMD_CHAT, start);
+    }
+
+    /* Now check if msg is page case. Like chat, no space is required and leading spaces are cut off the msg. */
+    if (strncmp(client_msg, PAGE_CMD, strlen(PAGE_CMD)) == 0)
+    {
+        char *page_msg = client_msg + strlen(PAGE_CMD);
+
+        while (*page_msg == ' ')
+        {
+            page_msg++;
+        }
+
+        uint64_t start = metrics_start();
+        int page_int = pbx_page(pbx, client_TU, page_msg);
+        metrics_command(METRIC_CMD_PAGE, start);
+
+        if (page_int < 0)
+        {
+            /* If -1, then error occurred. The caller exits failure! */
+            return -1;
+        }
+    }
+
+    /* Now check if msg is subscribe or unsubscribe case. Like dial, these require at least 1 space and then
+    the extension #. */
+    if (strncmp(client_msg, SUBSCRIBE_CMD, strlen(SUBSCRIBE_CMD)) == 0 ||
+        strncmp(client_msg, UNSUBSCRIBE_CMD, strlen(UNSUBSCRIBE_CMD)) == 0)
+    {
+        char *second_half = client_msg;
+        char *first_half = strtok_r(second_half, " ", &second_half);
+        int subscribe = (strcmp(first_half, SUBSCRIBE_CMD) == 0);
+
+        if (subscribe || strcmp(first_half, UNSUBSCRIBE_CMD) == 0)
+        {
+            int second_half_int = atoi(second_half);
+
+            if (second_half_int > 0)
+            {
+                uint64_t start = metrics_start();
+                int subscribe_int = pbx_subscribe(pbx, client_TU, second_half_int, subscribe);
+                metrics_command(METRIC_CMD_SUBSCRIBE, start);
+
+                if (subscribe_int < 0)
+                {
+                    /* If -1, then error occurred. The caller exits failure! */
+                    return -1;
+                }
+            }
+        }
+    }
+
+    /* Now check if msg is reclaim case. Like dial, this requires at least 1 space and then the extension #. */
+    if (strncmp(client_msg, RECLAIM_CMD, strlen(RECLAIM_CMD)) == 0)
+    {
+        char *second_half = client_msg;
+        char *first_half = strtok_r(second_half, " ", &second_half);
+
+        if (strcmp(first_half, RECLAIM_CMD) == 0)
+        {
+            int second_half_int = atoi(second_half);
+
+            if (second_half_int > 0)
+            {
+                uint64_t start = metrics_start();
+                int reclaim_int = pbx_reclaim(pbx, client_TU, second_half_int);
+                metrics_command(METRIC_CMD_RECLAIM, start);
+
+                if (reclaim_int < 0)
+                {
+                    /* If -1, then error occurred. The caller exits failure! */
+                    return -1;
+                }
+            }
+        }
+    }
+
+    trace_event(TRACE_COMMAND, -1, trace_arg, trace_start);
+    return 0;
+}
+
 /* Implementation of the pbx_client_service function which is the thread function that handles a client (TU). */
 void *pbx_client_service(void *arg)
 {
@@ -21,11 +219,14 @@ void *pbx_client_service(void *arg)
     /* Now detach the client thread so it can be implicitly reaped by the kernel. */
     pthread_detach(pthread_self());
 
-    /* Now register the client file descriptor with the PBX module. */
+    /* Now register the client file descriptor with the PBX module. If the PBX is full, only this client is
+    turned away. */
     TU *client_TU;
     if ((client_TU = pbx_register(pbx, connfd)) == NULL)
     {
-        exit(EXIT_FAILURE);
+        warn("Can't register client on fd %d", connfd);
+        close(connfd);
+        return NULL;
     }
 
     /* Get the TU's file descriptor to read input from the connection. Then open the file with given fd. */
@@ -37,156 +238,105 @@ void *pbx_client_service(void *arg)
 
     FILE *fp;
     if ((fp = fdopen(TU_fd, "r")) == NULL)
+    {
+        pbx_unregister(pbx, client_TU);
+        close(connfd);
+        return NULL;
+    }
+
+    /* Everything a command needs until it is done comes from the client's arena, which is reset for each one. */
+    struct arena arena;
+    if (arena_init(&arena, CLIENT_ARENA_SIZE) < 0)
     {
         exit(EXIT_FAILURE);
     }
 
+    command_arena = &arena;
+
+    /* Every command of this client goes into the journal (if it is on) under this id. The journal keeps the
+    extension the client connected at, since replaying its commands (reclaims included) gets it to the same ones. */
+    int ext = tu_extension(client_TU);
+    uint32_t journal_conn = journal_connect(ext);
+
+    /* In the trace, the thread goes by its TU's extension. */
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "TU %d", ext);
+    trace_name_thread(thread_name);
+
     /* Now enter the service loop to parse the messages sent by the client and carry out the specified command.
     NOTE: The work done to carry out the command is done in the PBX MODULE! This includes responses back to the client
     so the server module SHOULDN'T be concerned w/ the function implementations. */
     while (1)
     {
-        /* Read in client input w/ fgetc until reach EOL. */
-
-        /* malloc for one char and realloc constantly for extra char. REMEMBER TO FREE! */
-        char *client_msg = malloc(sizeof(char));
-
-        /* If can't malloc for some reason, return NULL. */
-        if (client_msg == NULL)
-        {
-            exit(EXIT_FAILURE);
-        }
+        /* Read in client input until reach EOL. Only this thread reads fp, so there is no need to lock it for
+        every char. */
+        arena_reset(&arena);
+        char *client_msg = arena_alloc(&arena, CLIENT_MAX_LINE + 1);
 
         int msg_size = 0;
-        char *curr_msg_ptr = client_msg;
+        int too_long = 0;
         int curr_char;
 
-        while ((curr_char = fgetc(fp)) != '\r')
+        while ((curr_char = getc_unlocked(fp)) != '\r')
         {
-            if (feof(fp))
+            /* End of file, or an error reading (like the connection being reset). Either way the client is gone. */
+            if (curr_char == EOF)
             {
-                free(client_msg);
                 goto service_ended;
             }
 
-            /* First, read the char in. Increment the msg size. Set the curr msg ptr to the new char. */
-            msg_size++;
-            *curr_msg_ptr = curr_char;
-
-            /* Now, increment the curr msg ptr to move forward and realloc for 1 more char. */
-            char *realloc_ptr = realloc((void *)client_msg, sizeof(char) * (msg_size + 1));
-
-            /* If can't realloc for some reason, return NULL. */
-            if (realloc_ptr == NULL)
+            if (msg_size < CLIENT_MAX_LINE)
             {
-                exit(EXIT_FAILURE);
+                client_msg[msg_size++] = curr_char;
+            }
+            else
+            {
+                too_long = 1;
             }
-
-            client_msg = realloc_ptr;
-            curr_msg_ptr = client_msg + msg_size;
         }
 
         /* Read the next char \n to flush out the whole msg. */
-        curr_char = fgetc(fp);
+        curr_char = getc_unlocked(fp);
 
         /* After flushing \n AND reaching the \r, we end reading from the input and add a null terminator. */
-        *curr_msg_ptr = '\0';
-
-        /* NOTES FOR EACH TU FUNCTION in demo:
-        1. pickup doesn't work if spaces after 'pickup'.
-        2. hangup doesn't work if spaces after 'hangup'.
-        3. dial ONLY works if at least 1 space after the 'dial' keyword. dial + 3 spaces + extension # WORKS.
-        dial + extension # immediately afterwards doesn't work. Ex:dial   4 works but dial4 doesn't work.
-        4. chat requires NO space afterwards for the message. if no msg after chat, chat will send empty msg.
-        chat always sends a message. Therefore send string w/e it is after splitting it. */
-
-        /* First check if msg is STRICTLY "pickup". If it is, call tu_pickup command. */
-        if (strcmp(client_msg, tu_command_names[TU_PICKUP_CMD]) == 0)
-        {
-            int pickup_int;
-            if ((pickup_int = tu_pickup(client_TU)) < 0)
-            {
-                /* If -1, then error occurred. exit failure! */
-                free(client_msg);
-                exit(EXIT_FAILURE);
-            }
-        }
+        client_msg[msg_size] = '\0';
 
-        /* Now check if msg is STRICTLY "hangup". If it is, call tu_hangup command. */
-        if (strcmp(client_msg, tu_command_names[TU_HANGUP_CMD]) == 0)
+        /* A line that is too long can't be a valid command, so it is thrown away like any other invalid one. */
+        if (too_long)
         {
-            int hangup_int;
-            if ((hangup_int = tu_hangup(client_TU)) < 0)
-            {
-                /* If -1, then error occurred. exit failure! */
-                free(client_msg);
-                exit(EXIT_FAILURE);
-            }
+            warn("Command from %d longer than %d chars thrown away", ext, CLIENT_MAX_LINE);
+            continue;
         }
 
-        /* Now check if msg is dial case. Remember this requires at least 1 space. So check strcmp first for "dial" then
-        number. If not a number exit failure. */
-        if (strncmp(client_msg, tu_command_names[TU_DIAL_CMD], strlen(tu_command_names[TU_DIAL_CMD])) == 0)
-        {
-            /* Now split by message by space to see if there is any space. Lets use the strtok_r function for reentrant. */
-            char *second_half = client_msg;
-            char *first_half = strtok_r(second_half, " ", &second_half);
+        journal_command(journal_conn, client_msg, msg_size);
 
-            /* For cases where dial has no second half. Example command: "dial"
-            FOR CASES WHERE DIAL # IS NOT A NUM DEALT W/ LATER (Ex: "dial q"). */
+        /* The watchdog reports a command that is taking too long (see watchdog.h). */
+        watchdog_busy(ext);
 
-            /* After splitting, check if first half was dial. If it was not, go on to exit failure.
-            Example command: "dial4" */
-            if (strcmp(first_half, tu_command_names[TU_DIAL_CMD]) == 0)
-            {
-                /* Now check if the second half is an integer. */
-                int second_half_int = atoi(second_half);
-
-                /* Check if second half could be converted to an int. If it can't (= 0) exit failure
-                (catches dial with bunch of spaces command: "dial    " */
-                if (second_half_int > 0)
-                {
-                    /* If it is a valid #, proceed to call tu_dial command. */
-                    int dial_int;
-                    if ((dial_int = tu_dial(client_TU, second_half_int)) < 0)
-                    {
-                        /* If -1, then error occurred. exit failure! */
-                        free(client_msg);
-                        exit(EXIT_FAILURE);
-                    }
-                }
-            }
+        if (pbx_dispatch(pbx, client_TU, client_msg) < 0)
+        {
+            exit(EXIT_FAILURE);
         }
 
-        /* Lastly check if the msg is chat case. First check if "chat" is in the msg. If it is, then any valid chat is
-        acceptable. chat does not require any spaces. */
-        if (strncmp(client_msg, tu_command_names[TU_CHAT_CMD], strlen(tu_command_names[TU_CHAT_CMD])) == 0)
-        {
-            char *chat_msg = client_msg + strlen(tu_command_names[TU_CHAT_CMD]);
+        watchdog_idle();
 
-            /* Now cut off any excess space before the msg. any spaces afterwards is NOT cut off. For example,
-            the message "     hey" -> "hey" BUT "    hey  there    " -> "hey  there    ". */
-            while (*chat_msg == ' ')
-            {
-                chat_msg++;
-            }
+        /* Only a command of this client (a reclaim) can change its TU's extension, so it is looked at again after
+        each one, and the trace and the watchdog go by the new one from then on. */
+        int new_ext = tu_extension(client_TU);
 
-            /* Now send the chat message using the tu_chat command. */
-            int chat_int;
-            if ((chat_int = tu_chat(client_TU, chat_msg)) < 0)
-            {
-                free(client_msg);
-                exit(EXIT_FAILURE);
-            }
+        if (new_ext != ext)
+        {
+            ext = new_ext;
+            snprintf(thread_name, sizeof(thread_name), "TU %d", ext);
+            trace_name_thread(thread_name);
         }
-
-        free(client_msg);
     }
 
     service_ended:
-        fclose(fp);
+        journal_disconnect(journal_conn);
 
-        /* After service loop, unregister the client TU and close the connection! */
+        /* After service loop, unregister the client TU and close the connection! The TU is unregistered first, so
+        nothing is written to (or shut down on) its fd once the fd may have been reused by another connection. */
         int unregister_int;
 
         /* Check if unregistered successfully. */
@@ -195,6 +345,10 @@ void *pbx_client_service(void *arg)
             exit(EXIT_FAILURE);
         }
 
-        close(connfd);
+        /* Closing fp closes connfd too. */
+        fclose(fp);
+
+        command_arena = NULL;
+        arena_destroy(&arena);
         return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pbx.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "debug.h"
+#include "csapp.h"
+
+/* One event. tsc is when it happened (or started), ticks how long it went on for. */
+struct trace_record {
+    uint64_t tsc;
+    uint64_t arg;
+    uint64_t ticks;
+    int32_t ext;
+    uint32_t type;
+};
+
+/* Ring of one thread. Only the owning thread writes to it, and it publishes each event by moving head past it,
+so the dumper can read the ring while it is being written to (see trace_write_ring). first is where the events
+of the current owner start, as a ring is handed on to a new thread when its owner exits. */
+struct trace_ring {
+    uint64_t head;
+    uint64_t first;
+    int tid;
+    char name[32];
+    struct trace_ring *next_free;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+static struct {
+    struct trace_ring *rings[TRACE_MAX_RINGS];
+    int num_rings;
+    struct trace_ring *free_rings;
+    sem_t rings_mutex;
+    pthread_key_t ring_key;
+    uint64_t start_tsc;
+    uint64_t start_ns;
+    int dumper_started;
+    sem_t dump_request;
+    int dumps;
+} trace;
+
+static char *call_event_names[] = { "dial", "ring", "answer", "chat", "hangup" };
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *trace_thread_ring;
+
+static uint64_t trace_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return trace_clock_ns();
+#endif
+}
+
+static void trace_release_ring(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    P(&(trace.rings_mutex));
+    ring -> next_free = trace.free_rings;
+    trace.free_rings = ring;
+    V(&(trace.rings_mutex));
+}
+
+/* The rings are set up the first time anybody traces anything, which is also the zero of the timestamps. */
+static void trace_setup(void)
+{
+    Sem_init(&(trace.rings_mutex), 0, 1);
+    pthread_key_create(&(trace.ring_key), trace_release_ring);
+    trace.start_ns = trace_clock_ns();
+    trace.start_tsc = trace_now();
+}
+
+/* Gets the calling thread's ring, taking one the first time. Returns NULL if there are no rings left. */
+static struct trace_ring *trace_get_ring(void)
+{
+    if (trace_thread_ring != NULL)
+    {
+        return trace_thread_ring;
+    }
+
+    Pthread_once(&trace_once, trace_setup);
+
+    struct trace_ring *ring = NULL;
+
+    P(&(trace.rings_mutex));
+
+    if (trace.free_rings != NULL)
+    {
+        ring = trace.free_rings;
+        trace.free_rings = ring -> next_free;
+    }
+    else if (trace.num_rings < TRACE_MAX_RINGS)
+    {
+        ring = calloc(1, sizeof(struct trace_ring));
+
+        if (ring == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        trace.rings[trace.num_rings] = ring;
+        __atomic_store_n(&(trace.num_rings), trace.num_rings + 1, __ATOMIC_RELEASE);
+    }
+
+    V(&(trace.rings_mutex));
+
+    if (ring != NULL)
+    {
+        ring -> tid = syscall(SYS_gettid);
+        snprintf(ring -> name, sizeof(ring -> name), "thread %d", ring -> tid);
+        __atomic_store_n(&(ring -> first), ring -> head, __ATOMIC_RELEASE);
+
+        pthread_setspecific(trace.ring_key, ring);
+        trace_thread_ring = ring;
+    }
+
+    return ring;
+}
+
+void trace_event(TRACE_TYPE type, int ext, uint64_t arg, uint64_t start)
+{
+    struct trace_ring *ring = trace_get_ring();
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t now = trace_now();
+    struct trace_record *record = &(ring -> records[ring -> head & (TRACE_RING_SIZE - 1)]);
+
+    record -> tsc = (start != 0) ? start : now;
+    record -> ticks = (start != 0) ? now - start : 0;
+    record -> arg = arg;
+    record -> ext = ext;
+    record -> type = type;
+
+    __atomic_store_n(&(ring -> head), ring -> head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_name_thread(char *name)
+{
+    struct trace_ring *ring = trace_get_ring();
+
+    if (ring != NULL)
+    {
+        snprintf(ring -> name, sizeof(ring -> name), "%s", name);
+    }
+}
+
+/* Writes out the first 8 bytes of a command line, leaving out anything that would need quoting in JSON. */
+static void trace_write_command(FILE *out, uint64_t arg)
+{
+    char command[sizeof(arg) + 1];
+
+    memcpy(command, &arg, sizeof(arg));
+    command[sizeof(arg)] = '\0';
+
+    for (char *c = command; *c != '\0'; c++)
+    {
+        fputc((*c >= ' ' && *c <= '~' && *c != '"' && *c != '\\') ? *c : '?', out);
+    }
+}
+
+/* Writes out the events of one ring, each starting with a ",\n". ticks_per_us converts the timestamps. */
+static void trace_write_ring(FILE *out, struct trace_ring *ring, struct trace_record *copy, double ticks_per_us)
+{
+    int pid = getpid();
+    uint64_t first = __atomic_load_n(&(ring -> first), __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE);
+    uint64_t start = (head > TRACE_RING_SIZE && head - TRACE_RING_SIZE > first) ? head - TRACE_RING_SIZE : first;
+
+    for (uint64_t i = start; i < head; i++)
+    {
+        copy[i - start] = ring -> records[i & (TRACE_RING_SIZE - 1)];
+    }
+
+    /* The owner may have gone on recording while the ring was copied. Whatever it may have written over in
+    the meantime (the slot of the record after the last one published) is thrown away. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t head_after = __atomic_load_n(&(ring -> head), __ATOMIC_ACQUIRE);
+    uint64_t valid = (head_after + 1 > TRACE_RING_SIZE) ? head_after + 1 - TRACE_RING_SIZE : 0;
+
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        pid, ring -> tid, ring -> name);
+
+    for (uint64_t i = (start > valid) ? start : valid; i < head; i++)
+    {
+        struct trace_record *record = &copy[i - start];
+        double ts = ((double) record -> tsc - (double) trace.start_tsc) / ticks_per_us;
+        double dur = record -> ticks / ticks_per_us;
+
+        fprintf(out, ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", pid, ring -> tid, ts);
+
+        switch (record -> type)
+        {
+            case TRACE_COMMAND:
+                fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"command\",\"name\":\"", dur);
+                trace_write_command(out, record -> arg);
+                fprintf(out, "\"}");
+                break;
+            case TRACE_LOCK:
+            {
+                struct lockprof_site *site = (struct lockprof_site *) (uintptr_t) record -> arg;
+                fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"lock\",\"name\":\"%s\",\"args\":{\"site\":\"%s:%d\"}}",
+                    dur, site -> lock, site -> func, site -> line);
+                break;
+            }
+            case TRACE_STATE:
+                fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"state\",\"name\":\"%s\",\"args\":{\"ext\":%d}}",
+                    (record -> arg <= TU_ERROR) ? tu_state_names[record -> arg] : "?", record -> ext);
+                break;
+            case TRACE_WRITE:
+                fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,\"cat\":\"write\",\"name\":\"write\","
+                    "\"args\":{\"ext\":%d,\"bytes\":%lu}}", dur, record -> ext, record -> arg);
+                break;
+            case TRACE_DIAL:
+            case TRACE_RING:
+            case TRACE_ANSWER:
+            case TRACE_CHAT:
+            case TRACE_HANGUP:
+            {
+                /* The flow event ties the call's events together, thru the command spans they are in. */
+                int phase = (record -> type == TRACE_DIAL) ? 's' : (record -> type == TRACE_HANGUP) ? 'f' : 't';
+                fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"call\",\"name\":\"%s\","
+                    "\"args\":{\"ext\":%d,\"call\":%lu}}", call_event_names[record -> type - TRACE_DIAL],
+                    record -> ext, record -> arg);
+                fprintf(out, ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"ph\":\"%c\",\"bp\":\"e\",\"cat\":\"call\","
+                    "\"name\":\"call\",\"id\":%lu}", pid, ring -> tid, ts, phase, record -> arg);
+                break;
+            }
+            default:
+                fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"unknown\"}");
+        }
+    }
+}
+
+int trace_write(FILE *out)
+{
+    Pthread_once(&trace_once, trace_setup);
+
+    /* Work out the rate of the time stamp counter from how far it and the clock have gone since the start. */
+    uint64_t elapsed_ns = trace_clock_ns() - trace.start_ns;
+
+    if (elapsed_ns < 10000000)
+    {
+        struct timespec pause = { 0, 10000000 - elapsed_ns };
+        nanosleep(&pause, NULL);
+    }
+
+    uint64_t elapsed_tsc = trace_now() - trace.start_tsc;
+    elapsed_ns = trace_clock_ns() - trace.start_ns;
+    double ticks_per_us = (double) elapsed_tsc / elapsed_ns * 1000.0;
+
+    struct trace_record *copy = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+
+    if (copy == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"pbx\"}}", getpid());
+
+    int num_rings = __atomic_load_n(&(trace.num_rings), __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_rings; i++)
+    {
+        trace_write_ring(out, trace.rings[i], copy, ticks_per_us);
+    }
+
+    fprintf(out, "\n]}\n");
+    free(copy);
+
+    return ferror(out) ? -1 : 0;
+}
+
+/* Thread function of the dumper, which dumps the rings to a new file each time it is asked to. */
+static void *trace_dumper_thread(void *arg)
+{
+    while (1)
+    {
+        P(&(trace.dump_request));
+
+        char path[64];
+        snprintf(path, sizeof(path), "pbx-trace.%d.%d.json", getpid(), ++trace.dumps);
+
+        FILE *out = fopen(path, "w");
+
+        if (out == NULL)
+        {
+            error("Can't write trace to %s", path);
+            continue;
+        }
+
+        int result = trace_write(out);
+
+        if (fclose(out) != 0 || result < 0)
+        {
+            error("Can't write trace to %s", path);
+        }
+        else
+        {
+            info("Trace written to %s", path);
+        }
+    }
+
+    return NULL;
+}
+
+void trace_init(void)
+{
+    pthread_t dumper;
+
+    Sem_init(&(trace.dump_request), 0, 0);
+    Pthread_create(&dumper, NULL, trace_dumper_thread, NULL);
+    Pthread_detach(dumper);
+    trace.dumper_started = 1;
+}
+
+void trace_request_dump(void)
+{
+    /* sem_post is async-signal-safe, so this can be called from the SIGUSR2 handler. */
+    if (trace.dumper_started)
+    {
+        sem_post(&(trace.dump_request));
+    }
+}
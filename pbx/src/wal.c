@@ -0,0 +1,845 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pbx.h"
+#include "wal.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define WAL_MAX_EXTENSIONS (PBX_MAX_EXTENSIONS + 4)
+#define WAL_RECORDS_SIZE (WAL_LOG_SIZE - WAL_HEADER_SIZE)
+
+/* Flags of a directory entry. */
+#define WAL_ENTRY_REGISTERED 0x1
+#define WAL_ENTRY_RESERVED 0x2
+#define WAL_ENTRY_PENDING 0x4
+
+/* What the WAL knows about one extension. */
+struct wal_entry {
+    int flags;
+    TU_STATE state;
+    int peer;
+};
+
+/* One of the two memory-mapped log files. tail is the offset of the next record within the record area. */
+struct wal_log {
+    int fd;
+    char *map;
+    size_t tail;
+    int header_dirty;
+};
+
+/* All the WAL state lives in this one static struct, just like the global PBX. */
+static struct {
+    volatile int enabled;
+    char *dir;
+
+    /* The mutex protects the active log index, its tail, the next sequence number and the overflow. */
+    sem_t mutex;
+    struct wal_log logs[2];
+    int active;
+    uint64_t next_seq;
+    int kicked;
+
+    /* Records appended while the active log was full, waiting for the next checkpoint to move them into the
+    fresh log. */
+    struct wal_record *overflow;
+    size_t overflow_count;
+    size_t overflow_cap;
+
+    /* The flusher thread and the state only it touches. */
+    pthread_t flusher;
+    sem_t wakeup;
+    volatile int stopping;
+    int synced_log;
+    size_t synced;
+    uint64_t applied_seq;
+    struct timespec last_checkpoint;
+    struct wal_entry directory[WAL_MAX_EXTENSIONS];
+
+    /* Reservations and pending calls left over from recovery, protected by their own mutex. */
+    sem_t reserve_mutex;
+    struct wal_entry recovered[WAL_MAX_EXTENSIONS];
+    volatile int outstanding;
+    time_t reserve_deadline;
+} wal;
+
+/* FNV-1a hash, used as a checksum for records and checkpoints. */
+static uint32_t wal_checksum(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct wal_header *wal_log_header(struct wal_log *log)
+{
+    return (struct wal_header *)(log -> map);
+}
+
+static struct wal_record *wal_log_records(struct wal_log *log)
+{
+    return (struct wal_record *)(log -> map + WAL_HEADER_SIZE);
+}
+
+/* Builds "<dir>/<name>" in a malloced buffer. REMEMBER TO FREE! */
+static char *wal_path(char *name)
+{
+    char *path = malloc(strlen(wal.dir) + strlen(name) + 2);
+
+    if (path == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    sprintf(path, "%s/%s", wal.dir, name);
+    return path;
+}
+
+/* Applies one record to the directory. Records hold absolute states, so replaying one twice is harmless. */
+static void wal_apply(struct wal_record *rec)
+{
+    if (rec -> ext < 0 || rec -> ext >= WAL_MAX_EXTENSIONS)
+    {
+        return;
+    }
+
+    struct wal_entry *entry = &(wal.directory[rec -> ext]);
+
+    switch (rec -> type)
+    {
+        case WAL_REGISTER:
+            entry -> flags = WAL_ENTRY_REGISTERED;
+            entry -> state = TU_ON_HOOK;
+            entry -> peer = -1;
+            break;
+        case WAL_UNREGISTER:
+            entry -> flags = 0;
+            entry -> peer = -1;
+            break;
+        case WAL_STATE:
+            entry -> flags = WAL_ENTRY_REGISTERED;
+            entry -> state = rec -> state;
+            entry -> peer = rec -> peer;
+            break;
+    }
+}
+
+/* Wakes the flusher before its interval is up. */
+static void wal_kick(void)
+{
+    V(&(wal.wakeup));
+}
+
+/* Drops the pending call of an extension, because something newer happened to it. */
+static void wal_drop_pending(int ext)
+{
+    if (wal.outstanding == 0 || ext < 0 || ext >= WAL_MAX_EXTENSIONS)
+    {
+        return;
+    }
+
+    P(&(wal.reserve_mutex));
+
+    if (wal.recovered[ext].flags & WAL_ENTRY_PENDING)
+    {
+        wal.recovered[ext].flags = 0;
+        wal.outstanding--;
+    }
+
+    V(&(wal.reserve_mutex));
+}
+
+/* Appends one record to the active log. No I/O happens here; the flusher commits the record later. */
+static void wal_append(WAL_RECORD_TYPE type, int ext, TU_STATE state, int peer)
+{
+    if (!wal.enabled)
+    {
+        return;
+    }
+
+    wal_drop_pending(ext);
+
+    struct wal_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.state = state;
+    rec.ext = ext;
+    rec.peer = peer;
+
+    P(&(wal.mutex));
+    struct wal_log *log = &(wal.logs[wal.active]);
+
+    rec.seq = wal.next_seq++;
+    rec.checksum = wal_checksum(&rec, offsetof(struct wal_record, checksum));
+
+    /* Ask for a checkpoint once the log gets too full. Only ask once per log. */
+    int kick = 0;
+
+    if (wal.overflow_count == 0 && log -> tail + sizeof(rec) <= WAL_RECORDS_SIZE)
+    {
+        memcpy(log -> map + WAL_HEADER_SIZE + log -> tail, &rec, sizeof(rec));
+        log -> tail += sizeof(rec);
+
+        if (log -> tail >= WAL_CHECKPOINT_FILL && !wal.kicked)
+        {
+            wal.kicked = 1;
+            kick = 1;
+        }
+    }
+    else
+    {
+        /* The active log is full, which only happens if appends outrun checkpoints. Nobody waits for the
+        flusher to make room (the flusher itself appends, and appenders hold the PBX lock): the record is kept
+        in memory until the next checkpoint moves it into the fresh log, in sequence. */
+        if (wal.overflow_count == wal.overflow_cap)
+        {
+            wal.overflow_cap = (wal.overflow_cap == 0) ? 1024 : wal.overflow_cap * 2;
+            wal.overflow = realloc(wal.overflow, sizeof(struct wal_record) * wal.overflow_cap);
+
+            if (wal.overflow == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        wal.overflow[wal.overflow_count++] = rec;
+        kick = 1;
+    }
+
+    V(&(wal.mutex));
+
+    if (kick)
+    {
+        wal_kick();
+    }
+}
+
+void wal_log_register(int ext)
+{
+    wal_append(WAL_REGISTER, ext, TU_ON_HOOK, -1);
+}
+
+void wal_log_unregister(int ext)
+{
+    wal_append(WAL_UNREGISTER, ext, TU_ON_HOOK, -1);
+}
+
+void wal_log_state(int ext, TU_STATE state, int peer)
+{
+    wal_append(WAL_STATE, ext, state, peer);
+}
+
+/* Makes the records of a log up to end durable with one msync, then applies them to the directory.
+This is the group commit: everything appended since the last pass goes out together. Flusher only. */
+static void wal_sync_log(int index, size_t end)
+{
+    struct wal_log *log = &(wal.logs[index]);
+
+    if (log -> header_dirty)
+    {
+        msync(log -> map, WAL_HEADER_SIZE, MS_SYNC);
+        log -> header_dirty = 0;
+    }
+
+    if (end <= wal.synced)
+    {
+        return;
+    }
+
+    /* msync needs a page aligned start address. */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = WAL_HEADER_SIZE + wal.synced;
+    size_t aligned_start = start - (start % page_size);
+
+    if (msync(log -> map + aligned_start, WAL_HEADER_SIZE + end - aligned_start, MS_SYNC) < 0)
+    {
+        error("WAL msync failed: %s", strerror(errno));
+    }
+
+    struct wal_record *records = wal_log_records(log);
+    for (size_t i = wal.synced / sizeof(struct wal_record); i < end / sizeof(struct wal_record); i++)
+    {
+        wal_apply(&(records[i]));
+        wal.applied_seq = records[i].seq;
+    }
+
+    wal.synced = end;
+}
+
+/* Group commits whatever has been appended to the active log. Flusher only. */
+static void wal_commit(void)
+{
+    P(&(wal.mutex));
+    int active = wal.active;
+    size_t end = wal.logs[active].tail;
+    V(&(wal.mutex));
+
+    wal_sync_log(active, end);
+}
+
+/* Writes the directory to a new checkpoint file and atomically replaces the old one. */
+static int wal_write_checkpoint(uint64_t seq)
+{
+    struct wal_checkpoint_entry *entries = malloc(sizeof(struct wal_checkpoint_entry) * WAL_MAX_EXTENSIONS);
+
+    if (entries == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Compact the directory down to the extensions that are registered. */
+    uint32_t count = 0;
+    for (int i = 0; i < WAL_MAX_EXTENSIONS; i++)
+    {
+        if (wal.directory[i].flags & WAL_ENTRY_REGISTERED)
+        {
+            entries[count].ext = i;
+            entries[count].state = wal.directory[i].state;
+            entries[count].peer = wal.directory[i].peer;
+            count++;
+        }
+    }
+
+    struct wal_checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = WAL_CKPT_MAGIC;
+    header.version = WAL_VERSION;
+    header.seq = seq;
+    header.count = count;
+    header.checksum = wal_checksum(entries, sizeof(struct wal_checkpoint_entry) * count);
+
+    char *path = wal_path(WAL_CHECKPOINT_NAME);
+    char *tmp_path = wal_path(WAL_CHECKPOINT_NAME ".tmp");
+    int ret = -1;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        if (rio_writen(fd, &header, sizeof(header)) == sizeof(header) &&
+            rio_writen(fd, entries, sizeof(struct wal_checkpoint_entry) * count) ==
+                (ssize_t)(sizeof(struct wal_checkpoint_entry) * count) &&
+            fsync(fd) == 0 && close(fd) == 0)
+        {
+            fd = -1;
+
+            /* Rename over the old checkpoint, then sync the directory so the rename itself is durable. */
+            if (rename(tmp_path, path) == 0)
+            {
+                int dir_fd = open(wal.dir, O_RDONLY);
+                if (dir_fd >= 0)
+                {
+                    fsync(dir_fd);
+                    close(dir_fd);
+                }
+                ret = 0;
+            }
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    if (ret < 0)
+    {
+        error("WAL checkpoint failed: %s", strerror(errno));
+    }
+
+    free(tmp_path);
+    free(path);
+    free(entries);
+    return ret;
+}
+
+/* Switches appenders over to the other log, folds the old log into a new checkpoint, and leaves the old log
+free to be reused by the next checkpoint. Flusher only. */
+static void wal_checkpoint(void)
+{
+    P(&(wal.mutex));
+
+    int old = wal.active;
+    size_t old_end = wal.logs[old].tail;
+    int new = old ^ 1;
+
+    /* Records that overflowed the old log were numbered when they were appended, so the new log starts with
+    the first of them. */
+    wal_log_header(&(wal.logs[new])) -> base_seq = (wal.overflow_count > 0) ? wal.overflow[0].seq : wal.next_seq;
+    wal.logs[new].tail = 0;
+    wal.logs[new].header_dirty = 1;
+    wal.active = new;
+    wal.kicked = 0;
+
+    /* Move whatever overflowed the old log into the new one, oldest first. Whatever doesn't fit waits for the
+    checkpoint after this one. */
+    size_t moved = 0;
+    while (moved < wal.overflow_count && wal.logs[new].tail + sizeof(struct wal_record) <= WAL_RECORDS_SIZE)
+    {
+        memcpy(wal.logs[new].map + WAL_HEADER_SIZE + wal.logs[new].tail, &(wal.overflow[moved]),
+            sizeof(struct wal_record));
+        wal.logs[new].tail += sizeof(struct wal_record);
+        moved++;
+    }
+
+    if (moved > 0)
+    {
+        memmove(wal.overflow, wal.overflow + moved, sizeof(struct wal_record) * (wal.overflow_count - moved));
+        wal.overflow_count -= moved;
+    }
+
+    V(&(wal.mutex));
+
+    /* Flush the rest of the old log so the directory covers all of it. */
+    wal_sync_log(old, old_end);
+
+    if (wal_write_checkpoint(wal.applied_seq) < 0)
+    {
+        /* Never recycle a log that isn't covered by a checkpoint. Stop logging instead. */
+        error("WAL disabled after failed checkpoint");
+        wal.enabled = 0;
+    }
+
+    wal.synced_log = new;
+    wal.synced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &(wal.last_checkpoint));
+}
+
+/* Drops reservations that nobody reclaimed within the grace period. Flusher only.
+An expired extension stays reserved (so wal_is_reserved keeps it from being handed out) until its UNREGISTER has
+been logged, so that a new client can't be given it, and logged as registered, before the old one is logged out. */
+static void wal_expire_reservations(void)
+{
+    if (wal.outstanding == 0 || time(NULL) < wal.reserve_deadline)
+    {
+        return;
+    }
+
+    int *expired = malloc(sizeof(int) * WAL_MAX_EXTENSIONS);
+
+    if (expired == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    int num_expired = 0;
+
+    P(&(wal.reserve_mutex));
+    for (int i = 0; i < WAL_MAX_EXTENSIONS; i++)
+    {
+        if (wal.recovered[i].flags & WAL_ENTRY_RESERVED)
+        {
+            expired[num_expired++] = i;
+        }
+    }
+    V(&(wal.reserve_mutex));
+
+    /* The expired extensions are gone for good, so log them as unregistered. */
+    for (int i = 0; i < num_expired; i++)
+    {
+        wal_log_unregister(expired[i]);
+    }
+
+    P(&(wal.reserve_mutex));
+    for (int i = 0; i < WAL_MAX_EXTENSIONS; i++)
+    {
+        wal.recovered[i].flags = 0;
+    }
+    wal.outstanding = 0;
+    V(&(wal.reserve_mutex));
+
+    free(expired);
+}
+
+/* Thread function of the flusher. Group commits every few milliseconds (or sooner when kicked) and takes
+checkpoints when they are due. */
+static void *wal_flusher(void *arg)
+{
+    while (!wal.stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_COMMIT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (sem_timedwait(&(wal.wakeup), &deadline) < 0 && errno == EINTR)
+        {
+            ;
+        }
+
+        if (!wal.enabled)
+        {
+            break;
+        }
+
+        wal_commit();
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long since_checkpoint_ms = (now.tv_sec - wal.last_checkpoint.tv_sec) * 1000 +
+            (now.tv_nsec - wal.last_checkpoint.tv_nsec) / 1000000;
+
+        /* Records that overflowed the active log only get into a log at a checkpoint. */
+        int overflowed = __atomic_load_n(&(wal.overflow_count), __ATOMIC_RELAXED) > 0;
+
+        if (wal.synced >= WAL_CHECKPOINT_FILL || since_checkpoint_ms >= WAL_CHECKPOINT_INTERVAL_MS || overflowed)
+        {
+            wal_checkpoint();
+        }
+
+        wal_expire_reservations();
+    }
+
+    return NULL;
+}
+
+/* Reads the checkpoint into the directory. A missing checkpoint is just an empty directory. */
+static int wal_read_checkpoint(uint64_t *seq)
+{
+    *seq = 0;
+
+    char *path = wal_path(WAL_CHECKPOINT_NAME);
+    int fd = open(path, O_RDONLY);
+    free(path);
+
+    if (fd < 0)
+    {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    struct wal_checkpoint_header header;
+    struct wal_checkpoint_entry *entries = NULL;
+    int ret = -1;
+
+    if (rio_readn(fd, &header, sizeof(header)) == sizeof(header) && header.magic == WAL_CKPT_MAGIC &&
+        header.version == WAL_VERSION && header.count <= WAL_MAX_EXTENSIONS)
+    {
+        size_t size = sizeof(struct wal_checkpoint_entry) * header.count;
+        entries = malloc(size + 1);
+
+        if (entries != NULL && rio_readn(fd, entries, size) == (ssize_t)size &&
+            wal_checksum(entries, size) == header.checksum)
+        {
+            for (uint32_t i = 0; i < header.count; i++)
+            {
+                if (entries[i].ext >= 0 && entries[i].ext < WAL_MAX_EXTENSIONS)
+                {
+                    wal.directory[entries[i].ext].flags = WAL_ENTRY_REGISTERED;
+                    wal.directory[entries[i].ext].state = entries[i].state;
+                    wal.directory[entries[i].ext].peer = entries[i].peer;
+                }
+            }
+
+            *seq = header.seq;
+            ret = 0;
+        }
+    }
+
+    free(entries);
+    close(fd);
+    return ret;
+}
+
+/* Opens (or creates) one log file and maps it. */
+static int wal_open_log(int index, char *name)
+{
+    struct wal_log *log = &(wal.logs[index]);
+    char *path = wal_path(name);
+
+    log -> fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+
+    if (log -> fd < 0 || ftruncate(log -> fd, WAL_LOG_SIZE) < 0)
+    {
+        return -1;
+    }
+
+    log -> map = mmap(NULL, WAL_LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, log -> fd, 0);
+
+    if (log -> map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    log -> tail = 0;
+    log -> header_dirty = 0;
+    return 0;
+}
+
+/* Replays the valid prefix of a log on top of the directory. Records already covered by the checkpoint are
+skipped. Returns the last sequence number seen. */
+static uint64_t wal_replay_log(struct wal_log *log, uint64_t checkpoint_seq)
+{
+    struct wal_header *header = wal_log_header(log);
+    struct wal_record *records = wal_log_records(log);
+    uint64_t last_seq = 0;
+
+    if (header -> magic != WAL_MAGIC || header -> version != WAL_VERSION)
+    {
+        return 0;
+    }
+
+    /* Records must be numbered consecutively from the base of the log. The first one that isn't (or whose
+    checksum is wrong) marks where the log ended. */
+    uint64_t expected = header -> base_seq;
+    for (size_t i = 0; i < WAL_RECORDS_SIZE / sizeof(struct wal_record); i++)
+    {
+        if (records[i].seq != expected ||
+            records[i].checksum != wal_checksum(&(records[i]), offsetof(struct wal_record, checksum)))
+        {
+            break;
+        }
+
+        if (records[i].seq > checkpoint_seq)
+        {
+            wal_apply(&(records[i]));
+        }
+
+        last_seq = records[i].seq;
+        expected++;
+    }
+
+    return last_seq;
+}
+
+/* Initializes the WAL, recovering whatever directory the logs describe. */
+int wal_init(char *dir)
+{
+    char *log_names[] = WAL_LOG_NAMES;
+
+    wal.dir = strdup(dir);
+    if (wal.dir == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < WAL_MAX_EXTENSIONS; i++)
+    {
+        wal.directory[i].flags = 0;
+        wal.directory[i].peer = -1;
+        wal.recovered[i].flags = 0;
+        wal.recovered[i].peer = -1;
+    }
+
+    /* First the checkpoint, then both logs on top of it, oldest first. */
+    uint64_t checkpoint_seq;
+    if (wal_read_checkpoint(&checkpoint_seq) < 0)
+    {
+        error("WAL checkpoint in %s is unreadable, ignoring it", dir);
+        checkpoint_seq = 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (wal_open_log(i, log_names[i]) < 0)
+        {
+            return -1;
+        }
+    }
+
+    int first = (wal_log_header(&(wal.logs[0])) -> base_seq <= wal_log_header(&(wal.logs[1])) -> base_seq) ? 0 : 1;
+    uint64_t last_seq = checkpoint_seq;
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint64_t seq = wal_replay_log(&(wal.logs[first ^ i]), checkpoint_seq);
+        if (seq > last_seq)
+        {
+            last_seq = seq;
+        }
+    }
+
+    /* Whatever was registered when we died is reserved for its old client. */
+    wal.outstanding = 0;
+    for (int i = 0; i < WAL_MAX_EXTENSIONS; i++)
+    {
+        if (wal.directory[i].flags & WAL_ENTRY_REGISTERED)
+        {
+            wal.recovered[i] = wal.directory[i];
+            wal.recovered[i].flags = WAL_ENTRY_RESERVED;
+            wal.outstanding++;
+        }
+    }
+    wal.reserve_deadline = time(NULL) + WAL_RECLAIM_GRACE_SECS;
+
+    if (wal.outstanding > 0)
+    {
+        info("WAL recovered %d extensions", wal.outstanding);
+    }
+
+    /* Fold the recovery into a fresh checkpoint and start over with empty logs. */
+    wal.next_seq = last_seq + 1;
+    wal.applied_seq = last_seq;
+
+    if (wal_write_checkpoint(last_seq) < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        struct wal_header *header = wal_log_header(&(wal.logs[i]));
+        header -> magic = WAL_MAGIC;
+        header -> version = WAL_VERSION;
+        header -> base_seq = (i == 0) ? wal.next_seq : 0;
+        msync(wal.logs[i].map, WAL_HEADER_SIZE, MS_SYNC);
+    }
+
+    wal.active = 0;
+    wal.kicked = 0;
+    wal.synced_log = 0;
+    wal.synced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &(wal.last_checkpoint));
+
+    Sem_init(&(wal.mutex), 0, 1);
+    Sem_init(&(wal.wakeup), 0, 0);
+    Sem_init(&(wal.reserve_mutex), 0, 1);
+
+    wal.stopping = 0;
+    wal.enabled = 1;
+    Pthread_create(&(wal.flusher), NULL, wal_flusher, NULL);
+
+    return 0;
+}
+
+/* Stops the flusher and leaves a final checkpoint behind. */
+void wal_shutdown(void)
+{
+    if (!wal.enabled)
+    {
+        return;
+    }
+
+    wal.stopping = 1;
+    wal_kick();
+    Pthread_join(wal.flusher, NULL);
+
+    /* Checkpoint until nothing is left over in memory, then commit what the last checkpoint moved into the log. */
+    do
+    {
+        wal_commit();
+        wal_checkpoint();
+    }
+    while (wal.overflow_count > 0 && wal.enabled);
+
+    wal_commit();
+    wal.enabled = 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        munmap(wal.logs[i].map, WAL_LOG_SIZE);
+        close(wal.logs[i].fd);
+    }
+
+    free(wal.overflow);
+    free(wal.dir);
+}
+
+int wal_is_reserved(int ext)
+{
+    if (!wal.enabled || wal.outstanding == 0 || ext < 0 || ext >= WAL_MAX_EXTENSIONS)
+    {
+        return 0;
+    }
+
+    P(&(wal.reserve_mutex));
+    /* Past the deadline, the reservation holds until the flusher has logged it out (see wal_expire_reservations). */
+    int reserved = (wal.recovered[ext].flags & WAL_ENTRY_RESERVED) != 0;
+    V(&(wal.reserve_mutex));
+
+    return reserved;
+}
+
+int wal_claim(int ext, TU_STATE *state, int *peer)
+{
+    if (!wal.enabled || wal.outstanding == 0 || ext < 0 || ext >= WAL_MAX_EXTENSIONS)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+
+    P(&(wal.reserve_mutex));
+
+    if ((wal.recovered[ext].flags & WAL_ENTRY_RESERVED) && time(NULL) < wal.reserve_deadline)
+    {
+        *state = wal.recovered[ext].state;
+        *peer = wal.recovered[ext].peer;
+        wal.recovered[ext].flags = 0;
+        wal.outstanding--;
+        ret = 0;
+    }
+
+    V(&(wal.reserve_mutex));
+
+    return ret;
+}
+
+void wal_await_peer(int ext, TU_STATE state, int peer)
+{
+    if (!wal.enabled || ext < 0 || ext >= WAL_MAX_EXTENSIONS)
+    {
+        return;
+    }
+
+    P(&(wal.reserve_mutex));
+
+    if (wal.recovered[ext].flags == 0)
+    {
+        wal.outstanding++;
+    }
+
+    wal.recovered[ext].flags = WAL_ENTRY_PENDING;
+    wal.recovered[ext].state = state;
+    wal.recovered[ext].peer = peer;
+
+    V(&(wal.reserve_mutex));
+}
+
+int wal_take_pending(int ext, TU_STATE *state, int *peer)
+{
+    if (!wal.enabled || wal.outstanding == 0 || ext < 0 || ext >= WAL_MAX_EXTENSIONS)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+
+    P(&(wal.reserve_mutex));
+
+    if (wal.recovered[ext].flags & WAL_ENTRY_PENDING)
+    {
+        *state = wal.recovered[ext].state;
+        *peer = wal.recovered[ext].peer;
+        wal.recovered[ext].flags = 0;
+        wal.outstanding--;
+        ret = 0;
+    }
+
+    V(&(wal.reserve_mutex));
+
+    return ret;
+}
@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "watchdog.h"
+#include "lockprof.h"
+#include "csapp.h"
+
+/* A lock a thread is holding (or waiting for), and since when. */
+struct watchdog_lock {
+    MUTEX *mutex;
+    struct lockprof_site *site;
+    uint64_t since_ns;
+};
+
+/* What one thread is doing. Only the owning thread writes to it, except for reported_ns, which only the
+watchdog touches. busy_since_ns (and waiting.since_ns) are 0 when there is nothing going on. */
+struct watchdog_thread {
+    pthread_t thread;
+    int tid;
+    int in_use;
+    int ext;
+    uint64_t busy_since_ns;
+    struct watchdog_lock waiting;
+    int num_held;
+    struct watchdog_lock held[WATCHDOG_MAX_HELD];
+    uint64_t reported_ns;
+    struct watchdog_thread *next_free;
+};
+
+static struct {
+    struct watchdog_thread *threads[WATCHDOG_MAX_THREADS];
+    int num_threads;
+    struct watchdog_thread *free_threads;
+    sem_t threads_mutex;
+    pthread_key_t thread_key;
+    uint64_t threshold_ns;
+    void *frames[WATCHDOG_MAX_FRAMES];
+    int num_frames;
+    sem_t backtrace_done;
+} watchdog;
+
+int watchdog_enabled;
+
+static __thread struct watchdog_thread *watchdog_self;
+
+static uint64_t watchdog_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Runs when a watched thread exits. */
+static void watchdog_release_thread(void *arg)
+{
+    struct watchdog_thread *t = arg;
+
+    P(&(watchdog.threads_mutex));
+    __atomic_store_n(&(t -> in_use), 0, __ATOMIC_RELEASE);
+    t -> next_free = watchdog.free_threads;
+    watchdog.free_threads = t;
+    V(&(watchdog.threads_mutex));
+}
+
+/* Gets the calling thread's record, taking one the first time. Returns NULL if there are none left. */
+static struct watchdog_thread *watchdog_get_thread(void)
+{
+    if (watchdog_self != NULL)
+    {
+        return watchdog_self;
+    }
+
+    struct watchdog_thread *t = NULL;
+
+    P(&(watchdog.threads_mutex));
+
+    if (watchdog.free_threads != NULL)
+    {
+        t = watchdog.free_threads;
+        watchdog.free_threads = t -> next_free;
+    }
+    else if (watchdog.num_threads < WATCHDOG_MAX_THREADS)
+    {
+        t = calloc(1, sizeof(struct watchdog_thread));
+
+        if (t == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        watchdog.threads[watchdog.num_threads] = t;
+        __atomic_store_n(&(watchdog.num_threads), watchdog.num_threads + 1, __ATOMIC_RELEASE);
+    }
+
+    if (t != NULL)
+    {
+        t -> thread = pthread_self();
+        t -> tid = syscall(SYS_gettid);
+        t -> ext = -1;
+        t -> busy_since_ns = 0;
+        t -> waiting.since_ns = 0;
+        t -> num_held = 0;
+        __atomic_store_n(&(t -> in_use), 1, __ATOMIC_RELEASE);
+    }
+
+    V(&(watchdog.threads_mutex));
+
+    if (t != NULL)
+    {
+        pthread_setspecific(watchdog.thread_key, t);
+        watchdog_self = t;
+    }
+
+    return t;
+}
+
+void watchdog_waiting(MUTEX *mutex, struct lockprof_site *site)
+{
+    struct watchdog_thread *t = watchdog_get_thread();
+
+    if (t == NULL)
+    {
+        return;
+    }
+
+    t -> waiting.mutex = mutex;
+    t -> waiting.site = site;
+    __atomic_store_n(&(t -> waiting.since_ns), watchdog_now(), __ATOMIC_RELEASE);
+}
+
+void watchdog_acquired(MUTEX *mutex, struct lockprof_site *site)
+{
+    struct watchdog_thread *t = watchdog_get_thread();
+
+    if (t == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&(t -> waiting.since_ns), 0, __ATOMIC_RELEASE);
+
+    if (t -> num_held < WATCHDOG_MAX_HELD)
+    {
+        struct watchdog_lock *lock = &(t -> held[t -> num_held]);
+
+        lock -> mutex = mutex;
+        lock -> site = site;
+        lock -> since_ns = watchdog_now();
+        __atomic_store_n(&(t -> num_held), t -> num_held + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void watchdog_released(MUTEX *mutex)
+{
+    struct watchdog_thread *t = watchdog_self;
+
+    if (t == NULL)
+    {
+        return;
+    }
+
+    /* Locks are nearly always let go of in the reverse order, so look from the most recent one. */
+    for (int i = t -> num_held - 1; i >= 0; i--)
+    {
+        if (t -> held[i].mutex == mutex)
+        {
+            memmove(&(t -> held[i]), &(t -> held[i + 1]), sizeof(struct watchdog_lock) * (t -> num_held - i - 1));
+            __atomic_store_n(&(t -> num_held), t -> num_held - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+}
+
+void watchdog_busy(int ext)
+{
+    if (!__atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    struct watchdog_thread *t = watchdog_get_thread();
+
+    if (t != NULL)
+    {
+        t -> ext = ext;
+        __atomic_store_n(&(t -> busy_since_ns), watchdog_now(), __ATOMIC_RELEASE);
+    }
+}
+
+void watchdog_idle(void)
+{
+    if (watchdog_self != NULL)
+    {
+        __atomic_store_n(&(watchdog_self -> busy_since_ns), 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Writes out one lock of a thread: what it is, whose it is, where it was taken and for how long. */
+static void watchdog_write_lock(FILE *out, char *what, struct watchdog_lock *lock, uint64_t now)
+{
+    char owner[32];
+
+    pbx_describe_lock(lock -> mutex, owner, sizeof(owner));
+    fprintf(out, "    %s %s (%s) at %s:%d for %.3f s\n", what, lock -> site -> lock, owner, lock -> site -> func,
+        lock -> site -> line, (now - lock -> since_ns) / 1e9);
+}
+
+/* Writes out what a thread is doing. Returns 0 (writing nothing) if it is doing nothing. */
+static int watchdog_write_thread(FILE *out, struct watchdog_thread *t, uint64_t now)
+{
+    uint64_t busy_since = __atomic_load_n(&(t -> busy_since_ns), __ATOMIC_ACQUIRE);
+    uint64_t waiting_since = __atomic_load_n(&(t -> waiting.since_ns), __ATOMIC_ACQUIRE);
+    int num_held = __atomic_load_n(&(t -> num_held), __ATOMIC_ACQUIRE);
+
+    if (busy_since == 0 && waiting_since == 0 && num_held == 0)
+    {
+        return 0;
+    }
+
+    fprintf(out, "thread %d", t -> tid);
+
+    if (t -> ext >= 0)
+    {
+        fprintf(out, " (TU %d)", t -> ext);
+    }
+
+    if (busy_since != 0)
+    {
+        fprintf(out, ": busy with a command for %.3f s", (now - busy_since) / 1e9);
+    }
+
+    fprintf(out, "\n");
+
+    for (int i = 0; i < num_held; i++)
+    {
+        watchdog_write_lock(out, "holding", &(t -> held[i]), now);
+    }
+
+    if (waiting_since != 0)
+    {
+        watchdog_write_lock(out, "waiting for", &(t -> waiting), now);
+    }
+
+    return 1;
+}
+
+int watchdog_write(FILE *out)
+{
+    uint64_t now = watchdog_now();
+    int num_threads = __atomic_load_n(&(watchdog.num_threads), __ATOMIC_ACQUIRE);
+    int written = 0;
+
+    fprintf(out, "watchdog is %s\n", __atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED) ? "on" : "off");
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        struct watchdog_thread *t = watchdog.threads[i];
+
+        if (__atomic_load_n(&(t -> in_use), __ATOMIC_ACQUIRE))
+        {
+            written += watchdog_write_thread(out, t, now);
+        }
+    }
+
+    if (written == 0)
+    {
+        fprintf(out, "no thread is doing anything\n");
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+/* Handler of WATCHDOG_SIGNAL, in the thread the watchdog wants the backtrace of. */
+static void watchdog_backtrace_handler(int sig)
+{
+    int saved_errno = errno;
+
+    watchdog.num_frames = backtrace(watchdog.frames, WATCHDOG_MAX_FRAMES);
+    sem_post(&(watchdog.backtrace_done));
+
+    errno = saved_errno;
+}
+
+/* Gets the backtrace of a thread and writes it out, if the thread answers within 100 ms. */
+static void watchdog_write_backtrace(FILE *out, struct watchdog_thread *t)
+{
+    /* Throw away the answer of a thread that answered too late last time. */
+    while (sem_trywait(&(watchdog.backtrace_done)) == 0)
+    {
+        ;
+    }
+
+    /* A thread can't go away while the mutex is held, so it is still there to be signalled. */
+    P(&(watchdog.threads_mutex));
+    int signalled = __atomic_load_n(&(t -> in_use), __ATOMIC_ACQUIRE) &&
+        pthread_kill(t -> thread, WATCHDOG_SIGNAL) == 0;
+    V(&(watchdog.threads_mutex));
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int answered = 0;
+    while (signalled && (answered = (sem_timedwait(&(watchdog.backtrace_done), &deadline) == 0)) == 0 &&
+        errno == EINTR)
+    {
+        ;
+    }
+
+    char **symbols = answered ? backtrace_symbols(watchdog.frames, watchdog.num_frames) : NULL;
+
+    if (symbols == NULL)
+    {
+        fprintf(out, "    (no backtrace)\n");
+        return;
+    }
+
+    fprintf(out, "    backtrace:\n");
+    for (int i = 0; i < watchdog.num_frames; i++)
+    {
+        fprintf(out, "        %s\n", symbols[i]);
+    }
+
+    free(symbols);
+}
+
+/* Reports a stuck thread on stderr, together with every thread waiting for one of its locks. */
+static void watchdog_report(struct watchdog_thread *t, uint64_t now)
+{
+    char *report = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&report, &size);
+
+    if (out == NULL)
+    {
+        return;
+    }
+
+    fprintf(out, "watchdog: thread %d is stuck\n", t -> tid);
+    watchdog_write_thread(out, t, now);
+    watchdog_write_backtrace(out, t);
+
+    int num_threads = __atomic_load_n(&(watchdog.num_threads), __ATOMIC_ACQUIRE);
+    int num_held = __atomic_load_n(&(t -> num_held), __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        struct watchdog_thread *waiter = watchdog.threads[i];
+
+        if (waiter == t || !__atomic_load_n(&(waiter -> in_use), __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&(waiter -> waiting.since_ns), __ATOMIC_ACQUIRE) == 0)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < num_held; j++)
+        {
+            if (waiter -> waiting.mutex == t -> held[j].mutex)
+            {
+                fprintf(out, "  held up by it:\n");
+                watchdog_write_thread(out, waiter, now);
+                break;
+            }
+        }
+    }
+
+    fclose(out);
+    fwrite(report, 1, size, stderr);
+    fflush(stderr);
+    free(report);
+}
+
+/* When a thread got stuck: the earliest of when it took a lock it still holds and when it started its command,
+or 0 if it is doing neither. */
+static uint64_t watchdog_stuck_since(struct watchdog_thread *t)
+{
+    uint64_t since = __atomic_load_n(&(t -> busy_since_ns), __ATOMIC_ACQUIRE);
+    int num_held = __atomic_load_n(&(t -> num_held), __ATOMIC_ACQUIRE);
+
+    if (num_held > 0 && (since == 0 || t -> held[0].since_ns < since))
+    {
+        since = t -> held[0].since_ns;
+    }
+
+    return since;
+}
+
+/* Thread function of the watchdog. */
+static void *watchdog_thread(void *arg)
+{
+    uint64_t interval_ns = watchdog.threshold_ns / 4;
+    struct timespec interval = { interval_ns / 1000000000, interval_ns % 1000000000 };
+
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+
+        uint64_t now = watchdog_now();
+        int num_threads = __atomic_load_n(&(watchdog.num_threads), __ATOMIC_ACQUIRE);
+
+        for (int i = 0; i < num_threads; i++)
+        {
+            struct watchdog_thread *t = watchdog.threads[i];
+
+            if (!__atomic_load_n(&(t -> in_use), __ATOMIC_ACQUIRE))
+            {
+                continue;
+            }
+
+            /* Each hold (or command) is reported once, however long it goes on. */
+            uint64_t since = watchdog_stuck_since(t);
+
+            if (since != 0 && now - since > watchdog.threshold_ns && since != t -> reported_ns)
+            {
+                t -> reported_ns = since;
+                watchdog_report(t, now);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void watchdog_init(int threshold_ms)
+{
+    pthread_t thread;
+    struct sigaction action;
+
+    Sem_init(&(watchdog.threads_mutex), 0, 1);
+    Sem_init(&(watchdog.backtrace_done), 0, 0);
+    pthread_key_create(&(watchdog.thread_key), watchdog_release_thread);
+    watchdog.threshold_ns = (uint64_t) threshold_ms * 1000000;
+
+    /* The first backtrace loads libgcc, which allocates, so it is done here rather than in the handler. */
+    watchdog.num_frames = backtrace(watchdog.frames, WATCHDOG_MAX_FRAMES);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watchdog_backtrace_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(WATCHDOG_SIGNAL, &action, NULL);
+
+    __atomic_store_n(&watchdog_enabled, 1, __ATOMIC_RELEASE);
+
+    Pthread_create(&thread, NULL, watchdog_thread, NULL);
+    Pthread_detach(thread);
+}
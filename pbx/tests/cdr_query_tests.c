@@ -0,0 +1,243 @@
+#include <fcntl.h>
+#include <criterion/criterion.h>
+
+/*
+ * Tests of the pbx-cdr queries: each grouping and filter, counted by the tool's own scan of a segment, has to
+ * come out the same as counting the rows that went into the segment one at a time.
+ *
+ * The tool is built into the tests, with its main renamed, so that the tests can set up a query and scan a
+ * segment with it directly.
+ */
+
+#define main pbx_cdr_main
+#include "../util/pbx-cdr.c"
+#undef main
+
+#define QUERY_ROWS (3 * CDRSEG_BLOCK_ROWS + 777)
+#define QUERY_EXTS 40
+
+static char dir[] = "/tmp/cdr_query_testXXXXXX";
+static char path[256];
+static struct cdr_record *rows;
+static size_t num_rows;
+
+/* Calls among a few extensions over a few days, written into a segment. Adding the row's index to its setup time
+keeps the times distinct, so the order the segment sorts them into is the only one. */
+static void make_segment(void)
+{
+    cr_assert_not_null(mkdtemp(dir), "Can't make a directory for the segment");
+    snprintf(path, sizeof(path), "%s/query.seg", dir);
+
+    num_rows = QUERY_ROWS;
+    rows = calloc(num_rows, sizeof(struct cdr_record));
+    cr_assert_not_null(rows);
+
+    srand(4);
+    uint64_t base = 1700000000ULL * 1000000000ULL;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        rows[i].setup_ns = base + (uint64_t) (rand() % (3 * 86400)) * 1000000000ULL + i;
+        rows[i].end_ns = rows[i].setup_ns + (uint64_t) (rand() % 600) * 1000000000ULL;
+        rows[i].caller = 2 + rand() % QUERY_EXTS;
+        rows[i].callee = 2 + rand() % QUERY_EXTS;
+        rows[i].disposition = rand() % NUM_DISPOSITIONS;
+        rows[i].answer_ns = (rows[i].disposition == CDR_ANSWERED) ? rows[i].setup_ns + 1000000000ULL : 0;
+    }
+
+    /* The segment is written from a copy, since writing sorts the rows. */
+    struct cdr_record *written = malloc(sizeof(struct cdr_record) * num_rows);
+    cr_assert_not_null(written);
+    memcpy(written, rows, sizeof(struct cdr_record) * num_rows);
+    cr_assert_eq(cdrseg_write(path, written, num_rows), 0);
+    free(written);
+}
+
+static int compare_setup(const void *a, const void *b)
+{
+    const struct cdr_record *x = a, *y = b;
+
+    return (x -> setup_ns > y -> setup_ns) - (x -> setup_ns < y -> setup_ns);
+}
+
+static void remove_segment(void)
+{
+    free(rows);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void reset_query(void)
+{
+    since_ns = 0;
+    until_ns = UINT64_MAX;
+    have_ext = 0;
+    filter_disposition = -1;
+    group = GROUP_CALLEE;
+    tz_offset = 0;
+}
+
+/* The group a row falls in, for the current query, the slow way. */
+static int64_t naive_key(struct cdr_record *row)
+{
+    switch (group)
+    {
+        case GROUP_CALLER:
+            return row -> caller;
+        case GROUP_CALLEE:
+            return row -> callee;
+        case GROUP_DISPOSITION:
+            return row -> disposition;
+        case GROUP_HOUR:
+            return (((int64_t) (row -> setup_ns / 1000000000ULL) + tz_offset) / 3600 % 24 + 24) % 24;
+        default:
+            return 0;
+    }
+}
+
+static int naive_keeps(struct cdr_record *row)
+{
+    return row -> setup_ns >= since_ns && row -> setup_ns < until_ns &&
+        (!have_ext || row -> caller == filter_ext || row -> callee == filter_ext) &&
+        (filter_disposition < 0 || row -> disposition == filter_disposition);
+}
+
+/* Scans the segment with the current query, and checks the results against counting the rows one at a time,
+leaving out the rows in skip (if any). */
+static void assert_query_matches(size_t *skip, int num_skip)
+{
+    /* Keys are extensions (2 .. 2 + QUERY_EXTS), hours or dispositions, so they all fit in this. */
+    uint64_t expected[2 + QUERY_EXTS][NUM_DISPOSITIONS];
+    memset(expected, 0, sizeof(expected));
+    size_t expected_groups = 0;
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        int skipped = 0;
+        for (int s = 0; s < num_skip; s++)
+        {
+            skipped |= (skip[s] == i);
+        }
+
+        if (!skipped && naive_keeps(&(rows[i])))
+        {
+            uint64_t *counts = expected[naive_key(&(rows[i]))];
+            expected_groups += (counts[0] + counts[1] + counts[2] + counts[3] == 0);
+            counts[rows[i].disposition]++;
+        }
+    }
+
+    struct cdrseg seg;
+    struct results r;
+    memset(&r, 0, sizeof(r));
+
+    cr_assert_eq(cdrseg_open(&seg, path), 0);
+    scan_segment(&seg, &r);
+    cdrseg_close(&seg);
+
+    cr_assert_eq(r.bad_segments, 0);
+    cr_assert_eq(r.count, expected_groups, "Query grouped by %s found %zu groups, not %zu", group_names[group],
+        r.count, expected_groups);
+
+    for (size_t i = 0; i < r.cap; i++)
+    {
+        if (!r.table[i].used)
+        {
+            continue;
+        }
+
+        int64_t key = r.table[i].key;
+        cr_assert(key >= 0 && key < 2 + QUERY_EXTS, "Query grouped by %s found group %ld", group_names[group],
+            (long) key);
+
+        for (int d = 0; d < NUM_DISPOSITIONS; d++)
+        {
+            cr_assert_eq(r.table[i].counts[d], expected[key][d],
+                "Query grouped by %s counted %lu %s calls for %ld, not %lu", group_names[group],
+                (unsigned long) r.table[i].counts[d], disposition_names[d], (long) key,
+                (unsigned long) expected[key][d]);
+        }
+    }
+
+    free(r.table);
+}
+
+/* Every grouping, with and without each filter. The time range cuts thru the middle of blocks, and leaves whole
+blocks out on either side. */
+Test(cdr_query, matches_naive_count, .init = make_segment, .fini = remove_segment, .timeout = 60)
+{
+    uint64_t base = 1700000000ULL * 1000000000ULL;
+    long tz_offsets[] = { 0, 19800, -8 * 3600 };
+
+    for (int g = GROUP_CALLER; g <= GROUP_NONE; g++)
+    {
+        for (int filters = 0; filters < 8; filters++)
+        {
+            for (int tz = 0; tz < 3; tz++)
+            {
+                reset_query();
+                group = g;
+                tz_offset = tz_offsets[tz];
+
+                if (filters & 1)
+                {
+                    since_ns = base + 20 * 3600 * 1000000000ULL + 12345;
+                    until_ns = base + 50 * 3600 * 1000000000ULL + 67890;
+                }
+                if (filters & 2)
+                {
+                    have_ext = 1;
+                    filter_ext = 2 + QUERY_EXTS / 2;
+                }
+                if (filters & 4)
+                {
+                    filter_disposition = CDR_BUSY;
+                }
+
+                assert_query_matches(NULL, 0);
+            }
+        }
+    }
+}
+
+/* A time range or extension that nothing falls in finds nothing. */
+Test(cdr_query, finds_nothing, .init = make_segment, .fini = remove_segment, .timeout = 10)
+{
+    reset_query();
+    until_ns = 1;
+    assert_query_matches(NULL, 0);
+
+    reset_query();
+    have_ext = 1;
+    filter_ext = 2 + QUERY_EXTS + 1;
+    assert_query_matches(NULL, 0);
+}
+
+/* A row whose caller or callee code is past the end of the dictionary is left out, rather than counted out of
+bounds. */
+Test(cdr_query, skips_bad_codes, .init = make_segment, .fini = remove_segment, .timeout = 10)
+{
+    struct cdrseg seg;
+    cr_assert_eq(cdrseg_open(&seg, path), 0);
+    uint64_t caller_offset = seg.footer -> caller_offset;
+    uint64_t callee_offset = seg.footer -> callee_offset;
+    cdrseg_close(&seg);
+
+    /* The rows of the segment are sorted by setup time, and so have to be the rows here to find them. */
+    qsort(rows, num_rows, sizeof(struct cdr_record), compare_setup);
+
+    size_t bad_rows[] = { 10, CDRSEG_BLOCK_ROWS + 5 };
+    uint16_t bad_code = 60000;
+
+    int fd = open(path, O_WRONLY);
+    cr_assert_geq(fd, 0);
+    cr_assert_eq(pwrite(fd, &bad_code, sizeof(bad_code), caller_offset + 2 * bad_rows[0]), sizeof(bad_code));
+    cr_assert_eq(pwrite(fd, &bad_code, sizeof(bad_code), callee_offset + 2 * bad_rows[1]), sizeof(bad_code));
+    close(fd);
+
+    for (int g = GROUP_CALLER; g <= GROUP_NONE; g++)
+    {
+        reset_query();
+        group = g;
+        assert_query_matches(bad_rows, 2);
+    }
+}
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <criterion/criterion.h>
+
+#include "cdr.h"
+#include "cdrseg.h"
+
+/*
+ * Tests of CDR segments: what is written into a segment (or compacted from a row file) has to come back out of
+ * it the same, row for row, once sorted by setup time.
+ */
+
+static char dir[] = "/tmp/cdrseg_testXXXXXX";
+static char path[256];
+
+static void make_dir(void)
+{
+    cr_assert_not_null(mkdtemp(dir), "Can't make a directory for the segments");
+    snprintf(path, sizeof(path), "%s/test.seg", dir);
+}
+
+static void remove_dir(void)
+{
+    char other[256];
+
+    unlink(path);
+    snprintf(other, sizeof(other), "%s/test.cdr", dir);
+    unlink(other);
+    rmdir(dir);
+}
+
+/* Random calls among a few extensions, set up in random order over a few days, with distinct setup times so that
+the order they are sorted into is the only one. Some are answered before they were set up, or end before they were
+answered or set up, which can only happen with clocks that jump, but has to come back the same anyway. */
+static struct cdr_record *random_rows(size_t num_rows, int num_exts)
+{
+    struct cdr_record *rows = calloc(num_rows, sizeof(struct cdr_record));
+    cr_assert_not_null(rows);
+
+    uint64_t base = 1700000000ULL * 1000000000ULL;
+    uint64_t spacing = 3ULL * 86400 * 1000000000ULL / num_rows;
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        /* A random permutation of evenly spaced times, give or take less than the spacing. */
+        size_t j = rand() % (i + 1);
+        rows[i] = rows[j];
+        rows[j].setup_ns = base + i * spacing + rand() % spacing;
+
+        rows[i].caller = 2 + rand() % num_exts;
+        rows[i].callee = 2 + rand() % num_exts;
+        rows[i].disposition = rand() % 4;
+    }
+
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        int64_t answer_delta = (rand() % 10 == 0) ? -(rand() % 1000) : rand() % 30000000000LL;
+        int64_t end_delta = (rand() % 10 == 0) ? -(rand() % 1000) : rand() % 3600000000000LL;
+
+        rows[i].answer_ns = (rows[i].disposition == CDR_ANSWERED) ? rows[i].setup_ns + answer_delta : 0;
+        rows[i].end_ns = rows[i].setup_ns + end_delta;
+    }
+
+    return rows;
+}
+
+static int compare_setup(const void *a, const void *b)
+{
+    const struct cdr_record *x = a, *y = b;
+
+    return (x -> setup_ns > y -> setup_ns) - (x -> setup_ns < y -> setup_ns);
+}
+
+/* Checks that a segment holds exactly the given rows (sorted by setup time). */
+static void assert_segment_holds(char *seg_path, struct cdr_record *rows, size_t num_rows)
+{
+    struct cdrseg seg;
+    cr_assert_eq(cdrseg_open(&seg, seg_path), 0, "Segment %s should have opened", seg_path);
+    cr_assert_eq(seg.footer -> rows, num_rows);
+
+    if (num_rows > 0)
+    {
+        cr_assert_eq(seg.footer -> min_setup_ns, rows[0].setup_ns);
+        cr_assert_eq(seg.footer -> max_setup_ns, rows[num_rows - 1].setup_ns);
+    }
+
+    uint64_t *setup = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    uint64_t *answer = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    uint64_t *end = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    cr_assert(setup != NULL && answer != NULL && end != NULL);
+
+    for (uint32_t b = 0; b < seg.footer -> num_blocks; b++)
+    {
+        int block_rows = cdrseg_decode_block(&seg, b, setup, answer, end);
+        size_t first = (size_t) b * CDRSEG_BLOCK_ROWS;
+
+        cr_assert_eq(block_rows, (num_rows - first < CDRSEG_BLOCK_ROWS) ? num_rows - first : CDRSEG_BLOCK_ROWS);
+        cr_assert_eq(seg.blocks[b].min_setup_ns, rows[first].setup_ns);
+        cr_assert_eq(seg.blocks[b].max_setup_ns, rows[first + block_rows - 1].setup_ns);
+
+        for (int i = 0; i < block_rows; i++)
+        {
+            struct cdr_record *row = &(rows[first + i]);
+
+            cr_assert_eq(setup[i], row -> setup_ns, "Row %zu: setup time is wrong", first + i);
+            cr_assert_eq(answer[i], row -> answer_ns, "Row %zu: answer time is wrong", first + i);
+            cr_assert_eq(end[i], row -> end_ns, "Row %zu: end time is wrong", first + i);
+            cr_assert_lt(seg.caller[first + i], seg.footer -> dict_size);
+            cr_assert_lt(seg.callee[first + i], seg.footer -> dict_size);
+            cr_assert_eq(seg.dict[seg.caller[first + i]], row -> caller, "Row %zu: caller is wrong", first + i);
+            cr_assert_eq(seg.dict[seg.callee[first + i]], row -> callee, "Row %zu: callee is wrong", first + i);
+            cr_assert_eq(seg.disposition[first + i], row -> disposition, "Row %zu: disposition is wrong", first + i);
+        }
+    }
+
+    /* The dictionary is sorted, with no duplicates, so it can be binary searched. */
+    for (uint32_t i = 1; i < seg.footer -> dict_size; i++)
+    {
+        cr_assert_lt(seg.dict[i - 1], seg.dict[i]);
+    }
+
+    free(setup);
+    free(answer);
+    free(end);
+    cdrseg_close(&seg);
+}
+
+Test(cdrseg, round_trip, .init = make_dir, .fini = remove_dir, .timeout = 30)
+{
+    /* A few blocks, the last one partly full. */
+    size_t num_rows = 2 * CDRSEG_BLOCK_ROWS + 1234;
+
+    srand(1);
+    struct cdr_record *rows = random_rows(num_rows, 50);
+    struct cdr_record *written = malloc(sizeof(struct cdr_record) * num_rows);
+    cr_assert_not_null(written);
+    memcpy(written, rows, sizeof(struct cdr_record) * num_rows);
+
+    cr_assert_eq(cdrseg_write(path, written, num_rows), 0);
+
+    qsort(rows, num_rows, sizeof(struct cdr_record), compare_setup);
+    assert_segment_holds(path, rows, num_rows);
+
+    free(written);
+    free(rows);
+}
+
+/* Times right at the edges of what the varints hold, and extensions past what fits in 16 bits. */
+Test(cdrseg, round_trip_extremes, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct cdr_record rows[] = {
+        { 0, 0, 0, -1, 0, CDR_ERROR, 0 },
+        { 1, UINT64_MAX, UINT64_MAX, 100000, -100000, CDR_ANSWERED, 0 },
+        { UINT64_MAX / 2, 1, 0, 2147483647, -2147483647, CDR_ANSWERED, 0 },
+        { UINT64_MAX, 0, 0, 5, 5, CDR_BUSY, 0 }
+    };
+    size_t num_rows = sizeof(rows) / sizeof(rows[0]);
+    struct cdr_record written[sizeof(rows) / sizeof(rows[0])];
+    memcpy(written, rows, sizeof(rows));
+
+    cr_assert_eq(cdrseg_write(path, written, num_rows), 0);
+    assert_segment_holds(path, rows, num_rows);
+}
+
+/* A row file is compacted into a segment next to it, and the record cut short at its end is dropped. */
+Test(cdrseg, compacts_row_file, .init = make_dir, .fini = remove_dir, .timeout = 30)
+{
+    size_t num_rows = CDRSEG_BLOCK_ROWS + 17;
+
+    srand(2);
+    struct cdr_record *rows = random_rows(num_rows, 300);
+
+    char cdr_path[256];
+    snprintf(cdr_path, sizeof(cdr_path), "%s/test.cdr", dir);
+    int fd = open(cdr_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cr_assert_geq(fd, 0);
+
+    struct cdr_file_header header = { CDR_MAGIC, CDR_VERSION, sizeof(struct cdr_record), 0 };
+    cr_assert_eq(write(fd, &header, sizeof(header)), sizeof(header));
+    cr_assert_eq(write(fd, rows, sizeof(struct cdr_record) * num_rows), sizeof(struct cdr_record) * num_rows);
+    cr_assert_eq(write(fd, rows, sizeof(struct cdr_record) / 2), sizeof(struct cdr_record) / 2);
+    close(fd);
+
+    cr_assert_eq(cdrseg_compact(cdr_path), 0);
+    cr_assert_neq(access(cdr_path, F_OK), 0, "The row file should have been removed");
+
+    qsort(rows, num_rows, sizeof(struct cdr_record), compare_setup);
+    assert_segment_holds(path, rows, num_rows);
+
+    free(rows);
+}
+
+/* A segment that was cut short, or isn't one, doesn't open. */
+Test(cdrseg, rejects_damaged_segments, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    size_t num_rows = 100;
+
+    srand(3);
+    struct cdr_record *rows = random_rows(num_rows, 10);
+    cr_assert_eq(cdrseg_write(path, rows, num_rows), 0);
+
+    struct stat st;
+    cr_assert_eq(stat(path, &st), 0);
+
+    struct cdrseg seg;
+    cr_assert_eq(truncate(path, st.st_size - 8), 0);
+    cr_assert_eq(cdrseg_open(&seg, path), -1, "A truncated segment should not open");
+
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    cr_assert_geq(fd, 0);
+    char junk[4096];
+    memset(junk, 0x5a, sizeof(junk));
+    cr_assert_eq(write(fd, junk, sizeof(junk)), sizeof(junk));
+    close(fd);
+    cr_assert_eq(cdrseg_open(&seg, path), -1, "Junk should not open as a segment");
+
+    free(rows);
+}
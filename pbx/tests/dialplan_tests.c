@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <criterion/criterion.h>
+
+#include "dialplan.h"
+
+/*
+ * Tests of the dial plan: the rule parser, the DFA compiler and rule precedence. Each test runs in its own
+ * process (as criterion does by default), so each one loads its own plan with dialplan_init.
+ */
+
+/* Writes a plan to a temporary file. REMEMBER TO FREE! */
+static char *write_plan(char *text)
+{
+    char *path = strdup("/tmp/dialplan_testXXXXXX");
+    cr_assert_not_null(path);
+
+    int fd = mkstemp(path);
+    cr_assert_geq(fd, 0, "Can't make a file for the dial plan");
+    cr_assert_eq(write(fd, text, strlen(text)), strlen(text));
+    close(fd);
+
+    return path;
+}
+
+/* Loads a plan as the first one, asserting that it is valid. */
+static void init_plan(char *text)
+{
+    char *path = write_plan(text);
+
+    cr_assert_eq(dialplan_init(path), 0, "Plan should have loaded:\n%s", text);
+    unlink(path);
+    free(path);
+}
+
+/* Loads a plan on top of the current one. Returns what dialplan_load does. */
+static int reload_plan(char *text)
+{
+    char *path = write_plan(text);
+    int ret = dialplan_load(path);
+
+    unlink(path);
+    free(path);
+    return ret;
+}
+
+static void assert_resolves(char *dialed, int ext)
+{
+    char buf[DIALPLAN_MAX_LINE];
+
+    /* dialplan_resolve takes a mutable string, like the server's command line. */
+    snprintf(buf, sizeof(buf), "%s", dialed);
+    int resolved = dialplan_resolve(buf);
+    cr_assert_eq(resolved, ext, "\"%s\" resolved to %d, not %d", dialed, resolved, ext);
+}
+
+Test(dialplan, no_plan)
+{
+    assert_resolves("123", 123);
+    assert_resolves("0", -1);
+    assert_resolves("abc", -1);
+}
+
+Test(dialplan, short_codes_and_aliases)
+{
+    init_plan("0 4\n"
+        "411 9\n"
+        "alice 17\n");
+
+    assert_resolves("0", 4);
+    assert_resolves("411", 9);
+    assert_resolves("4111", 4111);
+    assert_resolves("41", 41);
+    assert_resolves("alice", 17);
+    assert_resolves("ALICE", 17);
+    assert_resolves("Alice", 17);
+    assert_resolves("alic", -1);
+    assert_resolves("alicex", -1);
+}
+
+Test(dialplan, wildcards)
+{
+    init_plan("1XX 500\n"
+        "2NX 600\n"
+        "3ZX 700\n");
+
+    assert_resolves("100", 500);
+    assert_resolves("199", 500);
+    assert_resolves("12", 12);
+    assert_resolves("1234", 1234);
+    assert_resolves("220", 600);
+    assert_resolves("299", 600);
+    assert_resolves("210", 210);
+    assert_resolves("200", 200);
+    assert_resolves("310", 700);
+    assert_resolves("300", 300);
+}
+
+Test(dialplan, ranges)
+{
+    init_plan("[1-3]X 800\n"
+        "4[05-7] 950\n"
+        "[a-c]9 900\n");
+
+    assert_resolves("15", 800);
+    assert_resolves("39", 800);
+    assert_resolves("40", 950);
+    assert_resolves("45", 950);
+    assert_resolves("47", 950);
+    assert_resolves("41", 41);
+    assert_resolves("48", 48);
+    assert_resolves("b9", 900);
+    assert_resolves("B9", 900);
+    assert_resolves("d9", -1);
+}
+
+/* '.' matches one or more of anything. */
+Test(dialplan, prefixes)
+{
+    init_plan("9. 1000\n"
+        "*. 1001\n");
+
+    assert_resolves("9", 9);
+    assert_resolves("91", 1000);
+    assert_resolves("9123", 1000);
+    assert_resolves("9abc", 1000);
+    assert_resolves("*1", 1001);
+    assert_resolves("*", -1);
+}
+
+Test(dialplan, dialed_number_targets)
+{
+    init_plan("1XX =\n"
+        "2XX =+100\n"
+        "3XX =-250\n"
+        "4XX =-500\n");
+
+    assert_resolves("123", 123);
+    assert_resolves("201", 301);
+    assert_resolves("300", 50);
+    assert_resolves("450", -1);
+}
+
+Test(dialplan, exact_beats_prefix)
+{
+    init_plan("5. 1\n"
+        "555 2\n");
+
+    assert_resolves("555", 2);
+    assert_resolves("556", 1);
+    assert_resolves("5555", 1);
+}
+
+Test(dialplan, longer_prefix_beats_shorter)
+{
+    init_plan("6. 1\n"
+        "66. 2\n"
+        "7X. 3\n"
+        "7. 4\n");
+
+    assert_resolves("661", 2);
+    assert_resolves("61", 1);
+    assert_resolves("712", 3);
+    assert_resolves("71", 4);
+}
+
+Test(dialplan, first_rule_wins_ties)
+{
+    init_plan("8X 1\n"
+        "81 2\n"
+        "91 3\n"
+        "9X 4\n");
+
+    assert_resolves("81", 1);
+    assert_resolves("82", 1);
+    assert_resolves("91", 3);
+    assert_resolves("92", 4);
+}
+
+Test(dialplan, comments_and_blank_lines)
+{
+    init_plan("; Short codes\n"
+        "\n"
+        "12 5 ; the operator\n"
+        "\t13\t6\n");
+
+    assert_resolves("12", 5);
+    assert_resolves("13", 6);
+}
+
+Test(dialplan, rejects_bad_rules)
+{
+    char *bad_plans[] = {
+        "12\n",
+        "12 abc\n",
+        "12 0\n",
+        "12 5 6\n",
+        "1.2 5\n",
+        "[5-1] 3\n",
+        "[] 3\n",
+        "1$ 5\n",
+        "12 =+x\n"
+    };
+
+    for (size_t i = 0; i < sizeof(bad_plans) / sizeof(bad_plans[0]); i++)
+    {
+        char *path = write_plan(bad_plans[i]);
+        cr_assert_eq(dialplan_init(path), -1, "Plan should have been rejected:\n%s", bad_plans[i]);
+        unlink(path);
+        free(path);
+    }
+}
+
+Test(dialplan, bad_reload_keeps_plan)
+{
+    init_plan("12 5\n");
+
+    cr_assert_eq(reload_plan("12 abc\n"), -1);
+    assert_resolves("12", 5);
+
+    cr_assert_eq(reload_plan("12 6\n"), 0);
+    assert_resolves("12", 6);
+}
+
+/* Bytes past ASCII can't be dialed, so they don't match anything, not even '.'. */
+Test(dialplan, non_ascii)
+{
+    init_plan("alice 5\n"
+        "9. 1000\n");
+
+    assert_resolves("\xe9\xe9", -1);
+    assert_resolves("al\xffice", -1);
+    assert_resolves("9\x80", 9);
+}
+
+/*
+ * Random plans, checked against a matcher that tries every rule in turn. The patterns are built from the digits
+ * 0-3, X, ranges and '.', and the dialed strings from the digits 0-3, so that most of them match something,
+ * often more than one rule. Rule i goes to extension 5000 + i, which no dialed string can be on its own.
+ */
+
+#define RANDOM_PLANS 200
+#define RANDOM_RULES 12
+#define RANDOM_DIALS 200
+
+struct naive_rule {
+    int sets[8][10];
+    int len;
+    int prefix;
+};
+
+static void random_rule(char *pattern, struct naive_rule *rule)
+{
+    int len = 1 + rand() % 4;
+    char *p = pattern;
+
+    memset(rule, 0, sizeof(*rule));
+    rule -> prefix = rand() % 3 == 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        int kind = rand() % 4;
+
+        if (kind == 0)
+        {
+            *p++ = 'X';
+            for (int d = 0; d < 10; d++)
+            {
+                rule -> sets[i][d] = 1;
+            }
+        }
+        else if (kind == 1)
+        {
+            int lo = rand() % 4, hi = lo + rand() % (4 - lo);
+            p += sprintf(p, "[%d-%d]", lo, hi);
+            for (int d = lo; d <= hi; d++)
+            {
+                rule -> sets[i][d] = 1;
+            }
+        }
+        else
+        {
+            int d = rand() % 4;
+            *p++ = '0' + d;
+            rule -> sets[i][d] = 1;
+        }
+    }
+
+    if (rule -> prefix)
+    {
+        *p++ = '.';
+    }
+    *p = '\0';
+    rule -> len = len;
+}
+
+static int naive_matches(struct naive_rule *rule, char *dialed)
+{
+    int len = strlen(dialed);
+
+    if (rule -> prefix ? len <= rule -> len : len != rule -> len)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < rule -> len; i++)
+    {
+        if (!rule -> sets[i][dialed[i] - '0'])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* The rule that wins out of the ones that match (see dialplan.h), or -1 if none does. */
+static int naive_resolve(struct naive_rule *rules, int num_rules, char *dialed)
+{
+    int best = -1;
+
+    for (int i = 0; i < num_rules; i++)
+    {
+        if (!naive_matches(&(rules[i]), dialed))
+        {
+            continue;
+        }
+
+        if (best < 0 || (rules[best].prefix && !rules[i].prefix) ||
+            (rules[best].prefix && rules[i].prefix && rules[i].len > rules[best].len))
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+Test(dialplan, matches_naive_matcher, .timeout = 60)
+{
+    struct naive_rule rules[RANDOM_RULES];
+    char text[RANDOM_RULES * 64];
+    char pattern[64];
+
+    srand(1);
+    init_plan("0 1\n");
+
+    for (int plan = 0; plan < RANDOM_PLANS; plan++)
+    {
+        int num_rules = 1 + rand() % RANDOM_RULES;
+        char *t = text;
+
+        for (int i = 0; i < num_rules; i++)
+        {
+            random_rule(pattern, &(rules[i]));
+            t += sprintf(t, "%s %d\n", pattern, 5000 + i);
+        }
+
+        cr_assert_eq(reload_plan(text), 0, "Plan should have loaded:\n%s", text);
+
+        for (int i = 0; i < RANDOM_DIALS; i++)
+        {
+            char dialed[8];
+            int len = 1 + rand() % 6;
+
+            for (int j = 0; j < len; j++)
+            {
+                dialed[j] = '0' + rand() % 4;
+            }
+            dialed[len] = '\0';
+
+            int rule = naive_resolve(rules, num_rules, dialed);
+            int expected = (rule >= 0) ? 5000 + rule : (atoi(dialed) > 0) ? atoi(dialed) : -1;
+            int resolved = dialplan_resolve(dialed);
+
+            cr_assert_eq(resolved, expected, "\"%s\" resolved to %d, not %d, with the plan:\n%s", dialed, resolved,
+                expected, text);
+        }
+    }
+}
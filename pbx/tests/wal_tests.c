@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <criterion/criterion.h>
+
+#include "wal.h"
+
+/*
+ * Tests of WAL recovery. Each test runs in its own process (as criterion does by default), so wal_init can
+ * be called once per test. A server that dies is played by a child process that logs and then exits without
+ * shutting the WAL down; the test then recovers what it left behind. Torn and truncated logs are written
+ * by hand, record by record.
+ */
+
+static char dir[] = "/tmp/wal_testXXXXXX";
+static char *log_names[] = WAL_LOG_NAMES;
+
+static void make_dir(void)
+{
+    cr_assert_not_null(mkdtemp(dir), "Can't make a directory for the WAL");
+}
+
+static void remove_dir(void)
+{
+    char path[256];
+
+    for (int i = 0; i < 2; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, log_names[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_CHECKPOINT_NAME);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* Same checksum as the WAL's. */
+static uint32_t checksum(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct wal_record record(uint64_t seq, WAL_RECORD_TYPE type, int ext, TU_STATE state, int peer)
+{
+    struct wal_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = seq;
+    rec.type = type;
+    rec.state = state;
+    rec.ext = ext;
+    rec.peer = peer;
+    rec.checksum = checksum(&rec, offsetof(struct wal_record, checksum));
+    return rec;
+}
+
+/* Writes a log file with the given records, padded out to full size with zeros. */
+static void write_log(int index, uint64_t base_seq, struct wal_record *records, int count)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, log_names[index]);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cr_assert_geq(fd, 0);
+
+    char header[WAL_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    struct wal_header *h = (struct wal_header *) header;
+    h -> magic = WAL_MAGIC;
+    h -> version = WAL_VERSION;
+    h -> base_seq = base_seq;
+
+    cr_assert_eq(write(fd, header, sizeof(header)), sizeof(header));
+    if (count > 0)
+    {
+        cr_assert_eq(write(fd, records, sizeof(struct wal_record) * count), sizeof(struct wal_record) * count);
+    }
+    cr_assert_eq(ftruncate(fd, WAL_LOG_SIZE), 0);
+    close(fd);
+}
+
+static void write_checkpoint(uint64_t seq, struct wal_checkpoint_entry *entries, int count)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_CHECKPOINT_NAME);
+
+    struct wal_checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = WAL_CKPT_MAGIC;
+    header.version = WAL_VERSION;
+    header.seq = seq;
+    header.count = count;
+    header.checksum = checksum(entries, sizeof(struct wal_checkpoint_entry) * count);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cr_assert_geq(fd, 0);
+    cr_assert_eq(write(fd, &header, sizeof(header)), sizeof(header));
+    cr_assert_eq(write(fd, entries, sizeof(struct wal_checkpoint_entry) * count),
+        sizeof(struct wal_checkpoint_entry) * count);
+    close(fd);
+}
+
+/* Long enough for the flusher to have committed everything logged before it. */
+static void wait_for_commit(void)
+{
+    struct timespec ts = { 0, 20 * WAL_COMMIT_INTERVAL_MS * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static void assert_recovered(int ext, TU_STATE state, int peer)
+{
+    TU_STATE recovered_state;
+    int recovered_peer;
+
+    cr_assert(wal_is_reserved(ext), "Extension %d should have been recovered", ext);
+    cr_assert_eq(wal_claim(ext, &recovered_state, &recovered_peer), 0);
+    cr_assert_eq(recovered_state, state, "Extension %d recovered in state %d, not %d", ext, recovered_state, state);
+    cr_assert_eq(recovered_peer, peer, "Extension %d recovered with peer %d, not %d", ext, recovered_peer, peer);
+}
+
+static void assert_not_recovered(int ext)
+{
+    cr_assert_not(wal_is_reserved(ext), "Extension %d should not have been recovered", ext);
+}
+
+Test(wal, recovers_after_crash, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        wal_init(dir);
+        wal_log_register(5);
+        wal_log_register(6);
+        wal_log_register(7);
+        wal_log_state(5, TU_CONNECTED, 6);
+        wal_log_state(6, TU_CONNECTED, 5);
+        wal_log_unregister(7);
+        wait_for_commit();
+        _exit(0);
+    }
+
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_CONNECTED, 6);
+    assert_recovered(6, TU_CONNECTED, 5);
+    assert_not_recovered(7);
+}
+
+Test(wal, recovers_after_shutdown, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        wal_init(dir);
+        wal_log_register(5);
+        wal_log_state(5, TU_DIAL_TONE, -1);
+        wal_shutdown();
+        _exit(0);
+    }
+
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_DIAL_TONE, -1);
+}
+
+/* More records than both logs hold, so the flusher has to checkpoint and switch logs along the way. */
+Test(wal, recovers_across_checkpoints, .init = make_dir, .fini = remove_dir, .timeout = 30)
+{
+    int records = 3 * (WAL_LOG_SIZE / sizeof(struct wal_record));
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        wal_init(dir);
+        wal_log_register(5);
+        wal_log_register(6);
+        for (int i = 0; i < records; i++)
+        {
+            wal_log_state(5, (i % 2) ? TU_RING_BACK : TU_DIAL_TONE, -1);
+        }
+        wal_log_state(5, TU_CONNECTED, 6);
+        wal_log_state(6, TU_CONNECTED, 5);
+        wait_for_commit();
+        _exit(0);
+    }
+
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_CONNECTED, 6);
+    assert_recovered(6, TU_CONNECTED, 5);
+}
+
+/* A record whose checksum is wrong was torn by the crash: it and everything after it are ignored. */
+Test(wal, stops_at_torn_record, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_record records[] = {
+        record(1, WAL_REGISTER, 5, TU_ON_HOOK, -1),
+        record(2, WAL_REGISTER, 6, TU_ON_HOOK, -1),
+        record(3, WAL_STATE, 5, TU_RING_BACK, 6),
+        record(4, WAL_REGISTER, 7, TU_ON_HOOK, -1)
+    };
+
+    /* Tear the third record: what is in it no longer matches its checksum. */
+    records[2].peer = 7;
+
+    write_log(0, 1, records, 4);
+    write_log(1, 0, NULL, 0);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_ON_HOOK, -1);
+    assert_recovered(6, TU_ON_HOOK, -1);
+    assert_not_recovered(7);
+}
+
+/* The log ends where the records stop being numbered consecutively: at the zeros after the last record written,
+at a record only half written, or at records left over from the last time the file was used. */
+Test(wal, stops_at_end_of_log, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_record records[] = {
+        record(10, WAL_REGISTER, 5, TU_ON_HOOK, -1),
+        record(11, WAL_STATE, 5, TU_DIAL_TONE, -1),
+        record(3, WAL_REGISTER, 6, TU_ON_HOOK, -1),
+        record(4, WAL_REGISTER, 7, TU_ON_HOOK, -1)
+    };
+
+    write_log(0, 10, records, 4);
+    write_log(1, 0, NULL, 0);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_DIAL_TONE, -1);
+    assert_not_recovered(6);
+    assert_not_recovered(7);
+}
+
+Test(wal, stops_at_half_written_record, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_record records[] = {
+        record(1, WAL_REGISTER, 5, TU_ON_HOOK, -1),
+        record(2, WAL_REGISTER, 6, TU_ON_HOOK, -1)
+    };
+
+    /* Only the first half of the second record made it to the disk. */
+    memset((char *) &(records[1]) + sizeof(struct wal_record) / 2, 0, sizeof(struct wal_record) / 2);
+
+    write_log(0, 1, records, 2);
+    write_log(1, 0, NULL, 0);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_ON_HOOK, -1);
+    assert_not_recovered(6);
+}
+
+/* Records the checkpoint already covers are not applied again on top of it. */
+Test(wal, replays_only_past_checkpoint, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_checkpoint_entry entries[] = {
+        { 5, TU_CONNECTED, 6 },
+        { 6, TU_CONNECTED, 5 }
+    };
+    struct wal_record records[] = {
+        record(8, WAL_UNREGISTER, 5, TU_ON_HOOK, -1),
+        record(9, WAL_UNREGISTER, 6, TU_ON_HOOK, -1),
+        record(10, WAL_REGISTER, 8, TU_ON_HOOK, -1),
+        record(11, WAL_REGISTER, 7, TU_ON_HOOK, -1),
+        record(12, WAL_STATE, 7, TU_DIAL_TONE, -1)
+    };
+
+    write_checkpoint(10, entries, 2);
+    write_log(0, 8, records, 5);
+    write_log(1, 0, NULL, 0);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_recovered(5, TU_CONNECTED, 6);
+    assert_recovered(6, TU_CONNECTED, 5);
+    assert_recovered(7, TU_DIAL_TONE, -1);
+    assert_not_recovered(8);
+}
+
+/* The logs are replayed oldest first, whichever file that is. */
+Test(wal, replays_older_log_first, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_record older[] = {
+        record(1, WAL_REGISTER, 5, TU_ON_HOOK, -1),
+        record(2, WAL_REGISTER, 6, TU_ON_HOOK, -1)
+    };
+    struct wal_record newer[] = {
+        record(3, WAL_UNREGISTER, 5, TU_ON_HOOK, -1),
+        record(4, WAL_STATE, 6, TU_DIAL_TONE, -1)
+    };
+
+    write_log(1, 1, older, 2);
+    write_log(0, 3, newer, 2);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_not_recovered(5);
+    assert_recovered(6, TU_DIAL_TONE, -1);
+}
+
+/* A checkpoint that doesn't check out is ignored, and the logs are replayed on their own. */
+Test(wal, ignores_corrupt_checkpoint, .init = make_dir, .fini = remove_dir, .timeout = 10)
+{
+    struct wal_checkpoint_entry entries[] = {
+        { 5, TU_CONNECTED, 6 }
+    };
+    struct wal_record records[] = {
+        record(1, WAL_REGISTER, 6, TU_ON_HOOK, -1)
+    };
+
+    write_checkpoint(0, entries, 1);
+
+    /* Flip a bit of the entry, after its checksum was taken. */
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, WAL_CHECKPOINT_NAME);
+    int fd = open(path, O_WRONLY);
+    cr_assert_geq(fd, 0);
+    entries[0].state ^= 1;
+    cr_assert_eq(pwrite(fd, entries, sizeof(entries), sizeof(struct wal_checkpoint_header)), sizeof(entries));
+    close(fd);
+
+    write_log(0, 1, records, 1);
+    write_log(1, 0, NULL, 0);
+    cr_assert_eq(wal_init(dir), 0);
+
+    assert_not_recovered(5);
+    assert_recovered(6, TU_ON_HOOK, -1);
+}
@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pbx.h"
+#include "server_ext.h"
+#include "histogram.h"
+#include "lockprof.h"
+#include "csapp.h"
+
+/*
+ * pbx-bench: microbenchmarks of the PBX core, run in this process with no sockets (TU output goes to
+ * /dev/null), so what is measured is the PBX module and its locking, not the network.
+ *
+ * Usage: pbx-bench [-t <max_threads>] [-d <seconds>] [-b <bench>,...] [-l] [-c]
+ *
+ *     -t  Run each benchmark with 1, 2, 4, ... threads, up to and including this many (default: # of CPUs).
+ *     -d  How long each run lasts (default 1).
+ *     -b  Which benchmarks to run (default all of them).
+ *     -l  Profile the PBX locks (see lockprof.h), and write the profile of all the runs to stderr at the end.
+ *     -c  Count CPU events with perf_event_open while the operations run, and report them per operation.
+ *
+ * Benchmarks (one operation of each is timed):
+ *     register  pbx_register then pbx_unregister of one TU
+ *     call      a whole call between two TUs: pickup, dial, pickup, hangup, hangup
+ *     chat      tu_chat between two connected TUs
+ *     dispatch  the same call as "call", but each step is a command line handed to pbx_dispatch, so the
+ *               difference between the two is the cost of parsing
+ *
+ * Each thread has TUs of its own, so the threads only contend in the PBX itself. Every run prints one JSON
+ * object per line:
+ *
+ *     {"bench":"call","threads":4,"ops":1234567,"seconds":1.000,"ops_per_sec":1234567.0,
+ *      "mean_ns":3100,"p50_ns":2900,"p99_ns":8100,"p999_ns":23000,"max_ns":120000}
+ *
+ * With -c, each object also has the events per operation, summed over the threads:
+ *
+ *     "cycles_per_op":9100.2,"instructions_per_op":7020.5,"cache_misses_per_op":3.1,"branch_misses_per_op":12.4,
+ *     "context_switches_per_op":0.002
+ *
+ * (cache misses are the CPU's generic cache miss event, which is usually last level cache misses). The counters
+ * count in the kernel too, unless perf_event_paranoid only lets them count in user space. A counter that can't
+ * be opened at all, e.g. the hardware ones in a VM with no PMU, is reported as null.
+ */
+
+/* Events counted with -c. */
+static struct {
+    char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+#define NUM_COUNTERS ((int) (sizeof(counters) / sizeof(counters[0])))
+
+/* TU fds (= extensions) of thread t are FIRST_EXT + 2t and FIRST_EXT + 2t + 1. */
+#define FIRST_EXT 16
+#define MAX_THREADS ((PBX_MAX_EXTENSIONS - FIRST_EXT) / 2)
+
+struct bench_thread {
+    pthread_t thread_id;
+    int ext[2];
+    TU *tu[2];
+    uint64_t ops;
+    struct histogram latency;
+    int counter_fd[NUM_COUNTERS];
+    uint64_t counts[NUM_COUNTERS];
+};
+
+struct bench {
+    char *name;
+    void (*setup)(struct bench_thread *t);
+    void (*op)(struct bench_thread *t);
+    void (*teardown)(struct bench_thread *t);
+};
+
+static struct bench *current;
+static pthread_barrier_t start_barrier;
+static int stop;
+static int count_events;
+
+/* Whether each counter can be opened, once the first thread has tried: 1 if so, -1 if not. The first failure
+is reported. */
+static int counter_works[NUM_COUNTERS];
+static int kernel_excluded;
+
+static void check(int result, char *what)
+{
+    if (result < 0)
+    {
+        fprintf(stderr, "pbx-bench: %s failed\n", what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void register_both(struct bench_thread *t)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if ((t -> tu[i] = pbx_register(pbx, t -> ext[i])) == NULL)
+        {
+            check(-1, "pbx_register");
+        }
+    }
+}
+
+static void unregister_both(struct bench_thread *t)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        check(pbx_unregister(pbx, t -> tu[i]), "pbx_unregister");
+    }
+}
+
+static void register_op(struct bench_thread *t)
+{
+    TU *tu = pbx_register(pbx, t -> ext[0]);
+
+    if (tu == NULL)
+    {
+        check(-1, "pbx_register");
+    }
+    check(pbx_unregister(pbx, tu), "pbx_unregister");
+}
+
+static void call_op(struct bench_thread *t)
+{
+    check(tu_pickup(t -> tu[0]), "tu_pickup");
+    check(tu_dial(t -> tu[0], t -> ext[1]), "tu_dial");
+    check(tu_pickup(t -> tu[1]), "tu_pickup");
+    check(tu_hangup(t -> tu[0]), "tu_hangup");
+    check(tu_hangup(t -> tu[1]), "tu_hangup");
+}
+
+static void chat_setup(struct bench_thread *t)
+{
+    register_both(t);
+    check(tu_pickup(t -> tu[0]), "tu_pickup");
+    check(tu_dial(t -> tu[0], t -> ext[1]), "tu_dial");
+    check(tu_pickup(t -> tu[1]), "tu_pickup");
+}
+
+static void chat_op(struct bench_thread *t)
+{
+    check(tu_chat(t -> tu[0], "hello"), "tu_chat");
+}
+
+/* The dispatcher scribbles on the line, so each one is copied in first. */
+static void dispatch_line(TU *tu, char *line)
+{
+    char buf[64];
+
+    strcpy(buf, line);
+    check(pbx_dispatch(pbx, tu, buf), line);
+}
+
+static void dispatch_op(struct bench_thread *t)
+{
+    char dial[32];
+
+    snprintf(dial, sizeof(dial), "dial %d", t -> ext[1]);
+
+    dispatch_line(t -> tu[0], "pickup");
+    dispatch_line(t -> tu[0], dial);
+    dispatch_line(t -> tu[1], "pickup");
+    dispatch_line(t -> tu[0], "hangup");
+    dispatch_line(t -> tu[1], "hangup");
+}
+
+static struct bench benches[] = {
+    {"register", NULL, register_op, NULL},
+    {"call", register_both, call_op, unregister_both},
+    {"chat", chat_setup, chat_op, unregister_both},
+    {"dispatch", register_both, dispatch_op, unregister_both},
+};
+
+#define NUM_BENCHES ((int) (sizeof(benches) / sizeof(benches[0])))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Opens a counter of the calling thread, stopped. Returns the fd, or -1 if the counter can't be opened. */
+static int open_counter(int c)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[c].type;
+    attr.config = counters[c].config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_kernel = __atomic_load_n(&kernel_excluded, __ATOMIC_RELAXED);
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+    /* Counting in the kernel may not be allowed (perf_event_paranoid >= 2), but counting in user space is. */
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && !attr.exclude_kernel)
+    {
+        attr.exclude_kernel = 1;
+
+        if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC)) >= 0 &&
+            !__atomic_exchange_n(&kernel_excluded, 1, __ATOMIC_RELAXED))
+        {
+            fprintf(stderr, "pbx-bench: counting events in user space only\n");
+        }
+    }
+
+    if (fd < 0 && __atomic_exchange_n(&counter_works[c], -1, __ATOMIC_RELAXED) == 0)
+    {
+        fprintf(stderr, "pbx-bench: can't count %s: %s\n", counters[c].name, strerror(errno));
+    }
+    else if (fd >= 0)
+    {
+        __atomic_store_n(&counter_works[c], 1, __ATOMIC_RELAXED);
+    }
+
+    return fd;
+}
+
+/* Reads a stopped counter and closes it. If the counter had to share the PMU with others, the count is scaled up
+to the whole time it was enabled. */
+static uint64_t close_counter(int fd)
+{
+    uint64_t values[3];
+    uint64_t count = 0;
+
+    if (read(fd, values, sizeof(values)) == sizeof(values) && values[2] > 0)
+    {
+        count = (values[2] < values[1]) ? (uint64_t) ((double) values[0] * values[1] / values[2]) : values[0];
+    }
+
+    close(fd);
+    return count;
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+
+    if (current -> setup != NULL)
+    {
+        current -> setup(t);
+    }
+
+    /* The counters are opened before the barrier, and only count while the operations run. */
+    for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+        t -> counter_fd[c] = count_events ? open_counter(c) : -1;
+        t -> counts[c] = 0;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+
+    for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+        if (t -> counter_fd[c] >= 0)
+        {
+            ioctl(t -> counter_fd[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        uint64_t start = now_ns();
+        current -> op(t);
+        histogram_record(&(t -> latency), now_ns() - start);
+        t -> ops++;
+    }
+
+    for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+        if (t -> counter_fd[c] >= 0)
+        {
+            ioctl(t -> counter_fd[c], PERF_EVENT_IOC_DISABLE, 0);
+            t -> counts[c] = close_counter(t -> counter_fd[c]);
+        }
+    }
+
+    if (current -> teardown != NULL)
+    {
+        current -> teardown(t);
+    }
+
+    return NULL;
+}
+
+static void run(struct bench *bench, struct bench_thread *threads, int num_threads, double seconds)
+{
+    current = bench;
+    stop = 0;
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        threads[i].ops = 0;
+        histogram_init(&(threads[i].latency));
+        Pthread_create(&(threads[i].thread_id), NULL, bench_thread, &threads[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+
+    struct timespec duration;
+    duration.tv_sec = (time_t) seconds;
+    duration.tv_nsec = (long) ((seconds - duration.tv_sec) * 1e9);
+    nanosleep(&duration, NULL);
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    uint64_t elapsed = now_ns() - start;
+
+    struct histogram *total = malloc(sizeof(struct histogram));
+    if (total == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    histogram_init(total);
+
+    uint64_t counts[NUM_COUNTERS] = { 0 };
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        Pthread_join(threads[i].thread_id, NULL);
+        histogram_merge(total, &(threads[i].latency));
+
+        for (int c = 0; c < NUM_COUNTERS; c++)
+        {
+            counts[c] += threads[i].counts[c];
+        }
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+
+    /* Ops that finished just after the stop are counted, and so is the time they took. */
+    double secs = (elapsed > 0) ? elapsed / 1e9 : 1e-9;
+    uint64_t mean = (total -> count > 0) ? total -> sum / total -> count : 0;
+
+    printf("{\"bench\":\"%s\",\"threads\":%d,\"ops\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,"
+        "\"mean_ns\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu",
+        bench -> name, num_threads, total -> count, secs, total -> count / secs, mean,
+        histogram_percentile(total, 50.0), histogram_percentile(total, 99.0), histogram_percentile(total, 99.9),
+        total -> max);
+
+    for (int c = 0; count_events && c < NUM_COUNTERS; c++)
+    {
+        if (counter_works[c] > 0 && total -> count > 0)
+        {
+            printf(",\"%s_per_op\":%.3f", counters[c].name, (double) counts[c] / total -> count);
+        }
+        else
+        {
+            printf(",\"%s_per_op\":null", counters[c].name);
+        }
+    }
+
+    printf("}\n");
+    fflush(stdout);
+
+    free(total);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: pbx-bench [-t <max_threads>] [-d <seconds>] [-b <bench>,...] [-l] [-c]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = (num_cpus > 0) ? num_cpus : 1;
+    double seconds = 1.0;
+    char *selected = NULL;
+    int profile_locks = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:d:b:lc")) != -1)
+    {
+        switch (option)
+        {
+            case 't':
+                if ((max_threads = atoi(optarg)) < 1)
+                {
+                    usage();
+                }
+                break;
+            case 'd':
+                if ((seconds = atof(optarg)) <= 0)
+                {
+                    usage();
+                }
+                break;
+            case 'b':
+                selected = optarg;
+                break;
+            case 'l':
+                profile_locks = 1;
+                break;
+            case 'c':
+                count_events = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind != argc)
+    {
+        usage();
+    }
+
+    if (max_threads > MAX_THREADS)
+    {
+        max_threads = MAX_THREADS;
+    }
+
+    int run_bench[NUM_BENCHES];
+    for (int b = 0; b < NUM_BENCHES; b++)
+    {
+        run_bench[b] = (selected == NULL);
+    }
+
+    for (char *name = (selected != NULL) ? strtok(selected, ",") : NULL; name != NULL; name = strtok(NULL, ","))
+    {
+        int b;
+        for (b = 0; b < NUM_BENCHES && strcmp(benches[b].name, name) != 0; b++)
+        {
+            ;
+        }
+
+        if (b == NUM_BENCHES)
+        {
+            fprintf(stderr, "pbx-bench: no benchmark named %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+        run_bench[b] = 1;
+    }
+
+    pbx = pbx_init();
+    lockprof_enable(profile_locks);
+
+    /* Every TU fd is /dev/null, at the fd number that is its extension. */
+    int null_fd = open("/dev/null", O_WRONLY);
+    struct bench_thread *threads = calloc(max_threads, sizeof(struct bench_thread));
+
+    if (null_fd < 0 || threads == NULL)
+    {
+        perror("pbx-bench");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < max_threads; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            threads[i].ext[j] = FIRST_EXT + 2 * i + j;
+
+            if (dup2(null_fd, threads[i].ext[j]) < 0)
+            {
+                perror("pbx-bench: dup2");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (int b = 0; b < NUM_BENCHES; b++)
+    {
+        if (!run_bench[b])
+        {
+            continue;
+        }
+
+        for (int n = 1; ; n *= 2)
+        {
+            if (n > max_threads)
+            {
+                n = max_threads;
+            }
+
+            run(&benches[b], threads, n, seconds);
+
+            if (n == max_threads)
+            {
+                break;
+            }
+        }
+    }
+
+    if (profile_locks)
+    {
+        lockprof_write(stderr);
+    }
+
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,610 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cdr.h"
+#include "cdrseg.h"
+
+/*
+ * pbx-cdr: queries over CDR segments (see cdrseg.h).
+ *
+ * Usage: pbx-cdr [-s <since>] [-u <until>] [-e <ext>] [-d <disposition>] [-g <group>] [-j <threads>] <segment|dir>...
+ *
+ *     -s, -u  Only calls set up at or after <since>, and before <until>. A time is either seconds since the epoch,
+ *             or how long ago, as a number followed by s, m, h, d or w (e.g. "7d").
+ *     -e      Only calls to or from <ext>.
+ *     -d      Only calls that ended a certain way: answered, no-answer, busy or error.
+ *     -g      Group by caller, callee (the default), disposition, hour (of the day) or none.
+ *     -j      # of threads (default: one per CPU).
+ *
+ * A directory stands for every segment in it. For each group, prints the # of calls, the # of each disposition
+ * and the busy rate, as tab-separated columns with a header line. How long the query took goes to stderr.
+ *
+ * Segments are mmapped and split among the threads. Within a segment, blocks that are entirely outside the
+ * time range are skipped using the footer index, and the times are only decoded for blocks that straddle the
+ * range (or when grouping by hour). The rest is branch-free loops over the fixed-width columns, counting into
+ * a table indexed by dictionary code, which is only translated back into extensions once per segment.
+ */
+
+#define GROUP_CALLER 0
+#define GROUP_CALLEE 1
+#define GROUP_DISPOSITION 2
+#define GROUP_HOUR 3
+#define GROUP_NONE 4
+
+#define NUM_DISPOSITIONS 4
+
+static char *disposition_names[NUM_DISPOSITIONS] = { "answered", "no-answer", "busy", "error" };
+static char *group_names[] = { "caller", "callee", "disposition", "hour", "none" };
+
+/* The query. */
+static uint64_t since_ns = 0;
+static uint64_t until_ns = UINT64_MAX;
+static int have_ext = 0;
+static int32_t filter_ext;
+static int filter_disposition = -1;
+static int group = GROUP_CALLEE;
+static long tz_offset;
+
+static char **segments;
+static int num_segments;
+static int next_segment;
+
+/* Counts of one group, by disposition. */
+struct group_counts {
+    int64_t key;
+    uint64_t counts[NUM_DISPOSITIONS];
+    int used;
+};
+
+/* Results of one thread: a hash table from group key to counts. */
+struct results {
+    struct group_counts *table;
+    size_t cap;
+    size_t count;
+    uint64_t rows_scanned;
+    int bad_segments;
+};
+
+static struct group_counts *results_get(struct results *r, int64_t key)
+{
+    if (2 * (r -> count + 1) > r -> cap)
+    {
+        struct group_counts *old = r -> table;
+        size_t old_cap = r -> cap;
+
+        r -> cap = (old_cap == 0) ? 64 : old_cap * 2;
+        if ((r -> table = calloc(r -> cap, sizeof(struct group_counts))) == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+        r -> count = 0;
+
+        for (size_t i = 0; i < old_cap; i++)
+        {
+            if (old[i].used)
+            {
+                struct group_counts *g = results_get(r, old[i].key);
+                memcpy(g -> counts, old[i].counts, sizeof(g -> counts));
+            }
+        }
+        free(old);
+    }
+
+    size_t i = ((uint64_t) key * 0x9e3779b97f4a7c15ULL) & (r -> cap - 1);
+    while (r -> table[i].used && r -> table[i].key != key)
+    {
+        i = (i + 1) & (r -> cap - 1);
+    }
+
+    if (!r -> table[i].used)
+    {
+        r -> table[i].used = 1;
+        r -> table[i].key = key;
+        r -> count++;
+    }
+
+    return &(r -> table[i]);
+}
+
+/* Looks up an extension's code in a segment's (sorted) dictionary. Returns -1 if it isn't there. */
+static int dict_code(struct cdrseg *seg, int32_t ext)
+{
+    int lo = 0, hi = seg -> footer -> dict_size - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (seg -> dict[mid] == ext)
+        {
+            return mid;
+        }
+        if (seg -> dict[mid] < ext)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+static void scan_segment(struct cdrseg *seg, struct results *r)
+{
+    struct cdrseg_footer *footer = seg -> footer;
+
+    if (footer -> rows == 0 || footer -> max_setup_ns < since_ns || footer -> min_setup_ns >= until_ns)
+    {
+        return;
+    }
+
+    /* An extension that isn't in the dictionary has no calls here. */
+    int ext_code = -1;
+    if (have_ext && (ext_code = dict_code(seg, filter_ext)) < 0)
+    {
+        return;
+    }
+
+    /* Count by local key: dictionary code, disposition or hour. */
+    size_t num_keys = (group == GROUP_CALLER || group == GROUP_CALLEE) ? footer -> dict_size : (group == GROUP_HOUR) ? 24 : NUM_DISPOSITIONS;
+    uint64_t *counts = calloc(num_keys * NUM_DISPOSITIONS, sizeof(uint64_t));
+    uint64_t *setup = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    uint64_t *answer = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    uint64_t *end = malloc(sizeof(uint64_t) * CDRSEG_BLOCK_ROWS);
+    uint8_t *keep = malloc(CDRSEG_BLOCK_ROWS);
+
+    if (counts == NULL || setup == NULL || answer == NULL || end == NULL || keep == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t b = 0; b < footer -> num_blocks; b++)
+    {
+        struct cdrseg_block *block = &(seg -> blocks[b]);
+
+        if (block -> max_setup_ns < since_ns || block -> min_setup_ns >= until_ns)
+        {
+            continue;
+        }
+
+        size_t first = (size_t) b * CDRSEG_BLOCK_ROWS;
+        int rows = (first + CDRSEG_BLOCK_ROWS <= footer -> rows) ? CDRSEG_BLOCK_ROWS : footer -> rows - first;
+        int straddles = block -> min_setup_ns < since_ns || block -> max_setup_ns >= until_ns;
+
+        if ((straddles || group == GROUP_HOUR) && cdrseg_decode_block(seg, b, setup, answer, end) != rows)
+        {
+            r -> bad_segments++;
+            break;
+        }
+
+        uint16_t *caller = seg -> caller + first;
+        uint16_t *callee = seg -> callee + first;
+        uint8_t *disposition = seg -> disposition + first;
+
+        /* Build the filter mask column by column. */
+        memset(keep, 1, rows);
+
+        if (straddles)
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                keep[i] &= (setup[i] >= since_ns) & (setup[i] < until_ns);
+            }
+        }
+
+        if (have_ext)
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                keep[i] &= (caller[i] == ext_code) | (callee[i] == ext_code);
+            }
+        }
+
+        /* Codes out of range can only come from a damaged segment. Drop those rows rather than count them
+        past the end of counts. */
+        uint32_t dict_size = footer -> dict_size;
+        for (int i = 0; i < rows; i++)
+        {
+            keep[i] &= (disposition[i] < NUM_DISPOSITIONS) & (caller[i] < dict_size) & (callee[i] < dict_size);
+        }
+
+        if (filter_disposition >= 0)
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                keep[i] &= (disposition[i] == filter_disposition);
+            }
+        }
+
+        /* Count. Rows that were filtered out add 0 to slot 0 instead of branching around it. */
+        for (int i = 0; i < rows; i++)
+        {
+            size_t key;
+
+            switch (group)
+            {
+                case GROUP_CALLER:
+                    key = caller[i];
+                    break;
+                case GROUP_CALLEE:
+                    key = callee[i];
+                    break;
+                case GROUP_HOUR:
+                    key = (((int64_t) (setup[i] / 1000000000ULL) + tz_offset) / 3600 % 24 + 24) % 24;
+                    break;
+                default:
+                    key = 0;
+                    break;
+            }
+
+            size_t slot = (key * NUM_DISPOSITIONS + disposition[i]) * keep[i];
+            counts[slot] += keep[i];
+        }
+
+        r -> rows_scanned += rows;
+    }
+
+    /* Fold the local counts into the thread's results. */
+    for (size_t k = 0; k < num_keys; k++)
+    {
+        uint64_t *c = counts + k * NUM_DISPOSITIONS;
+
+        if (c[0] + c[1] + c[2] + c[3] == 0)
+        {
+            continue;
+        }
+
+        int64_t key;
+        if (group == GROUP_CALLER || group == GROUP_CALLEE)
+        {
+            key = seg -> dict[k];
+        }
+        else
+        {
+            key = k;
+        }
+
+        if (group == GROUP_DISPOSITION || group == GROUP_NONE)
+        {
+            /* Each disposition is its own group (or there's only one group). */
+            for (int d = 0; d < NUM_DISPOSITIONS; d++)
+            {
+                if (c[d] > 0)
+                {
+                    results_get(r, (group == GROUP_NONE) ? 0 : d) -> counts[d] += c[d];
+                }
+            }
+            continue;
+        }
+
+        struct group_counts *g = results_get(r, key);
+        for (int d = 0; d < NUM_DISPOSITIONS; d++)
+        {
+            g -> counts[d] += c[d];
+        }
+    }
+
+    free(counts);
+    free(setup);
+    free(answer);
+    free(end);
+    free(keep);
+}
+
+/* Thread function: takes segments until there are none left. */
+static void *worker(void *arg)
+{
+    struct results *r = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&next_segment, 1, __ATOMIC_RELAXED)) < num_segments)
+    {
+        struct cdrseg seg;
+
+        if (cdrseg_open(&seg, segments[i]) < 0)
+        {
+            fprintf(stderr, "pbx-cdr: %s is not a CDR segment\n", segments[i]);
+            r -> bad_segments++;
+            continue;
+        }
+
+        scan_segment(&seg, r);
+        cdrseg_close(&seg);
+    }
+
+    return NULL;
+}
+
+static void add_segment(char *path)
+{
+    segments = realloc(segments, sizeof(char *) * (num_segments + 1));
+
+    if (segments == NULL || (segments[num_segments] = strdup(path)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    num_segments++;
+}
+
+/* Adds a segment, or every segment in a directory. */
+static void add_path(char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *d = opendir(path);
+        struct dirent *entry;
+
+        while (d != NULL && (entry = readdir(d)) != NULL)
+        {
+            size_t len = strlen(entry -> d_name);
+
+            if (len > 4 && strcmp(entry -> d_name + len - 4, ".seg") == 0)
+            {
+                char full[4096];
+                snprintf(full, sizeof(full), "%s/%s", path, entry -> d_name);
+                add_segment(full);
+            }
+        }
+
+        if (d != NULL)
+        {
+            closedir(d);
+        }
+        return;
+    }
+
+    add_segment(path);
+}
+
+/* Parses a time: seconds since the epoch, or a number followed by a unit meaning that long ago. */
+static int parse_time(char *arg, uint64_t *ns)
+{
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+
+    if (end == arg || n < 0)
+    {
+        return -1;
+    }
+
+    long long unit = 0;
+    switch (*end)
+    {
+        case '\0':
+            *ns = (uint64_t) n * 1000000000ULL;
+            return 0;
+        case 's':
+            unit = 1;
+            break;
+        case 'm':
+            unit = 60;
+            break;
+        case 'h':
+            unit = 3600;
+            break;
+        case 'd':
+            unit = 86400;
+            break;
+        case 'w':
+            unit = 7 * 86400;
+            break;
+        default:
+            return -1;
+    }
+
+    if (end[1] != '\0')
+    {
+        return -1;
+    }
+
+    *ns = (uint64_t) (time(NULL) - n * unit) * 1000000000ULL;
+    return 0;
+}
+
+static int compare_groups(const void *a, const void *b)
+{
+    const struct group_counts *x = a;
+    const struct group_counts *y = b;
+
+    return (x -> key > y -> key) - (x -> key < y -> key);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: pbx-cdr [-s <since>] [-u <until>] [-e <ext>] [-d answered|no-answer|busy|error] "
+        "[-g caller|callee|disposition|hour|none] [-j <threads>] <segment|dir>...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int option;
+
+    while ((option = getopt(argc, argv, "s:u:e:d:g:j:")) != -1)
+    {
+        switch (option)
+        {
+            case 's':
+                if (parse_time(optarg, &since_ns) < 0)
+                {
+                    usage();
+                }
+                break;
+            case 'u':
+                if (parse_time(optarg, &until_ns) < 0)
+                {
+                    usage();
+                }
+                break;
+            case 'e':
+                have_ext = 1;
+                filter_ext = atoi(optarg);
+                break;
+            case 'd':
+                for (filter_disposition = 0; filter_disposition < NUM_DISPOSITIONS; filter_disposition++)
+                {
+                    if (strcmp(optarg, disposition_names[filter_disposition]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (filter_disposition == NUM_DISPOSITIONS)
+                {
+                    usage();
+                }
+                break;
+            case 'g':
+                for (group = 0; group <= GROUP_NONE; group++)
+                {
+                    if (strcmp(optarg, group_names[group]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (group > GROUP_NONE)
+                {
+                    usage();
+                }
+                break;
+            case 'j':
+                if ((num_threads = atoi(optarg)) < 1)
+                {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage();
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        add_path(argv[i]);
+    }
+
+    /* Hour of the day is local time, using the offset from UTC as it is now. */
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    tz_offset = local.tm_gmtoff;
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (num_threads > num_segments)
+    {
+        num_threads = (num_segments > 0) ? num_segments : 1;
+    }
+
+    struct results *results = calloc(num_threads, sizeof(struct results));
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+
+    if (results == NULL || threads == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, worker, &results[t]) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Merge everything into the first thread's results. */
+    struct results *total = &results[0];
+    pthread_join(threads[0], NULL);
+
+    for (int t = 1; t < num_threads; t++)
+    {
+        pthread_join(threads[t], NULL);
+
+        for (size_t i = 0; i < results[t].cap; i++)
+        {
+            if (results[t].table[i].used)
+            {
+                struct group_counts *g = results_get(total, results[t].table[i].key);
+
+                for (int d = 0; d < NUM_DISPOSITIONS; d++)
+                {
+                    g -> counts[d] += results[t].table[i].counts[d];
+                }
+            }
+        }
+
+        total -> rows_scanned += results[t].rows_scanned;
+        total -> bad_segments += results[t].bad_segments;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    /* Print the groups in order. */
+    struct group_counts *groups = malloc(sizeof(struct group_counts) * (total -> count + 1));
+    size_t num_groups = 0;
+
+    if (groups == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < total -> cap; i++)
+    {
+        if (total -> table[i].used)
+        {
+            groups[num_groups++] = total -> table[i];
+        }
+    }
+
+    qsort(groups, num_groups, sizeof(struct group_counts), compare_groups);
+
+    printf("%s\tcalls\tanswered\tno_answer\tbusy\terror\tbusy_rate\n", group_names[group]);
+
+    for (size_t i = 0; i < num_groups; i++)
+    {
+        uint64_t *c = groups[i].counts;
+        uint64_t calls = c[CDR_ANSWERED] + c[CDR_NO_ANSWER] + c[CDR_BUSY] + c[CDR_ERROR];
+
+        if (group == GROUP_DISPOSITION)
+        {
+            printf("%s", disposition_names[groups[i].key]);
+        }
+        else if (group == GROUP_NONE)
+        {
+            printf("all");
+        }
+        else
+        {
+            printf("%lld", (long long) groups[i].key);
+        }
+
+        printf("\t%llu\t%llu\t%llu\t%llu\t%llu\t%.4f\n", (unsigned long long) calls,
+            (unsigned long long) c[CDR_ANSWERED], (unsigned long long) c[CDR_NO_ANSWER],
+            (unsigned long long) c[CDR_BUSY], (unsigned long long) c[CDR_ERROR],
+            (calls > 0) ? (double) c[CDR_BUSY] / calls : 0.0);
+    }
+
+    double secs = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d segments, %llu rows scanned in %.3f s (%d threads)\n", num_segments,
+        (unsigned long long) total -> rows_scanned, secs, num_threads);
+
+    return (total -> bad_segments > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
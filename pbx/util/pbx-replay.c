@@ -0,0 +1,554 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "pbx.h"
+#include "server_ext.h"
+#include "journal.h"
+#include "dialplan.h"
+#include "hunt.h"
+#include "csapp.h"
+
+/*
+ * pbx-replay: replays a command journal (see journal.h), or a synthetic trace, straight into the PBX module
+ * in this process. There are no sockets: each TU's output goes to /dev/null, or to a pipe that a drainer
+ * thread reads and throws away (so the cost of the writes is more like a real connection's).
+ *
+ * Usage: pbx-replay [-t <threads>] [-p] [-o null|pipe] [-d <dial_plan>] [-g <hunt_groups>] <journal>
+ *        pbx-replay [...] -s <clients>:<commands>[:<seed>]
+ *
+ *     -t  # of threads. With 1 (the default) the records are replayed one at a time in timestamp order, which
+ *         is deterministic. With more, each connection is replayed by one of the threads (like the server's one
+ *         thread per client), each in timestamp order, so the PBX sees concurrent commands.
+ *     -p  Replay at the recorded pace instead of as fast as possible.
+ *     -o  Where TU output goes (default null).
+ *     -s  Replay a synthetic trace of <clients> TUs issuing <commands> random commands instead of a journal.
+ *
+ * Each TU is registered with an fd equal to the extension it had when the journal was recorded, so it gets
+ * the same extension again and dial commands reach the same TUs. The replayer's own fds are kept above the
+ * extension range. When it is done, it prints one line of key=value results.
+ */
+
+/* Replayer's own fds start here, out of the way of the TU fds (= extensions). */
+#define FD_BASE (PBX_MAX_EXTENSIONS + 1024)
+
+#define MAX_EXT (PBX_MAX_EXTENSIONS + 4)
+
+/* Output sinks. */
+#define SINK_NULL 0
+#define SINK_PIPE 1
+
+static int sink_mode = SINK_NULL;
+static int null_fd;
+static int epoll_fd;
+
+static int pace = 0;
+static struct timespec replay_start;
+
+static struct journal trace;
+
+/* TU of each connection, by connection id. */
+static TU **conn_tus;
+static int *conn_exts;
+static uint32_t max_conn;
+
+/* An extension only gets its next connection once the last one has gone away, even if they are replayed by
+different threads. */
+static sem_t ext_free[MAX_EXT];
+
+static uint64_t commands_replayed;
+static uint64_t bytes_drained;
+static int open_pipes;
+
+/* Records one thread replays. */
+struct replay_thread {
+    pthread_t thread_id;
+    struct journal_record **records;
+    size_t num_records;
+};
+
+/* Moves an fd up out of the extension range. */
+static int high_fd(int fd)
+{
+    int moved = fcntl(fd, F_DUPFD, FD_BASE);
+
+    if (moved < 0)
+    {
+        perror("pbx-replay: fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd);
+    return moved;
+}
+
+/* Puts an output sink at the given fd (the TU's extension). */
+static void open_sink(int ext)
+{
+    if (sink_mode == SINK_NULL)
+    {
+        dup2(null_fd, ext);
+        return;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        perror("pbx-replay: pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    int read_fd = high_fd(fds[0]);
+    __atomic_add_fetch(&open_pipes, 1, __ATOMIC_RELAXED);
+    dup2(fds[1], ext);
+    close(fds[1]);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = read_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, read_fd, &event);
+}
+
+/* Thread function of the pipe drainer. A pipe whose write end is closed is closed too. */
+static void *drainer(void *arg)
+{
+    struct epoll_event events[64];
+    char buf[65536];
+
+    while (1)
+    {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+
+        for (int i = 0; i < n; i++)
+        {
+            ssize_t got = read(events[i].data.fd, buf, sizeof(buf));
+
+            if (got > 0)
+            {
+                __atomic_add_fetch(&bytes_drained, got, __ATOMIC_RELAXED);
+            }
+            else if (got == 0 || (errno != EINTR && errno != EAGAIN))
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+                close(events[i].data.fd);
+                __atomic_sub_fetch(&open_pipes, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Waits until it is time for a record, when replaying at the recorded pace. */
+static void wait_for(struct journal_record *rec)
+{
+    struct timespec due = replay_start;
+    due.tv_sec += rec -> time_ns / 1000000000ULL;
+    due.tv_nsec += rec -> time_ns % 1000000000ULL;
+    if (due.tv_nsec >= 1000000000L)
+    {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+    {
+        ;
+    }
+}
+
+static void replay_record(struct journal_record *rec, char *line)
+{
+    if (rec -> conn == 0 || rec -> conn > max_conn)
+    {
+        return;
+    }
+
+    if (pace)
+    {
+        wait_for(rec);
+    }
+
+    switch (rec -> type)
+    {
+        case JOURNAL_CONNECT:
+        {
+            int32_t ext;
+
+            if (rec -> len != sizeof(ext))
+            {
+                return;
+            }
+
+            memcpy(&ext, journal_payload(rec), sizeof(ext));
+
+            if (ext <= 2 || ext >= MAX_EXT || conn_tus[rec -> conn] != NULL)
+            {
+                return;
+            }
+
+            P(&ext_free[ext]);
+            open_sink(ext);
+
+            if ((conn_tus[rec -> conn] = pbx_register(pbx, ext)) == NULL)
+            {
+                close(ext);
+                V(&ext_free[ext]);
+                return;
+            }
+            conn_exts[rec -> conn] = ext;
+            break;
+        }
+        case JOURNAL_COMMAND:
+            if (conn_tus[rec -> conn] == NULL)
+            {
+                return;
+            }
+
+            /* The dispatcher wants a null-terminated line it can scribble on. */
+            memcpy(line, journal_payload(rec), rec -> len);
+            line[rec -> len] = '\0';
+
+            /* An error can leave the PBX locked, which is why the server exits on one. So do we. */
+            if (pbx_dispatch(pbx, conn_tus[rec -> conn], line) < 0)
+            {
+                fprintf(stderr, "pbx-replay: command \"%.*s\" of connection %u failed\n", (int) rec -> len,
+                    journal_payload(rec), rec -> conn);
+                exit(EXIT_FAILURE);
+            }
+            __atomic_add_fetch(&commands_replayed, 1, __ATOMIC_RELAXED);
+            break;
+        case JOURNAL_DISCONNECT:
+            if (conn_tus[rec -> conn] == NULL)
+            {
+                return;
+            }
+
+            pbx_unregister(pbx, conn_tus[rec -> conn]);
+            conn_tus[rec -> conn] = NULL;
+            close(conn_exts[rec -> conn]);
+            V(&ext_free[conn_exts[rec -> conn]]);
+            break;
+    }
+}
+
+static void *replay_thread(void *arg)
+{
+    struct replay_thread *t = arg;
+    char *line = malloc(JOURNAL_MAX_COMMAND + 1);
+
+    if (line == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < t -> num_records; i++)
+    {
+        replay_record(t -> records[i], line);
+    }
+
+    free(line);
+    return NULL;
+}
+
+/* Adds a record to a synthetic trace being built. */
+static void synth_record(char **data, size_t *len, size_t *cap, uint64_t time_ns, uint32_t conn, int type,
+    void *payload, size_t payload_len)
+{
+    size_t size = sizeof(struct journal_record) + ((payload_len + 7) & ~((size_t) 7));
+
+    while (*len + size > *cap)
+    {
+        *cap = (*cap == 0) ? 65536 : *cap * 2;
+        if ((*data = realloc(*data, *cap)) == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct journal_record rec = { time_ns, conn, payload_len, type, 0 };
+    memcpy(*data + *len, &rec, sizeof(rec));
+    memset(*data + *len + sizeof(rec), 0, size - sizeof(rec));
+    memcpy(*data + *len + sizeof(rec), payload, payload_len);
+    *len += size;
+}
+
+/* Builds a synthetic trace: clients connect, issue random commands 10us apart, then go away.
+The commands are a mix of the ones a phone would send, with dials to the other clients. */
+static void synth_trace(int clients, long commands, unsigned int seed)
+{
+    char *data = NULL;
+    size_t len = 0, cap = 0;
+    uint64_t t = 0;
+
+    if (clients < 1 || clients > PBX_MAX_EXTENSIONS - 4)
+    {
+        fprintf(stderr, "pbx-replay: bad # of clients\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srandom(seed);
+
+    for (int c = 1; c <= clients; c++)
+    {
+        int32_t ext = 3 + c;
+        synth_record(&data, &len, &cap, t, c, JOURNAL_CONNECT, &ext, sizeof(ext));
+    }
+
+    for (long i = 0; i < commands; i++)
+    {
+        char cmd[64];
+        int c = 1 + random() % clients;
+        int r = random() % 100;
+
+        if (r < 30)
+        {
+            strcpy(cmd, "pickup");
+        }
+        else if (r < 60)
+        {
+            strcpy(cmd, "hangup");
+        }
+        else if (r < 90)
+        {
+            snprintf(cmd, sizeof(cmd), "dial %d", 4 + (int) (random() % clients));
+        }
+        else
+        {
+            strcpy(cmd, "chat hello there");
+        }
+
+        t += 10000;
+        synth_record(&data, &len, &cap, t, c, JOURNAL_COMMAND, cmd, strlen(cmd));
+    }
+
+    for (int c = 1; c <= clients; c++)
+    {
+        synth_record(&data, &len, &cap, t + 10000, c, JOURNAL_DISCONNECT, NULL, 0);
+    }
+
+    /* Index it the same way a journal read from a file is. */
+    trace.data = data;
+    if ((trace.records = malloc(sizeof(struct journal_record *) * (clients * 2 + commands + 1))) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    size_t offset = 0;
+    trace.num_records = 0;
+    while (offset < len)
+    {
+        struct journal_record *rec = (struct journal_record *) (data + offset);
+        trace.records[trace.num_records++] = rec;
+        offset += sizeof(struct journal_record) + ((rec -> len + 7) & ~((size_t) 7));
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: pbx-replay [-t <threads>] [-p] [-o null|pipe] [-d <dial_plan>] [-g <hunt_groups>] "
+        "<journal> | -s <clients>:<commands>[:<seed>]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_threads = 1;
+    char *synthetic = NULL;
+    char *dial_plan = NULL;
+    char *hunt_groups = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:po:s:d:g:")) != -1)
+    {
+        switch (option)
+        {
+            case 't':
+                if ((num_threads = atoi(optarg)) < 1)
+                {
+                    usage();
+                }
+                break;
+            case 'p':
+                pace = 1;
+                break;
+            case 'o':
+                if (strcmp(optarg, "null") == 0)
+                {
+                    sink_mode = SINK_NULL;
+                }
+                else if (strcmp(optarg, "pipe") == 0)
+                {
+                    sink_mode = SINK_PIPE;
+                }
+                else
+                {
+                    usage();
+                }
+                break;
+            case 's':
+                synthetic = optarg;
+                break;
+            case 'd':
+                dial_plan = optarg;
+                break;
+            case 'g':
+                hunt_groups = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if ((synthetic == NULL) == (optind == argc) || optind < argc - 1)
+    {
+        usage();
+    }
+
+    /* Room for the TU fds below FD_BASE and our own above it. */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < FD_BASE + 1024)
+    {
+        limit.rlim_cur = (limit.rlim_max < FD_BASE + 1024) ? limit.rlim_max : FD_BASE + 1024;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < FD_BASE + 16)
+    {
+        fprintf(stderr, "pbx-replay: need at least %d fds\n", FD_BASE + 16);
+        exit(EXIT_FAILURE);
+    }
+
+    if (synthetic != NULL)
+    {
+        int clients = 0;
+        long commands = 0;
+        unsigned int seed = 1;
+
+        if (sscanf(synthetic, "%d:%ld:%u", &clients, &commands, &seed) < 2)
+        {
+            usage();
+        }
+        synth_trace(clients, commands, seed);
+    }
+    else if (journal_read(argv[optind], &trace) < 0)
+    {
+        fprintf(stderr, "pbx-replay: can't read journal %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (hunt_groups != NULL && hunt_init(hunt_groups) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    pbx = pbx_init();
+
+    if (dial_plan != NULL && dialplan_init(dial_plan) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    null_fd = high_fd(open("/dev/null", O_WRONLY));
+    if (sink_mode == SINK_PIPE)
+    {
+        epoll_fd = high_fd(epoll_create1(0));
+
+        pthread_t drainer_id;
+        Pthread_create(&drainer_id, NULL, drainer, NULL);
+        Pthread_detach(drainer_id);
+    }
+
+    for (int i = 0; i < MAX_EXT; i++)
+    {
+        Sem_init(&ext_free[i], 0, 1);
+    }
+
+    /* Hand each connection's records to one thread, keeping them in timestamp order. */
+    max_conn = 0;
+    for (size_t i = 0; i < trace.num_records; i++)
+    {
+        if (trace.records[i] -> conn > max_conn)
+        {
+            max_conn = trace.records[i] -> conn;
+        }
+    }
+
+    conn_tus = calloc(max_conn + 1, sizeof(TU *));
+    conn_exts = calloc(max_conn + 1, sizeof(int));
+    struct replay_thread *threads = calloc(num_threads, sizeof(struct replay_thread));
+
+    if (conn_tus == NULL || conn_exts == NULL || threads == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        if ((threads[t].records = malloc(sizeof(struct journal_record *) * (trace.num_records + 1))) == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < trace.num_records; i++)
+    {
+        struct replay_thread *t = &threads[trace.records[i] -> conn % num_threads];
+        t -> records[t -> num_records++] = trace.records[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        Pthread_create(&threads[t].thread_id, NULL, replay_thread, &threads[t]);
+    }
+    for (int t = 0; t < num_threads; t++)
+    {
+        Pthread_join(threads[t].thread_id, NULL);
+    }
+
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    /* Connections the journal never saw go away (e.g. the server was killed) are unregistered now. */
+    for (uint32_t c = 1; c <= max_conn; c++)
+    {
+        if (conn_tus[c] != NULL)
+        {
+            pbx_unregister(pbx, conn_tus[c]);
+            close(conn_exts[c]);
+        }
+    }
+
+    /* Let the drainer get to the end of every pipe, so the byte count is complete. */
+    while (__atomic_load_n(&open_pipes, __ATOMIC_ACQUIRE) > 0)
+    {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    double secs = (finish.tv_sec - replay_start.tv_sec) + (finish.tv_nsec - replay_start.tv_nsec) / 1e9;
+
+    printf("records=%zu commands=%lu threads=%d seconds=%.6f commands_per_sec=%.0f",
+        trace.num_records, (unsigned long) commands_replayed, num_threads,
+        secs, (secs > 0) ? commands_replayed / secs : 0.0);
+    if (sink_mode == SINK_PIPE)
+    {
+        printf(" bytes_out=%lu", (unsigned long) __atomic_load_n(&bytes_drained, __ATOMIC_RELAXED));
+    }
+    printf("\n");
+
+    pbx_shutdown(pbx);
+    journal_free(&trace);
+
+    return EXIT_SUCCESS;
+}
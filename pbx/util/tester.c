@@ -4,12 +4,25 @@
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <math.h>
+#include <stdarg.h>
+#include <sched.h>
 
 #include "pbx.h"
 #include "server.h"
+#include "histogram.h"
 #include "debug.h"
 
 /* Default values. */
@@ -166,11 +179,25 @@ int port = PORT;
 int cmds = 0;
 int min_ext = EXTENSION_MIN, max_ext = EXTENSION_MAX;
 int basic_delay = BASIC_DELAY;
+int ext_range_given = 0;
+int num_tus = 0;
+int num_threads = 1;
+int duration = 0;
+double rate = 0;
+int poisson = 1;
+char *scenario_file = NULL;
+int oracle_grace = 0;
 
 /* Prototypes for functions that appear below. */
 static void test(FILE *in, FILE *out, int cmds);
+static void load_test(struct in_addr *addr, int port, int tus, int threads, int cmds, int seconds);
+static void usage(void);
+static int load_scenario(char *path);
 static int choose_action(void);
+static int choose_from(double *probs, double r);
+static int check_transition(TU_STATE new, int expected);
 static TU_STATE parse_message(char *msg);
+static int parse_state(char *msg);
 static int connect_to_server(struct in_addr *addr, int port);
 static char *unparse_state_set(int set);
 static void trim_eol(char *msg);
@@ -186,6 +213,13 @@ static char *timestamp(void);
  *   -x <min_extension>           (default 4)
  *   -y <max_extension>           (default 5)
  *   -d <microseconds>            (basic delay time: default 100000)
+ *   -n <tus>                     (load mode: simulate this many TUs at once -- see load_test())
+ *   -j <threads>                 (load mode: # of threads to spread the TUs over: default 1)
+ *   -s <seconds>                 (load mode: stop after this long: default 0 -- means no limit)
+ *   -r <calls_per_second>        (load mode: open loop at this rate -- see load_test())
+ *   -a poisson|fixed             (open loop: how calls arrive: default poisson)
+ *   -f <scenario_file>           (load mode: mixed populations of TUs -- see load_scenario() and util/scenarios/)
+ *   -o <grace_ms>                (load mode: cross-check TUs against each other -- see oracle_thread())
  */
 int main(int argc, char *argv[]) {
     char *hostname = "localhost";
@@ -194,7 +228,7 @@ int main(int argc, char *argv[]) {
     int sfd;
     FILE *in, *out;
     int option;
-    while((option = getopt(argc, argv, "h:p:l:x:y:d:")) != EOF) {
+    while((option = getopt(argc, argv, "h:p:l:x:y:d:n:j:s:r:a:f:o:")) != EOF) {
 	switch(option) {
 	case 'h':
 	    hostname = optarg++;
@@ -207,13 +241,42 @@ int main(int argc, char *argv[]) {
 	    break;
 	case 'x':
 	    min_ext = atoi(optarg++);
+	    ext_range_given = 1;
 	    break;
 	case 'y':
 	    max_ext = atoi(optarg++);
+	    ext_range_given = 1;
 	    break;
 	case 'd':
 	    basic_delay = atoi(optarg++);
 	    break;
+	case 'n':
+	    num_tus = atoi(optarg++);
+	    break;
+	case 'j':
+	    num_threads = atoi(optarg++);
+	    break;
+	case 's':
+	    duration = atoi(optarg++);
+	    break;
+	case 'r':
+	    rate = atof(optarg++);
+	    break;
+	case 'a':
+	    if(!strcmp(optarg, "poisson"))
+		poisson = 1;
+	    else if(!strcmp(optarg, "fixed"))
+		poisson = 0;
+	    else
+		usage();
+	    break;
+	case 'f':
+	    scenario_file = optarg++;
+	    break;
+	case 'o':
+	    if((oracle_grace = atoi(optarg++)) < 1)
+		usage();
+	    break;
 	}
     }
 
@@ -223,6 +286,17 @@ int main(int argc, char *argv[]) {
 	exit(EXIT_FAILURE);
     }
     memcpy(&sa, he->h_addr, sizeof(sa));
+    if(scenario_file != NULL) {
+	if(rate > 0)
+	    usage();
+	num_tus = load_scenario(scenario_file);
+    }
+    if(rate > 0 && num_tus < 2)
+	usage();
+    if(num_tus > 0) {
+	load_test(&sa, port, num_tus, num_threads < 1 ? 1 : num_threads, cmds, duration);
+	exit(EXIT_SUCCESS);
+    }
     if((sfd = connect_to_server(&sa, port)) == -1) {
 	perror("proto_connect");
 	exit(EXIT_FAILURE);
@@ -241,6 +315,12 @@ int main(int argc, char *argv[]) {
     test(in, out, cmds);
 }
 
+static void usage(void) {
+    fprintf(stderr, "usage: tester [-h host] [-p port] [-l cmds] [-x min_ext] [-y max_ext] [-d usec]"
+	    " [-n tus | -f scenario] [-j threads] [-s seconds] [-r calls_per_sec [-a poisson|fixed]] [-o grace_ms]\n");
+    exit(EXIT_FAILURE);
+}
+
 /* There isn't really a maximum message length, but this is just a test driver... */
 #define MAX_MESSAGE_LEN 256
 
@@ -287,10 +367,11 @@ void test(FILE *in, FILE *out, int cmds) {
 	}
 
 	// Check state transition to see if it is as expected.
-	if(1<<new & expected_states) {
+	int check = check_transition(new, expected_states);
+	if(check == 0) {
 	    // OK
 	    resync = 0;
-	} else if(1<<(new+RESYNC) & expected_states) {
+	} else if(check == 1) {
 	    // OK, but set resync because messages crossed in transit.
 	    fprintf(stderr, "%s: Resync: state %s, expecting %s\n",
 		    timestamp(), tu_state_names[new], unparse_state_set(expected_states));
@@ -362,9 +443,17 @@ void test(FILE *in, FILE *out, int cmds) {
  */
 static int choose_action(void) {
     double r = (double)(random()) / RAND_MAX;
+    return choose_from(action_probs[current_state], r);
+}
+
+/*
+ * Choose an action from one row of an action table, given a random number
+ * between 0 and 1.
+ */
+static int choose_from(double *probs, double r) {
     double p = 0.0;
     for(int i = 0; i < NUM_COMMANDS; i++) {
-	p += action_probs[current_state][i];
+	p += probs[i];
 	if(r <= p)
 	    return i;
     }
@@ -372,18 +461,42 @@ static int choose_action(void) {
     return NUM_COMMANDS-1;
 }
 
+/*
+ * Check a state transition against an expected state bitmap.
+ * Returns 0 if the new state is a "normal case" state, 1 if it is an
+ * "abnormal case" state (so we must resync), and -1 if it was not expected at all.
+ */
+static int check_transition(TU_STATE new, int expected) {
+    if(1<<new & expected)
+	return 0;
+    if(1<<(new+RESYNC) & expected)
+	return 1;
+    return -1;
+}
+
 /*
  * Parse a message from the PBX, determining the new state.
  */
 static TU_STATE parse_message(char *msg) {
+    int new = parse_state(msg);
+    if(new >= 0)
+	return new;
+    fprintf(stderr, "%s: Unrecognized message: %s\n", timestamp(), msg);
+    abort();
+}
+
+/*
+ * Parse a message from the PBX without giving up on a bad one.
+ * Returns the new state, NUM_STATES for a chat, or -1 if the message is not recognized.
+ */
+static int parse_state(char *msg) {
     for(int i = 0; i < NUM_STATES; i++) {
 	if(strstr(msg, tu_state_names[i]) == msg)
 	    return i;
     }
     if(strstr(msg, "CHAT") == msg)
 	return NUM_STATES;
-    fprintf(stderr, "%s: Unrecognized message: %s\n", timestamp(), msg);
-    abort();
+    return -1;
 }
 
 /*
@@ -449,3 +562,1306 @@ static char *timestamp() {
     sprintf(buf, "%ld.%06ld", tv.tv_sec, tv.tv_usec);
     return buf;
 }
+
+/*
+ * Load mode.
+ *
+ * Instead of a single TU driven with blocking reads and sleeps, load mode simulates
+ * many TUs at once, each with a connection of its own, driven by a few threads on epoll.
+ * Each simulated TU walks the same action table, and checks the same expected state
+ * bitmaps (resyncs included), as the single-TU tester does.  A delay doesn't block
+ * anything: the TU just sets a timer.  Whatever arrives from the server for it in the
+ * meantime is buffered, and only looked at after its next command has been sent, which
+ * is what the single-TU tester does too.
+ *
+ * The response latency of each command (from sending it until the "normal case" state
+ * notification that answers it) is recorded in a histogram per command.  A dial from
+ * TU_DIAL_TONE counts as a call attempt, and the call counts as completed when the
+ * caller goes from TU_RING_BACK to TU_CONNECTED.
+ *
+ * Unless -x or -y is given, the simulated TUs dial each other.  With -f, the TUs are
+ * split into populations that each have their own action table, think times, dial
+ * targets and ramp schedule, as described by a scenario file (see load_scenario()).  A TU that sees something
+ * unexpected is reported and disconnected, and the test carries on without it (but
+ * exits with failure status at the end).  The test ends after -l commands in total,
+ * after -s seconds, or on SIGINT, and then prints a report to stdout.
+ *
+ * All of the above is closed loop: a TU only sends a command once the last one was
+ * answered, so when the server slows down, the tester slows down with it and the
+ * latencies it records look better than what a user would see.  With -r, load mode
+ * runs open loop instead.  Calls arrive at the given rate, as a Poisson process or at
+ * fixed intervals, whether or not the server is keeping up.  Each call takes two idle
+ * TUs and goes through a script:
+ *
+ *     caller: pickup, dial the callee, wait for CONNECTED, hold (-d), hangup
+ *     callee: on RINGING pickup, on DIAL TONE hangup
+ *
+ * (with a hangup straight away on TU_BUSY_SIGNAL or TU_ERROR).  Every message is still
+ * checked against next_states; a TU waiting for something to happen expects the
+ * states of the DELAY column.  Latency is measured from when each command was meant
+ * to be sent, not from when it was: the caller's pickup from the call's arrival time,
+ * a hangup after a hold from the end of the hold, anything else from the response it
+ * follows.  If no two TUs are idle when a call arrives, the call waits in a backlog and
+ * its latency includes the wait.  So falling behind (the server's fault, or the
+ * tester's) shows up in the percentiles instead of being omitted from them.  Call
+ * setup latency (arrival until the caller is CONNECTED) is reported as well.
+ */
+
+#define LOAD_INBUF 1024
+#define LOAD_MAX_REPORTED 10
+#define LOAD_MAX_BACKLOG 65536
+
+#define SCENARIO_MAX_POPULATIONS 32
+#define SCENARIO_MAX_TARGETS 16
+#define SCENARIO_MAX_RAMP 64
+#define SCENARIO_MAX_LINE 1024
+
+/* Something a population dials: the members of a population, or a range of extensions. */
+struct dial_target {
+    char name[32];
+    int pop;              // Index of the population, or -1 for the range lo..hi.
+    int lo, hi;
+    double weight;
+};
+
+/* A point on a ramp schedule: at this many seconds in, this fraction of the population is active. */
+struct ramp_point {
+    double at;
+    double active;
+};
+
+struct population {
+    char name[32];
+    int count;
+    int first;            // Index of its first TU in load_tus.
+    double probs[NUM_STATES][NUM_COMMANDS];
+    int think_min;        // Think (delay) time range, in microseconds.
+    int think_max;
+    int ntargets;
+    struct dial_target targets[SCENARIO_MAX_TARGETS];
+    double total_weight;
+    int nramp;
+    struct ramp_point ramp[SCENARIO_MAX_RAMP];
+};
+
+/* Per-population counts. */
+struct pop_stats {
+    uint64_t commands;
+    uint64_t dials;
+    uint64_t answered;
+};
+
+#define ORACLE_RING 65536
+#define ORACLE_DRAIN_MS 500
+#define ORACLE_MAX_EXT (PBX_MAX_EXTENSIONS + 4)
+
+/* Kinds of events the load threads pass to the oracle. */
+#define ORACLE_RING_BACK 0   // a went to RING BACK after dialing b.
+#define ORACLE_RINGING 1     // a went to RINGING.
+#define ORACLE_CONNECTED 2   // a went to CONNECTED to b.
+
+struct oracle_event {
+    uint64_t t_ns;
+    int kind;
+    int a;
+    int b;
+};
+
+/* Events from one load thread to the oracle thread.  Single producer, single consumer. */
+struct oracle_ring {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    struct oracle_event events[ORACLE_RING];
+};
+
+/*
+ * Something that has to happen the same # of times on two sides: RING BACKs to a TU vs.
+ * the times it rang, or one TU of a pair being CONNECTED to the other vs. the other way
+ * around.  balance is side one's count minus side two's, and since_ns (roughly) when the
+ * oldest unmatched one happened.  Matches with a nonzero balance are on the pending list.
+ */
+struct oracle_match {
+    uint64_t key;
+    int balance;
+    int reported;
+    uint64_t since_ns;
+    uint64_t last_ns;
+    int prev;
+    int next;
+};
+
+/* Roles of TUs in open-loop calls. */
+#define ROLE_NONE 0
+#define ROLE_CALLER 1
+#define ROLE_CALLEE 2
+
+struct sim_tu {
+    int fd;
+    int ext;
+    TU_STATE state;
+    int expected;
+    int resync;
+    TU_COMMAND last_command;
+    int delaying;         // Waiting for wake_ns before choosing again.
+    int awaiting;         // A command has been sent and not answered yet.
+    int calling;          // A dial got TU_RING_BACK and we are waiting for an answer.
+    int closed;
+    uint64_t sent_ns;
+    uint64_t wake_ns;
+    int role;             // Open loop: the TU's part in a call, and the other TU's extension.
+    int peer_ext;
+    int idle;             // Open loop: waiting in the thread's idle pool.
+    int scheduled;        // Open loop: the timer is for sending scheduled_cmd.
+    int resting;          // Scenario: inactive, and the timer is for looking at the ramp schedule again.
+    TU_COMMAND scheduled_cmd;
+    uint64_t arrival_ns;
+    struct population *pop;   // Scenario: the TU's population (or NULL), and its index in it.
+    int pop_index;
+    int last_dialed;          // The extension in the last dial command sent.
+    int dialed_ext;           // Oracle: the extension of the call we are in, and who we are CONNECTED to.
+    int connected_ext;
+    int inlen;
+    char in[LOAD_INBUF];
+};
+
+struct load_stats {
+    uint64_t commands;
+    uint64_t dials;
+    uint64_t ring_backs;
+    uint64_t busy;
+    uint64_t errors;
+    uint64_t answered;
+    uint64_t chats;
+    uint64_t resyncs;
+    uint64_t failures;
+    uint64_t unanswered;
+    uint64_t arrivals;
+    uint64_t dropped;
+    int max_backlog;
+    uint64_t oracle_stalls;
+    struct histogram latency[DELAY_COMMAND];
+    struct histogram setup;
+    struct pop_stats pops[SCENARIO_MAX_POPULATIONS];
+};
+
+struct load_thread {
+    pthread_t tid;
+    int epfd;
+    struct sim_tu **tus;
+    int ntus;
+    struct sim_tu **timers;    // Binary heap of delaying TUs, by wake_ns.
+    int ntimers;
+    unsigned short rand[3];
+    struct sim_tu **idle;      // Open loop: TUs that can take part in the next call.
+    int nidle;
+    uint64_t *backlog;         // Open loop: arrival times of calls waiting for TUs.
+    int backlog_head;
+    int backlog_len;
+    uint64_t next_arrival_ns;
+    double thread_rate;
+    struct oracle_ring *oracle;
+    struct load_stats stats;
+};
+
+static struct sim_tu *load_tus;
+static int load_ntus;
+static long load_cmds_left;
+static uint64_t load_deadline;
+static int load_stop;
+static int load_reported;
+static uint64_t load_start_ns;
+static struct population populations[SCENARIO_MAX_POPULATIONS];
+static int num_populations;
+
+static struct load_thread *load_threads;
+static int load_nthreads;
+static int oracle_done;
+static uint64_t oracle_events;
+static uint64_t oracle_matched;
+static uint64_t oracle_violations;
+static int oracle_max_pending;
+static char oracle_simulated[ORACLE_MAX_EXT];   // Which extensions are simulated TUs.
+static struct oracle_match *oracle_matches;     // Every match ever seen, found thru the hash table.
+static int oracle_nmatches;
+static int oracle_cap;
+static int *oracle_table;                       // Open addressing: 1 + index into oracle_matches, or 0.
+static int oracle_table_size;
+static int oracle_pending = -1;                 // Head of the pending list.
+static int oracle_npending;
+static pthread_mutex_t load_print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void load_sigint(int sig) {
+    __atomic_store_n(&load_stop, 1, __ATOMIC_RELAXED);
+}
+
+static void scenario_error(char *path, int line, char *what) {
+    fprintf(stderr, "%s:%d: %s\n", path, line, what);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Read a scenario file.
+ *
+ * A scenario describes the simulated TUs as populations.  Each one starts with a
+ * population line, and the lines after it (up to the next population line) describe it:
+ *
+ *     population <name> <count>
+ *     think <min_usec> [<max_usec>]
+ *     dial <target>[:<weight>] ...
+ *     probs <state> <pickup> <hangup> <dial> <chat> <delay>
+ *     ramp <seconds> <percent_active>
+ *
+ * think   How long a delay lasts: a uniformly random time between min and max
+ *         (default: -d, always).
+ * dial    Who the population dials.  A target is the name of a population (a random
+ *         member of it), an extension, or a range of extensions <lo>-<hi>.  Targets are
+ *         picked in proportion to their weights (default 1).  Without a dial line,
+ *         a population dials everybody (or the -x/-y range).
+ * probs   The row of the action table for one state, instead of the one in action_probs.
+ *         States are on_hook, ringing, dial_tone, ring_back, busy_signal, connected and
+ *         error, and the probabilities must add up to 1.
+ * ramp    Points of a schedule of how much of the population is active, with the
+ *         percentage in between two points interpolated.  Before the first point the
+ *         first one holds, and after the last the last one.  An inactive TU (the members
+ *         of a population are activated in order) only delays, and doesn't answer if it
+ *         rings.  Without ramp lines the whole population is always active.
+ *
+ * Lines starting with ';' are comments.  Ready-to-run scenarios are in util/scenarios/: office.scenario
+ * (call-center agents, rarely-calling executives and chatty bots) and morning-peak.scenario (agents logging
+ * in and customer calls ramping up to a peak).  For example, a small office with a morning peak:
+ *
+ *     population agents 200
+ *     think 20000 100000
+ *     dial agents:1 execs:1 4-1000:2
+ *     probs on_hook 0.3 0.01 0.01 0.01 0.67
+ *     ramp 0 10
+ *     ramp 30 100
+ *     ramp 90 40
+ *
+ *     population execs 20
+ *     think 500000 2000000
+ *     dial agents
+ *     probs ringing 0.9 0.01 0.01 0.01 0.07
+ *
+ * The TUs are assigned to populations in order, as they connect.
+ *
+ * @param path  The scenario file.
+ * @return the total # of TUs.
+ */
+static int load_scenario(char *path) {
+    static char *state_keys[NUM_STATES] = {
+	[TU_ON_HOOK] "on_hook", [TU_RINGING] "ringing", [TU_DIAL_TONE] "dial_tone",
+	[TU_RING_BACK] "ring_back", [TU_BUSY_SIGNAL] "busy_signal", [TU_CONNECTED] "connected",
+	[TU_ERROR] "error"
+    };
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+	perror(path);
+	exit(EXIT_FAILURE);
+    }
+
+    char line[SCENARIO_MAX_LINE];
+    int lineno = 0;
+    int total = 0;
+    struct population *pop = NULL;
+    while(fgets(line, sizeof(line), f) != NULL) {
+	lineno++;
+	char *word = strtok(line, " \t\r\n");
+	if(word == NULL || word[0] == ';')
+	    continue;
+	if(!strcmp(word, "population")) {
+	    char *name = strtok(NULL, " \t\r\n");
+	    char *count = strtok(NULL, " \t\r\n");
+	    if(name == NULL || count == NULL || atoi(count) < 1 || strlen(name) >= sizeof(pop->name))
+		scenario_error(path, lineno, "expected population <name> <count>");
+	    if(num_populations == SCENARIO_MAX_POPULATIONS)
+		scenario_error(path, lineno, "too many populations");
+	    pop = &populations[num_populations++];
+	    strcpy(pop->name, name);
+	    pop->count = atoi(count);
+	    pop->first = total;
+	    total += pop->count;
+	    memcpy(pop->probs, action_probs, sizeof(action_probs));
+	    pop->think_min = pop->think_max = basic_delay;
+	    continue;
+	}
+	if(pop == NULL)
+	    scenario_error(path, lineno, "expected a population line first");
+
+	if(!strcmp(word, "think")) {
+	    char *min = strtok(NULL, " \t\r\n");
+	    char *max = strtok(NULL, " \t\r\n");
+	    if(min == NULL)
+		scenario_error(path, lineno, "expected think <min_usec> [<max_usec>]");
+	    pop->think_min = atoi(min);
+	    pop->think_max = max != NULL ? atoi(max) : pop->think_min;
+	    if(pop->think_min < 0 || pop->think_max < pop->think_min)
+		scenario_error(path, lineno, "bad think time range");
+	} else if(!strcmp(word, "dial")) {
+	    char *target;
+	    while((target = strtok(NULL, " \t\r\n")) != NULL) {
+		if(pop->ntargets == SCENARIO_MAX_TARGETS)
+		    scenario_error(path, lineno, "too many dial targets");
+		struct dial_target *dt = &pop->targets[pop->ntargets++];
+		char *weight = strchr(target, ':');
+		dt->weight = 1;
+		if(weight != NULL) {
+		    *weight++ = '\0';
+		    if((dt->weight = atof(weight)) <= 0)
+			scenario_error(path, lineno, "bad dial target weight");
+		}
+		dt->pop = -1;
+		if(sscanf(target, "%d-%d", &dt->lo, &dt->hi) == 2) {
+		    ;
+		} else if(sscanf(target, "%d", &dt->lo) == 1) {
+		    dt->hi = dt->lo;
+		} else if(strlen(target) < sizeof(dt->name)) {
+		    // Populations can be named before they are described: resolved below.
+		    strcpy(dt->name, target);
+		    dt->pop = SCENARIO_MAX_POPULATIONS;
+		} else {
+		    scenario_error(path, lineno, "bad dial target");
+		}
+		if(dt->pop < 0 && dt->hi < dt->lo)
+		    scenario_error(path, lineno, "bad extension range");
+		pop->total_weight += dt->weight;
+	    }
+	} else if(!strcmp(word, "probs")) {
+	    char *state = strtok(NULL, " \t\r\n");
+	    int s;
+	    for(s = 0; s < NUM_STATES && (state == NULL || strcmp(state, state_keys[s])); s++)
+		;
+	    if(s == NUM_STATES)
+		scenario_error(path, lineno, "expected probs <state> followed by one probability per command");
+	    double sum = 0;
+	    for(int c = 0; c < NUM_COMMANDS; c++) {
+		char *prob = strtok(NULL, " \t\r\n");
+		if(prob == NULL || (pop->probs[s][c] = atof(prob)) < 0)
+		    scenario_error(path, lineno, "expected a probability for each command");
+		sum += pop->probs[s][c];
+	    }
+	    if(sum < 0.999 || sum > 1.001)
+		scenario_error(path, lineno, "probabilities don't add up to 1");
+	} else if(!strcmp(word, "ramp")) {
+	    char *at = strtok(NULL, " \t\r\n");
+	    char *active = strtok(NULL, " \t\r\n");
+	    if(at == NULL || active == NULL)
+		scenario_error(path, lineno, "expected ramp <seconds> <percent_active>");
+	    if(pop->nramp == SCENARIO_MAX_RAMP)
+		scenario_error(path, lineno, "too many ramp points");
+	    struct ramp_point *rp = &pop->ramp[pop->nramp];
+	    rp->at = atof(at);
+	    rp->active = atof(active) / 100;
+	    if(rp->active < 0 || rp->active > 1 || (pop->nramp > 0 && rp->at <= pop->ramp[pop->nramp-1].at))
+		scenario_error(path, lineno, "ramp points must be in order, with percentages from 0 to 100");
+	    pop->nramp++;
+	} else {
+	    scenario_error(path, lineno, "unknown keyword");
+	}
+    }
+    fclose(f);
+    if(total == 0)
+	scenario_error(path, lineno, "no populations");
+
+    for(int p = 0; p < num_populations; p++) {
+	for(int i = 0; i < populations[p].ntargets; i++) {
+	    struct dial_target *dt = &populations[p].targets[i];
+	    if(dt->pop < 0)
+		continue;
+	    for(dt->pop = 0; dt->pop < num_populations && strcmp(populations[dt->pop].name, dt->name); dt->pop++)
+		;
+	    if(dt->pop == num_populations) {
+		fprintf(stderr, "%s: population %s dials unknown population %s\n", path, populations[p].name, dt->name);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+    return total;
+}
+
+/*
+ * Check whether a TU of a scenario population is active at the moment, according to its ramp schedule.
+ */
+static int pop_active(struct sim_tu *tu) {
+    struct population *pop = tu->pop;
+    if(pop == NULL || pop->nramp == 0)
+	return 1;
+
+    double at = (now_ns() - load_start_ns) / 1e9;
+    double active;
+    int i;
+    for(i = 0; i < pop->nramp && pop->ramp[i].at <= at; i++)
+	;
+    if(i == 0)
+	active = pop->ramp[0].active;
+    else if(i == pop->nramp)
+	active = pop->ramp[i-1].active;
+    else
+	active = pop->ramp[i-1].active + (pop->ramp[i].active - pop->ramp[i-1].active)
+	    * (at - pop->ramp[i-1].at) / (pop->ramp[i].at - pop->ramp[i-1].at);
+    return tu->pop_index < (int)(active * pop->count + 0.5);
+}
+
+/*
+ * Report something the oracle found wrong.  Only the first few are printed.
+ */
+static void oracle_violation(char *fmt, ...) {
+    va_list args;
+    if(__atomic_fetch_add(&oracle_violations, 1, __ATOMIC_RELAXED) >= LOAD_MAX_REPORTED)
+	return;
+    pthread_mutex_lock(&load_print_mutex);
+    fprintf(stderr, "%s: Oracle: ", timestamp());
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    pthread_mutex_unlock(&load_print_mutex);
+}
+
+/*
+ * Pass an event from a load thread to the oracle.  If the oracle has fallen a whole ring
+ * behind, the load thread waits for it rather than losing the event.
+ */
+static void oracle_post(struct load_thread *t, int kind, int a, int b) {
+    struct oracle_ring *r = t->oracle;
+    if(r == NULL)
+	return;
+    uint64_t tail = r->tail;
+    if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == ORACLE_RING) {
+	t->stats.oracle_stalls++;
+	while(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == ORACLE_RING)
+	    sched_yield();
+    }
+    struct oracle_event *e = &r->events[tail % ORACLE_RING];
+    e->t_ns = now_ns();
+    e->kind = kind;
+    e->a = a;
+    e->b = b;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct oracle_match *oracle_lookup(uint64_t key) {
+    if(2 * (oracle_nmatches + 1) > oracle_table_size) {
+	// Grow the table (the matches themselves don't move) and put everything back in.
+	free(oracle_table);
+	oracle_table_size = oracle_table_size ? 2 * oracle_table_size : 65536;
+	if((oracle_table = calloc(oracle_table_size, sizeof(int))) == NULL) {
+	    perror("calloc");
+	    exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < oracle_nmatches; i++) {
+	    uint64_t h = (oracle_matches[i].key * 0x9e3779b97f4a7c15ULL) >> 20;
+	    while(oracle_table[h % oracle_table_size] != 0)
+		h++;
+	    oracle_table[h % oracle_table_size] = i + 1;
+	}
+    }
+
+    uint64_t h = (key * 0x9e3779b97f4a7c15ULL) >> 20;
+    for(;; h++) {
+	int i = oracle_table[h % oracle_table_size];
+	if(i == 0)
+	    break;
+	if(oracle_matches[i-1].key == key)
+	    return &oracle_matches[i-1];
+    }
+
+    if(oracle_nmatches == oracle_cap) {
+	oracle_cap = oracle_cap ? 2 * oracle_cap : 65536;
+	if((oracle_matches = realloc(oracle_matches, oracle_cap * sizeof(struct oracle_match))) == NULL) {
+	    perror("realloc");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    struct oracle_match *m = &oracle_matches[oracle_nmatches];
+    memset(m, 0, sizeof(*m));
+    m->key = key;
+    oracle_table[h % oracle_table_size] = ++oracle_nmatches;
+    return m;
+}
+
+/*
+ * Count one side (+1 or -1) of a match.
+ */
+static void oracle_count(uint64_t key, int side, uint64_t t_ns) {
+    struct oracle_match *m = oracle_lookup(key);
+    int i = m - oracle_matches;
+
+    if(m->balance == 0) {
+	m->since_ns = m->last_ns = t_ns;
+	m->reported = 0;
+	m->prev = -1;
+	m->next = oracle_pending;
+	if(oracle_pending >= 0)
+	    oracle_matches[oracle_pending].prev = i;
+	oracle_pending = i;
+	if(++oracle_npending > oracle_max_pending)
+	    oracle_max_pending = oracle_npending;
+    } else if((m->balance > 0) == (side > 0)) {
+	m->last_ns = t_ns;
+    } else {
+	oracle_matched++;
+	// The oldest unmatched one got matched.  The age of the next is only known roughly.
+	m->since_ns = m->last_ns;
+	if(m->balance + side == 0) {
+	    if(m->prev >= 0)
+		oracle_matches[m->prev].next = m->next;
+	    else
+		oracle_pending = m->next;
+	    if(m->next >= 0)
+		oracle_matches[m->next].prev = m->prev;
+	    oracle_npending--;
+	}
+    }
+    m->balance += side;
+}
+
+/*
+ * Report the pending matches that have been unmatched for longer than grace_ns.
+ */
+static void oracle_check(uint64_t now, uint64_t grace_ns) {
+    for(int i = oracle_pending; i >= 0; i = oracle_matches[i].next) {
+	struct oracle_match *m = &oracle_matches[i];
+	if(m->reported || now - m->since_ns < grace_ns)
+	    continue;
+	m->reported = 1;
+	int a = (m->key >> 16) & 0xffff, b = m->key & 0xffff;
+	if(m->key >> 32 && m->balance > 0)
+	    oracle_violation("%d RING BACK(s) from dialing TU %d not matched by it going RINGING", m->balance, b);
+	else if(m->key >> 32)
+	    oracle_violation("TU %d went RINGING %d time(s) with no caller getting RING BACK", b, -m->balance);
+	else
+	    oracle_violation("TU %d was CONNECTED to TU %d %d more time(s) than the other way around",
+			     m->balance > 0 ? a : b, m->balance > 0 ? b : a, m->balance > 0 ? m->balance : -m->balance);
+    }
+}
+
+static void oracle_event(struct oracle_event *e) {
+    oracle_events++;
+    switch(e->kind) {
+    case ORACLE_RING_BACK:
+	if(e->b >= 0 && e->b < ORACLE_MAX_EXT && oracle_simulated[e->b])
+	    oracle_count(1ULL << 32 | e->b, 1, e->t_ns);
+	break;
+    case ORACLE_RINGING:
+	oracle_count(1ULL << 32 | e->a, -1, e->t_ns);
+	break;
+    case ORACLE_CONNECTED:
+	if(e->b >= 0 && e->b < ORACLE_MAX_EXT && oracle_simulated[e->b]) {
+	    int lo = e->a < e->b ? e->a : e->b, hi = e->a < e->b ? e->b : e->a;
+	    oracle_count((uint64_t)lo << 16 | hi, e->a == lo ? 1 : -1, e->t_ns);
+	}
+	break;
+    }
+}
+
+/*
+ * The oracle.
+ *
+ * Each simulated TU only knows what the server tells it.  The oracle sees what all of
+ * them are told, and cross-checks them.  In the load threads, where only one TU's
+ * messages are needed, it checks that:
+ *
+ *     a caller that goes from RING BACK to CONNECTED is connected to whom it dialed
+ *     a chat comes from the TU we are CONNECTED to (load mode chats say who they are from)
+ *
+ * and everything that needs messages to more than one TU is passed on to the oracle
+ * thread, which checks that:
+ *
+ *     each time a TU goes to RING BACK after dialing a simulated TU, that TU goes to RINGING
+ *     (and the other way around)
+ *     each time a TU goes to CONNECTED to a simulated TU, that TU goes to CONNECTED to it
+ *
+ * The two sides of each of these are told by the server at the same time, but the TUs
+ * can be arbitrarily far apart in looking at them (a TU in a delay doesn't look at all),
+ * so the sides are counted, and a count that stays unmatched for longer than the grace
+ * period (-o) is a violation.  A TU only looks at its messages between delays, so the
+ * grace period has to be longer than the longest run of delays a TU is likely to make
+ * (a few seconds with slow think times).  At the end of the test, the TUs stop sending
+ * commands, look at everything they have been told, and then everything must match.
+ *
+ * The load threads hand events over in single-producer rings, and the oracle thread
+ * keeps all of its state to itself, so no locks are taken and each event costs a hash
+ * table lookup (and a list update when a match starts or stops pending).  A single
+ * oracle thread handles millions of events a second.
+ */
+static void *oracle_thread(void *arg) {
+    uint64_t grace_ns = oracle_grace * 1000000ULL;
+    uint64_t last_check = now_ns();
+
+    while(1) {
+	int done = __atomic_load_n(&oracle_done, __ATOMIC_ACQUIRE);
+	int got = 0;
+	for(int i = 0; i < load_nthreads; i++) {
+	    struct oracle_ring *r = load_threads[i].oracle;
+	    uint64_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	    for(; head != tail; head++, got++)
+		oracle_event(&r->events[head % ORACLE_RING]);
+	    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	}
+
+	uint64_t now = now_ns();
+	if(now - last_check > 100000000ULL) {
+	    oracle_check(now, grace_ns);
+	    last_check = now;
+	}
+	if(done && got == 0)
+	    break;
+	if(got == 0) {
+	    struct timespec ts = { 0, 1000000 };
+	    nanosleep(&ts, NULL);
+	}
+    }
+
+    // Everything has been looked at, so whatever is unmatched now stays that way.
+    oracle_check(now_ns(), 0);
+    return NULL;
+}
+
+static void timer_push(struct load_thread *t, struct sim_tu *tu) {
+    int i = t->ntimers++;
+    while(i > 0 && t->timers[(i-1)/2]->wake_ns > tu->wake_ns) {
+	t->timers[i] = t->timers[(i-1)/2];
+	i = (i-1)/2;
+    }
+    t->timers[i] = tu;
+}
+
+static struct sim_tu *timer_pop(struct load_thread *t) {
+    struct sim_tu *top = t->timers[0];
+    struct sim_tu *last = t->timers[--t->ntimers];
+    int i = 0;
+    while(1) {
+	int c = 2*i + 1;
+	if(c >= t->ntimers)
+	    break;
+	if(c+1 < t->ntimers && t->timers[c+1]->wake_ns < t->timers[c]->wake_ns)
+	    c++;
+	if(last->wake_ns <= t->timers[c]->wake_ns)
+	    break;
+	t->timers[i] = t->timers[c];
+	i = c;
+    }
+    if(t->ntimers > 0)
+	t->timers[i] = last;
+    return top;
+}
+
+/*
+ * Give up on a simulated TU: report why (for the first few) and disconnect it.
+ */
+static void load_fail(struct load_thread *t, struct sim_tu *tu, char *why, char *msg) {
+    t->stats.failures++;
+    pthread_mutex_lock(&load_print_mutex);
+    if(load_reported++ < LOAD_MAX_REPORTED)
+	fprintf(stderr, "%s: TU %d: %s: %s (state %s, expecting %s)\n", timestamp(), tu->ext, why, msg,
+		tu_state_names[tu->state], unparse_state_set(tu->expected));
+    pthread_mutex_unlock(&load_print_mutex);
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, tu->fd, NULL);
+    close(tu->fd);
+    tu->closed = 1;
+    for(int i = 0; tu->idle && i < t->nidle; i++) {
+	if(t->idle[i] == tu) {
+	    memmove(t->idle + i, t->idle + i + 1, sizeof(struct sim_tu *) * (--t->nidle - i));
+	    tu->idle = 0;
+	}
+    }
+}
+
+/*
+ * Send a command for a simulated TU.  Its latency is measured from intended_ns.
+ */
+static void load_send(struct load_thread *t, struct sim_tu *tu, TU_COMMAND cmd, int ext, uint64_t intended_ns) {
+    if(load_cmds_left >= 0 && __atomic_sub_fetch(&load_cmds_left, 1, __ATOMIC_RELAXED) < 0) {
+	__atomic_store_n(&load_stop, 1, __ATOMIC_RELAXED);
+	tu->expected = next_states[tu->state][DELAY_COMMAND];
+	return;
+    }
+
+    char buf[64];
+    int len;
+    if(cmd == TU_DIAL_CMD) {
+	len = snprintf(buf, sizeof(buf), "%s %d%s", tu_command_names[cmd], ext, EOL);
+	tu->last_dialed = ext;
+	if(tu->state == TU_DIAL_TONE) {
+	    t->stats.dials++;
+	    if(tu->pop != NULL)
+		t->stats.pops[tu->pop - populations].dials++;
+	}
+    } else {
+	len = snprintf(buf, sizeof(buf), "%s%s", tu_command_names[cmd], EOL);
+    }
+    if(cmd == TU_CHAT_CMD)   // Say who it is from, for the oracle.
+	len = snprintf(buf, sizeof(buf), "%s %d%s", tu_command_names[cmd], tu->ext, EOL);
+
+    tu->expected = next_states[tu->state][cmd];
+    tu->last_command = cmd;
+    tu->awaiting = 1;
+    tu->sent_ns = intended_ns;
+    t->stats.commands++;
+    if(tu->pop != NULL)
+	t->stats.pops[tu->pop - populations].commands++;
+    if(send(tu->fd, buf, len, MSG_NOSIGNAL) != len)
+	load_fail(t, tu, "Can't send command", buf);
+}
+
+/*
+ * Choose the next action of a simulated TU, and either send it or start a delay.
+ */
+static void load_step(struct load_thread *t, struct sim_tu *tu) {
+    if(__atomic_load_n(&load_stop, __ATOMIC_RELAXED)) {
+	// From now on the TU only waits for things to happen to it.
+	tu->expected = next_states[tu->state][DELAY_COMMAND];
+	return;
+    }
+    struct population *pop = tu->pop;
+    if(tu->resting || !pop_active(tu)) {
+	// Inactive TUs don't do anything, but they do look at what happens to them in the meantime.
+	tu->expected = next_states[tu->state][DELAY_COMMAND];
+	if(!tu->resting) {
+	    tu->resting = 1;
+	    tu->wake_ns = now_ns() + pop->think_max * 1000ULL + 1000000;
+	    timer_push(t, tu);
+	}
+	return;
+    }
+    int cmd = choose_from(pop != NULL ? pop->probs[tu->state] : action_probs[tu->state], erand48(t->rand));
+    if(cmd == DELAY_COMMAND) {
+	int delay = basic_delay;
+	if(pop != NULL)
+	    delay = pop->think_min + (int)(erand48(t->rand) * (pop->think_max - pop->think_min));
+	tu->delaying = 1;
+	tu->wake_ns = now_ns() + delay * 1000ULL;
+	timer_push(t, tu);
+	return;
+    }
+
+    int ext = 0;
+    if(cmd == TU_DIAL_CMD && pop != NULL && pop->ntargets > 0) {
+	// Pick a target by weight, then somebody in it.
+	double w = erand48(t->rand) * pop->total_weight;
+	int i;
+	for(i = 0; i < pop->ntargets - 1 && (w -= pop->targets[i].weight) >= 0; i++)
+	    ;
+	struct dial_target *dt = &pop->targets[i];
+	if(dt->pop >= 0)
+	    ext = load_tus[populations[dt->pop].first
+			   + (int)(erand48(t->rand) * populations[dt->pop].count)].ext;
+	else
+	    ext = dt->lo + (int)(erand48(t->rand) * (dt->hi - dt->lo + 1));
+    } else if(cmd == TU_DIAL_CMD) {
+	if(ext_range_given)
+	    ext = min_ext + (int)(erand48(t->rand) * (max_ext - min_ext + 1));
+	else
+	    ext = load_tus[(int)(erand48(t->rand) * load_ntus)].ext;
+    }
+    load_send(t, tu, cmd, ext, now_ns());
+}
+
+/*
+ * Open loop: put a TU whose part in a call is over back in the idle pool.
+ */
+static void open_release(struct load_thread *t, struct sim_tu *tu) {
+    tu->role = ROLE_NONE;
+    if(!tu->idle) {
+	tu->idle = 1;
+	t->idle[t->nidle++] = tu;
+    }
+}
+
+/*
+ * Open loop: start a call that arrived at arrival_ns, with the two TUs that have been idle the longest.
+ */
+static void open_start_call(struct load_thread *t, uint64_t arrival_ns) {
+    struct sim_tu *caller = t->idle[0];
+    struct sim_tu *callee = t->idle[1];
+    t->nidle -= 2;
+    memmove(t->idle, t->idle + 2, sizeof(struct sim_tu *) * t->nidle);
+
+    caller->idle = callee->idle = 0;
+    caller->role = ROLE_CALLER;
+    caller->peer_ext = callee->ext;
+    caller->arrival_ns = arrival_ns;
+    callee->role = ROLE_CALLEE;
+    load_send(t, caller, TU_PICKUP_CMD, 0, arrival_ns);
+}
+
+/*
+ * Open loop: queue the calls that have arrived by now, and start as many as there are TUs for.
+ */
+static void open_arrivals(struct load_thread *t, uint64_t now) {
+    while(t->next_arrival_ns <= now) {
+	if(t->backlog_len == LOAD_MAX_BACKLOG) {
+	    t->stats.dropped++;
+	} else {
+	    t->backlog[(t->backlog_head + t->backlog_len++) % LOAD_MAX_BACKLOG] = t->next_arrival_ns;
+	    if(t->backlog_len > t->stats.max_backlog)
+		t->stats.max_backlog = t->backlog_len;
+	}
+	t->stats.arrivals++;
+	double interval = poisson ? -log(1.0 - erand48(t->rand)) / t->thread_rate : 1.0 / t->thread_rate;
+	t->next_arrival_ns += (uint64_t)(interval * 1e9);
+    }
+    while(t->backlog_len > 0 && t->nidle >= 2 && !__atomic_load_n(&load_stop, __ATOMIC_RELAXED)) {
+	uint64_t arrival_ns = t->backlog[t->backlog_head];
+	t->backlog_head = (t->backlog_head + 1) % LOAD_MAX_BACKLOG;
+	t->backlog_len--;
+	open_start_call(t, arrival_ns);
+    }
+}
+
+/*
+ * Open loop: take the next step of a TU's script, after it got a message it wasn't resyncing over.
+ */
+static void open_step(struct load_thread *t, struct sim_tu *tu, TU_STATE new) {
+    uint64_t now = now_ns();
+
+    // Unless a command is sent below, the TU waits for something to happen.
+    tu->expected = next_states[new][DELAY_COMMAND];
+    if(__atomic_load_n(&load_stop, __ATOMIC_RELAXED))
+	return;
+
+    switch(tu->role) {
+    case ROLE_CALLER:
+	if(new == TU_DIAL_TONE && tu->last_command == TU_PICKUP_CMD) {
+	    load_send(t, tu, TU_DIAL_CMD, tu->peer_ext, now);
+	} else if(new == TU_CONNECTED) {
+	    histogram_record(&t->stats.setup, now - tu->arrival_ns);
+	    tu->scheduled = 1;
+	    tu->scheduled_cmd = TU_HANGUP_CMD;
+	    tu->wake_ns = now + basic_delay * 1000ULL;
+	    timer_push(t, tu);
+	} else if(new == TU_ON_HOOK) {
+	    open_release(t, tu);
+	} else if(new != TU_RING_BACK) {
+	    load_send(t, tu, TU_HANGUP_CMD, 0, now);
+	}
+	break;
+    case ROLE_CALLEE:
+	if(new == TU_RINGING)
+	    load_send(t, tu, TU_PICKUP_CMD, 0, now);
+	else if(new == TU_DIAL_TONE)
+	    load_send(t, tu, TU_HANGUP_CMD, 0, now);
+	else if(new == TU_ON_HOOK)
+	    open_release(t, tu);
+	break;
+    default:
+	if(new == TU_ON_HOOK)
+	    open_release(t, tu);
+	break;
+    }
+}
+
+/*
+ * Handle one message from the server to a simulated TU.
+ */
+static void load_message(struct load_thread *t, struct sim_tu *tu, char *msg) {
+    int new = parse_state(msg);
+    if(new < 0) {
+	load_fail(t, tu, "Unrecognized message", msg);
+	return;
+    }
+    if(new == NUM_STATES) {
+	t->stats.chats++;
+	int from;
+	if(tu->state != TU_CONNECTED)
+	    load_fail(t, tu, "Chat received when not connected", msg);
+	else if(oracle_grace && sscanf(msg, "CHAT %d", &from) == 1 && from != tu->connected_ext)
+	    oracle_violation("TU %d got a chat from TU %d while CONNECTED to TU %d", tu->ext, from,
+			     tu->connected_ext);
+	return;
+    }
+
+    int check = check_transition(new, tu->expected);
+    if(check < 0) {
+	load_fail(t, tu, "Unexpected state", msg);
+	return;
+    }
+
+    if(oracle_grace && new != tu->state) {
+	if(new == TU_RING_BACK && tu->state == TU_DIAL_TONE) {
+	    // Only a dial from DIAL TONE rings anybody: a later dial just gets RING BACK again.
+	    tu->dialed_ext = tu->last_dialed;
+	    oracle_post(t, ORACLE_RING_BACK, tu->ext, tu->dialed_ext);
+	} else if(new == TU_RINGING) {
+	    oracle_post(t, ORACLE_RINGING, tu->ext, 0);
+	} else if(new == TU_CONNECTED) {
+	    tu->connected_ext = -1;
+	    sscanf(msg, "CONNECTED %d", &tu->connected_ext);
+	    if(tu->state == TU_RING_BACK && tu->connected_ext != tu->dialed_ext)
+		oracle_violation("TU %d dialed TU %d but got CONNECTED to TU %d", tu->ext, tu->dialed_ext,
+				 tu->connected_ext);
+	    oracle_post(t, ORACLE_CONNECTED, tu->ext, tu->connected_ext);
+	}
+    }
+
+    if(tu->calling && tu->state == TU_RING_BACK && new == TU_CONNECTED) {
+	t->stats.answered++;
+	if(tu->pop != NULL)
+	    t->stats.pops[tu->pop - populations].answered++;
+    }
+    if(new != TU_RING_BACK)
+	tu->calling = 0;
+
+    if(check == 0) {
+	tu->resync = 0;
+	if(tu->awaiting) {
+	    tu->awaiting = 0;
+	    histogram_record(&t->stats.latency[tu->last_command], now_ns() - tu->sent_ns);
+	    if(tu->last_command == TU_DIAL_CMD) {
+		if(new == TU_RING_BACK) {
+		    t->stats.ring_backs++;
+		    tu->calling = 1;
+		} else if(new == TU_BUSY_SIGNAL) {
+		    t->stats.busy++;
+		} else if(new == TU_ERROR) {
+		    t->stats.errors++;
+		}
+	    }
+	}
+    } else if(tu->awaiting) {
+	// (A TU that isn't waiting for an answer was just told something happened to it.)
+	tu->resync = 1;
+	t->stats.resyncs++;
+    }
+
+    tu->state = new;
+    if(tu->resync)
+	tu->expected = next_states[new][tu->last_command];
+    else if(rate > 0)
+	open_step(t, tu, new);
+    else
+	load_step(t, tu);
+}
+
+/*
+ * Handle the complete messages buffered for a simulated TU, unless it is in a delay.
+ */
+static void load_input(struct load_thread *t, struct sim_tu *tu) {
+    int start = 0;
+    char *eol;
+    while(!tu->delaying && !tu->closed
+	  && (eol = memchr(tu->in + start, '\n', tu->inlen - start)) != NULL) {
+	*eol = '\0';
+	char *msg = tu->in + start;
+	start = eol - tu->in + 1;
+	trim_eol(msg);
+	load_message(t, tu, msg);
+    }
+    if(tu->closed)
+	return;
+    memmove(tu->in, tu->in + start, tu->inlen - start);
+    tu->inlen -= start;
+    if(tu->inlen == LOAD_INBUF) {
+	tu->in[LOAD_INBUF-1] = '\0';
+	load_fail(t, tu, "Message too long", tu->in);
+    }
+}
+
+static void load_read(struct load_thread *t, struct sim_tu *tu) {
+    ssize_t n = read(tu->fd, tu->in + tu->inlen, LOAD_INBUF - tu->inlen);
+    if(n == 0) {
+	load_fail(t, tu, "EOF reading message from server", tu->resync ? "during resync" : "");
+	return;
+    }
+    if(n < 0) {
+	if(errno != EAGAIN && errno != EINTR)
+	    load_fail(t, tu, "Can't read from server", strerror(errno));
+	return;
+    }
+    tu->inlen += n;
+    load_input(t, tu);
+}
+
+static void *load_thread(void *arg) {
+    struct load_thread *t = arg;
+    struct epoll_event events[64];
+
+    // Each TU has its first notification (ON HOOK) buffered already.
+    for(int i = 0; i < t->ntus; i++)
+	load_input(t, t->tus[i]);
+
+    while(!__atomic_load_n(&load_stop, __ATOMIC_RELAXED)) {
+	uint64_t now = now_ns();
+	if(load_deadline && now >= load_deadline)
+	    break;
+	while(t->ntimers > 0 && t->timers[0]->wake_ns <= now) {
+	    struct sim_tu *tu = timer_pop(t);
+	    if(tu->closed)
+		continue;
+	    if(tu->scheduled) {
+		tu->scheduled = 0;
+		load_send(t, tu, tu->scheduled_cmd, 0, tu->wake_ns);
+		continue;
+	    }
+	    if(tu->resting) {
+		tu->resting = 0;
+		if(!tu->awaiting)
+		    load_step(t, tu);
+		continue;
+	    }
+	    tu->delaying = 0;
+	    load_step(t, tu);
+	    load_input(t, tu);
+	}
+	if(rate > 0)
+	    open_arrivals(t, now);
+
+	// Wake up for the next timer or arrival, or every so often to look at the stop flag.
+	uint64_t wake = now + 100000000ULL;
+	if(t->ntimers > 0 && t->timers[0]->wake_ns < wake)
+	    wake = t->timers[0]->wake_ns;
+	if(rate > 0 && t->next_arrival_ns < wake)
+	    wake = t->next_arrival_ns;
+	int timeout = (wake - now + 999999) / 1000000;
+	int n = epoll_wait(t->epfd, events, 64, timeout);
+	for(int i = 0; i < n; i++) {
+	    struct sim_tu *tu = events[i].data.ptr;
+	    if(!tu->closed)
+		load_read(t, tu);
+	}
+    }
+    __atomic_store_n(&load_stop, 1, __ATOMIC_RELAXED);
+
+    if(oracle_grace) {
+	// No more commands.  Look at what was held back by delays, then at whatever is still on its way.
+	t->ntimers = 0;
+	for(int i = 0; i < t->ntus; i++) {
+	    struct sim_tu *tu = t->tus[i];
+	    if(tu->delaying || tu->scheduled)
+		tu->expected = next_states[tu->state][DELAY_COMMAND];
+	    tu->delaying = tu->scheduled = tu->resting = 0;
+	    if(!tu->closed)
+		load_input(t, tu);
+	}
+	uint64_t end = now_ns() + ORACLE_DRAIN_MS * 1000000ULL;
+	int n;
+	while(now_ns() < end && (n = epoll_wait(t->epfd, events, 64, 10)) >= 0) {
+	    for(int i = 0; i < n; i++) {
+		struct sim_tu *tu = events[i].data.ptr;
+		if(!tu->closed)
+		    load_read(t, tu);
+	    }
+	}
+    }
+
+    for(int i = 0; i < t->ntus; i++) {
+	if(!t->tus[i]->closed && (t->tus[i]->awaiting || t->tus[i]->resync))
+	    t->stats.unanswered++;
+    }
+    return NULL;
+}
+
+/*
+ * Connect a simulated TU, and wait for its first notification, which tells us its extension.
+ */
+static void load_connect(struct sim_tu *tu, struct in_addr *addr, int port) {
+    if((tu->fd = connect_to_server(addr, port)) == -1) {
+	perror("proto_connect");
+	exit(EXIT_FAILURE);
+    }
+    while(memchr(tu->in, '\n', tu->inlen) == NULL) {
+	ssize_t n = read(tu->fd, tu->in + tu->inlen, LOAD_INBUF - tu->inlen);
+	if(n <= 0) {
+	    fprintf(stderr, "%s: EOF reading message from server\n", timestamp());
+	    exit(EXIT_FAILURE);
+	}
+	tu->inlen += n;
+    }
+    if(sscanf(tu->in, "ON HOOK %d", &tu->ext) != 1) {
+	fprintf(stderr, "%s: Unrecognized message: %.*s\n", timestamp(), tu->inlen, tu->in);
+	exit(EXIT_FAILURE);
+    }
+    fcntl(tu->fd, F_SETFL, fcntl(tu->fd, F_GETFL) | O_NONBLOCK);
+    // Commands are tiny: don't let Nagle hold them back waiting for an ACK.
+    int one = 1;
+    setsockopt(tu->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    tu->state = TU_ON_HOOK;
+    tu->expected = 1<<TU_ON_HOOK;
+    tu->last_command = TU_HANGUP_CMD;
+}
+
+/*
+ * Run the load test.
+ *
+ * @param addr  Address of the server.
+ * @param port  Port of the server.
+ * @param tus  # of TUs to simulate.
+ * @param threads  # of threads to simulate them with.
+ * @param cmds  Total number of commands to be sent, or 0 for no limit.
+ * @param seconds  How long to run, or 0 for no limit.
+ */
+static void load_test(struct in_addr *addr, int port, int tus, int threads, int cmds, int seconds) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if(limit.rlim_cur < tus + 64) {
+	limit.rlim_cur = limit.rlim_max < tus + 64 ? limit.rlim_max : tus + 64;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    load_ntus = tus;
+    load_cmds_left = cmds > 0 ? cmds : -1;
+    if((load_tus = calloc(tus, sizeof(struct sim_tu))) == NULL) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < tus; i++)
+	load_connect(&load_tus[i], addr, port);
+    for(int p = 0; p < num_populations; p++) {
+	for(int i = 0; i < populations[p].count; i++) {
+	    load_tus[populations[p].first + i].pop = &populations[p];
+	    load_tus[populations[p].first + i].pop_index = i;
+	}
+    }
+    fprintf(stdout, "%s: Connected %d TUs to server port %d\n", timestamp(), tus, port);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = load_sigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    struct load_thread *ts = calloc(threads, sizeof(struct load_thread));
+    if(ts == NULL) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    load_threads = ts;
+    load_nthreads = threads;
+    if(oracle_grace) {
+	for(int i = 0; i < tus; i++) {
+	    if(load_tus[i].ext >= 0 && load_tus[i].ext < ORACLE_MAX_EXT)
+		oracle_simulated[load_tus[i].ext] = 1;
+	}
+	for(int i = 0; i < threads; i++) {
+	    if((ts[i].oracle = aligned_alloc(64, sizeof(struct oracle_ring))) == NULL) {
+		perror("aligned_alloc");
+		exit(EXIT_FAILURE);
+	    }
+	    ts[i].oracle->head = ts[i].oracle->tail = 0;
+	}
+    }
+    for(int i = 0; i < threads; i++) {
+	struct load_thread *t = &ts[i];
+	t->tus = malloc(sizeof(struct sim_tu *) * (tus / threads + 1));
+	t->timers = malloc(sizeof(struct sim_tu *) * (tus / threads + 1));
+	t->idle = malloc(sizeof(struct sim_tu *) * (tus / threads + 1));
+	t->backlog = malloc(sizeof(uint64_t) * LOAD_MAX_BACKLOG);
+	t->thread_rate = rate / threads;
+	if(t->tus == NULL || t->timers == NULL || t->idle == NULL || t->backlog == NULL
+	   || (t->epfd = epoll_create1(0)) < 0) {
+	    perror("load_test");
+	    exit(EXIT_FAILURE);
+	}
+	t->rand[0] = 0x330e;
+	t->rand[1] = i;
+	t->rand[2] = i >> 16;
+	for(int c = 0; c < DELAY_COMMAND; c++)
+	    histogram_init(&t->stats.latency[c]);
+	histogram_init(&t->stats.setup);
+    }
+    if(rate > 0 && tus / threads < 2) {
+	fprintf(stderr, "Open loop needs at least 2 TUs per thread\n");
+	exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < tus; i++) {
+	struct load_thread *t = &ts[i % threads];
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &load_tus[i];
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, load_tus[i].fd, &event);
+	t->tus[t->ntus++] = &load_tus[i];
+    }
+
+    uint64_t start = now_ns();
+    load_start_ns = start;
+    load_deadline = seconds > 0 ? start + seconds * 1000000000ULL : 0;
+    for(int i = 0; i < threads; i++)
+	ts[i].next_arrival_ns = start;
+    pthread_t oracle_tid;
+    if(oracle_grace)
+	pthread_create(&oracle_tid, NULL, oracle_thread, NULL);
+    for(int i = 0; i < threads; i++)
+	pthread_create(&ts[i].tid, NULL, load_thread, &ts[i]);
+
+    struct load_stats *total = calloc(1, sizeof(struct load_stats));
+    if(total == NULL) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    for(int c = 0; c < DELAY_COMMAND; c++)
+	histogram_init(&total->latency[c]);
+    histogram_init(&total->setup);
+    for(int i = 0; i < threads; i++) {
+	pthread_join(ts[i].tid, NULL);
+	struct load_stats *s = &ts[i].stats;
+	total->commands += s->commands;
+	total->dials += s->dials;
+	total->ring_backs += s->ring_backs;
+	total->busy += s->busy;
+	total->errors += s->errors;
+	total->answered += s->answered;
+	total->chats += s->chats;
+	total->resyncs += s->resyncs;
+	total->failures += s->failures;
+	total->unanswered += s->unanswered;
+	total->oracle_stalls += s->oracle_stalls;
+	total->arrivals += s->arrivals;
+	total->dropped += s->dropped;
+	if(s->max_backlog > total->max_backlog)
+	    total->max_backlog = s->max_backlog;
+	for(int c = 0; c < DELAY_COMMAND; c++)
+	    histogram_merge(&total->latency[c], &s->latency[c]);
+	histogram_merge(&total->setup, &s->setup);
+	for(int p = 0; p < num_populations; p++) {
+	    total->pops[p].commands += s->pops[p].commands;
+	    total->pops[p].dials += s->pops[p].dials;
+	    total->pops[p].answered += s->pops[p].answered;
+	}
+    }
+    double secs = (now_ns() - start) / 1e9;
+    if(oracle_grace) {
+	__atomic_store_n(&oracle_done, 1, __ATOMIC_RELEASE);
+	pthread_join(oracle_tid, NULL);
+    }
+
+    fprintf(stdout, "tus=%d threads=%d seconds=%.3f commands=%lu commands_per_sec=%.1f"
+	    " calls=%lu ring_backs=%lu busy=%lu errors=%lu answered=%lu calls_per_sec=%.1f"
+	    " completion_rate=%.4f chats=%lu resyncs=%lu unanswered=%lu failures=%lu\n",
+	    tus, threads, secs, total->commands, total->commands / secs,
+	    total->dials, total->ring_backs, total->busy, total->errors, total->answered,
+	    total->answered / secs, total->dials ? (double)total->answered / total->dials : 0.0,
+	    total->chats, total->resyncs, total->unanswered, total->failures);
+    if(rate > 0)
+	fprintf(stdout, "open_loop rate=%.1f arrival=%s arrivals=%lu arrivals_per_sec=%.1f dropped=%lu max_backlog=%d\n",
+		rate, poisson ? "poisson" : "fixed", total->arrivals, total->arrivals / secs, total->dropped,
+		total->max_backlog);
+    for(int c = 0; c <= DELAY_COMMAND; c++) {
+	struct histogram *h = c < DELAY_COMMAND ? &total->latency[c] : &total->setup;
+	if(c == DELAY_COMMAND && rate == 0)
+	    break;
+	fprintf(stdout, "command=%s count=%lu mean_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+		c < DELAY_COMMAND ? tu_command_names[c] : "setup", h->count, h->count ? h->sum / 1e3 / h->count : 0.0,
+		histogram_percentile(h, 50.0) / 1e3, histogram_percentile(h, 99.0) / 1e3,
+		histogram_percentile(h, 99.9) / 1e3, h->count ? h->max / 1e3 : 0.0);
+    }
+    if(oracle_grace)
+	fprintf(stdout, "oracle events=%lu events_per_sec=%.1f matched=%lu max_pending=%d stalls=%lu violations=%lu\n",
+		oracle_events, oracle_events / secs, oracle_matched, oracle_max_pending, total->oracle_stalls,
+		oracle_violations);
+    for(int p = 0; p < num_populations; p++) {
+	struct pop_stats *ps = &total->pops[p];
+	fprintf(stdout, "population=%s tus=%d commands=%lu calls=%lu answered=%lu completion_rate=%.4f\n",
+		populations[p].name, populations[p].count, ps->commands, ps->dials, ps->answered,
+		ps->dials ? (double)ps->answered / ps->dials : 0.0);
+    }
+    fflush(stdout);
+
+    if(total->failures > 0 || oracle_violations > 0)
+	exit(EXIT_FAILURE);
+}